@@ -1,6 +1,7 @@
 #include "ControlDevice.h"
 #include "Device.h"
 #include "RemapEngine.h"
+#include "PersistState.h"
 
 static WDFSPINLOCK g_DeviceListLock = NULL;
 static LIST_ENTRY g_DeviceList;
@@ -25,6 +26,7 @@ static VOID KbdLaySnapshotStatus(_In_ PKBDLAY_DEVICE_CONTEXT Ctx, _Inout_ KBLAY_
         Out->State = (UINT32)InterlockedCompareExchange((volatile LONG*)&Ctx->State, 0, 0);
         Out->LastErrorNtStatus = (UINT32)InterlockedCompareExchange((volatile LONG*)&Ctx->LastErrorNtStatus, 0, 0);
         Out->ContainerId = Ctx->ContainerId;
+        Out->RuleBlobHash = (UINT32)InterlockedCompareExchange((volatile LONG*)&Ctx->RuleBlobHash, 0, 0);
         *Have = TRUE;
     }
 
@@ -32,6 +34,14 @@ static VOID KbdLaySnapshotStatus(_In_ PKBDLAY_DEVICE_CONTEXT Ctx, _Inout_ KBLAY_
     Out->PassThroughCount += (UINT64)InterlockedCompareExchange64((volatile LONG64*)&Ctx->PassThroughCount, 0, 0);
     Out->UnmappedCount += (UINT64)InterlockedCompareExchange64((volatile LONG64*)&Ctx->UnmappedCount, 0, 0);
     Out->ShiftToggleCount += (UINT64)InterlockedCompareExchange64((volatile LONG64*)&Ctx->ShiftToggleCount, 0, 0);
+    Out->DebounceDropCount += (UINT64)InterlockedCompareExchange64((volatile LONG64*)&Ctx->DebounceDropCount, 0, 0);
+    Out->EventsOutCount += (UINT64)InterlockedCompareExchange64((volatile LONG64*)&Ctx->EventsOutCount, 0, 0);
+
+    WdfSpinLockAcquire(Ctx->Lock);
+    const UINT32 late = Ctx->Engine.TapHold.MaxLateMs;
+    WdfSpinLockRelease(Ctx->Lock);
+    if (late > Out->TapHoldMaxLateMs)
+        Out->TapHoldMaxLateMs = late;
 }
 
 static VOID KbdLayRefreshAllContainerIds(VOID)
@@ -68,6 +78,7 @@ static NTSTATUS KbdLayApplyRoleByContainerOnce(_In_ const GUID* ContainerId, _In
         {
             InterlockedExchange(&ctx->Role, (LONG)Role);
             InterlockedExchange(&ctx->LastErrorNtStatus, STATUS_SUCCESS);
+            KbdLayPersistSchedule(ctx);
             found = TRUE;
         }
     }
@@ -102,6 +113,7 @@ static NTSTATUS KbdLayApplyStateByContainerOnce(_In_ const GUID* ContainerId, _I
         {
             InterlockedExchange(&ctx->State, (LONG)State);
             InterlockedExchange(&ctx->LastErrorNtStatus, STATUS_SUCCESS);
+            KbdLayPersistSchedule(ctx);
             found = TRUE;
         }
     }
@@ -148,6 +160,7 @@ static NTSTATUS KbdLayApplyRuleBlobByContainerOnce(_In_ const GUID* ContainerId,
             else
             {
                 InterlockedExchange(&ctx->LastErrorNtStatus, STATUS_SUCCESS);
+                KbdLayPersistSchedule(ctx);
             }
         }
     }
@@ -205,6 +218,184 @@ static NTSTATUS KbdLayGetStatusByContainer(_In_ const GUID* ContainerId, _Out_ K
     return KbdLayGetStatusByContainerOnce(ContainerId, Out, &found);
 }
 
+static NTSTATUS KbdLaySetTraceByContainerOnce(_In_ const GUID* ContainerId, _In_ BOOLEAN Enable, _In_ ULONG Capacity, _Out_ BOOLEAN* Found)
+{
+    if (!g_DeviceListLock)
+        return STATUS_DEVICE_NOT_READY;
+
+    BOOLEAN found = FALSE;
+    NTSTATUS status = STATUS_SUCCESS;
+    KBLAY_TRACE_RING* spare = NULL;
+
+    // Rings can be megabytes of nonpaged pool, so they are allocated here
+    // at PASSIVE_LEVEL and only installed under the lock. Each pass installs
+    // at most one; devices sharing the ContainerId take another pass each.
+    for (;;)
+    {
+        BOOLEAN allocFailed = FALSE;
+        BOOLEAN needRing = FALSE;
+        if (Enable && !spare)
+        {
+            spare = KbdLayTraceRingAllocate(Capacity);
+            allocFailed = spare ? FALSE : TRUE;
+        }
+
+        WdfSpinLockAcquire(g_DeviceListLock);
+        for (PLIST_ENTRY e = g_DeviceList.Flink; e != &g_DeviceList; e = e->Flink)
+        {
+            PKBDLAY_DEVICE_CONTEXT ctx = CONTAINING_RECORD(e, KBDLAY_DEVICE_CONTEXT, ListEntry);
+            if (!IsEqualGUID(&ctx->ContainerId, ContainerId))
+                continue;
+
+            found = TRUE;
+            if (!Enable)
+            {
+                InterlockedExchangePointer((PVOID volatile*)&ctx->TraceActive, NULL);
+                continue;
+            }
+
+            // The ring is kept until cleanup so the input path never sees it freed.
+            if (!ctx->TraceRing && spare)
+            {
+                ctx->TraceRing = spare;
+                spare = NULL;
+            }
+            if (!ctx->TraceRing)
+            {
+                needRing = TRUE;
+                continue;
+            }
+            InterlockedExchangePointer((PVOID volatile*)&ctx->TraceActive, ctx->TraceRing);
+        }
+        WdfSpinLockRelease(g_DeviceListLock);
+
+        if (!needRing)
+            break;
+        if (allocFailed)
+        {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+            break;
+        }
+    }
+
+    // Every device already had one, or none matched.
+    KbdLayTraceRingFree(spare);
+
+    *Found = found ? TRUE : FALSE;
+    return found ? status : STATUS_NOT_FOUND;
+}
+
+static NTSTATUS KbdLaySetTraceByContainer(_In_ const GUID* ContainerId, _In_ BOOLEAN Enable, _In_ ULONG Capacity)
+{
+    BOOLEAN found = FALSE;
+    NTSTATUS status = KbdLaySetTraceByContainerOnce(ContainerId, Enable, Capacity, &found);
+    if (found || !NT_SUCCESS(status))
+        return status;
+
+    KbdLayRefreshAllContainerIds();
+    return KbdLaySetTraceByContainerOnce(ContainerId, Enable, Capacity, &found);
+}
+
+// Drains the first device with this ContainerId that has a trace ring.
+static NTSTATUS KbdLayDrainTraceByContainer(_In_ const GUID* ContainerId, _Out_writes_bytes_(OutBytes) KBLAY_DRAIN_TRACE_OUTPUT* Out, _In_ size_t OutBytes)
+{
+    if (!g_DeviceListLock)
+        return STATUS_DEVICE_NOT_READY;
+
+    const size_t header = FIELD_OFFSET(KBLAY_DRAIN_TRACE_OUTPUT, Records);
+    if (OutBytes < header)
+        return STATUS_BUFFER_TOO_SMALL;
+
+    const size_t cap = (OutBytes - header) / sizeof(KBLAY_TRACE_RECORD);
+
+    LARGE_INTEGER freq;
+    KeQueryPerformanceCounter(&freq);
+
+    Out->Count = 0;
+    Out->Dropped = 0;
+    Out->Frequency = (UINT64)freq.QuadPart;
+
+    NTSTATUS status = STATUS_NOT_FOUND;
+
+    WdfSpinLockAcquire(g_DeviceListLock);
+    for (PLIST_ENTRY e = g_DeviceList.Flink; e != &g_DeviceList; e = e->Flink)
+    {
+        PKBDLAY_DEVICE_CONTEXT ctx = CONTAINING_RECORD(e, KBDLAY_DEVICE_CONTEXT, ListEntry);
+        if (!IsEqualGUID(&ctx->ContainerId, ContainerId))
+            continue;
+
+        if (!ctx->TraceRing)
+        {
+            status = STATUS_INVALID_DEVICE_STATE;
+            continue;
+        }
+
+        ULONG dropped = 0;
+        Out->Count = KbdLayTraceRingDrain(ctx->TraceRing, Out->Records, (ULONG)cap, &dropped);
+        Out->Dropped = dropped;
+        status = STATUS_SUCCESS;
+        break;
+    }
+    WdfSpinLockRelease(g_DeviceListLock);
+    return status;
+}
+
+// Re-serializes the active rule table of the first device with this ContainerId.
+static NTSTATUS KbdLayGetRuleBlobByContainer(_In_ const GUID* ContainerId, _Out_writes_bytes_(OutBytes) VOID* Out, _In_ size_t OutBytes, _Out_ size_t* Used)
+{
+    if (!g_DeviceListLock)
+        return STATUS_DEVICE_NOT_READY;
+
+    *Used = 0;
+    NTSTATUS status = STATUS_NOT_FOUND;
+
+    WdfSpinLockAcquire(g_DeviceListLock);
+    for (PLIST_ENTRY e = g_DeviceList.Flink; e != &g_DeviceList; e = e->Flink)
+    {
+        PKBDLAY_DEVICE_CONTEXT ctx = CONTAINING_RECORD(e, KBDLAY_DEVICE_CONTEXT, ListEntry);
+        if (!IsEqualGUID(&ctx->ContainerId, ContainerId))
+            continue;
+
+        WdfSpinLockAcquire(ctx->Lock);
+        const size_t need = ctx->RuleBlob ? ctx->RuleBlobSize : sizeof(KBLAY_RULE_BLOB_HEADER);
+        if (need <= OutBytes)
+        {
+            if (ctx->RuleBlob)
+            {
+                RtlCopyMemory(Out, ctx->RuleBlob, need);
+            }
+            else
+            {
+                // Nothing loaded: an empty v1 blob.
+                KBLAY_RULE_BLOB_HEADER* h = (KBLAY_RULE_BLOB_HEADER*)Out;
+                RtlZeroMemory(h, sizeof(*h));
+                h->Version = KBLAY_RULE_BLOB_VERSION;
+                h->TotalSizeBytes = sizeof(*h);
+            }
+        }
+        WdfSpinLockRelease(ctx->Lock);
+
+        if (need > OutBytes)
+        {
+            // Tell the caller how much to allocate, and nothing else: the
+            // rest of the header would be whatever the buffer held.
+            KBLAY_RULE_BLOB_HEADER* h = (KBLAY_RULE_BLOB_HEADER*)Out;
+            RtlZeroMemory(h, sizeof(*h));
+            h->TotalSizeBytes = (UINT32)need;
+            *Used = sizeof(KBLAY_RULE_BLOB_HEADER);
+            status = STATUS_BUFFER_OVERFLOW;
+        }
+        else
+        {
+            *Used = need;
+            status = STATUS_SUCCESS;
+        }
+        break;
+    }
+    WdfSpinLockRelease(g_DeviceListLock);
+    return status;
+}
+
 static NTSTATUS KbdLayEnumContainers(_Out_writes_bytes_(OutBytes) KBLAY_ENUM_CONTAINERS_OUTPUT* Out, _In_ size_t OutBytes)
 {
     if (!g_DeviceListLock)
@@ -346,11 +537,7 @@ KbdLayEvtIoControlDeviceControl(
         status = WdfRequestRetrieveInputBuffer(Request, min, (PVOID*)&in, &cb);
         if (NT_SUCCESS(status))
         {
-            if (cb < min || in->BlobSize == 0 || in->BlobSize > (UINT32)KBLAY_MAX_RULE_BLOB_BYTES)
-            {
-                status = STATUS_INVALID_BUFFER_SIZE;
-            }
-            else if (in->BlobSize > cb - min)
+            if (!KbdLayCheckRuleBlobEx(in, cb, KBLAY_MAX_RULE_BLOB_BYTES))
             {
                 status = STATUS_INVALID_BUFFER_SIZE;
             }
@@ -360,6 +547,27 @@ KbdLayEvtIoControlDeviceControl(
             }
         }
     }
+    else if (IoControlCode == IOCTL_KBLAY_SET_RULE_BLOB_EX_DIRECT)
+    {
+        // Header in the system buffer, blob mapped from the caller's MDL.
+        // KbdLayRemapLoadRuleBlob copies before it validates.
+        KBLAY_SET_RULE_BLOB_DIRECT_INPUT* in = NULL;
+        size_t cbIn = 0;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(KBLAY_SET_RULE_BLOB_DIRECT_INPUT), (PVOID*)&in, &cbIn);
+        if (NT_SUCCESS(status))
+        {
+            VOID* blob = NULL;
+            size_t cbBlob = 0;
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBLAY_RULE_BLOB_HEADER), &blob, &cbBlob);
+            if (NT_SUCCESS(status))
+            {
+                if (!KbdLayCheckRuleBlobDirect(in, cbIn, cbBlob, KBLAY_MAX_RULE_BLOB_BYTES))
+                    status = STATUS_INVALID_BUFFER_SIZE;
+                else
+                    status = KbdLayApplyRuleBlobByContainer(&in->ContainerId, blob, cbBlob);
+            }
+        }
+    }
     else if (IoControlCode == IOCTL_KBLAY_GET_STATUS_EX)
     {
         KBLAY_GET_STATUS_EX_INPUT* in = NULL;
@@ -369,12 +577,18 @@ KbdLayEvtIoControlDeviceControl(
         {
             KBLAY_STATUS_OUTPUT* out = NULL;
             size_t cbOut = 0;
-            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBLAY_STATUS_OUTPUT), (PVOID*)&out, &cbOut);
+            status = WdfRequestRetrieveOutputBuffer(Request, KBLAY_STATUS_OUTPUT_V1_SIZE, (PVOID*)&out, &cbOut);
             if (NT_SUCCESS(status))
             {
-                status = KbdLayGetStatusByContainer(&in->ContainerId, out);
+                // Build the full record locally; older callers get the prefix that fits.
+                KBLAY_STATUS_OUTPUT snap;
+                const size_t used = cbOut < sizeof(snap) ? cbOut : sizeof(snap);
+                status = KbdLayGetStatusByContainer(&in->ContainerId, &snap);
                 if (NT_SUCCESS(status))
-                    WdfRequestSetInformation(Request, sizeof(*out));
+                {
+                    RtlCopyMemory(out, &snap, used);
+                    WdfRequestSetInformation(Request, used);
+                }
             }
         }
     }
@@ -410,6 +624,58 @@ KbdLayEvtIoControlDeviceControl(
             }
         }
     }
+    else if (IoControlCode == IOCTL_KBLAY_SET_TRACE_EX)
+    {
+        KBLAY_SET_TRACE_EX_INPUT* in = NULL;
+        size_t cb = 0;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(KBLAY_SET_TRACE_EX_INPUT), (PVOID*)&in, &cb);
+        if (NT_SUCCESS(status))
+        {
+            status = KbdLaySetTraceByContainer(&in->ContainerId, in->Enable ? TRUE : FALSE, in->Capacity);
+        }
+    }
+    else if (IoControlCode == IOCTL_KBLAY_DRAIN_TRACE_EX)
+    {
+        KBLAY_DRAIN_TRACE_EX_INPUT* in = NULL;
+        size_t cbIn = 0;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(KBLAY_DRAIN_TRACE_EX_INPUT), (PVOID*)&in, &cbIn);
+        if (NT_SUCCESS(status))
+        {
+            // Copy the ContainerId out first: input and output share the system buffer.
+            const GUID containerId = in->ContainerId;
+            KBLAY_DRAIN_TRACE_OUTPUT* out = NULL;
+            size_t cbOut = 0;
+            status = WdfRequestRetrieveOutputBuffer(Request, FIELD_OFFSET(KBLAY_DRAIN_TRACE_OUTPUT, Records), (PVOID*)&out, &cbOut);
+            if (NT_SUCCESS(status))
+            {
+                status = KbdLayDrainTraceByContainer(&containerId, out, cbOut);
+                if (NT_SUCCESS(status))
+                {
+                    const size_t header = FIELD_OFFSET(KBLAY_DRAIN_TRACE_OUTPUT, Records);
+                    WdfRequestSetInformation(Request, header + (size_t)out->Count * sizeof(KBLAY_TRACE_RECORD));
+                }
+            }
+        }
+    }
+    else if (IoControlCode == IOCTL_KBLAY_GET_RULE_BLOB_EX)
+    {
+        KBLAY_GET_RULE_BLOB_EX_INPUT* in = NULL;
+        size_t cbIn = 0;
+        status = WdfRequestRetrieveInputBuffer(Request, sizeof(KBLAY_GET_RULE_BLOB_EX_INPUT), (PVOID*)&in, &cbIn);
+        if (NT_SUCCESS(status))
+        {
+            const GUID containerId = in->ContainerId;
+            VOID* out = NULL;
+            size_t cbOut = 0;
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBLAY_RULE_BLOB_HEADER), &out, &cbOut);
+            if (NT_SUCCESS(status))
+            {
+                size_t used = 0;
+                status = KbdLayGetRuleBlobByContainer(&containerId, out, cbOut, &used);
+                WdfRequestSetInformation(Request, used);
+            }
+        }
+    }
 
     WdfRequestComplete(Request, status);
 }
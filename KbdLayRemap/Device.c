@@ -3,12 +3,15 @@
 #include "KeyboardConnect.h"
 #include "IoctlQueue.h"
 #include "RemapEngine.h"
+#include "PersistState.h"
 
 #include <initguid.h>
 #include <devpropdef.h>
 #include <devpkey.h>
 #include <wdfdevice.h>
 
+#define KBLAY_POOL_TAG_DEVICE 'dLbK'
+
 static const GUID KBDLAY_GUID_NULL = { 0 };
 // Standard keyboard device interface GUID.
 static const GUID KBDLAY_GUID_DEVINTERFACE_KEYBOARD =
@@ -36,15 +39,22 @@ KbdLayEvtDeviceAdd(_In_ WDFDRIVER Driver, _Inout_ PWDFDEVICE_INIT DeviceInit)
     if (!NT_SUCCESS(sddlStatus)) return sddlStatus;
 
     WDF_OBJECT_ATTRIBUTES attributes;
-    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, KBDLAY_DEVICE_CONTEXT);
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, KBDLAY_DEVICE_HANDLE);
     attributes.EvtCleanupCallback = KbdLayEvtDeviceContextCleanup;
+    attributes.EvtDestroyCallback = KbdLayEvtDeviceContextDestroy;
 
     WDFDEVICE device = NULL;
     NTSTATUS status = WdfDeviceCreate(&DeviceInit, &attributes, &device);
     if (!NT_SUCCESS(status)) return status;
 
-    PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext(device);
+    // Freed by KbdLayEvtDeviceContextDestroy, so it lives exactly as long as
+    // a WDF context would.
+    PKBDLAY_DEVICE_CONTEXT ctx = (PKBDLAY_DEVICE_CONTEXT)ExAllocatePoolWithTag(
+        NonPagedPoolNxCacheAligned, sizeof(KBDLAY_DEVICE_CONTEXT), KBLAY_POOL_TAG_DEVICE);
+    if (!ctx) return STATUS_INSUFFICIENT_RESOURCES;
     RtlZeroMemory(ctx, sizeof(*ctx));
+    KbdLayGetDeviceHandle(device)->Ctx = ctx;
+
     ctx->Role = KBLAY_ROLE_NONE;
     ctx->State = KBLAY_STATE_BYPASS_HARD;
     ctx->ContainerId = KBDLAY_GUID_NULL;
@@ -52,11 +62,37 @@ KbdLayEvtDeviceAdd(_In_ WDFDRIVER Driver, _Inout_ PWDFDEVICE_INIT DeviceInit)
     ctx->Device = device;
     InitializeListHead(&ctx->ListEntry);
 
+    KeInitializeDpc(&ctx->BacklogDpc, KbdLayBacklogDpc, ctx);
+    KeInitializeTimer(&ctx->RetryTimer);
+
+    // Closed until IOCTL_INTERNAL_KEYBOARD_CONNECT opens it.
+    KbdLayRundownInit(&ctx->UpperRundown);
+    KbdLayRundownClose(&ctx->UpperRundown);
+
     status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &ctx->Lock);
     if (!NT_SUCCESS(status)) return status;
 
     KbdLayRemapInit(ctx);
+
+    WDF_TIMER_CONFIG tcfg;
+    WDF_TIMER_CONFIG_INIT(&tcfg, KbdLayTapHoldTimerFunc);
+    tcfg.AutomaticSerialization = FALSE;
+    tcfg.TolerableDelay = 0;
+
+    WDF_OBJECT_ATTRIBUTES tattr;
+    WDF_OBJECT_ATTRIBUTES_INIT(&tattr);
+    tattr.ParentObject = device;
+
+    status = WdfTimerCreate(&tcfg, &tattr, &ctx->TapHoldTimer);
+    if (!NT_SUCCESS(status)) return status;
+
+    status = KbdLayPersistInit(device);
+    if (!NT_SUCCESS(status)) return status;
+
+    // Restore the last applied configuration before the control device can
+    // reach us, so a load never races an apply.
     KbdLayRefreshContainerId(device);
+    KbdLayPersistLoad(device);
     KbdLayDeviceListAdd(device);
 
     status = WdfDeviceCreateDeviceInterface(device, &GUID_DEVINTERFACE_KbdLayRemap, NULL);
@@ -81,13 +117,18 @@ KbdLayEvtDeviceAdd(_In_ WDFDRIVER Driver, _Inout_ PWDFDEVICE_INIT DeviceInit)
     status = WdfIoQueueCreate(device, &qcfg, WDF_NO_OBJECT_ATTRIBUTES, &queue);
     if (!NT_SUCCESS(status)) return status;
 
-    // Internal IOCTLs are serialized to avoid connect/disconnect overlap.
+    // Internal IOCTLs are serialized to avoid connect/disconnect overlap, and
+    // run at PASSIVE_LEVEL so disconnect can wait for callbacks to drain.
     WDF_IO_QUEUE_CONFIG iqcfg;
     WDF_IO_QUEUE_CONFIG_INIT(&iqcfg, WdfIoQueueDispatchSequential);
     iqcfg.EvtIoInternalDeviceControl = KbdLayEvtIoInternalDeviceControl;
 
+    WDF_OBJECT_ATTRIBUTES iqattr;
+    WDF_OBJECT_ATTRIBUTES_INIT(&iqattr);
+    iqattr.ExecutionLevel = WdfExecutionLevelPassive;
+
     WDFQUEUE iqueue = NULL;
-    status = WdfIoQueueCreate(device, &iqcfg, WDF_NO_OBJECT_ATTRIBUTES, &iqueue);
+    status = WdfIoQueueCreate(device, &iqcfg, &iqattr, &iqueue);
     if (!NT_SUCCESS(status)) return status;
 
     status = WdfDeviceConfigureRequestDispatching(
@@ -100,7 +141,36 @@ KbdLayEvtDeviceAdd(_In_ WDFDRIVER Driver, _Inout_ PWDFDEVICE_INIT DeviceInit)
 VOID
 KbdLayEvtDeviceContextCleanup(_In_ WDFOBJECT DeviceObject)
 {
+    PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext((WDFDEVICE)DeviceObject);
+    if (!ctx)
+        return;
+
     KbdLayDeviceListRemove((WDFDEVICE)DeviceObject);
+
+    // The callback and the tap-hold timer, which queue it, are done by now.
+    // With the connection closed, a BacklogDpc still to run drops its
+    // backlog instead of arming RetryTimer again.
+    if (ctx->UpperConnected)
+        KbdLayRundownClose(&ctx->UpperRundown);
+    KeCancelTimer(&ctx->RetryTimer);
+    KeRemoveQueueDpc(&ctx->BacklogDpc);
+    KeFlushQueuedDpcs();
+
+    // Off the list, so no drain can reach the ring any more.
+    InterlockedExchangePointer((PVOID volatile*)&ctx->TraceActive, NULL);
+    KbdLayTraceRingFree(ctx->TraceRing);
+    ctx->TraceRing = NULL;
+    KbdLayRemapFreeRuleBlob(ctx);
+    KbdLayRemapUninit(ctx);
+}
+
+VOID
+KbdLayEvtDeviceContextDestroy(_In_ WDFOBJECT DeviceObject)
+{
+    PKBDLAY_DEVICE_HANDLE h = KbdLayGetDeviceHandle((WDFDEVICE)DeviceObject);
+    if (h->Ctx)
+        ExFreePoolWithTag(h->Ctx, KBLAY_POOL_TAG_DEVICE);
+    h->Ctx = NULL;
 }
 
 NTSTATUS
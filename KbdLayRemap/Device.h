@@ -5,55 +5,103 @@
 #include <kbdmou.h>   // CONNECT_DATA, IOCTL_INTERNAL_KEYBOARD_CONNECT, PSERVICE_CALLBACK_ROUTINE
 
 #include "..\\Shared\Public.h"
+#include "..\\Shared\\KbdLayEngine.h"
+#include "..\\Shared\\KbdLayBudget.h"
+#include "..\\Shared\\KbdLayDeliver.h"
+#include "..\\Shared\\KbdLayRundown.h"
+#include "Trace.h"
 
 #ifndef KBLAY_DEVICE_SDDL
 #define KBLAY_DEVICE_SDDL L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GR;;;BU)"
 #endif
 
-// One rule cell in the inE0/inShift/make-code table.
-typedef struct KBLAY_RULE_CELL
-{
-    UINT8  OutMakeCode;
-    UINT8  OutFlags;    // KBLAY_FLAG_E0 | KBLAY_FLAG_SHIFT
-    UINT16 Reserved;
-} KBLAY_RULE_CELL;
-
+// Per-device state, in its own cache-aligned pool block (WDF only aligns
+// object contexts to MEMORY_ALLOCATION_ALIGNMENT). Fields are grouped by how
+// the input path touches them:
+//   - one line read by every event and written only on reconfiguration
+//     or when delivery stalls;
+//   - one line written by every batch (counters, rundown, arena flag);
+//   - the engine, whose first line holds the modifier and tap-hold state;
+//   - everything else, which the input path does not read.
 typedef struct KBDLAY_DEVICE_CONTEXT
 {
+    // --- Hot, read-mostly ---------------------------------------------------
+
     // Driver-controlled state (accessed with interlocked ops where appropriate).
-    volatile LONG Role;   // KBLAY_ROLE
-    volatile LONG State;  // KBLAY_STATE
+    DECLSPEC_CACHEALIGN volatile LONG Role;   // KBLAY_ROLE
+    volatile LONG State;                      // KBLAY_STATE
+
+    // Event trace. The input path only checks TraceActive (NULL when off).
+    KBLAY_TRACE_RING* volatile TraceActive;
+
+    WDFSPINLOCK Lock;
+
+    // Ticks the engine's tap-hold timers while any are armed, so a held key
+    // resolves without waiting for the next input.
+    WDFTIMER TapHoldTimer;
 
-    // Keyboard class connection we proxy.
+    // Keyboard class connection we proxy. Written only while UpperRundown
+    // is closed, so a callback holding the rundown can read it without the lock.
     CONNECT_DATA UpperConnect;     // original class connect data
-    BOOLEAN      UpperConnectValid;
-
-    // Physical modifier state as seen from hardware events.
-    // (Split L/R so we can reason about shift accurately.)
-    BOOLEAN PhysLShift;
-    BOOLEAN PhysRShift;
-    BOOLEAN PhysLCtrl;
-    BOOLEAN PhysRCtrl;
-    BOOLEAN PhysLAlt;
-    BOOLEAN PhysRAlt;
-    BOOLEAN PhysLWin;
-    BOOLEAN PhysRWin;
-
-    // Rules: [inE0][inShift][inMakeCode]
-    KBLAY_RULE_CELL Rules[2][2][256];
-    BOOLEAN         RuleValid[2][2][256];
+
+    // 1 while the class driver is full and RetryTimer, not the release of
+    // the arena, runs BacklogDpc next. Every batch reads it; only a stall
+    // and its retry write it.
+    volatile LONG DeliveryStalled;
+
+    // --- Hot, written per event or batch -----------------------------------
 
     // Stats (8-byte aligned for Interlocked*64 on all architectures).
-    DECLSPEC_ALIGN(8) volatile LONG64 RemapHitCount;
+    DECLSPEC_CACHEALIGN volatile LONG64 RemapHitCount;
     DECLSPEC_ALIGN(8) volatile LONG64 PassThroughCount;
     DECLSPEC_ALIGN(8) volatile LONG64 UnmappedCount;
     DECLSPEC_ALIGN(8) volatile LONG64 ShiftToggleCount;
+    DECLSPEC_ALIGN(8) volatile LONG64 DebounceDropCount;
+    DECLSPEC_ALIGN(8) volatile LONG64 EventsOutCount;
+
+    KBLAY_RUNDOWN UpperRundown;    // open while connected
+
+    // OutArenaBusy guards OutArena (a callback that finds it held defers its
+    // input to the backlog). TapHoldTimerQueued is 1 while the timer is started.
+    volatile LONG OutArenaBusy;
+    volatile LONG TapHoldTimerQueued;
+
+    // --- Engine (guarded by Lock) -----------------------------------------
+
+    // Modifier tracking, tap-hold state and the current rule table (portable core).
+    DECLSPEC_CACHEALIGN KBLAY_ENGINE Engine;
+
+    // Output arena: translated events are batched here and handed to the
+    // class driver in one call. What it does not accept stays here and goes
+    // out before anything newer; the input behind it is already consumed.
+    KBLAY_OUTBOX OutArena;
+
+    // Input taken from the port driver but not yet translated, because a
+    // callback ran out of budget. Guarded by Lock; only the OutArenaBusy
+    // owner delivers from it, in BacklogDpc.
+    KBLAY_BACKLOG Backlog;
+
+    // --- Cold ----------------------------------------------------------------
+
+    // Copy of the blob the table was built from, for IOCTL_KBLAY_GET_RULE_BLOB_EX
+    // (the lowered table cannot be turned back into rules). Guarded by Lock.
+    VOID*  RuleBlob;
+    size_t RuleBlobSize;
 
     volatile LONG   LastErrorNtStatus;
+    volatile LONG   RuleBlobHash;      // KbdLayRuleBlobHash of the loaded blob
 
-    GUID ContainerId; // best-effort cache (GUID_NULL if unknown)
+    // Owns the trace allocation; freed at context cleanup.
+    KBLAY_TRACE_RING* TraceRing;
 
-    WDFSPINLOCK Lock;
+    BOOLEAN UpperConnected;        // owned by the internal IOCTL queue
+
+    KDPC BacklogDpc;               // KbdLayBacklogDpc
+    KTIMER RetryTimer;             // runs BacklogDpc after the class driver was full
+
+    WDFWORKITEM PersistWorkItem;   // saves role/state/rules to the hardware key
+
+    GUID ContainerId; // best-effort cache (GUID_NULL if unknown)
 
     LIST_ENTRY ListEntry;
     BOOLEAN    Listed;
@@ -61,8 +109,26 @@ typedef struct KBDLAY_DEVICE_CONTEXT
 
 } KBDLAY_DEVICE_CONTEXT, * PKBDLAY_DEVICE_CONTEXT;
 
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(KBDLAY_DEVICE_CONTEXT, KbdLayGetDeviceContext)
+// Each hot group fits one line, and the engine's per-event state fits its first.
+C_ASSERT(FIELD_OFFSET(KBDLAY_DEVICE_CONTEXT, RemapHitCount) == SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(FIELD_OFFSET(KBDLAY_DEVICE_CONTEXT, Engine) == 2 * SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(FIELD_OFFSET(KBDLAY_DEVICE_CONTEXT, TapHoldTimerQueued) + sizeof(LONG) <= 2 * SYSTEM_CACHE_ALIGNMENT_SIZE);
+C_ASSERT(KBLAY_ENGINE_HOT_BYTES <= SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+// The WDF object context only points at the pool block.
+typedef struct KBDLAY_DEVICE_HANDLE
+{
+    PKBDLAY_DEVICE_CONTEXT Ctx;
+} KBDLAY_DEVICE_HANDLE, * PKBDLAY_DEVICE_HANDLE;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(KBDLAY_DEVICE_HANDLE, KbdLayGetDeviceHandle)
+
+static __forceinline PKBDLAY_DEVICE_CONTEXT KbdLayGetDeviceContext(_In_ WDFDEVICE Device)
+{
+    return KbdLayGetDeviceHandle(Device)->Ctx;
+}
 
+EVT_WDF_OBJECT_CONTEXT_DESTROY KbdLayEvtDeviceContextDestroy;
 EVT_WDF_DEVICE_CONTEXT_CLEANUP KbdLayEvtDeviceContextCleanup;
 EVT_WDF_DEVICE_SELF_MANAGED_IO_INIT KbdLayEvtDeviceSelfManagedIoInit;
 
@@ -2,6 +2,37 @@
 #include "ControlDevice.h"
 #include "Device.h"
 
+KBLAY_BUDGET_CONFIG g_KbdLayCallbackBudget = { KBLAY_BUDGET_DEFAULT_EVENTS, KBLAY_BUDGET_DEFAULT_US };
+ULONG g_KbdLayDebounceMs = 0;
+BOOLEAN g_KbdLayShareModifiers = FALSE;
+// Written by every keyboard's modifier changes; keep it off other data's line.
+DECLSPEC_CACHEALIGN KBLAY_MOD_SHARE g_KbdLayModShare = { 0 };
+
+static VOID
+KbdLayReadParameters(_In_ WDFDRIVER Driver)
+{
+    WDFKEY key = NULL;
+    if (!NT_SUCCESS(WdfDriverOpenParametersRegistryKey(Driver, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key)))
+        return;
+
+    DECLARE_CONST_UNICODE_STRING(eventsName, L"CallbackEventBudget");
+    DECLARE_CONST_UNICODE_STRING(microsName, L"CallbackBudgetMicroseconds");
+    DECLARE_CONST_UNICODE_STRING(debounceName, L"DebounceMilliseconds");
+    DECLARE_CONST_UNICODE_STRING(shareName, L"ShareModifiers");
+
+    ULONG value = 0;
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &eventsName, &value)))
+        g_KbdLayCallbackBudget.MaxEvents = value;
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &microsName, &value)))
+        g_KbdLayCallbackBudget.MaxMicros = value;
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &debounceName, &value)))
+        g_KbdLayDebounceMs = value < KBLAY_DEBOUNCE_MAX_MS ? value : KBLAY_DEBOUNCE_MAX_MS;
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &shareName, &value)))
+        g_KbdLayShareModifiers = value != 0 ? TRUE : FALSE;
+
+    WdfRegistryClose(key);
+}
+
 NTSTATUS
 DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
 {
@@ -17,6 +48,8 @@ DriverEntry(_In_ PDRIVER_OBJECT DriverObject, _In_ PUNICODE_STRING RegistryPath)
     if (!NT_SUCCESS(status))
         return status;
 
+    KbdLayReadParameters(driver);
+
     return KbdLayControlDeviceInitialize(driver);
 }
 
@@ -3,8 +3,24 @@
 #include <wdf.h>
 
 #include "..\\Shared\\Public.h"
+#include "..\\Shared\\KbdLayBudget.h"
+#include "..\\Shared\\KbdLayModShare.h"
 
 DRIVER_INITIALIZE DriverEntry;
 
 EVT_WDF_DRIVER_DEVICE_ADD KbdLayEvtDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP KbdLayEvtDriverContextCleanup;
+
+// Per-callback work budget (Parameters\CallbackEventBudget and
+// Parameters\CallbackBudgetMicroseconds; read once at load).
+extern KBLAY_BUDGET_CONFIG g_KbdLayCallbackBudget;
+
+// Chatter debounce window for new devices, in ms; 0 = off
+// (Parameters\DebounceMilliseconds; read once at load).
+extern ULONG g_KbdLayDebounceMs;
+
+// Pool modifier state across every keyboard (Parameters\ShareModifiers,
+// nonzero = on; read once at load), so Shift held on one keyboard picks
+// the shifted rules on another.
+extern BOOLEAN g_KbdLayShareModifiers;
+extern KBLAY_MOD_SHARE g_KbdLayModShare;
@@ -1,6 +1,7 @@
 #include "Device.h"
 #include "KeyboardConnect.h"
 #include "RemapEngine.h"
+#include "PersistState.h"
 
 static __forceinline BOOLEAN KbdLayIsValidRole(_In_ UINT32 Role)
 {
@@ -56,6 +57,7 @@ KbdLayEvtIoDeviceControl(
                 InterlockedExchange(&ctx->Role, (LONG)in->Role);
                 InterlockedExchange(&ctx->LastErrorNtStatus, STATUS_SUCCESS);
                 status = STATUS_SUCCESS;
+                KbdLayPersistSchedule(ctx);
             }
         }
     }
@@ -75,17 +77,22 @@ KbdLayEvtIoDeviceControl(
                 InterlockedExchange(&ctx->State, (LONG)in->State);
                 InterlockedExchange(&ctx->LastErrorNtStatus, STATUS_SUCCESS);
                 status = STATUS_SUCCESS;
+                KbdLayPersistSchedule(ctx);
             }
         }
     }
-    else if (IoControlCode == IOCTL_KBLAY_SET_RULE_BLOB)
+    else if (IoControlCode == IOCTL_KBLAY_SET_RULE_BLOB || IoControlCode == IOCTL_KBLAY_SET_RULE_BLOB_DIRECT)
     {
+        // The direct form passes the blob as the (locked) output buffer.
         VOID* blob = NULL;
         size_t cb = 0;
-        status = WdfRequestRetrieveInputBuffer(Request, sizeof(KBLAY_RULE_BLOB_HEADER), &blob, &cb);
+        if (IoControlCode == IOCTL_KBLAY_SET_RULE_BLOB)
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(KBLAY_RULE_BLOB_HEADER), &blob, &cb);
+        else
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBLAY_RULE_BLOB_HEADER), &blob, &cb);
         if (NT_SUCCESS(status))
         {
-            if (cb == 0 || cb > (size_t)KBLAY_MAX_RULE_BLOB_BYTES)
+            if (!KbdLayRuleBlobSizeOk(cb, KBLAY_MAX_RULE_BLOB_BYTES))
             {
                 status = STATUS_INVALID_BUFFER_SIZE;
             }
@@ -95,18 +102,24 @@ KbdLayEvtIoDeviceControl(
                 if (!NT_SUCCESS(status))
                     InterlockedExchange(&ctx->LastErrorNtStatus, (LONG)status);
                 else
+                {
                     InterlockedExchange(&ctx->LastErrorNtStatus, STATUS_SUCCESS);
+                    KbdLayPersistSchedule(ctx);
+                }
             }
         }
     }
     else if (IoControlCode == IOCTL_KBLAY_GET_STATUS)
     {
-        KBLAY_STATUS_OUTPUT* out = NULL;
+        KBLAY_STATUS_OUTPUT* buf = NULL;
         size_t cb = 0;
-        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(KBLAY_STATUS_OUTPUT), (PVOID*)&out, &cb);
+        status = WdfRequestRetrieveOutputBuffer(Request, KBLAY_STATUS_OUTPUT_V1_SIZE, (PVOID*)&buf, &cb);
         if (NT_SUCCESS(status))
         {
-            RtlZeroMemory(out, cb < sizeof(*out) ? cb : sizeof(*out));
+            KBLAY_STATUS_OUTPUT snap;
+            KBLAY_STATUS_OUTPUT* out = &snap;
+            const size_t used = cb < sizeof(snap) ? cb : sizeof(snap);
+            RtlZeroMemory(out, sizeof(*out));
 
             // Snapshot fields atomically (avoid torn reads on 32-bit targets and reduce inconsistency).
             out->Role = (UINT32)InterlockedCompareExchange((volatile LONG*)&ctx->Role, 0, 0);
@@ -116,14 +129,19 @@ KbdLayEvtIoDeviceControl(
             out->PassThroughCount = (UINT64)InterlockedCompareExchange64((volatile LONG64*)&ctx->PassThroughCount, 0, 0);
             out->UnmappedCount = (UINT64)InterlockedCompareExchange64((volatile LONG64*)&ctx->UnmappedCount, 0, 0);
             out->ShiftToggleCount = (UINT64)InterlockedCompareExchange64((volatile LONG64*)&ctx->ShiftToggleCount, 0, 0);
+            out->DebounceDropCount = (UINT64)InterlockedCompareExchange64((volatile LONG64*)&ctx->DebounceDropCount, 0, 0);
+            out->EventsOutCount = (UINT64)InterlockedCompareExchange64((volatile LONG64*)&ctx->EventsOutCount, 0, 0);
 
             out->LastErrorNtStatus = (UINT32)InterlockedCompareExchange((volatile LONG*)&ctx->LastErrorNtStatus, 0, 0);
+            out->RuleBlobHash = (UINT32)InterlockedCompareExchange((volatile LONG*)&ctx->RuleBlobHash, 0, 0);
 
             WdfSpinLockAcquire(ctx->Lock);
             out->ContainerId = ctx->ContainerId;
+            out->TapHoldMaxLateMs = ctx->Engine.TapHold.MaxLateMs;
             WdfSpinLockRelease(ctx->Lock);
 
-            WdfRequestSetInformation(Request, sizeof(*out));
+            RtlCopyMemory(buf, out, used);
+            WdfRequestSetInformation(Request, used);
             status = STATUS_SUCCESS;
         }
     }
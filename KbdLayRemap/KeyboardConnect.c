@@ -1,62 +1,19 @@
 #include "KeyboardConnect.h"
+#include "DriverEntry.h"
 #include "RemapEngine.h"
 
+// How long delivery waits after the class driver took less than it was offered.
+#define KBDLAY_DELIVER_RETRY_MS 8
+
 // Forward helpers.
 static NTSTATUS KbdLayForwardSendAndForget(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target);
+static NTSTATUS KbdLayForwardSynchronously(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target);
 
+// Waits for callbacks in flight to leave, after which UpperConnect may change.
 static VOID
-KbdLayClearUpperConnectLocked(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx)
-{
-    Ctx->UpperConnectValid = FALSE;
-    RtlZeroMemory(&Ctx->UpperConnect, sizeof(Ctx->UpperConnect));
-}
-
-static VOID
-KbdLayConnectCompletionRoutine(
-    _In_ WDFREQUEST Request,
-    _In_ WDFIOTARGET Target,
-    _In_ PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
-    _In_ WDFCONTEXT Context)
+KbdLayCloseUpper(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx)
 {
-    UNREFERENCED_PARAMETER(Target);
-
-    PKBDLAY_DEVICE_CONTEXT ctx = (PKBDLAY_DEVICE_CONTEXT)Context;
-    NTSTATUS status = CompletionParams->IoStatus.Status;
-
-    if (ctx != NULL)
-    {
-        WdfSpinLockAcquire(ctx->Lock);
-        if (!NT_SUCCESS(status))
-            KbdLayClearUpperConnectLocked(ctx);
-        WdfSpinLockRelease(ctx->Lock);
-    }
-
-    // We own completion when we set a completion routine.
-    WdfRequestComplete(Request, status);
-}
-
-static VOID
-KbdLayDisconnectCompletionRoutine(
-    _In_ WDFREQUEST Request,
-    _In_ WDFIOTARGET Target,
-    _In_ PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
-    _In_ WDFCONTEXT Context)
-{
-    UNREFERENCED_PARAMETER(Target);
-
-    PKBDLAY_DEVICE_CONTEXT ctx = (PKBDLAY_DEVICE_CONTEXT)Context;
-    NTSTATUS status = CompletionParams->IoStatus.Status;
-
-    if (ctx != NULL)
-    {
-        WdfSpinLockAcquire(ctx->Lock);
-        if (NT_SUCCESS(status))
-            KbdLayClearUpperConnectLocked(ctx);
-        WdfSpinLockRelease(ctx->Lock);
-    }
-
-    // We own completion when we set a completion routine.
-    WdfRequestComplete(Request, status);
+    KbdLayRundownClose(&Ctx->UpperRundown);
 }
 
 NTSTATUS
@@ -74,14 +31,13 @@ KbdLayHandleInternalIoctl(
     PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext(device);
     WDFIOTARGET target = WdfDeviceGetIoTarget(device);
 
+    // Connect and disconnect are sent down synchronously: this queue is
+    // sequential and passive-level, so UpperConnected and the rundown
+    // transitions need no lock.
     if (IoControlCode == IOCTL_INTERNAL_KEYBOARD_CONNECT)
     {
         // Only allow one connection.
-        WdfSpinLockAcquire(ctx->Lock);
-        BOOLEAN alreadyConnected = ctx->UpperConnectValid ? TRUE : FALSE;
-        WdfSpinLockRelease(ctx->Lock);
-
-        if (alreadyConnected)
+        if (ctx->UpperConnected)
         {
             WdfRequestComplete(Request, STATUS_SHARING_VIOLATION);
             return STATUS_SHARING_VIOLATION;
@@ -97,10 +53,8 @@ KbdLayHandleInternalIoctl(
         }
 
         // Cache original connect info so our callback can call the next driver.
-        WdfSpinLockAcquire(ctx->Lock);
+        // The rundown is closed, so no callback is reading it.
         ctx->UpperConnect = *cd;
-        ctx->UpperConnectValid = TRUE;
-        WdfSpinLockRelease(ctx->Lock);
 
         // Hook into the report chain.
         cd->ClassDeviceObject = WdfDeviceWdmGetDeviceObject(device);
@@ -110,50 +64,65 @@ KbdLayHandleInternalIoctl(
         cd->ClassService = (PVOID)(ULONG_PTR)KbdLayClassServiceCallback;
 #pragma warning(pop)
 
-        // Forward down and complete in our completion routine.
-        // NOTE: WdfRequestFormatRequestUsingCurrentType returns VOID.
-        WdfRequestFormatRequestUsingCurrentType(Request);
-        WdfRequestSetCompletionRoutine(Request, KbdLayConnectCompletionRoutine, (WDFCONTEXT)ctx);
+        // Open before the port driver can call us.
+        KbdLayRundownReopen(&ctx->UpperRundown);
 
-        if (!WdfRequestSend(Request, target, WDF_NO_SEND_OPTIONS))
+        status = KbdLayForwardSynchronously(Request, target);
+        if (NT_SUCCESS(status))
         {
-            // Request NOT sent => we still own it and must complete.
-            status = WdfRequestGetStatus(Request);
-
-            // Roll back cached state to allow retry.
-            WdfSpinLockAcquire(ctx->Lock);
-            KbdLayClearUpperConnectLocked(ctx);
-            WdfSpinLockRelease(ctx->Lock);
-
-            WdfRequestComplete(Request, status);
-            return status;
+            ctx->UpperConnected = TRUE;
+        }
+        else
+        {
+            // Roll back to allow retry.
+            KbdLayCloseUpper(ctx);
+            RtlZeroMemory(&ctx->UpperConnect, sizeof(ctx->UpperConnect));
         }
 
-        return STATUS_PENDING;
+        WdfRequestComplete(Request, status);
+        return status;
     }
     else if (IoControlCode == IOCTL_INTERNAL_KEYBOARD_DISCONNECT)
     {
-        // Lower stack is disconnecting; drop cached connect state on success.
-        // Forward down and complete in our completion routine.
-        // NOTE: WdfRequestFormatRequestUsingCurrentType returns VOID.
-        WdfRequestFormatRequestUsingCurrentType(Request);
-        WdfRequestSetCompletionRoutine(Request, KbdLayDisconnectCompletionRoutine, (WDFCONTEXT)ctx);
+        // Drain callbacks before the class driver goes away; any that arrive
+        // from here on drop their input.
+        if (ctx->UpperConnected)
+            KbdLayCloseUpper(ctx);
 
-        if (!WdfRequestSend(Request, target, WDF_NO_SEND_OPTIONS))
+        NTSTATUS status = KbdLayForwardSynchronously(Request, target);
+        if (NT_SUCCESS(status))
         {
-            NTSTATUS status = WdfRequestGetStatus(Request);
-
-            WdfRequestComplete(Request, status);
-            return status;
+            ctx->UpperConnected = FALSE;
+            RtlZeroMemory(&ctx->UpperConnect, sizeof(ctx->UpperConnect));
+        }
+        else if (ctx->UpperConnected)
+        {
+            // Lower stack kept the connection; so do we.
+            KbdLayRundownReopen(&ctx->UpperRundown);
         }
 
-        return STATUS_PENDING;
+        WdfRequestComplete(Request, status);
+        return status;
     }
 
     // Pass-through for all other internal IOCTLs.
     return KbdLayForwardSendAndForget(Request, target);
 }
 
+static NTSTATUS
+KbdLayForwardSynchronously(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target)
+{
+    // NOTE: WdfRequestFormatRequestUsingCurrentType returns VOID.
+    WdfRequestFormatRequestUsingCurrentType(Request);
+
+    WDF_REQUEST_SEND_OPTIONS options;
+    WDF_REQUEST_SEND_OPTIONS_INIT(&options, WDF_REQUEST_SEND_OPTION_SYNCHRONOUS);
+
+    // Either way the status is in the request and we still own it.
+    (VOID)WdfRequestSend(Request, Target, &options);
+    return WdfRequestGetStatus(Request);
+}
+
 static NTSTATUS
 KbdLayForwardSendAndForget(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target)
 {
@@ -173,6 +142,119 @@ KbdLayForwardSendAndForget(_In_ WDFREQUEST Request, _In_ WDFIOTARGET Target)
     return STATUS_PENDING;
 }
 
+// The class driver a delivery goes to, for the KBLAY_DELIVER_OPS below.
+typedef struct KBDLAY_UPPER
+{
+    PKBDLAY_DEVICE_CONTEXT Ctx;
+    PSERVICE_CALLBACK_ROUTINE Callback;
+    PDEVICE_OBJECT Device;
+} KBDLAY_UPPER;
+
+static UINT32
+KbdLayUpperTranslate(
+    _Inout_ VOID* Context,
+    _In_reads_(Count) const KBLAY_KEY_EVENT* In,
+    _In_ UINT32 Count,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ UINT32 OutCap,
+    _Out_ UINT32* Produced)
+{
+    KBDLAY_UPPER* upper = (KBDLAY_UPPER*)Context;
+    ULONG produced = 0;
+    const ULONG taken = KbdLayRemapBatch(upper->Ctx, (const KEYBOARD_INPUT_DATA*)In, Count, (KEYBOARD_INPUT_DATA*)Out, OutCap, &produced);
+    *Produced = produced;
+    return taken;
+}
+
+static UINT32
+KbdLayUpperSend(
+    _Inout_ VOID* Context,
+    _In_reads_(Count) const KBLAY_KEY_EVENT* Events,
+    _In_ UINT32 Count)
+{
+    KBDLAY_UPPER* upper = (KBDLAY_UPPER*)Context;
+    PKEYBOARD_INPUT_DATA start = (PKEYBOARD_INPUT_DATA)(ULONG_PTR)Events;
+    ULONG consumedOut = 0;
+    upper->Callback(upper->Device, start, start + Count, &consumedOut);
+    return consumedOut;
+}
+
+static UINT64
+KbdLayUpperNow(_Inout_ VOID* Context)
+{
+    UNREFERENCED_PARAMETER(Context);
+    return (UINT64)KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+static VOID
+KbdLayUpperLock(_Inout_ VOID* Context)
+{
+    WdfSpinLockAcquire(((KBDLAY_UPPER*)Context)->Ctx->Lock);
+}
+
+static VOID
+KbdLayUpperUnlock(_Inout_ VOID* Context)
+{
+    WdfSpinLockRelease(((KBDLAY_UPPER*)Context)->Ctx->Lock);
+}
+
+static const KBLAY_DELIVER_OPS g_KbdLayUpperOps = { KbdLayUpperTranslate, KbdLayUpperSend, KbdLayUpperNow, KbdLayUpperLock, KbdLayUpperUnlock };
+
+static __forceinline VOID
+KbdLayStartBudget(_Out_ KBLAY_BUDGET* Budget)
+{
+    LARGE_INTEGER freq;
+    const LARGE_INTEGER now = KeQueryPerformanceCounter(&freq);
+    KbdLayBudgetStart(Budget, &g_KbdLayCallbackBudget, (UINT64)now.QuadPart, (UINT64)freq.QuadPart);
+}
+
+static __forceinline BOOLEAN
+KbdLayHasBacklog(_In_ PKBDLAY_DEVICE_CONTEXT Ctx)
+{
+    return InterlockedCompareExchange((volatile LONG*)&Ctx->Backlog.Count, 0, 0) != 0 ? TRUE : FALSE;
+}
+
+// Takes input into the backlog for BacklogDpc; returns how much fit. The
+// rest stays with the port driver through the partial-consumption contract.
+static ULONG
+KbdLayDefer(
+    _In_ PKBDLAY_DEVICE_CONTEXT Ctx,
+    _In_ PKEYBOARD_INPUT_DATA InputDataStart,
+    _In_ PKEYBOARD_INPUT_DATA InputDataEnd)
+{
+    WdfSpinLockAcquire(Ctx->Lock);
+    const UINT32 taken = KbdLayBacklogPush(&Ctx->Backlog, (const KBLAY_KEY_EVENT*)InputDataStart, (UINT32)(InputDataEnd - InputDataStart));
+    WdfSpinLockRelease(Ctx->Lock);
+
+    if (taken != 0)
+        KeInsertQueueDpc(&Ctx->BacklogDpc, NULL, NULL);
+    return taken;
+}
+
+// The class driver is full. Re-running BacklogDpc at once would only find
+// it full again, at DISPATCH_LEVEL and for as long as it stays full, so it
+// runs from RetryTimer instead (or from the next callback's Defer).
+static VOID
+KbdLayStallDelivery(_In_ PKBDLAY_DEVICE_CONTEXT Ctx)
+{
+    LARGE_INTEGER due;
+    due.QuadPart = -(LONGLONG)KBDLAY_DELIVER_RETRY_MS * 10000;
+
+    InterlockedExchange(&Ctx->DeliveryStalled, 1);
+    KeSetTimer(&Ctx->RetryTimer, due, &Ctx->BacklogDpc);
+}
+
+// Every holder of OutArenaBusy lets go through here: BacklogDpc gives up
+// when the arena is held, so whoever releases it wakes the DPC again,
+// unless delivery is stalled and RetryTimer will.
+static VOID
+KbdLayReleaseArena(_In_ PKBDLAY_DEVICE_CONTEXT Ctx)
+{
+    InterlockedExchange(&Ctx->OutArenaBusy, 0);
+    if (KbdLayHasBacklog(Ctx) && InterlockedCompareExchange(&Ctx->DeliveryStalled, 0, 0) == 0)
+        KeInsertQueueDpc(&Ctx->BacklogDpc, NULL, NULL);
+}
+
 VOID
 KbdLayClassServiceCallback(
     _In_ PDEVICE_OBJECT DeviceObject,
@@ -190,77 +272,191 @@ KbdLayClassServiceCallback(
 
     PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext(device);
 
-    CONNECT_DATA upper;
-    BOOLEAN upperValid = FALSE;
+    if (InputDataEnd < InputDataStart)
+    {
+        if (InputDataConsumed) *InputDataConsumed = 0;
+        return;
+    }
+
+    ULONG originalCount = (ULONG)(InputDataEnd - InputDataStart);
+    if (originalCount == 0)
+    {
+        if (InputDataConsumed) *InputDataConsumed = 0;
+        return;
+    }
 
-    WdfSpinLockAcquire(ctx->Lock);
-    upper = ctx->UpperConnect;
-    upperValid = ctx->UpperConnectValid;
-    WdfSpinLockRelease(ctx->Lock);
+    // Held for the whole batch: the connection cannot change underneath us,
+    // and a disconnect waits for us to finish.
+    if (!KbdLayRundownAcquire(&ctx->UpperRundown))
+    {
+        if (InputDataConsumed) *InputDataConsumed = originalCount;
+        return;
+    }
 
-    if (!upperValid || upper.ClassService == NULL || upper.ClassDeviceObject == NULL)
+    const CONNECT_DATA* upper = &ctx->UpperConnect;
+    if (upper->ClassService == NULL || upper->ClassDeviceObject == NULL)
     {
-        if (InputDataConsumed && InputDataEnd >= InputDataStart)
-            *InputDataConsumed = (ULONG)(InputDataEnd - InputDataStart);
+        KbdLayRundownRelease(&ctx->UpperRundown);
+        if (InputDataConsumed) *InputDataConsumed = originalCount;
         return;
     }
 
-    PSERVICE_CALLBACK_ROUTINE upperCb = (PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)upper.ClassService;
+    PSERVICE_CALLBACK_ROUTINE upperCb = (PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)upper->ClassService;
 
-    if (InputDataEnd < InputDataStart)
+    ULONG inputConsumed = 0;
+
+    if (KbdLayHasBacklog(ctx) || InterlockedExchange(&ctx->OutArenaBusy, 1) != 0)
     {
-        if (InputDataConsumed) *InputDataConsumed = 0;
+        // Older input is still waiting, or the arena's holder (another CPU,
+        // the backlog DPC or the tap-hold timer) has output to send first.
+        // Queue behind it to keep order.
+        inputConsumed = KbdLayDefer(ctx, InputDataStart, InputDataEnd);
+    }
+    else
+    {
+        // Translate what the budget allows now; the rest continues from
+        // BacklogDpc so the port driver's DPC is not held for a burst.
+        KBLAY_BUDGET budget;
+        KbdLayStartBudget(&budget);
+
+        KBDLAY_UPPER to = { ctx, upperCb, upper->ClassDeviceObject };
+        UINT32 taken = 0;
+        const KBLAY_DELIVER_STATUS status = KbdLayDeliver(&ctx->OutArena, &g_KbdLayUpperOps, &to,
+            (const KBLAY_KEY_EVENT*)InputDataStart, originalCount, &budget, &taken);
+
+        // Translated input is consumed even if some of its output is still
+        // in the arena. When the class driver is full the rest stays with
+        // the port driver, which offers it again.
+        inputConsumed = taken;
+        if (status == KBLAY_DELIVER_BUDGET)
+            inputConsumed += KbdLayDefer(ctx, InputDataStart + taken, InputDataEnd);
+        else if (status == KBLAY_DELIVER_FULL)
+            KbdLayStallDelivery(ctx);
+
+        KbdLayReleaseArena(ctx);
+    }
+
+    KbdLayRundownRelease(&ctx->UpperRundown);
+
+    if (InputDataConsumed)
+        *InputDataConsumed = inputConsumed;
+}
+
+VOID
+KbdLayTapHoldTimerFunc(_In_ WDFTIMER Timer)
+{
+    WDFDEVICE device = (WDFDEVICE)WdfTimerGetParentObject(Timer);
+    PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext(device);
+
+    InterlockedExchange(&ctx->TapHoldTimerQueued, 0);
+
+    // The input path is delivering; it advances the clock itself before each
+    // event. Look again on the next tick.
+    if (InterlockedExchange(&ctx->OutArenaBusy, 1) != 0)
+    {
+        KbdLayRemapKickTimer(ctx);
         return;
     }
 
-    ULONG originalCount = (ULONG)(InputDataEnd - InputDataStart);
-    if (originalCount == 0)
+    const BOOLEAN connected = KbdLayRundownAcquire(&ctx->UpperRundown);
+    const CONNECT_DATA* upper = &ctx->UpperConnect;
+    if (!connected || upper->ClassService == NULL || upper->ClassDeviceObject == NULL)
     {
-        if (InputDataConsumed) *InputDataConsumed = 0;
+        // Holds still resolve; with nobody to deliver to, their output is
+        // dropped like input.
+        KEYBOARD_INPUT_DATA out[KBLAY_TAPHOLD_MAX_ACTIVE];
+        (VOID)KbdLayRemapAdvance(ctx, out, RTL_NUMBER_OF(out));
+        ctx->OutArena.Count = 0;
+
+        if (connected)
+            KbdLayRundownRelease(&ctx->UpperRundown);
+        KbdLayReleaseArena(ctx);
         return;
     }
 
-    ULONG inputConsumed = 0;
-    BOOLEAN upperLost = FALSE;
+    KBDLAY_UPPER to = { ctx, (PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)upper->ClassService, upper->ClassDeviceObject };
+    KBLAY_OUTBOX* box = &ctx->OutArena;
 
-    for (PKEYBOARD_INPUT_DATA p = InputDataStart; p < InputDataEnd; ++p)
+    // Holds go out behind output the class driver still owes us. Backlogged
+    // input arrived before now, so the clock only moves once BacklogDpc has
+    // translated it; until then look again on the next tick.
+    if (KBLAY_OUTBOX_EVENTS - box->Count < KBLAY_TAPHOLD_MAX_ACTIVE)
+        (VOID)KbdLayOutboxFlush(box, &g_KbdLayUpperOps, &to);
+    if (!KbdLayHasBacklog(ctx) && KBLAY_OUTBOX_EVENTS - box->Count >= KBLAY_TAPHOLD_MAX_ACTIVE)
     {
-        // If we get disconnected mid-callback, stop calling the upper driver.
-        WdfSpinLockAcquire(ctx->Lock);
-        BOOLEAN stillValid = ctx->UpperConnectValid ? TRUE : FALSE;
-        WdfSpinLockRelease(ctx->Lock);
+        box->Count += (UINT32)KbdLayRemapAdvance(ctx, (KEYBOARD_INPUT_DATA*)(box->Events + box->Count), KBLAY_OUTBOX_EVENTS - box->Count);
+        (VOID)KbdLayOutboxFlush(box, &g_KbdLayUpperOps, &to);
+    }
+    else
+    {
+        KbdLayRemapKickTimer(ctx);
+    }
 
-        if (!stillValid)
-        {
-            upperLost = TRUE;
-            break;
-        }
+    // Whatever the class driver left is sent again on the next tick, unless
+    // input gets there first.
+    if (box->Count != 0)
+        KbdLayRemapKickTimer(ctx);
 
-        KEYBOARD_INPUT_DATA tmp[3];
-        BOOLEAN didRemap = FALSE;
+    KbdLayRundownRelease(&ctx->UpperRundown);
+    KbdLayReleaseArena(ctx);
+}
 
-        size_t produced = KbdLayRemapOne(ctx, p, tmp, RTL_NUMBER_OF(tmp), &didRemap);
+// Continues input a callback ran out of budget for, one budget per run.
+// Each device has its own DPC and requeues it after a run that ran out of
+// budget, so a device with a long backlog takes turns with the others
+// instead of starving them. A run that found the class driver full waits
+// for RetryTimer instead.
+VOID
+KbdLayBacklogDpc(
+    _In_ PKDPC Dpc,
+    _In_opt_ PVOID DeferredContext,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2)
+{
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
 
-        if (produced == 0)
-        {
-            ULONG consumedOut = 0;
-            upperCb(upper.ClassDeviceObject, p, p + 1, &consumedOut);
-            if (consumedOut == 0)
-                break;
+    PKBDLAY_DEVICE_CONTEXT ctx = (PKBDLAY_DEVICE_CONTEXT)DeferredContext;
+    if (ctx == NULL)
+        return;
 
-            inputConsumed += 1;
-            continue;
-        }
+    // The holder queues us again when it lets go.
+    if (InterlockedExchange(&ctx->OutArenaBusy, 1) != 0)
+        return;
+    InterlockedExchange(&ctx->DeliveryStalled, 0);
 
-        ULONG producedOut = (ULONG)produced;
-        ULONG consumedOut = 0;
-        upperCb(upper.ClassDeviceObject, tmp, tmp + producedOut, &consumedOut);
-        if (consumedOut < producedOut)
-            break;
+    const BOOLEAN connected = KbdLayRundownAcquire(&ctx->UpperRundown);
+    const CONNECT_DATA* upper = &ctx->UpperConnect;
+    if (!connected || upper->ClassService == NULL || upper->ClassDeviceObject == NULL)
+    {
+        // Nobody to deliver to; the input is dropped as the callback would
+        // have, and so is output the old class driver did not take.
+        WdfSpinLockAcquire(ctx->Lock);
+        KbdLayBacklogPop(&ctx->Backlog, ctx->Backlog.Count);
+        WdfSpinLockRelease(ctx->Lock);
+        ctx->OutArena.Count = 0;
 
-        inputConsumed += 1;
+        if (connected)
+            KbdLayRundownRelease(&ctx->UpperRundown);
+        InterlockedExchange(&ctx->OutArenaBusy, 0);
+        return;
     }
 
-    if (InputDataConsumed)
-        *InputDataConsumed = upperLost ? originalCount : inputConsumed;
+    KBDLAY_UPPER to = { ctx, (PSERVICE_CALLBACK_ROUTINE)(ULONG_PTR)upper->ClassService, upper->ClassDeviceObject };
+
+    KBLAY_BUDGET budget;
+    KbdLayStartBudget(&budget);
+
+    // Owed output first, then the backlog; translated entries leave it.
+    const KBLAY_DELIVER_STATUS status = KbdLayDeliverBacklog(&ctx->OutArena, &ctx->Backlog, &g_KbdLayUpperOps, &to, &budget);
+
+    // Out of budget: queued again behind the other devices' DPCs by the
+    // release below. Class driver full: retried from RetryTimer, armed
+    // while the connection is held so cleanup can cancel it.
+    if (status == KBLAY_DELIVER_FULL)
+        KbdLayStallDelivery(ctx);
+
+    KbdLayRundownRelease(&ctx->UpperRundown);
+    KbdLayReleaseArena(ctx);
 }
@@ -13,3 +13,6 @@ VOID KbdLayClassServiceCallback(
     _In_ PKEYBOARD_INPUT_DATA InputDataStart,
     _In_ PKEYBOARD_INPUT_DATA InputDataEnd,
     _Inout_ PULONG InputDataConsumed);
+
+EVT_WDF_TIMER KbdLayTapHoldTimerFunc;
+KDEFERRED_ROUTINE KbdLayBacklogDpc;
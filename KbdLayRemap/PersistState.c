@@ -0,0 +1,149 @@
+#include "PersistState.h"
+#include "RemapEngine.h"
+#include "..\\Shared\\KbdLayPersist.h"
+
+#define KBLAY_POOL_TAG_PERSIST 'pLbK'
+
+static const GUID KBDLAY_GUID_NULL = { 0 };
+
+// The blob can be replaced while the work item allocates; give up after a
+// few tries and let the change that raced it schedule another save.
+#define KBLAY_PERSIST_SNAPSHOT_TRIES 4
+
+static EVT_WDF_WORKITEM KbdLayPersistWorkItem;
+
+NTSTATUS
+KbdLayPersistInit(_In_ WDFDEVICE Device)
+{
+    PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext(Device);
+
+    WDF_WORKITEM_CONFIG wcfg;
+    WDF_WORKITEM_CONFIG_INIT(&wcfg, KbdLayPersistWorkItem);
+    wcfg.AutomaticSerialization = FALSE;
+
+    WDF_OBJECT_ATTRIBUTES wattr;
+    WDF_OBJECT_ATTRIBUTES_INIT(&wattr);
+    wattr.ParentObject = Device;
+
+    return WdfWorkItemCreate(&wcfg, &wattr, &ctx->PersistWorkItem);
+}
+
+VOID
+KbdLayPersistSchedule(_In_ PKBDLAY_DEVICE_CONTEXT Ctx)
+{
+    if (Ctx->PersistWorkItem)
+        WdfWorkItemEnqueue(Ctx->PersistWorkItem);
+}
+
+VOID
+KbdLayPersistLoad(_In_ WDFDEVICE Device)
+{
+    PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext(Device);
+
+    WDFKEY key = NULL;
+    NTSTATUS status = WdfDeviceOpenRegistryKey(Device, PLUGPLAY_REGKEY_DEVICE, KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key);
+    if (!NT_SUCCESS(status))
+        return;
+
+    UNICODE_STRING name;
+    RtlInitUnicodeString(&name, KBLAY_PERSIST_VALUE_NAME);
+
+    ULONG cb = 0;
+    ULONG type = REG_NONE;
+    status = WdfRegistryQueryValue(key, &name, 0, NULL, &cb, &type);
+    if (status != STATUS_BUFFER_OVERFLOW || type != REG_BINARY ||
+        cb < sizeof(KBLAY_PERSIST_HEADER) || cb > KbdLayPersistSize(KBLAY_MAX_RULE_BLOB_BYTES))
+    {
+        WdfRegistryClose(key);
+        return;
+    }
+
+    VOID* record = ExAllocatePoolWithTag(PagedPool, cb, KBLAY_POOL_TAG_PERSIST);
+    if (!record)
+    {
+        WdfRegistryClose(key);
+        return;
+    }
+
+    status = WdfRegistryQueryValue(key, &name, cb, record, &cb, &type);
+    WdfRegistryClose(key);
+
+    KBLAY_PERSIST_VIEW view;
+    if (NT_SUCCESS(status) && type == REG_BINARY &&
+        KbdLayPersistDecode(record, cb, KBLAY_MAX_RULE_ENTRIES, KBLAY_MAX_RULE_BLOB_BYTES, &view))
+    {
+        // A record written for another container (the devnode was reused)
+        // is left for the service to overwrite.
+        GUID current;
+        WdfSpinLockAcquire(ctx->Lock);
+        current = ctx->ContainerId;
+        WdfSpinLockRelease(ctx->Lock);
+
+        const BOOLEAN sameDevice = IsEqualGUID(&current, &KBDLAY_GUID_NULL) ||
+            IsEqualGUID(&view.ContainerId, &KBDLAY_GUID_NULL) ||
+            IsEqualGUID(&current, &view.ContainerId);
+
+        if (sameDevice &&
+            (view.BlobSize == 0 || NT_SUCCESS(KbdLayRemapLoadRuleBlob(ctx, view.Blob, view.BlobSize))))
+        {
+            InterlockedExchange(&ctx->Role, (LONG)view.Role);
+            InterlockedExchange(&ctx->State, (LONG)view.State);
+        }
+    }
+
+    ExFreePoolWithTag(record, KBLAY_POOL_TAG_PERSIST);
+}
+
+static VOID
+KbdLayPersistWorkItem(_In_ WDFWORKITEM WorkItem)
+{
+    WDFDEVICE device = (WDFDEVICE)WdfWorkItemGetParentObject(WorkItem);
+    PKBDLAY_DEVICE_CONTEXT ctx = KbdLayGetDeviceContext(device);
+
+    // Copy the blob under the lock, then hash and write it at PASSIVE_LEVEL.
+    UINT8* record = NULL;
+    size_t blobSize = 0;
+    GUID containerId;
+    for (ULONG attempt = 0; attempt < KBLAY_PERSIST_SNAPSHOT_TRIES && !record; ++attempt)
+    {
+        WdfSpinLockAcquire(ctx->Lock);
+        blobSize = ctx->RuleBlob ? ctx->RuleBlobSize : 0;
+        WdfSpinLockRelease(ctx->Lock);
+
+        UINT8* buf = (UINT8*)ExAllocatePoolWithTag(NonPagedPoolNx, KbdLayPersistSize(blobSize), KBLAY_POOL_TAG_PERSIST);
+        if (!buf)
+            return;
+
+        WdfSpinLockAcquire(ctx->Lock);
+        const size_t now = ctx->RuleBlob ? ctx->RuleBlobSize : 0;
+        if (now == blobSize)
+        {
+            if (blobSize)
+                RtlCopyMemory(KbdLayPersistBlob(buf), ctx->RuleBlob, blobSize);
+            containerId = ctx->ContainerId;
+            record = buf;
+        }
+        WdfSpinLockRelease(ctx->Lock);
+
+        if (!record)
+            ExFreePoolWithTag(buf, KBLAY_POOL_TAG_PERSIST);
+    }
+    if (!record)
+        return;
+
+    const UINT32 role = (UINT32)InterlockedCompareExchange(&ctx->Role, 0, 0);
+    const UINT32 state = (UINT32)InterlockedCompareExchange(&ctx->State, 0, 0);
+    KbdLayPersistSeal(record, role, state, &containerId, blobSize);
+
+    // Best effort: without the record the device just starts bypassed.
+    WDFKEY key = NULL;
+    if (NT_SUCCESS(WdfDeviceOpenRegistryKey(device, PLUGPLAY_REGKEY_DEVICE, KEY_WRITE, WDF_NO_OBJECT_ATTRIBUTES, &key)))
+    {
+        UNICODE_STRING name;
+        RtlInitUnicodeString(&name, KBLAY_PERSIST_VALUE_NAME);
+        (VOID)WdfRegistryAssignValue(key, &name, REG_BINARY, (ULONG)KbdLayPersistSize(blobSize), record);
+        WdfRegistryClose(key);
+    }
+
+    ExFreePoolWithTag(record, KBLAY_POOL_TAG_PERSIST);
+}
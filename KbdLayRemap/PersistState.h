@@ -0,0 +1,18 @@
+#pragma once
+#include "Device.h"
+
+// The last role, state and rules applied to a device are kept in its
+// hardware key (KBLAY_PERSIST_VALUE_NAME) and restored when it is added,
+// so remapping works from boot and the service only has to correct drift.
+
+// Creates Ctx->PersistWorkItem. PASSIVE_LEVEL.
+NTSTATUS KbdLayPersistInit(_In_ WDFDEVICE Device);
+
+// Restores the saved record, if any and if it still validates. Call from
+// KbdLayEvtDeviceAdd before the device is listed. PASSIVE_LEVEL.
+VOID KbdLayPersistLoad(_In_ WDFDEVICE Device);
+
+// Saves the device's current role, state and rules from a work item.
+// Call after any of them changes; repeated calls before it runs coalesce.
+// IRQL <= DISPATCH_LEVEL.
+VOID KbdLayPersistSchedule(_In_ PKBDLAY_DEVICE_CONTEXT Ctx);
@@ -1,353 +1,324 @@
 #include "RemapEngine.h"
+#include "DriverEntry.h"
+
+// Thin WDF adapter over the portable core in Shared\KbdLayEngine.c:
+// locking, pool allocation and statistics live here, translation there.
 
 #define KBLAY_POOL_TAG_RULES 'rLbK'
 
+// How often the tap-hold timer looks at the wheel while timers are armed.
+// The system timer resolution usually rounds this up.
+#define KBLAY_TAPHOLD_TICK_MS 5
+
 // If Public.h does not define these yet, provide safe defaults.
 #ifndef KBLAY_MAX_RULE_ENTRIES
-#define KBLAY_MAX_RULE_ENTRIES      1024u
+#define KBLAY_MAX_RULE_ENTRIES      8192u
 #endif
 
 #ifndef KBLAY_MAX_RULE_BLOB_BYTES
-#define KBLAY_MAX_RULE_BLOB_BYTES   (64u * 1024u)
+#define KBLAY_MAX_RULE_BLOB_BYTES   (128u * 1024u)
 #endif
 
-// Common set-1 make codes for modifiers (no E0 for shifts).
-#define KBLAY_MAKE_LSHIFT 0x2A
-#define KBLAY_MAKE_RSHIFT 0x36
-#define KBLAY_MAKE_CTRL   0x1D
-#define KBLAY_MAKE_ALT    0x38
-#define KBLAY_MAKE_LWIN   0x5B
-#define KBLAY_MAKE_RWIN   0x5C
-
-typedef struct _KBLAY_RULE_TABLE
-{
-    KBLAY_RULE_CELL Rules[2][2][256];
-    BOOLEAN         RuleValid[2][2][256];
-} KBLAY_RULE_TABLE;
+// The engine works on KEYBOARD_INPUT_DATA buffers in place.
+C_ASSERT(sizeof(KBLAY_KEY_EVENT) == sizeof(KEYBOARD_INPUT_DATA));
+C_ASSERT(FIELD_OFFSET(KBLAY_KEY_EVENT, MakeCode) == FIELD_OFFSET(KEYBOARD_INPUT_DATA, MakeCode));
+C_ASSERT(FIELD_OFFSET(KBLAY_KEY_EVENT, Flags) == FIELD_OFFSET(KEYBOARD_INPUT_DATA, Flags));
+C_ASSERT(FIELD_OFFSET(KBLAY_KEY_EVENT, ExtraInformation) == FIELD_OFFSET(KEYBOARD_INPUT_DATA, ExtraInformation));
+C_ASSERT(KBLAY_KEY_BREAK == KEY_BREAK && KBLAY_KEY_E0 == KEY_E0 && KBLAY_KEY_E1 == KEY_E1);
 
-static __forceinline BOOLEAN IsKeyBreak(_In_ const KEYBOARD_INPUT_DATA* In)
+// Engine clock, in milliseconds of the performance counter. Trace records
+// carry the raw counter, and replay derives the same value from it.
+static __forceinline UINT64 KbdLayTicksToMs(_In_ LARGE_INTEGER Ticks, _In_ LARGE_INTEGER Freq)
 {
-    return (In->Flags & KEY_BREAK) ? TRUE : FALSE;
+    const UINT64 t = (UINT64)Ticks.QuadPart;
+    const UINT64 f = (UINT64)Freq.QuadPart;
+    return (t / f) * 1000 + (t % f) * 1000 / f;
 }
 
-static __forceinline BOOLEAN IsE0(_In_ const KEYBOARD_INPUT_DATA* In)
+VOID KbdLayRemapInit(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx)
 {
-    return (In->Flags & KEY_E0) ? TRUE : FALSE;
+    LARGE_INTEGER freq;
+    const LARGE_INTEGER now = KeQueryPerformanceCounter(&freq);
+
+    KbdLayEngineInit(&Ctx->Engine);
+    KbdLayEngineResetState(&Ctx->Engine, KbdLayTicksToMs(now, freq));
+    KbdLayEngineSetDebounce(&Ctx->Engine, g_KbdLayDebounceMs, KbdLayTicksToMs(now, freq));
+    if (g_KbdLayShareModifiers)
+        KbdLayEngineSetModShare(&Ctx->Engine, &g_KbdLayModShare);
 }
 
-static __forceinline BOOLEAN IsE1(_In_ const KEYBOARD_INPUT_DATA* In)
+VOID KbdLayRemapUninit(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx)
 {
-    return (In->Flags & KEY_E1) ? TRUE : FALSE;
+    // Input has stopped; take back whatever this keyboard still holds so
+    // an unplug with Shift down does not leave the pool shifted.
+    KbdLayEngineSetModShare(&Ctx->Engine, NULL);
 }
 
-static __forceinline BOOLEAN IsShiftMakeCode(_In_ USHORT MakeCode)
+VOID KbdLayRemapKickTimer(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx)
 {
-    return (MakeCode == KBLAY_MAKE_LSHIFT || MakeCode == KBLAY_MAKE_RSHIFT) ? TRUE : FALSE;
+    if (Ctx->TapHoldTimer != NULL && InterlockedExchange(&Ctx->TapHoldTimerQueued, 1) == 0)
+        WdfTimerStart(Ctx->TapHoldTimer, WDF_REL_TIMEOUT_IN_MS(KBLAY_TAPHOLD_TICK_MS));
 }
 
-static VOID UpdatePhysicalMods(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx, _In_ const KEYBOARD_INPUT_DATA* In)
+NTSTATUS KbdLayRemapLoadRuleBlob(
+    _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
+    _In_reads_bytes_(BlobSize) const VOID* Blob,
+    _In_ size_t BlobSize)
 {
-    const BOOLEAN brk = IsKeyBreak(In);
-    const BOOLEAN e0 = IsE0(In);
-    const BOOLEAN e1 = IsE1(In);
-    const USHORT mc = In->MakeCode;
-
-    // Ignore E1-prefixed sequences (e.g., Pause/Break) to avoid corrupting Ctrl state.
-    if (e1)
-        return;
+    if (BlobSize == 0 || BlobSize > KBLAY_MAX_RULE_BLOB_BYTES)
+        return STATUS_INVALID_PARAMETER;
 
-    // Shift (set-1; no E0)
-    if (!e0 && mc == KBLAY_MAKE_LSHIFT)
-    {
-        Ctx->PhysLShift = brk ? FALSE : TRUE;
-        return;
-    }
-    if (!e0 && mc == KBLAY_MAKE_RSHIFT)
-    {
-        Ctx->PhysRShift = brk ? FALSE : TRUE;
-        return;
-    }
+    // Blob may be the caller's locked pages (direct I/O), which can change
+    // under us: validate and build from our own copy only.
+    VOID* copy = ExAllocatePoolWithTag(NonPagedPoolNx, BlobSize, KBLAY_POOL_TAG_RULES);
+    if (!copy)
+        return STATUS_INSUFFICIENT_RESOURCES;
+    RtlCopyMemory(copy, Blob, BlobSize);
 
-    // Ctrl (E0 distinguishes right)
-    if (mc == KBLAY_MAKE_CTRL)
+    if (!KbdLayEngineValidateRuleBlob(copy, BlobSize, KBLAY_MAX_RULE_ENTRIES, KBLAY_MAX_RULE_BLOB_BYTES))
     {
-        if (e0) Ctx->PhysRCtrl = brk ? FALSE : TRUE;
-        else    Ctx->PhysLCtrl = brk ? FALSE : TRUE;
-        return;
+        ExFreePoolWithTag(copy, KBLAY_POOL_TAG_RULES);
+        return STATUS_INVALID_PARAMETER;
     }
 
-    // Alt (E0 distinguishes right alt / AltGr)
-    if (mc == KBLAY_MAKE_ALT)
+    // Build the table outside the spin lock; under it only pointers change.
+    KBLAY_RULE_TABLE* tbl = (KBLAY_RULE_TABLE*)ExAllocatePoolWithTag(
+        NonPagedPoolNx, sizeof(KBLAY_RULE_TABLE), KBLAY_POOL_TAG_RULES);
+    if (!tbl)
     {
-        if (e0) Ctx->PhysRAlt = brk ? FALSE : TRUE;
-        else    Ctx->PhysLAlt = brk ? FALSE : TRUE;
-        return;
+        ExFreePoolWithTag(copy, KBLAY_POOL_TAG_RULES);
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    // Win (typically E0, but be permissive)
-    if (mc == KBLAY_MAKE_LWIN)
-    {
-        Ctx->PhysLWin = brk ? FALSE : TRUE;
-        return;
-    }
-    if (mc == KBLAY_MAKE_RWIN)
-    {
-        Ctx->PhysRWin = brk ? FALSE : TRUE;
-        return;
-    }
-}
+    KbdLayEngineBuildRuleTable(copy, BlobSize, tbl);
+    const UINT32 hash = KbdLayRuleBlobHash(copy, BlobSize);
 
-static VOID MakeSyntheticShift(
-    _Out_ KEYBOARD_INPUT_DATA* Out,
-    _In_ const KEYBOARD_INPUT_DATA* Ref,
-    _In_ BOOLEAN Down)
-{
-    *Out = *Ref;
-    Out->MakeCode = KBLAY_MAKE_LSHIFT; // choose left shift for synthesis
-    Out->Flags = Ref->Flags;
+    WdfSpinLockAcquire(Ctx->Lock);
+    KBLAY_RULE_TABLE* oldTbl = (KBLAY_RULE_TABLE*)KbdLayEngineSetRuleTable(&Ctx->Engine, tbl);
+    VOID* old = Ctx->RuleBlob;
+    Ctx->RuleBlob = copy;
+    Ctx->RuleBlobSize = BlobSize;
+    WdfSpinLockRelease(Ctx->Lock);
 
-    // Ensure no extended flags on synthetic shift.
-    Out->Flags &= ~(KEY_E0 | KEY_E1);
+    InterlockedExchange(&Ctx->RuleBlobHash, (LONG)hash);
 
-    if (Down) Out->Flags &= ~KEY_BREAK;
-    else      Out->Flags |= KEY_BREAK;
+    // Every engine call runs under Ctx->Lock, so nothing still reads these.
+    if (old)
+        ExFreePoolWithTag(old, KBLAY_POOL_TAG_RULES);
+    if (oldTbl)
+        ExFreePoolWithTag(oldTbl, KBLAY_POOL_TAG_RULES);
+    return STATUS_SUCCESS;
 }
 
-VOID KbdLayRemapInit(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx)
+VOID KbdLayRemapFreeRuleBlob(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx)
 {
-    // Modifier states (physical)
-    Ctx->PhysLShift = FALSE;
-    Ctx->PhysRShift = FALSE;
-    Ctx->PhysLCtrl = FALSE;
-    Ctx->PhysRCtrl = FALSE;
-    Ctx->PhysLAlt = FALSE;
-    Ctx->PhysRAlt = FALSE;
-    Ctx->PhysLWin = FALSE;
-    Ctx->PhysRWin = FALSE;
-
-    // Rules
-    RtlZeroMemory(Ctx->Rules, sizeof(Ctx->Rules));
-    RtlZeroMemory(Ctx->RuleValid, sizeof(Ctx->RuleValid));
+    KBLAY_RULE_TABLE* tbl = (KBLAY_RULE_TABLE*)KbdLayEngineSetRuleTable(&Ctx->Engine, NULL);
+    if (tbl)
+        ExFreePoolWithTag(tbl, KBLAY_POOL_TAG_RULES);
+
+    if (Ctx->RuleBlob)
+        ExFreePoolWithTag(Ctx->RuleBlob, KBLAY_POOL_TAG_RULES);
+    Ctx->RuleBlob = NULL;
+    Ctx->RuleBlobSize = 0;
 }
 
-NTSTATUS KbdLayRemapLoadRuleBlob(
+// Results count inputs; EventsOutCount counts what they turned into, which
+// for a macro's make is many events and for a pending dual-role key none.
+static __forceinline VOID KbdLayCountResult(
     _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
-    _In_reads_bytes_(BlobSize) const VOID* Blob,
-    _In_ size_t BlobSize)
+    _In_ KBLAY_ENGINE_RESULT Result,
+    _In_ size_t Produced)
 {
-    if (Blob == NULL)
-        return STATUS_INVALID_PARAMETER;
-
-    if (BlobSize < sizeof(KBLAY_RULE_BLOB_HEADER) || BlobSize >(size_t)KBLAY_MAX_RULE_BLOB_BYTES)
-        return STATUS_INVALID_PARAMETER;
-
-    const KBLAY_RULE_BLOB_HEADER* h = (const KBLAY_RULE_BLOB_HEADER*)Blob;
-
-    // Expect: Version / Reserved / TotalSizeBytes / EntryCount
-    if (h->Version != KBLAY_RULE_BLOB_VERSION || h->Reserved != 0)
-        return STATUS_INVALID_PARAMETER;
-
-    if (h->TotalSizeBytes != (UINT32)BlobSize)
-        return STATUS_INVALID_PARAMETER;
-
-    if (h->EntryCount > KBLAY_MAX_RULE_ENTRIES)
-        return STATUS_INVALID_PARAMETER;
-
-    const size_t headerBytes = sizeof(KBLAY_RULE_BLOB_HEADER);
-    const size_t entryBytes = sizeof(KBLAY_RULE_ENTRY);
-
-    if (BlobSize < headerBytes)
-        return STATUS_INVALID_PARAMETER;
-
-    const size_t maxEntriesBySize = (BlobSize - headerBytes) / entryBytes;
-    if ((size_t)h->EntryCount > maxEntriesBySize)
-        return STATUS_INVALID_PARAMETER;
-
-    const size_t need = headerBytes + (size_t)h->EntryCount * entryBytes;
-    if (need != BlobSize)
-        return STATUS_INVALID_PARAMETER;
-
-    const KBLAY_RULE_ENTRY* e = (const KBLAY_RULE_ENTRY*)((const UINT8*)Blob + headerBytes);
-
-    // Build table outside the spin lock
-    KBLAY_RULE_TABLE* tbl = (KBLAY_RULE_TABLE*)ExAllocatePoolWithTag(
-        NonPagedPoolNx, sizeof(KBLAY_RULE_TABLE), KBLAY_POOL_TAG_RULES);
-    if (!tbl)
-        return STATUS_INSUFFICIENT_RESOURCES;
-
-    RtlZeroMemory(tbl, sizeof(*tbl));
+    if (Produced != 0)
+        InterlockedAdd64(&Ctx->EventsOutCount, (LONG64)Produced);
 
-    const UINT8 allowedMask = (UINT8)(KBLAY_FLAG_E0 | KBLAY_FLAG_SHIFT);
-
-    for (UINT32 i = 0; i < h->EntryCount; ++i)
+    switch (Result)
     {
-        const UINT8 inFlags = (UINT8)(e[i].InFlags & allowedMask);
-        const UINT8 outFlags = (UINT8)(e[i].OutFlags & allowedMask);
-
-        const UINT8 inE0 = (inFlags & KBLAY_FLAG_E0) ? 1 : 0;
-        const UINT8 inSh = (inFlags & KBLAY_FLAG_SHIFT) ? 1 : 0;
-
-        tbl->Rules[inE0][inSh][e[i].InMakeCode].OutMakeCode = e[i].OutMakeCode;
-        tbl->Rules[inE0][inSh][e[i].InMakeCode].OutFlags = outFlags;
-        tbl->RuleValid[inE0][inSh][e[i].InMakeCode] = TRUE;
+    case KBLAY_ENGINE_PASS:
+        InterlockedIncrement64(&Ctx->PassThroughCount);
+        break;
+    case KBLAY_ENGINE_UNMAPPED:
+        InterlockedIncrement64(&Ctx->UnmappedCount);
+        break;
+    case KBLAY_ENGINE_REMAP_TOGGLE:
+        InterlockedIncrement64(&Ctx->ShiftToggleCount);
+        // fall through
+    case KBLAY_ENGINE_REMAP:
+    case KBLAY_ENGINE_MACRO:
+    case KBLAY_ENGINE_TAPHOLD:
+        InterlockedIncrement64(&Ctx->RemapHitCount);
+        break;
+    case KBLAY_ENGINE_DEBOUNCED:
+        InterlockedIncrement64(&Ctx->DebounceDropCount);
+        break;
     }
+}
 
-    WdfSpinLockAcquire(Ctx->Lock);
-    RtlCopyMemory(Ctx->Rules, tbl->Rules, sizeof(Ctx->Rules));
-    RtlCopyMemory(Ctx->RuleValid, tbl->RuleValid, sizeof(Ctx->RuleValid));
-    WdfSpinLockRelease(Ctx->Lock);
-
-    ExFreePoolWithTag(tbl, KBLAY_POOL_TAG_RULES);
-    return STATUS_SUCCESS;
+static VOID KbdLayCountResults(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx, _In_ const KBLAY_ENGINE_BATCH* Batch)
+{
+    const UINT32* r = Batch->Results;
+    const LONG64 hits = (LONG64)r[KBLAY_ENGINE_REMAP] + r[KBLAY_ENGINE_REMAP_TOGGLE] + r[KBLAY_ENGINE_MACRO] + r[KBLAY_ENGINE_TAPHOLD];
+
+    if (r[KBLAY_ENGINE_PASS] != 0)
+        InterlockedAdd64(&Ctx->PassThroughCount, r[KBLAY_ENGINE_PASS]);
+    if (r[KBLAY_ENGINE_UNMAPPED] != 0)
+        InterlockedAdd64(&Ctx->UnmappedCount, r[KBLAY_ENGINE_UNMAPPED]);
+    if (r[KBLAY_ENGINE_REMAP_TOGGLE] != 0)
+        InterlockedAdd64(&Ctx->ShiftToggleCount, r[KBLAY_ENGINE_REMAP_TOGGLE]);
+    if (hits != 0)
+        InterlockedAdd64(&Ctx->RemapHitCount, hits);
+    if (r[KBLAY_ENGINE_DEBOUNCED] != 0)
+        InterlockedAdd64(&Ctx->DebounceDropCount, r[KBLAY_ENGINE_DEBOUNCED]);
+    if (Batch->Produced != 0)
+        InterlockedAdd64(&Ctx->EventsOutCount, Batch->Produced);
 }
 
-size_t KbdLayRemapOne(
+// One input through the engine and into the trace, for KbdLayRemapBatch
+// while tracing is on. Returns the events written to Out.
+static DECLSPEC_NOINLINE size_t KbdLayRemapOneTraced(
     _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
+    _Inout_ KBLAY_TRACE_RING* Ring,
+    _In_ LONG State,
+    _In_ LONG Role,
     _In_ const KEYBOARD_INPUT_DATA* In,
     _Out_writes_(OutCap) KEYBOARD_INPUT_DATA* Out,
-    _In_ size_t OutCap,
-    _Out_ BOOLEAN* DidRemap)
+    _In_ size_t OutCap)
 {
-    *DidRemap = FALSE;
+    KBLAY_TRACE_RECORD rec;
+    RtlZeroMemory(&rec, sizeof(rec));
+    rec.In = *(const KBLAY_KEY_EVENT*)In;
+    rec.State = (UINT8)State;
+    rec.Role = (UINT8)Role;
 
-    if (OutCap < 1)
-        return 0;
-
-    const LONG state = InterlockedCompareExchange(&Ctx->State, 0, 0);
-    const LONG role = InterlockedCompareExchange(&Ctx->Role, 0, 0);
+    KBLAY_ENGINE_RESULT result = KBLAY_ENGINE_PASS;
+    LARGE_INTEGER freq;
 
-    // Hard bypass: pass through input; still track modifiers for correct transitions.
-    if (state == (LONG)KBLAY_STATE_BYPASS_HARD)
-    {
-        // Keep modifier state in sync so a later transition to ACTIVE is correct.
-        WdfSpinLockAcquire(Ctx->Lock);
-        UpdatePhysicalMods(Ctx, In);
-        WdfSpinLockRelease(Ctx->Lock);
-
-        Out[0] = *In;
-        InterlockedIncrement64(&Ctx->PassThroughCount);
-        return 1;
-    }
+    WdfSpinLockAcquire(Ctx->Lock);
+    rec.Mods = KbdLayEngineModsToBits(&Ctx->Engine.Mods);
+    rec.DebounceMs = (UINT16)Ctx->Engine.Debounce.WindowMs;
+    rec.SharedMods = Ctx->Engine.Share ? KbdLayModShareRead(Ctx->Engine.Share) : 0;
+    const LARGE_INTEGER t0 = KeQueryPerformanceCounter(&freq);
+    const size_t produced = KbdLayEngineProcess(
+        &Ctx->Engine,
+        (UINT32)State,
+        (UINT32)Role,
+        KbdLayTicksToMs(t0, freq),
+        (const KBLAY_KEY_EVENT*)In,
+        (KBLAY_KEY_EVENT*)Out,
+        OutCap,
+        &result);
+    const LARGE_INTEGER t1 = KeQueryPerformanceCounter(NULL);
+    if (result != KBLAY_ENGINE_PASS)
+        rec.HasCell = KbdLayEngineLookupCell(&Ctx->Engine, &rec.In, &rec.Cell);
+    const BOOLEAN armed = KbdLayEngineTimersArmed(&Ctx->Engine);
+    WdfSpinLockRelease(Ctx->Lock);
 
-    // Soft bypass: pass through input, but keep tracking physical modifiers.
-    if (state == (LONG)KBLAY_STATE_BYPASS_SOFT)
-    {
-        WdfSpinLockAcquire(Ctx->Lock);
-        UpdatePhysicalMods(Ctx, In);
-        WdfSpinLockRelease(Ctx->Lock);
+    KbdLayCountResult(Ctx, result, produced);
+    if (armed)
+        KbdLayRemapKickTimer(Ctx);
 
-        Out[0] = *In;
-        InterlockedIncrement64(&Ctx->PassThroughCount);
-        return 1;
-    }
+    rec.Timestamp = (UINT64)t0.QuadPart;
+    rec.EngineTicks = (UINT32)(t1.QuadPart - t0.QuadPart);
+    rec.Result = (UINT8)result;
+    rec.OutCount = (UINT8)produced;
+    const size_t kept = produced < KBLAY_TRACE_RECORD_OUT ? produced : KBLAY_TRACE_RECORD_OUT;
+    RtlCopyMemory(rec.Out, Out, kept * sizeof(KBLAY_KEY_EVENT));
 
-    // Active but non-remap role: treat as soft bypass for safety.
-    if (state == (LONG)KBLAY_STATE_ACTIVE && role != (LONG)KBLAY_ROLE_REMAP)
-    {
-        WdfSpinLockAcquire(Ctx->Lock);
-        UpdatePhysicalMods(Ctx, In);
-        WdfSpinLockRelease(Ctx->Lock);
+    KbdLayTraceRingPush(Ring, &rec);
+    return produced;
+}
 
-        Out[0] = *In;
-        InterlockedIncrement64(&Ctx->PassThroughCount);
-        return 1;
-    }
+ULONG KbdLayRemapBatch(
+    _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
+    _In_reads_(InCount) const KEYBOARD_INPUT_DATA* In,
+    _In_ ULONG InCount,
+    _Out_writes_(OutCap) KEYBOARD_INPUT_DATA* Out,
+    _In_ ULONG OutCap,
+    _Out_ ULONG* Produced)
+{
+    const LONG state = InterlockedCompareExchange(&Ctx->State, 0, 0);
+    const LONG role = InterlockedCompareExchange(&Ctx->Role, 0, 0);
 
-    // ACTIVE: Update physical modifiers and snapshot shift state + rule cell under lock.
-    if (In->MakeCode > 0xFF)
+    // Tracing records every event on its own.
+    KBLAY_TRACE_RING* ring = (KBLAY_TRACE_RING*)ReadPointerAcquire((PVOID volatile*)&Ctx->TraceActive);
+    if (ring != NULL)
     {
-        // Unknown/extended make codes: cannot index the rule table safely.
-        // Still track physical modifiers (in case the platform ever produces such codes for modifiers).
-        WdfSpinLockAcquire(Ctx->Lock);
-        UpdatePhysicalMods(Ctx, In);
-        WdfSpinLockRelease(Ctx->Lock);
-
-        Out[0] = *In;
-        InterlockedIncrement64(&Ctx->UnmappedCount);
-        return 1;
+        ULONG used = 0;
+        ULONG i = 0;
+        for (; i < InCount && OutCap - used >= KBLAY_ENGINE_MAX_OUTPUT; ++i)
+            used += (ULONG)KbdLayRemapOneTraced(Ctx, ring, state, role, &In[i], Out + used, OutCap - used);
+        *Produced = used;
+        return i;
     }
 
-    BOOLEAN physShift = FALSE;
-    BOOLEAN valid = FALSE;
-    KBLAY_RULE_CELL cell = { 0 };
-
-    const UINT8 inE0 = IsE0(In) ? 1 : 0;
+    // One clock reading, lock hold and chain call for the whole run.
+    KBLAY_ENGINE_BATCH batch;
+    LARGE_INTEGER freq;
+    const LARGE_INTEGER now = KeQueryPerformanceCounter(&freq);
 
     WdfSpinLockAcquire(Ctx->Lock);
-    UpdatePhysicalMods(Ctx, In);
-    physShift = (Ctx->PhysLShift || Ctx->PhysRShift) ? TRUE : FALSE;
-
-    const UINT8 mc8 = (UINT8)In->MakeCode;
-    const UINT8 inSh = physShift ? 1 : 0;
-    valid = Ctx->RuleValid[inE0][inSh][mc8];
-    if (valid)
-        cell = Ctx->Rules[inE0][inSh][mc8];
+    const size_t taken = KbdLayEngineProcessBatch(
+        &Ctx->Engine,
+        (UINT32)state,
+        (UINT32)role,
+        KbdLayTicksToMs(now, freq),
+        (const KBLAY_KEY_EVENT*)In,
+        InCount,
+        (KBLAY_KEY_EVENT*)Out,
+        OutCap,
+        NULL,
+        &batch);
+    const BOOLEAN armed = KbdLayEngineTimersArmed(&Ctx->Engine);
     WdfSpinLockRelease(Ctx->Lock);
 
-    if (!valid || cell.OutMakeCode == 0)
-    {
-        Out[0] = *In;
-        InterlockedIncrement64(&Ctx->UnmappedCount);
-        return 1;
-    }
-
-    // Build the remapped event
-    KEYBOARD_INPUT_DATA mapped = *In;
-    mapped.MakeCode = (USHORT)cell.OutMakeCode;
-
-    // Adjust only E0 flag based on rule; preserve BREAK/E1 and any other bits.
-    if (cell.OutFlags & KBLAY_FLAG_E0) mapped.Flags |= KEY_E0;
-    else                              mapped.Flags &= ~KEY_E0;
+    KbdLayCountResults(Ctx, &batch);
+    if (armed)
+        KbdLayRemapKickTimer(Ctx);
 
-    // Shift-handling policy:
-    // We interpret KBLAY_FLAG_SHIFT in OutFlags as "emit the output as if Shift is held".
-    const BOOLEAN outShiftWanted = (cell.OutFlags & KBLAY_FLAG_SHIFT) ? TRUE : FALSE;
+    *Produced = batch.Produced;
+    return (ULONG)taken;
+}
 
-    // Never synthesize shift around actual Shift key events (avoid weirdness).
-    if (IsShiftMakeCode(In->MakeCode) || IsE1(In))
-    {
-        Out[0] = mapped;
-        *DidRemap = TRUE;
-        InterlockedIncrement64(&Ctx->RemapHitCount);
-        return 1;
-    }
+size_t KbdLayRemapAdvance(
+    _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
+    _Out_writes_(OutCap) KEYBOARD_INPUT_DATA* Out,
+    _In_ size_t OutCap)
+{
+    LARGE_INTEGER freq;
+    const LARGE_INTEGER now = KeQueryPerformanceCounter(&freq);
 
-    if (physShift == outShiftWanted)
-    {
-        Out[0] = mapped;
-        *DidRemap = TRUE;
-        InterlockedIncrement64(&Ctx->RemapHitCount);
-        return 1;
-    }
+    WdfSpinLockAcquire(Ctx->Lock);
+    const UINT8 mods = KbdLayEngineModsToBits(&Ctx->Engine.Mods);
+    const UINT32 debounceMs = Ctx->Engine.Debounce.WindowMs;
+    const UINT8 sharedMods = Ctx->Engine.Share ? KbdLayModShareRead(Ctx->Engine.Share) : 0;
+    const size_t produced = KbdLayEngineAdvance(&Ctx->Engine, KbdLayTicksToMs(now, freq), (KBLAY_KEY_EVENT*)Out, OutCap);
+    const BOOLEAN armed = KbdLayEngineTimersArmed(&Ctx->Engine);
+    WdfSpinLockRelease(Ctx->Lock);
 
-    // Need shift toggle. Require 3 slots.
-    if (OutCap < 3)
-    {
-        // Best-effort fallback: no toggle, just emit mapped.
-        Out[0] = mapped;
-        *DidRemap = TRUE;
-        InterlockedIncrement64(&Ctx->RemapHitCount);
-        return 1;
-    }
+    if (produced != 0)
+        InterlockedAdd64(&Ctx->EventsOutCount, (LONG64)produced);
+    if (armed)
+        KbdLayRemapKickTimer(Ctx);
 
-    if (outShiftWanted && !physShift)
-    {
-        // Shift DOWN -> key -> Shift UP
-        MakeSyntheticShift(&Out[0], In, TRUE);
-        Out[1] = mapped;
-        MakeSyntheticShift(&Out[2], In, FALSE);
-    }
-    else
+    // Timer output goes into the trace as a record with no input, so replay
+    // advances the clock at the same point.
+    KBLAY_TRACE_RING* ring = (KBLAY_TRACE_RING*)ReadPointerAcquire((PVOID volatile*)&Ctx->TraceActive);
+    if (ring != NULL && produced != 0)
     {
-        // physShift == TRUE && outShiftWanted == FALSE
-        // Shift UP -> key -> Shift DOWN
-        MakeSyntheticShift(&Out[0], In, FALSE);
-        Out[1] = mapped;
-        MakeSyntheticShift(&Out[2], In, TRUE);
+        KBLAY_TRACE_RECORD rec;
+        RtlZeroMemory(&rec, sizeof(rec));
+        rec.Timestamp = (UINT64)now.QuadPart;
+        rec.State = (UINT8)InterlockedCompareExchange(&Ctx->State, 0, 0);
+        rec.Role = (UINT8)InterlockedCompareExchange(&Ctx->Role, 0, 0);
+        rec.Mods = mods;
+        rec.DebounceMs = (UINT16)debounceMs;
+        rec.SharedMods = sharedMods;
+        rec.Result = (UINT8)KBLAY_ENGINE_TIMER;
+        rec.OutCount = (UINT8)produced;
+        const size_t kept = produced < KBLAY_TRACE_RECORD_OUT ? produced : KBLAY_TRACE_RECORD_OUT;
+        RtlCopyMemory(rec.Out, Out, kept * sizeof(KBLAY_KEY_EVENT));
+        KbdLayTraceRingPush(ring, &rec);
     }
 
-    *DidRemap = TRUE;
-    InterlockedIncrement64(&Ctx->RemapHitCount);
-    InterlockedIncrement64(&Ctx->ShiftToggleCount);
-    return 3;
+    return produced;
 }
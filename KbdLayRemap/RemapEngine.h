@@ -2,15 +2,33 @@
 #include "Device.h"
 
 VOID KbdLayRemapInit(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx);
+VOID KbdLayRemapUninit(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx);
 
 NTSTATUS KbdLayRemapLoadRuleBlob(
     _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
     _In_reads_bytes_(BlobSize) const VOID* Blob,
     _In_ size_t BlobSize);
 
-size_t KbdLayRemapOne(
+VOID KbdLayRemapFreeRuleBlob(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx);
+
+// Translates a run of input, stopping before an input once fewer than
+// KBLAY_ENGINE_MAX_OUTPUT slots are left in Out (one input never writes
+// more). Returns the inputs taken; *Produced is the events written, 0 when
+// every input taken was swallowed.
+ULONG KbdLayRemapBatch(
     _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
-    _In_ const KEYBOARD_INPUT_DATA* In,
+    _In_reads_(InCount) const KEYBOARD_INPUT_DATA* In,
+    _In_ ULONG InCount,
     _Out_writes_(OutCap) KEYBOARD_INPUT_DATA* Out,
-    _In_ size_t OutCap,
-    _Out_ BOOLEAN* DidRemap);
+    _In_ ULONG OutCap,
+    _Out_ ULONG* Produced);
+
+// Runs the engine clock to now with no input; returns the events that came
+// due (tap-hold keys turning into holds). OutCap of KBLAY_TAPHOLD_MAX_ACTIVE fits.
+size_t KbdLayRemapAdvance(
+    _Inout_ PKBDLAY_DEVICE_CONTEXT Ctx,
+    _Out_writes_(OutCap) KEYBOARD_INPUT_DATA* Out,
+    _In_ size_t OutCap);
+
+// Starts Ctx->TapHoldTimer unless it is already queued.
+VOID KbdLayRemapKickTimer(_Inout_ PKBDLAY_DEVICE_CONTEXT Ctx);
@@ -1 +1,67 @@
 #include "Trace.h"
+
+#define KBLAY_POOL_TAG_TRACE 'tLbK'
+
+KBLAY_TRACE_RING* KbdLayTraceRingAllocate(_In_ ULONG Capacity)
+{
+    if (Capacity == 0)
+        Capacity = KBLAY_TRACE_DEFAULT_CAPACITY;
+    if (Capacity > KBLAY_TRACE_MAX_CAPACITY)
+        Capacity = KBLAY_TRACE_MAX_CAPACITY;
+
+    ULONG cap = 1;
+    while (cap < Capacity)
+        cap <<= 1;
+
+    const size_t bytes = FIELD_OFFSET(KBLAY_TRACE_RING, Records) + (size_t)cap * sizeof(KBLAY_TRACE_RECORD);
+    KBLAY_TRACE_RING* ring = (KBLAY_TRACE_RING*)ExAllocatePoolWithTag(NonPagedPoolNx, bytes, KBLAY_POOL_TAG_TRACE);
+    if (!ring)
+        return NULL;
+
+    RtlZeroMemory(ring, FIELD_OFFSET(KBLAY_TRACE_RING, Records));
+    ring->Mask = cap - 1;
+    return ring;
+}
+
+VOID KbdLayTraceRingFree(_In_opt_ KBLAY_TRACE_RING* Ring)
+{
+    if (Ring)
+        ExFreePoolWithTag(Ring, KBLAY_POOL_TAG_TRACE);
+}
+
+VOID KbdLayTraceRingPush(_Inout_ KBLAY_TRACE_RING* Ring, _Inout_ KBLAY_TRACE_RECORD* Record)
+{
+    Record->Sequence = Ring->Sequence++;
+
+    const ULONG head = Ring->Head;
+    const ULONG tail = ReadULongAcquire(&Ring->Tail);
+    if (head - tail > Ring->Mask)
+    {
+        InterlockedIncrement(&Ring->Dropped);
+        return;
+    }
+
+    Ring->Records[head & Ring->Mask] = *Record;
+    WriteULongRelease(&Ring->Head, head + 1);
+}
+
+ULONG KbdLayTraceRingDrain(
+    _Inout_ KBLAY_TRACE_RING* Ring,
+    _Out_writes_(Cap) KBLAY_TRACE_RECORD* Out,
+    _In_ ULONG Cap,
+    _Out_ ULONG* Dropped)
+{
+    const ULONG tail = Ring->Tail;
+    const ULONG head = ReadULongAcquire(&Ring->Head);
+
+    ULONG n = head - tail;
+    if (n > Cap)
+        n = Cap;
+
+    for (ULONG i = 0; i < n; ++i)
+        Out[i] = Ring->Records[(tail + i) & Ring->Mask];
+
+    WriteULongRelease(&Ring->Tail, tail + n);
+    *Dropped = (ULONG)InterlockedExchange(&Ring->Dropped, 0);
+    return n;
+}
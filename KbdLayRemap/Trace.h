@@ -1,7 +1,39 @@
 #pragma once
 #include <ntddk.h>
 
+#include "..\\Shared\\KbdLayTrace.h"
+
 #define KBDLAY_DPFLTR_ID DPFLTR_IHVDRIVER_ID
 
 #define KbdLayLogInfo(fmt, ...)  DbgPrintEx(KBDLAY_DPFLTR_ID, DPFLTR_INFO_LEVEL,  "[KbdLay] " fmt "\n", __VA_ARGS__)
 #define KbdLayLogError(fmt, ...) DbgPrintEx(KBDLAY_DPFLTR_ID, DPFLTR_ERROR_LEVEL, "[KbdLay] " fmt "\n", __VA_ARGS__)
+
+// Per-device event trace ring. Single producer (the class service callback,
+// which the port driver serializes per device) and single consumer (drain,
+// serialized by the caller). Full rings drop new records and count them.
+typedef struct KBLAY_TRACE_RING
+{
+    ULONG Mask;              // capacity - 1; capacity is a power of two
+    volatile ULONG Head;     // next slot to write; advanced by the producer
+    volatile ULONG Tail;     // next slot to read; advanced by the consumer
+    volatile LONG  Dropped;
+    ULONG Sequence;          // producer only
+    KBLAY_TRACE_RECORD Records[1];
+} KBLAY_TRACE_RING;
+
+// Capacity is rounded up to a power of two and clamped; 0 selects the default.
+_IRQL_requires_max_(DISPATCH_LEVEL)
+KBLAY_TRACE_RING* KbdLayTraceRingAllocate(_In_ ULONG Capacity);
+
+VOID KbdLayTraceRingFree(_In_opt_ KBLAY_TRACE_RING* Ring);
+
+// Stamps Sequence and publishes the record.
+VOID KbdLayTraceRingPush(_Inout_ KBLAY_TRACE_RING* Ring, _Inout_ KBLAY_TRACE_RECORD* Record);
+
+// Copies up to Cap records out; returns the count. *Dropped gets the number
+// lost since the previous drain.
+ULONG KbdLayTraceRingDrain(
+    _Inout_ KBLAY_TRACE_RING* Ring,
+    _Out_writes_(Cap) KBLAY_TRACE_RECORD* Out,
+    _In_ ULONG Cap,
+    _Out_ ULONG* Dropped);
@@ -1,9 +1,16 @@
 #include <Windows.h>
+#include <cstdio>
 #include <iostream>
 #include <locale>
 #include <string>
 #include <vector>
+#include "..\\KbdLayRemapLib\\ControlDevice.hpp"
 #include "..\\KbdLayRemapLib\\DeviceId.hpp"
+#include "..\\KbdLayRemapLib\\EventLog.hpp"
+#include "..\\KbdLayRemapLib\\LayoutTables.hpp"
+#include "..\\KbdLayRemapLib\\RuleBlob.hpp"
+#include "..\\KbdLayRemapLib\\StatusRates.hpp"
+#include "..\\KbdLayRemapLib\\TraceFile.hpp"
 #include "..\\Shared\\Public.h"
 
 static void PrintUsage()
@@ -11,7 +18,12 @@ static void PrintUsage()
     std::wcout << L"Usage:\n"
         << L"  kblayctl list\n"
         << L"  kblayctl status [index]\n"
-        << L"  kblayctl containers\n";
+        << L"  kblayctl containers\n"
+        << L"  kblayctl watch [--interval ms] [--stream]\n"
+        << L"  kblayctl trace record <index|ContainerId> <file> [--capacity records]\n"
+        << L"  kblayctl trace replay <file>\n"
+        << L"  kblayctl compile-all <cacheDir> <KLID> <KLID>... [--layouts dir] [--threads n]\n"
+        << L"  kblayctl log <file>...\n";
 }
 
 static void PrintStatus(HANDLE h, const FilterDeviceInfo& dev)
@@ -50,22 +62,20 @@ static void PrintStatus(HANDLE h, const FilterDeviceInfo& dev)
         << L" Pass=" << out.PassThroughCount
         << L" Unmapped=" << out.UnmappedCount
         << L" ShiftToggle=" << out.ShiftToggleCount
-        << L" LastNt=0x" << std::hex << out.LastErrorNtStatus << std::dec
-        << L"\n";
+        << L" LastNt=0x" << std::hex << out.LastErrorNtStatus << std::dec;
+    if (ret >= FIELD_OFFSET(KBLAY_STATUS_OUTPUT, TapHoldMaxLateMs) + sizeof(out.TapHoldMaxLateMs))
+        std::wcout << L" TapHoldLateMs=" << out.TapHoldMaxLateMs;
+    if (ret >= FIELD_OFFSET(KBLAY_STATUS_OUTPUT, DebounceDropCount) + sizeof(out.DebounceDropCount))
+        std::wcout << L" DebounceDrops=" << out.DebounceDropCount;
+    if (ret >= FIELD_OFFSET(KBLAY_STATUS_OUTPUT, EventsOutCount) + sizeof(out.EventsOutCount))
+        std::wcout << L" EventsOut=" << out.EventsOutCount;
+    std::wcout << L"\n";
 
 }
 
 static int PrintDriverContainers()
 {
-    HANDLE h = CreateFileW(
-        KBLAY_CONTROL_DEVICE_DOS_NAME,
-        GENERIC_READ,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        nullptr);
-
+    HANDLE h = OpenControlDevice(GENERIC_READ);
     if (h == INVALID_HANDLE_VALUE)
     {
         DWORD e = GetLastError();
@@ -73,32 +83,9 @@ static int PrintDriverContainers()
         return 3;
     }
 
-    std::vector<BYTE> buf(4096);
-    DWORD ret = 0;
-    BOOL ok = FALSE;
+    std::vector<BYTE> buf;
     DWORD err = 0;
-
-    for (int i = 0; i < 3; ++i)
-    {
-        ret = 0;
-        ok = DeviceIoControl(
-            h,
-            IOCTL_KBLAY_ENUM_DEVICES,
-            nullptr,
-            0,
-            buf.data(),
-            (DWORD)buf.size(),
-            &ret,
-            nullptr);
-        if (ok)
-            break;
-        err = GetLastError();
-        if (err != ERROR_MORE_DATA && err != ERROR_INSUFFICIENT_BUFFER)
-            break;
-        buf.resize(buf.size() * 2);
-    }
-
-    if (!ok)
+    if (!EnumDriverDevices(h, buf, err))
     {
         std::wcout << L"IOCTL_KBLAY_ENUM_DEVICES failed: " << err << L"\n";
         CloseHandle(h);
@@ -122,6 +109,499 @@ static int PrintDriverContainers()
     return 0;
 }
 
+static volatile LONG g_stopRequested = 0;
+
+static BOOL WINAPI StopCtrlHandler(DWORD ctrl)
+{
+    if (ctrl == CTRL_C_EVENT || ctrl == CTRL_BREAK_EVENT)
+    {
+        InterlockedExchange(&g_stopRequested, 1);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static uint64_t NowUs()
+{
+    static LARGE_INTEGER freq{};
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    LARGE_INTEGER t{};
+    QueryPerformanceCounter(&t);
+    return (uint64_t)(t.QuadPart / freq.QuadPart) * 1000000ull +
+        (uint64_t)(t.QuadPart % freq.QuadPart) * 1000000ull / (uint64_t)freq.QuadPart;
+}
+
+static const wchar_t* RoleName(UINT32 role)
+{
+    switch (role)
+    {
+    case KBLAY_ROLE_NONE: return L"none";
+    case KBLAY_ROLE_BASE: return L"base";
+    case KBLAY_ROLE_REMAP: return L"remap";
+    default: return L"?";
+    }
+}
+
+static const wchar_t* StateName(UINT32 state)
+{
+    switch (state)
+    {
+    case KBLAY_STATE_BYPASS_HARD: return L"hard";
+    case KBLAY_STATE_BYPASS_SOFT: return L"soft";
+    case KBLAY_STATE_ACTIVE: return L"active";
+    default: return L"?";
+    }
+}
+
+// kblayctl watch [--interval ms] [--stream]
+static int WatchDevices(int argc, wchar_t** argv)
+{
+    DWORD intervalMs = 1000;
+    bool stream = false;
+    for (int i = 2; i < argc; ++i)
+    {
+        std::wstring a = argv[i];
+        if (a == L"--stream")
+            stream = true;
+        else if (a == L"--interval" && i + 1 < argc)
+            intervalMs = (DWORD)_wtoi(argv[++i]);
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if (intervalMs < 10) intervalMs = 10;
+
+    ControlDeviceStatusSource source;
+    if (!source.EnsureOpen())
+    {
+        DWORD e = GetLastError();
+        std::wcout << L"Open control device failed: " << e << L"\n";
+        return 3;
+    }
+
+    // Sleep() is tied to the ~15.6 ms system tick; a high-resolution
+    // waitable timer keeps 10 ms intervals honest where it is available.
+    HANDLE timer = CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!timer)
+        timer = CreateWaitableTimerW(nullptr, FALSE, nullptr);
+    if (!timer)
+    {
+        DWORD e = GetLastError();
+        std::wcout << L"CreateWaitableTimer failed: " << e << L"\n";
+        return 3;
+    }
+    LARGE_INTEGER due{};
+    due.QuadPart = -(LONGLONG)intervalMs * 10000;
+    SetWaitableTimer(timer, &due, (LONG)intervalMs, nullptr, nullptr, FALSE);
+
+    // Redraw in place when the console understands VT sequences.
+    bool vt = false;
+    if (!stream)
+    {
+        HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+        DWORD mode = 0;
+        vt = GetConsoleMode(out, &mode) &&
+            SetConsoleMode(out, mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    }
+
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+
+    StatusSampler sampler(source);
+    std::vector<DeviceRates> rates;
+
+    // Keep a LastNt change highlighted for a while so it is not missed at short intervals.
+    struct Highlight { GUID Id; uint64_t UntilUs; };
+    std::vector<Highlight> highlights;
+    const uint64_t highlightUs = 3000000;
+
+    int rc = 0;
+    (void)sampler.Sample(NowUs(), rates); // prime
+    while (!InterlockedCompareExchange(&g_stopRequested, 0, 0))
+    {
+        if (WaitForSingleObject(timer, INFINITE) != WAIT_OBJECT_0)
+        {
+            rc = 3;
+            break;
+        }
+
+        const uint64_t now = NowUs();
+        if (!sampler.Sample(now, rates))
+        {
+            std::wcerr << L"IOCTL_KBLAY_ENUM_DEVICES failed: " << GetLastError() << L"\n";
+            rc = 3;
+            break;
+        }
+
+        if (stream)
+        {
+            for (const auto& r : rates)
+                std::wcout << FormatRatesJson(r, now) << L"\n";
+            std::wcout.flush();
+            continue;
+        }
+
+        std::vector<Highlight> keep;
+        for (const auto& hl : highlights)
+            if (hl.UntilUs > now) keep.push_back(hl);
+        highlights.swap(keep);
+        for (const auto& r : rates)
+            if (r.NtStatusChanged) highlights.push_back({ r.ContainerId, now + highlightUs });
+
+        std::wstring frame;
+        if (vt) frame += L"\x1b[H\x1b[J";
+        frame += L"kblayctl watch  interval=" + std::to_wstring(intervalMs) + L" ms  (Ctrl+C to stop)\n";
+        wchar_t line[256];
+        swprintf(line, 256, L"%-38ls %-5ls %-6ls %10ls %10ls %10ls %10ls %7ls  %ls\n",
+            L"ContainerId", L"Role", L"State", L"remap/s", L"pass/s", L"unmap/s", L"toggle/s", L"amp", L"LastNt");
+        frame += line;
+        for (const auto& r : rates)
+        {
+            bool hot = false;
+            for (const auto& hl : highlights)
+                if (IsEqualGUID(hl.Id, r.ContainerId)) { hot = true; break; }
+
+            swprintf(line, 256, L"%-38ls %-5ls %-6ls %10.1f %10.1f %10.1f %10.1f %7.3f  ",
+                GuidToString(r.ContainerId).c_str(), RoleName(r.Role), StateName(r.State),
+                r.RemapPerSec, r.PassPerSec, r.UnmappedPerSec, r.ShiftTogglePerSec, r.Amplification);
+            frame += line;
+
+            swprintf(line, 256, L"0x%08X", r.LastErrorNtStatus);
+            if (hot)
+                frame += vt ? (std::wstring(L"\x1b[1;31m") + line + L" (changed)\x1b[0m") : (std::wstring(line) + L" (changed)");
+            else
+                frame += line;
+            if (r.CountersReset)
+                frame += L" [reset]";
+            frame += L"\n";
+        }
+        std::wcout << frame;
+        std::wcout.flush();
+    }
+
+    SetConsoleCtrlHandler(StopCtrlHandler, FALSE);
+    CancelWaitableTimer(timer);
+    CloseHandle(timer);
+    return rc;
+}
+
+// Device index as printed by "list", or a ContainerId.
+static bool ResolveContainer(const wchar_t* arg, GUID& out)
+{
+    if (ParseGuid(arg, out))
+        return true;
+
+    auto devs = EnumerateKbdLayFilterDevices();
+    wchar_t* end = nullptr;
+    const unsigned long idx = wcstoul(arg, &end, 10);
+    if (!end || *end != L'\0' || idx >= devs.size())
+        return false;
+    out = devs[idx].ContainerId;
+    return !IsNullGuid(out);
+}
+
+static bool GetRuleBlob(HANDLE h, const GUID& containerId, std::vector<uint8_t>& blob)
+{
+    KBLAY_GET_RULE_BLOB_EX_INPUT in{};
+    in.ContainerId = containerId;
+
+    blob.resize(4096);
+    for (int i = 0; i < 2; ++i)
+    {
+        DWORD ret = 0;
+        if (DeviceIoControl(h, IOCTL_KBLAY_GET_RULE_BLOB_EX, &in, sizeof(in), blob.data(), (DWORD)blob.size(), &ret, nullptr))
+        {
+            blob.resize(ret);
+            return true;
+        }
+        if (GetLastError() != ERROR_MORE_DATA || ret < sizeof(KBLAY_RULE_BLOB_HEADER))
+            return false;
+        blob.resize(reinterpret_cast<const KBLAY_RULE_BLOB_HEADER*>(blob.data())->TotalSizeBytes);
+    }
+    return false;
+}
+
+static bool SetTrace(HANDLE h, const GUID& containerId, bool enable, UINT32 capacity)
+{
+    KBLAY_SET_TRACE_EX_INPUT in{};
+    in.ContainerId = containerId;
+    in.Enable = enable ? 1u : 0u;
+    in.Capacity = capacity;
+    DWORD ret = 0;
+    return !!DeviceIoControl(h, IOCTL_KBLAY_SET_TRACE_EX, &in, sizeof(in), nullptr, 0, &ret, nullptr);
+}
+
+// kblayctl trace record <index|ContainerId> <file> [--capacity records]
+static int TraceRecord(int argc, wchar_t** argv)
+{
+    if (argc < 5)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    GUID containerId{};
+    if (!ResolveContainer(argv[3], containerId))
+    {
+        std::wcout << L"Unknown device: " << argv[3] << L"\n";
+        return 2;
+    }
+    const std::wstring path = argv[4];
+
+    UINT32 capacity = 0;
+    for (int i = 5; i < argc; ++i)
+    {
+        if (std::wstring(argv[i]) == L"--capacity" && i + 1 < argc)
+            capacity = (UINT32)_wtoi(argv[++i]);
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+
+    HANDLE h = OpenControlDevice(GENERIC_READ | GENERIC_WRITE);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        DWORD e = GetLastError();
+        std::wcout << L"Open control device failed: " << e << L"\n";
+        return 3;
+    }
+
+    std::vector<uint8_t> rules;
+    if (!GetRuleBlob(h, containerId, rules))
+    {
+        std::wcout << L"IOCTL_KBLAY_GET_RULE_BLOB_EX failed: " << GetLastError() << L"\n";
+        CloseHandle(h);
+        return 3;
+    }
+
+    LARGE_INTEGER freq{};
+    QueryPerformanceFrequency(&freq);
+
+    TraceWriter writer;
+    if (!writer.Open(path, containerId, (uint64_t)freq.QuadPart, rules))
+    {
+        std::wcout << L"Cannot create " << path << L"\n";
+        CloseHandle(h);
+        return 3;
+    }
+
+    if (!SetTrace(h, containerId, true, capacity))
+    {
+        std::wcout << L"IOCTL_KBLAY_SET_TRACE_EX failed: " << GetLastError() << L"\n";
+        CloseHandle(h);
+        return 3;
+    }
+
+    std::wcout << L"Recording " << GuidToString(containerId) << L" to " << path << L" (Ctrl+C to stop)\n";
+    SetConsoleCtrlHandler(StopCtrlHandler, TRUE);
+
+    const size_t header = FIELD_OFFSET(KBLAY_DRAIN_TRACE_OUTPUT, Records);
+    std::vector<BYTE> buf(header + 1024 * sizeof(KBLAY_TRACE_RECORD));
+    KBLAY_DRAIN_TRACE_EX_INPUT in{};
+    in.ContainerId = containerId;
+
+    int rc = 0;
+    uint64_t dropped = 0;
+    for (bool last = false; !last;)
+    {
+        last = !!InterlockedCompareExchange(&g_stopRequested, 0, 0);
+        if (last)
+            SetTrace(h, containerId, false, 0);
+
+        // Drain until the ring is empty, then wait a little.
+        for (;;)
+        {
+            DWORD ret = 0;
+            if (!DeviceIoControl(h, IOCTL_KBLAY_DRAIN_TRACE_EX, &in, sizeof(in), buf.data(), (DWORD)buf.size(), &ret, nullptr))
+            {
+                std::wcerr << L"IOCTL_KBLAY_DRAIN_TRACE_EX failed: " << GetLastError() << L"\n";
+                rc = 3;
+                last = true;
+                break;
+            }
+            const auto* out = reinterpret_cast<const KBLAY_DRAIN_TRACE_OUTPUT*>(buf.data());
+            dropped += out->Dropped;
+            if (!writer.Append(out->Records, out->Count))
+            {
+                std::wcerr << L"Write to " << path << L" failed.\n";
+                rc = 3;
+                last = true;
+                break;
+            }
+            if (out->Count < 1024)
+                break;
+        }
+
+        if (!last)
+            Sleep(50);
+    }
+
+    SetTrace(h, containerId, false, 0);
+    SetConsoleCtrlHandler(StopCtrlHandler, FALSE);
+    writer.Close();
+    CloseHandle(h);
+
+    std::wcout << L"Recorded " << writer.RecordCount() << L" events";
+    if (dropped)
+        std::wcout << L" (" << dropped << L" dropped by a full ring)";
+    std::wcout << L".\n";
+    return rc;
+}
+
+// kblayctl trace replay <file>
+static int TraceReplay(int argc, wchar_t** argv)
+{
+    if (argc < 4)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    TraceCapture capture;
+    if (!ReadTraceFile(argv[3], capture))
+    {
+        std::wcout << L"Cannot read trace file " << argv[3] << L"\n";
+        return 2;
+    }
+
+    TraceReplayReport report;
+    ReplayTrace(capture, report);
+
+    std::wcout << L"Trace " << GuidToString(capture.ContainerId) << L": " << report.Events << L" events";
+    if (report.DroppedRecords)
+        std::wcout << L", " << report.DroppedRecords << L" dropped while recording";
+    std::wcout << L"\n";
+    if (!report.RulesValid)
+        std::wcout << L"  Recorded rule blob is missing or invalid; replaying with no rules.\n";
+
+    std::wcout << L"  Mismatches: " << report.Mismatches << L"\n";
+    for (size_t idx : report.MismatchIndices)
+    {
+        const auto& r = capture.Records[idx];
+        std::wcout << L"    #" << idx << L" seq=" << r.Sequence
+            << L" in=0x" << std::hex << r.In.MakeCode << L"/0x" << r.In.Flags << std::dec
+            << L" state=" << (unsigned)r.State << L" role=" << (unsigned)r.Role << L"\n";
+    }
+
+    wchar_t line[128];
+    swprintf(line, 128, L"  Engine time: driver %.1f ns/event, replay %.1f ns/event\n",
+        report.RecordedNsPerEvent, report.HostNsPerEvent);
+    std::wcout << line;
+
+    return report.Mismatches ? 4 : 0;
+}
+
+// kblayctl compile-all <cacheDir> <KLID> <KLID>... [--layouts dir] [--threads n]
+static int CompileAll(int argc, wchar_t** argv)
+{
+    if (argc < 3)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    const std::wstring cacheDir = argv[2];
+    std::vector<std::wstring> klids;
+    std::wstring layoutDir;
+    unsigned threads = 0;
+    for (int i = 3; i < argc; ++i)
+    {
+        const std::wstring a = argv[i];
+        if (a == L"--layouts" && i + 1 < argc)
+            layoutDir = argv[++i];
+        else if (a == L"--threads" && i + 1 < argc)
+            threads = (unsigned)_wtoi(argv[++i]);
+        else if (a.size() == 8 && a.find_first_not_of(L"0123456789abcdefABCDEF") == std::wstring::npos)
+            klids.push_back(a);
+        else
+        {
+            PrintUsage();
+            return 1;
+        }
+    }
+    if (klids.size() < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    // Data files win over the built-in layouts, which win over installed ones.
+    LayoutFileSource files(layoutDir);
+    BuiltInLayoutSource builtIn;
+    InstalledLayoutSource installed;
+    LayoutSourceChain source;
+    if (!layoutDir.empty())
+        source.Add(&files);
+    source.Add(&builtIn);
+    source.Add(&installed);
+
+    const CompileAllReport report = CompileAllLayoutPairs(source, klids, threads);
+    for (const auto& k : report.MissingLayouts)
+        std::wcout << L"Layout " << k << L" not found; its pairs are skipped.\n";
+
+    size_t compiled = 0;
+    uint64_t pairMicros = 0;
+    wchar_t line[128];
+    for (const auto& r : report.Pairs)
+    {
+        if (r.Blob.empty())
+            continue;
+        ++compiled;
+        pairMicros += r.Micros;
+        swprintf(line, 128, L"  %ls -> %ls  %4u rules  %8llu us\n",
+            r.BaseKlid.c_str(), r.TargetKlid.c_str(), r.Entries, (unsigned long long)r.Micros);
+        std::wcout << line;
+    }
+
+    std::wstring error;
+    if (!WriteRuleBlobCache(cacheDir, report, error))
+    {
+        std::wcout << L"Blob cache: " << error << L"\n";
+        return 3;
+    }
+
+    const double wallSec = report.CompileMicros / 1e6;
+    swprintf(line, 128, L"%zu pairs in %.1f ms on %u threads (%.0f pairs/s, %.1fx parallel); layouts loaded in %.1f ms\n",
+        compiled, report.CompileMicros / 1e3, report.Threads,
+        wallSec > 0 ? compiled / wallSec : 0.0,
+        report.CompileMicros ? (double)pairMicros / report.CompileMicros : 0.0,
+        report.LoadMicros / 1e3);
+    std::wcout << line;
+    std::wcout << L"Wrote " << cacheDir << L"\n";
+
+    return report.MissingLayouts.empty() ? 0 : 2;
+}
+
+// kblayctl log <file>...
+// Prints service log files (KbdLayRemapService.kbllog and its rotated
+// .1, .2, ...) in the order given.
+static int PrintLog(int argc, wchar_t** argv)
+{
+    if (argc < 3)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    int rc = 0;
+    std::vector<LogRecord> records;
+    for (int i = 2; i < argc; ++i)
+    {
+        if (!ReadLogFile(argv[i], records))
+        {
+            std::wcout << L"Cannot read log file " << argv[i] << L"\n";
+            rc = 2;
+            continue;
+        }
+        for (const auto& r : records)
+            std::wcout << FormatLogRecord(r) << L"\n";
+    }
+    return rc;
+}
+
 int wmain(int argc, wchar_t** argv)
 {
     try
@@ -158,14 +638,7 @@ int wmain(int argc, wchar_t** argv)
             return 2;
         }
 
-        HANDLE hCtrl = CreateFileW(
-            KBLAY_CONTROL_DEVICE_DOS_NAME,
-            GENERIC_READ,
-            FILE_SHARE_READ | FILE_SHARE_WRITE,
-            nullptr,
-            OPEN_EXISTING,
-            FILE_ATTRIBUTE_NORMAL,
-            nullptr);
+        HANDLE hCtrl = OpenControlDevice(GENERIC_READ);
 
         if (hCtrl == INVALID_HANDLE_VALUE)
         {
@@ -209,6 +682,26 @@ int wmain(int argc, wchar_t** argv)
     {
         return PrintDriverContainers();
     }
+    if (cmd == L"watch")
+    {
+        return WatchDevices(argc, argv);
+    }
+    if (cmd == L"log")
+    {
+        return PrintLog(argc, argv);
+    }
+    if (cmd == L"compile-all")
+    {
+        return CompileAll(argc, argv);
+    }
+    if (cmd == L"trace" && argc >= 3)
+    {
+        std::wstring sub = argv[2];
+        if (sub == L"record")
+            return TraceRecord(argc, argv);
+        if (sub == L"replay")
+            return TraceReplay(argc, argv);
+    }
 
     PrintUsage();
     return 1;
@@ -0,0 +1,144 @@
+#include "ContainerPolicy.hpp"
+#include <algorithm>
+#include <cstring>
+#include <cwchar>
+
+const ContainerAssignment ContainerPolicy::kDefault{};
+
+size_t ContainerPolicy::Hash(const GUID& id)
+{
+    // ContainerIds are (mostly) random; fold and mix the two halves.
+    UINT64 lo = 0;
+    UINT64 hi = 0;
+    memcpy(&lo, &id, sizeof(lo));
+    memcpy(&hi, (const BYTE*)&id + sizeof(lo), sizeof(hi));
+    UINT64 h = (lo ^ (hi * 0x9E3779B97F4A7C15ull));
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 32;
+    return (size_t)h;
+}
+
+void ContainerPolicy::Grow()
+{
+    std::vector<Slot> old;
+    old.swap(slots_);
+    slots_.assign(old.empty() ? 16 : old.size() * 2, Slot{});
+
+    const size_t mask = slots_.size() - 1;
+    for (const auto& s : old)
+    {
+        if (IsNullGuid(s.Id))
+            continue;
+        size_t i = Hash(s.Id) & mask;
+        while (!IsNullGuid(slots_[i].Id))
+            i = (i + 1) & mask;
+        slots_[i] = s;
+    }
+}
+
+bool ContainerPolicy::Add(const GUID& id, const ContainerAssignment& a)
+{
+    if (IsNullGuid(id))
+        return true;
+
+    // Keep the load factor at or below 1/2 so probe runs stay short.
+    if ((count_ + 1) * 2 > slots_.size())
+        Grow();
+
+    const size_t mask = slots_.size() - 1;
+    size_t i = Hash(id) & mask;
+    while (!IsNullGuid(slots_[i].Id))
+    {
+        Slot& s = slots_[i];
+        if (IsEqualGUID(s.Id, id))
+        {
+            if (s.Conflict || (s.Assignment.Role == a.Role && s.Assignment.Profile == a.Profile))
+                return !s.Conflict;
+
+            s.Conflict = true;
+            s.Assignment = kDefault;
+            conflicts_.push_back(id);
+            return false;
+        }
+        i = (i + 1) & mask;
+    }
+
+    slots_[i] = Slot{ id, a, false };
+    ++count_;
+    if (a.Profile != 0 && std::find(profiles_.begin(), profiles_.end(), a.Profile) == profiles_.end())
+        profiles_.push_back(a.Profile);
+    return true;
+}
+
+const ContainerAssignment& ContainerPolicy::Resolve(const GUID& id) const
+{
+    if (slots_.empty() || IsNullGuid(id))
+        return kDefault;
+
+    const size_t mask = slots_.size() - 1;
+    size_t i = Hash(id) & mask;
+    while (!IsNullGuid(slots_[i].Id))
+    {
+        if (IsEqualGUID(slots_[i].Id, id))
+            return slots_[i].Assignment;
+        i = (i + 1) & mask;
+    }
+    return kDefault;
+}
+
+bool ParseKlid(std::wstring_view s, UINT32& out)
+{
+    if (s.size() != 8)
+        return false;
+    UINT32 v = 0;
+    for (const wchar_t c : s)
+    {
+        UINT32 d;
+        if (c >= L'0' && c <= L'9') d = (UINT32)(c - L'0');
+        else if (c >= L'a' && c <= L'f') d = (UINT32)(c - L'a' + 10);
+        else if (c >= L'A' && c <= L'F') d = (UINT32)(c - L'A' + 10);
+        else return false;
+        v = (v << 4) | d;
+    }
+    if (v == 0)
+        return false;
+    out = v;
+    return true;
+}
+
+std::wstring KlidToString(UINT32 klid)
+{
+    wchar_t buf[9]{};
+    swprintf(buf, sizeof(buf) / sizeof(buf[0]), L"%08lX", (unsigned long)klid);
+    return buf;
+}
+
+size_t CompileContainerPolicy(const ContainerPolicyLists& lists, ContainerPolicy& out)
+{
+    out = ContainerPolicy{};
+
+    ContainerAssignment remap;
+    remap.Role = KBLAY_ROLE_REMAP;
+    remap.State = KBLAY_STATE_ACTIVE;
+
+    ContainerAssignment base;
+    base.Role = KBLAY_ROLE_BASE;
+    base.State = KBLAY_STATE_ACTIVE; // BASE role is pass-through by driver logic
+
+    size_t bad = 0;
+    ForEachListToken(lists.Remap, [&](std::wstring_view token) {
+        ContainerAssignment a = remap;
+        const size_t colon = token.find(L':');
+        GUID g{};
+        if (!ParseGuid(token.substr(0, colon), g) ||
+            (colon != std::wstring_view::npos && !ParseKlid(token.substr(colon + 1), a.Profile)))
+        {
+            ++bad;
+            return;
+        }
+        out.Add(g, a);
+    });
+    bad += ForEachGuidInList(lists.Base, [&](const GUID& g) { out.Add(g, base); });
+    return bad;
+}
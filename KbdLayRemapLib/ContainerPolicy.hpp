@@ -0,0 +1,68 @@
+#pragma once
+#include "Guid.hpp"
+#include "../Shared/KbdLayIoctl.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// What the service should push to the devices of one ContainerId.
+struct ContainerAssignment
+{
+    UINT32 Role = KBLAY_ROLE_NONE;
+    UINT32 State = KBLAY_STATE_BYPASS_HARD;
+    UINT32 Profile = 0; // target KLID for KBLAY_ROLE_REMAP rules; 0 = [Options] TargetKlid
+};
+
+// A KLID is eight hex digits ("0000040C"); Profile holds it as a number.
+// Parsing rejects anything else, and zero.
+bool ParseKlid(std::wstring_view s, UINT32& out);
+std::wstring KlidToString(UINT32 klid); // upper case, as Windows names them
+
+// ContainerId -> assignment, compiled once per config load.
+// Open addressing with linear probing; GUID_NULL marks an empty slot, which
+// is safe because devices without a ContainerId are never looked up.
+class ContainerPolicy
+{
+public:
+    // Inserts `id`. If it is already present with a different role or
+    // profile, the entry is demoted to the default (bypass) assignment, the GUID is
+    // recorded in Conflicts() and false is returned.
+    bool Add(const GUID& id, const ContainerAssignment& a);
+
+    // Assignment for `id`, or the default (bypass) assignment if unlisted.
+    const ContainerAssignment& Resolve(const GUID& id) const;
+
+    size_t Size() const { return count_; }
+    const std::vector<GUID>& Conflicts() const { return conflicts_; }
+
+    // Every non-zero Profile added, once each, in the order first seen.
+    const std::vector<UINT32>& Profiles() const { return profiles_; }
+
+private:
+    struct Slot
+    {
+        GUID Id;
+        ContainerAssignment Assignment;
+        bool Conflict;
+    };
+
+    static size_t Hash(const GUID& id);
+    void Grow();
+
+    std::vector<Slot> slots_; // size is zero or a power of two
+    size_t count_ = 0;
+    std::vector<GUID> conflicts_;
+    std::vector<UINT32> profiles_;
+    static const ContainerAssignment kDefault;
+};
+
+struct ContainerPolicyLists
+{
+    std::wstring Remap; // [Mapping] US; "{guid}:<KLID>" targets that layout
+    std::wstring Base;  // [Mapping] JIS
+};
+
+// Compiles the [Mapping] lists. A GUID listed under both, or under US with two
+// different targets, ends up bypassed and reported via Conflicts(). Returns
+// the number of tokens that failed to parse, a bad KLID included.
+size_t CompileContainerPolicy(const ContainerPolicyLists& lists, ContainerPolicy& out);
@@ -0,0 +1,117 @@
+#include "ControlDevice.hpp"
+#include "..\\Shared\\Public.h"
+
+HANDLE OpenControlDevice(DWORD desiredAccess)
+{
+    return CreateFileW(
+        KBLAY_CONTROL_DEVICE_DOS_NAME,
+        desiredAccess,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+}
+
+bool IsControlHandleGone(DWORD error)
+{
+    switch (error)
+    {
+    case ERROR_INVALID_HANDLE:
+    case ERROR_DEVICE_REMOVED:
+    case ERROR_DEVICE_NOT_CONNECTED:
+    case ERROR_NO_SUCH_DEVICE:
+    case ERROR_FILE_NOT_FOUND:
+    case ERROR_BAD_COMMAND:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool EnumDriverDevices(HANDLE h, std::vector<BYTE>& buf, DWORD& err)
+{
+    if (buf.size() < 4096) buf.resize(4096);
+    for (int i = 0; i < 3; ++i)
+    {
+        DWORD ret = 0;
+        if (DeviceIoControl(h, IOCTL_KBLAY_ENUM_DEVICES, nullptr, 0, buf.data(), (DWORD)buf.size(), &ret, nullptr))
+            return true;
+        err = GetLastError();
+        if (err != ERROR_MORE_DATA && err != ERROR_INSUFFICIENT_BUFFER)
+            return false;
+        buf.resize(buf.size() * 2);
+    }
+    return false;
+}
+
+bool DeviceIoctlGetStatusEx(HANDLE h, const GUID& containerId, KBLAY_STATUS_OUTPUT& out)
+{
+    KBLAY_GET_STATUS_EX_INPUT in{};
+    in.ContainerId = containerId;
+
+    out = KBLAY_STATUS_OUTPUT{};
+    DWORD ret = 0;
+    if (!DeviceIoControl(h, IOCTL_KBLAY_GET_STATUS_EX, &in, sizeof(in), &out, sizeof(out), &ret, nullptr))
+        return false;
+
+    // An older driver returns only the V1 prefix; the rest stays zero.
+    KbdLayMarkStatusUnreported(&out, ret);
+    return ret >= KBLAY_STATUS_OUTPUT_V1_SIZE;
+}
+
+ControlDeviceStatusSource::~ControlDeviceStatusSource()
+{
+    if (h_ != INVALID_HANDLE_VALUE)
+        CloseHandle(h_);
+}
+
+bool ControlDeviceStatusSource::EnsureOpen()
+{
+    if (h_ == INVALID_HANDLE_VALUE)
+        h_ = OpenControlDevice(GENERIC_READ);
+    return h_ != INVALID_HANDLE_VALUE;
+}
+
+// Keeps the caller's last error for whoever reports the failure.
+void ControlDeviceStatusSource::CloseIfGone()
+{
+    const DWORD err = GetLastError();
+    if (IsControlHandleGone(err))
+    {
+        CloseHandle(h_);
+        h_ = INVALID_HANDLE_VALUE;
+    }
+    SetLastError(err);
+}
+
+bool ControlDeviceStatusSource::ListContainers(std::vector<GUID>& out)
+{
+    if (!EnsureOpen())
+        return false;
+
+    DWORD err = 0;
+    if (!EnumDriverDevices(h_, buf_, err))
+    {
+        CloseIfGone();
+        return false;
+    }
+
+    const auto* e = reinterpret_cast<const KBLAY_ENUM_DEVICES_OUTPUT*>(buf_.data());
+    for (UINT32 d = 0; d < e->ReturnedCount; ++d)
+    {
+        if (e->Devices[d].HasContainerId)
+            out.push_back(e->Devices[d].ContainerId);
+    }
+    return true;
+}
+
+bool ControlDeviceStatusSource::QueryStatus(const GUID& containerId, KBLAY_STATUS_OUTPUT& out)
+{
+    if (!EnsureOpen())
+        return false;
+    if (DeviceIoctlGetStatusEx(h_, containerId, out))
+        return true;
+    CloseIfGone();
+    return false;
+}
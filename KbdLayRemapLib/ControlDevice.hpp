@@ -0,0 +1,51 @@
+#pragma once
+#include <Windows.h>
+#include <vector>
+
+#include "StatusRates.hpp"
+#include "..\\Shared\\KbdLayIoctl.h"
+
+// Synchronous access to the driver's control device: opening it, listing
+// its devices and reading their status. kblayctl and the service both read
+// driver status through ControlDeviceStatusSource.
+
+HANDLE OpenControlDevice(DWORD desiredAccess);
+
+// True for errors that mean the handle is no longer usable (driver unloaded
+// or the control device was deleted); the owner should reopen.
+bool IsControlHandleGone(DWORD error);
+
+// IOCTL_KBLAY_ENUM_DEVICES into `buf` (a KBLAY_ENUM_DEVICES_OUTPUT),
+// doubling it while the driver asks for more room. `err` is the last error
+// on failure.
+bool EnumDriverDevices(HANDLE h, std::vector<BYTE>& buf, DWORD& err);
+
+// IOCTL_KBLAY_GET_STATUS_EX. Fields past an older driver's reply are zero,
+// or KBLAY_STATUS_NOT_REPORTED where zero would be a real count.
+bool DeviceIoctlGetStatusEx(HANDLE h, const GUID& containerId, KBLAY_STATUS_OUTPUT& out);
+
+// Driver status over its own synchronous handle. The handle is opened on
+// first use and reopened after the control device goes away, so a sampler
+// can start before the driver is loaded and outlive a driver reload.
+class ControlDeviceStatusSource final : public StatusSource
+{
+public:
+    ControlDeviceStatusSource() = default;
+    ~ControlDeviceStatusSource();
+
+    ControlDeviceStatusSource(const ControlDeviceStatusSource&) = delete;
+    ControlDeviceStatusSource& operator=(const ControlDeviceStatusSource&) = delete;
+
+    // Opens the handle if it is not open; false (with GetLastError set)
+    // when the control device is not there.
+    bool EnsureOpen();
+
+    bool ListContainers(std::vector<GUID>& out) override;
+    bool QueryStatus(const GUID& containerId, KBLAY_STATUS_OUTPUT& out) override;
+
+private:
+    void CloseIfGone();
+
+    HANDLE h_ = INVALID_HANDLE_VALUE;
+    std::vector<BYTE> buf_;
+};
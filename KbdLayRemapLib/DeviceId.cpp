@@ -6,13 +6,11 @@
 #include <ntddkbd.h>
 #include <devpkey.h>
 #include <cfgmgr32.h>
-#include <Rpc.h>
 #include <cwchar>
 #include <vector>
 
 #pragma comment(lib, "Setupapi.lib")
 #pragma comment(lib, "Cfgmgr32.lib")
-#pragma comment(lib, "Rpcrt4.lib")
 
 static std::wstring GetDevPropString(HDEVINFO h, SP_DEVINFO_DATA& dev, const DEVPROPKEY& key)
 {
@@ -76,6 +74,16 @@ static bool IsRootKeyboardInterfacePath(const std::wstring& path)
     return _wcsnicmp(path.c_str(), kPrefix, len) == 0;
 }
 
+static void FillDeviceProperties(HDEVINFO h, SP_DEVINFO_DATA& dev, FilterDeviceInfo& info)
+{
+    // ContainerId groups devnodes for one physical device.
+    info.ContainerId = GetDevPropGuid(h, dev, DEVPKEY_Device_ContainerId);
+
+    info.FriendlyName = GetDevPropString(h, dev, DEVPKEY_Device_FriendlyName);
+    if (info.FriendlyName.empty())
+        info.FriendlyName = GetDevPropString(h, dev, DEVPKEY_Device_DeviceDesc);
+}
+
 static std::vector<FilterDeviceInfo> EnumerateByInterfaceGuid(const GUID& guid)
 {
     std::vector<FilterDeviceInfo> out;
@@ -109,13 +117,7 @@ static std::vector<FilterDeviceInfo> EnumerateByInterfaceGuid(const GUID& guid)
         if (IsRootKeyboardInterfacePath(info.DevicePath))
             continue;
 
-        // ContainerId groups devnodes for one physical device.
-        info.ContainerId = GetDevPropGuid(h, dev, DEVPKEY_Device_ContainerId);
-
-        info.FriendlyName = GetDevPropString(h, dev, DEVPKEY_Device_FriendlyName);
-        if (info.FriendlyName.empty())
-            info.FriendlyName = GetDevPropString(h, dev, DEVPKEY_Device_DeviceDesc);
-
+        FillDeviceProperties(h, dev, info);
         out.push_back(std::move(info));
     }
 
@@ -161,44 +163,28 @@ std::vector<FilterDeviceInfo> EnumerateKbdLayFilterDevices()
     return EnumerateByInterfaceGuid(GUID_DEVINTERFACE_KEYBOARD);
 }
 
-std::wstring GuidToString(const GUID& g)
+bool QueryFilterDeviceInfo(const std::wstring& interfacePath, FilterDeviceInfo& out)
 {
-    RPC_WSTR s = nullptr;
-    if (UuidToStringW((UUID*)&g, &s) != RPC_S_OK || !s)
-        return L"";
-    std::wstring r = (wchar_t*)s;
-    RpcStringFreeW(&s);
-    return L"{" + r + L"}";
-}
+    HDEVINFO h = SetupDiCreateDeviceInfoList(nullptr, nullptr);
+    if (h == INVALID_HANDLE_VALUE) return false;
 
-std::vector<GUID> ParseGuidList(const std::wstring& semicolonSeparated)
-{
-    std::vector<GUID> v;
-    size_t start = 0;
-    while (start < semicolonSeparated.size())
+    bool ok = false;
+    SP_DEVICE_INTERFACE_DATA ifd{};
+    ifd.cbSize = sizeof(ifd);
+    if (SetupDiOpenDeviceInterfaceW(h, interfacePath.c_str(), 0, &ifd))
     {
-        size_t end = semicolonSeparated.find(L';', start);
-        if (end == std::wstring::npos) end = semicolonSeparated.size();
-        std::wstring token = semicolonSeparated.substr(start, end - start);
-
-        // trim
-        auto trim = [](std::wstring s) {
-            size_t a = s.find_first_not_of(L" \t\r\n");
-            if (a == std::wstring::npos) return std::wstring();
-            size_t b = s.find_last_not_of(L" \t\r\n");
-            return s.substr(a, b - a + 1);
-            };
-        token = trim(token);
-
-        if (!token.empty())
+        SP_DEVINFO_DATA dev{};
+        dev.cbSize = sizeof(dev);
+        if (SetupDiGetDeviceInterfaceDetailW(h, &ifd, nullptr, 0, nullptr, &dev) ||
+            GetLastError() == ERROR_INSUFFICIENT_BUFFER)
         {
-            GUID g = GUID_NULL;
-            RPC_WSTR w = (RPC_WSTR)token.c_str();
-            if (UuidFromStringW(w, (UUID*)&g) == RPC_S_OK)
-                v.push_back(g);
+            out = FilterDeviceInfo{};
+            out.DevicePath = interfacePath;
+            FillDeviceProperties(h, dev, out);
+            ok = true;
         }
-
-        start = end + 1;
     }
-    return v;
+
+    SetupDiDestroyDeviceInfoList(h);
+    return ok;
 }
@@ -1,5 +1,5 @@
 #pragma once
-#include <Windows.h>
+#include "Guid.hpp"
 #include <string>
 #include <vector>
 
@@ -11,5 +11,6 @@ struct FilterDeviceInfo
 };
 
 std::vector<FilterDeviceInfo> EnumerateKbdLayFilterDevices();
-std::vector<GUID> ParseGuidList(const std::wstring& semicolonSeparated);
-std::wstring GuidToString(const GUID& g);
+
+// Fills `out` for a single device interface path (as delivered by PnP notifications).
+bool QueryFilterDeviceInfo(const std::wstring& interfacePath, FilterDeviceInfo& out);
@@ -0,0 +1,171 @@
+#include "DeviceInventory.hpp"
+#include "Utf16.hpp"
+
+static bool SameDevicePath(const std::wstring& a, const std::wstring& b)
+{
+    // Interface paths are case-insensitive and arrive in mixed case.
+    return a.size() == b.size() && ToLowerAscii(a) == ToLowerAscii(b);
+}
+
+static bool SameDevice(const FilterDeviceInfo& a, const FilterDeviceInfo& b)
+{
+    return SameDevicePath(a.DevicePath, b.DevicePath) &&
+        IsEqualGUID(a.ContainerId, b.ContainerId) &&
+        a.FriendlyName == b.FriendlyName;
+}
+
+DeviceInventory::DeviceInventory(std::unique_ptr<DeviceNotificationBackend> backend)
+    : backend_(std::move(backend)),
+      snapshot_(std::make_shared<DeviceInventorySnapshot>())
+{
+}
+
+DeviceInventory::~DeviceInventory()
+{
+    Stop();
+}
+
+bool DeviceInventory::Start()
+{
+    if (!backend_)
+        return false;
+
+    // Subscribe first so changes during the enumeration are not lost; the
+    // rescan replays them over the list it gets back.
+    live_ = backend_->Subscribe([this](const DeviceChange& c) { Apply(c); });
+    Rescan();
+    return live_;
+}
+
+void DeviceInventory::Stop()
+{
+    if (backend_ && live_)
+        backend_->Unsubscribe();
+    live_ = false;
+}
+
+std::shared_ptr<const DeviceInventorySnapshot> DeviceInventory::Snapshot()
+{
+    if (RescanPending())
+        Rescan();
+
+    std::lock_guard<std::mutex> g(lock_);
+    return snapshot_;
+}
+
+uint64_t DeviceInventory::Version() const
+{
+    std::lock_guard<std::mutex> g(lock_);
+    return snapshot_->Version;
+}
+
+void DeviceInventory::Publish(std::vector<FilterDeviceInfo> devices)
+{
+    auto next = std::make_shared<DeviceInventorySnapshot>();
+    next->Version = snapshot_->Version + 1;
+    next->Devices = std::move(devices);
+    snapshot_ = std::move(next);
+}
+
+// Applies one delta to `devices`; false if it changes nothing.
+static bool ApplyChange(std::vector<FilterDeviceInfo>& devices, const DeviceChange& change)
+{
+    size_t idx = devices.size();
+    for (size_t i = 0; i < devices.size(); ++i)
+    {
+        if (SameDevicePath(devices[i].DevicePath, change.Device.DevicePath))
+        {
+            idx = i;
+            break;
+        }
+    }
+
+    if (change.Action == DeviceChange::Kind::Removal)
+    {
+        if (idx == devices.size())
+            return false;
+        devices.erase(devices.begin() + (ptrdiff_t)idx);
+        return true;
+    }
+
+    if (idx != devices.size() && SameDevice(devices[idx], change.Device))
+        return false;
+
+    if (idx == devices.size())
+        devices.push_back(change.Device);
+    else
+        devices[idx] = change.Device;
+    return true;
+}
+
+void DeviceInventory::ApplyLocked(const DeviceChange& change)
+{
+    // A rescan in progress may return a list taken before this delta.
+    if (rescans_ != 0)
+        duringRescan_.push_back(change);
+
+    std::vector<FilterDeviceInfo> next = snapshot_->Devices;
+    if (ApplyChange(next, change))
+        Publish(std::move(next));
+}
+
+void DeviceInventory::Apply(const DeviceChange& change)
+{
+    // Enumerating is slow, and notifications often come in bursts (every
+    // keyboard interface that appears alongside ours); one rescan covers them.
+    if (change.Action == DeviceChange::Kind::Rescan)
+    {
+        rescanPending_.store(true, std::memory_order_release);
+        return;
+    }
+
+    std::lock_guard<std::mutex> g(lock_);
+    ApplyLocked(change);
+}
+
+void DeviceInventory::Rescan()
+{
+    if (!backend_)
+        return;
+
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        ++rescans_;
+    }
+
+    // This enumeration answers every request made so far; one made while
+    // it runs may not be reflected, so it stays pending.
+    rescanPending_.store(false, std::memory_order_release);
+
+    // Enumerate outside the lock; it is the slow part.
+    std::vector<FilterDeviceInfo> fresh = backend_->Enumerate();
+
+    std::lock_guard<std::mutex> g(lock_);
+
+    // Deltas delivered while enumerating may be newer than the list; replay
+    // them in order on top of it.
+    for (const auto& c : duringRescan_)
+        ApplyChange(fresh, c);
+    if (--rescans_ == 0)
+        duringRescan_.clear();
+
+    const auto& cur = snapshot_->Devices;
+
+    bool same = fresh.size() == cur.size();
+    for (size_t i = 0; same && i < fresh.size(); ++i)
+    {
+        bool found = false;
+        for (const auto& d : cur)
+        {
+            if (SameDevice(d, fresh[i]))
+            {
+                found = true;
+                break;
+            }
+        }
+        same = found;
+    }
+
+    if (!same)
+        Publish(std::move(fresh));
+}
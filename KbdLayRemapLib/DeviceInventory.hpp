@@ -0,0 +1,92 @@
+#pragma once
+#include "DeviceId.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct DeviceChange
+{
+    enum class Kind
+    {
+        Arrival,  // Device is present (new or properties refreshed)
+        Removal,  // Device.DevicePath is gone
+        Rescan    // Notification source lost track; re-enumerate everything
+    };
+
+    Kind Action = Kind::Rescan;
+    FilterDeviceInfo Device{};
+};
+
+// Source of the initial device list and of later hotplug deltas.
+class DeviceNotificationBackend
+{
+public:
+    using Sink = std::function<void(const DeviceChange&)>;
+
+    virtual ~DeviceNotificationBackend() = default;
+
+    // Full, synchronous enumeration.
+    virtual std::vector<FilterDeviceInfo> Enumerate() = 0;
+
+    // Starts delivering deltas to `sink`, possibly from another thread.
+    // Returns false if live notifications are unavailable.
+    virtual bool Subscribe(Sink sink) = 0;
+
+    // Stops delivery; no sink call is in progress or made after this returns.
+    virtual void Unsubscribe() = 0;
+};
+
+struct DeviceInventorySnapshot
+{
+    uint64_t Version = 0;
+    std::vector<FilterDeviceInfo> Devices;
+};
+
+// Enumerates once, then tracks arrivals/removals from the backend. Readers
+// get an immutable snapshot; the version only changes when the set or a
+// device's properties actually change. A Rescan change from the backend only
+// marks the inventory: the enumeration runs in the next Snapshot(), on the
+// reader's thread, so the backend's notification thread never waits on it.
+class DeviceInventory
+{
+public:
+    explicit DeviceInventory(std::unique_ptr<DeviceNotificationBackend> backend);
+    ~DeviceInventory();
+
+    DeviceInventory(const DeviceInventory&) = delete;
+    DeviceInventory& operator=(const DeviceInventory&) = delete;
+
+    // Initial enumeration plus subscription. Returns true if live updates are
+    // active; otherwise callers should Rescan() whenever they need fresh data.
+    bool Start();
+    void Stop();
+    bool Live() const { return live_; }
+
+    // Runs a pending rescan first.
+    std::shared_ptr<const DeviceInventorySnapshot> Snapshot();
+    uint64_t Version() const;   // as of the last snapshot published
+    bool RescanPending() const { return rescanPending_.load(std::memory_order_acquire); }
+
+    void Apply(const DeviceChange& change);
+    void Rescan();
+
+private:
+    void Publish(std::vector<FilterDeviceInfo> devices);
+    void ApplyLocked(const DeviceChange& change);
+
+    std::unique_ptr<DeviceNotificationBackend> backend_;
+    bool live_ = false;
+
+    mutable std::mutex lock_;
+    std::shared_ptr<const DeviceInventorySnapshot> snapshot_;
+    size_t rescans_ = 0;                      // Rescan() calls between enumerate and publish
+    std::vector<DeviceChange> duringRescan_;  // deltas applied meanwhile
+    std::atomic<bool> rescanPending_{ false };  // set by a Rescan change
+};
+
+// PnP interface notifications (CM_Register_Notification); Windows only.
+std::unique_ptr<DeviceNotificationBackend> CreatePnpNotificationBackend();
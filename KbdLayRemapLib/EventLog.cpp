@@ -0,0 +1,400 @@
+#include "EventLog.hpp"
+#include "Guid.hpp"
+#include "MappedFile.hpp"
+#include "Utf16.hpp"
+
+#include <chrono>
+#include <ctime>
+#include <cwchar>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <Windows.h>
+#endif
+
+static const wchar_t* const kEventFormats[] = {
+#define KBLAY_LOG_EVENT(name, format) format,
+#include "LogEvents.inl"
+#undef KBLAY_LOG_EVENT
+};
+static_assert(sizeof(kEventFormats) / sizeof(kEventFormats[0]) == (size_t)LogEvent::Count, "event table out of sync");
+
+EventLog::EventLog(size_t capacity)
+{
+    size_t n = 2;
+    while (n < capacity)
+        n <<= 1;
+    slots_ = std::make_unique<Slot[]>(n);
+    for (size_t i = 0; i < n; ++i)
+        slots_[i].Seq.store(i, std::memory_order_relaxed);
+    mask_ = n - 1;
+}
+
+EventLog::~EventLog()
+{
+    Stop();
+}
+
+uint64_t EventLog::NowNs() noexcept
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+uint32_t EventLog::ThreadNumber() noexcept
+{
+    static std::atomic<uint32_t> s_next{ 0 };
+    thread_local uint32_t t_number = 0;
+    if (t_number == 0)
+        t_number = s_next.fetch_add(1, std::memory_order_relaxed) + 1;
+    return t_number;
+}
+
+void EventLog::Start(std::unique_ptr<LogSink> sink, uint32_t flushIntervalMs)
+{
+    if (flusher_.joinable() || !sink)
+        return;
+    sink_ = std::move(sink);
+    stop_ = false;
+    flusher_ = std::thread([this, flushIntervalMs] { FlusherLoop(flushIntervalMs); });
+}
+
+void EventLog::Stop()
+{
+    if (!flusher_.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    flusher_.join();
+    sink_.reset();
+}
+
+size_t EventLog::Drain(std::vector<LogRecord>& out)
+{
+    const size_t before = out.size();
+    for (;;)
+    {
+        Slot& s = slots_[tail_ & mask_];
+        if (s.Seq.load(std::memory_order_acquire) != tail_ + 1)
+            break;
+        out.push_back(s.Record);
+        s.Seq.store(tail_ + mask_ + 1, std::memory_order_release);
+        ++tail_;
+    }
+    return out.size() - before;
+}
+
+void EventLog::FlusherLoop(uint32_t flushIntervalMs)
+{
+    std::vector<LogRecord> batch;
+    batch.reserve(mask_ + 2);
+
+    for (bool last = false; !last;)
+    {
+        {
+            std::unique_lock<std::mutex> l(lock_);
+            wake_.wait_for(l, std::chrono::milliseconds(flushIntervalMs), [this] { return stop_; });
+            last = stop_;
+        }
+
+        batch.clear();
+        Drain(batch);
+
+        const uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reportedDropped_)
+        {
+            LogRecord r{};
+            r.Time = NowNs();
+            r.Thread = ThreadNumber();
+            r.Event = (uint16_t)LogEvent::LogDropped;
+            AddField(r, dropped - reportedDropped_);
+            batch.push_back(r);
+            reportedDropped_ = dropped;
+        }
+
+        if (!batch.empty())
+        {
+            sink_->Write(batch.data(), batch.size());
+            sink_->Flush();
+        }
+    }
+}
+
+std::wstring FormatLogRecord(const LogRecord& r)
+{
+    const time_t secs = (time_t)(r.Time / 1000000000ull);
+    struct tm tm {};
+#ifdef _WIN32
+    gmtime_s(&tm, &secs);
+#else
+    gmtime_r(&secs, &tm);
+#endif
+    wchar_t head[64];
+    swprintf(head, 64, L"%04d-%02d-%02d %02d:%02d:%02d.%06uZ t%u ",
+        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+        (unsigned)(r.Time % 1000000000ull / 1000), (unsigned)r.Thread);
+
+    std::wstring s = head;
+    const wchar_t* format = r.Event < (uint16_t)LogEvent::Count ? kEventFormats[r.Event] : nullptr;
+    if (!format)
+    {
+        s += L"event " + std::to_wstring(r.Event);
+        return s;
+    }
+
+    size_t offset = 0;
+    unsigned field = 0;
+    const size_t payload = r.PayloadBytes < KBLAY_LOG_PAYLOAD ? r.PayloadBytes : KBLAY_LOG_PAYLOAD;
+    for (const wchar_t* p = format; *p; ++p)
+    {
+        if (p[0] != L'{' || p[1] != L'}')
+        {
+            s += *p;
+            continue;
+        }
+        ++p;
+
+        if (field >= r.FieldCount || field >= KBLAY_LOG_MAX_FIELDS)
+        {
+            s += L"?";
+            continue;
+        }
+        switch ((LogFieldType)r.Types[field++])
+        {
+        case LogFieldType::U64:
+        case LogFieldType::I64:
+        {
+            uint64_t v = 0;
+            if (offset + sizeof(v) > payload)
+                break;
+            memcpy(&v, r.Payload + offset, sizeof(v));
+            offset += sizeof(v);
+            s += (LogFieldType)r.Types[field - 1] == LogFieldType::I64 ? std::to_wstring((int64_t)v) : std::to_wstring(v);
+            break;
+        }
+        case LogFieldType::Guid:
+        {
+            GUID g{};
+            if (offset + sizeof(g) > payload)
+                break;
+            memcpy(&g, r.Payload + offset, sizeof(g));
+            offset += sizeof(g);
+            s += GuidToString(g);
+            break;
+        }
+        case LogFieldType::Str:
+        {
+            if (offset + 1 > payload)
+                break;
+            const size_t n = r.Payload[offset++];
+            if (offset + n * sizeof(char16_t) > payload)
+                break;
+            for (size_t i = 0; i < n; ++i, offset += sizeof(char16_t))
+            {
+                char16_t c;
+                memcpy(&c, r.Payload + offset, sizeof(c));
+                s += (wchar_t)c;
+            }
+            break;
+        }
+        default:
+            s += L"?";
+            break;
+        }
+    }
+    return s;
+}
+
+void DebuggerLogSink::Write(const LogRecord* records, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const std::wstring line = FormatLogRecord(records[i]) + L"\n";
+#ifdef _WIN32
+        OutputDebugStringW(line.c_str());
+#else
+        std::fputs(WideToUtf8(line).c_str(), stderr);
+#endif
+    }
+}
+
+static std::filesystem::path FsPath(const std::wstring& p)
+{
+#ifdef _WIN32
+    return std::filesystem::path(p);
+#else
+    return std::filesystem::path(WideToUtf8(p));
+#endif
+}
+
+static bool HeaderMatches(const LogFileHeader& h)
+{
+    return memcmp(h.Magic, KBLAY_LOG_FILE_MAGIC, sizeof(h.Magic)) == 0 &&
+        h.Version == KBLAY_LOG_FILE_VERSION && h.RecordSize == sizeof(LogRecord);
+}
+
+RotatingLogFile::RotatingLogFile(std::wstring path, uint64_t maxBytes, unsigned keep)
+    : path_(std::move(path)), maxBytes_(maxBytes), keep_(keep)
+{
+}
+
+RotatingLogFile::~RotatingLogFile()
+{
+    if (f_)
+        std::fclose(f_);
+}
+
+bool RotatingLogFile::Open()
+{
+    if (f_)
+        return true;
+
+    std::error_code ec;
+    const auto path = FsPath(path_);
+    const uint64_t existing = std::filesystem::exists(path, ec) ? (uint64_t)std::filesystem::file_size(path, ec) : 0;
+    if (ec)
+        return false;
+
+    // Keep appending to a file this version wrote; anything else is moved
+    // aside and a new one started.
+    bool append = false;
+    if (existing >= sizeof(LogFileHeader))
+    {
+        MappedFile m;
+        LogFileHeader h{};
+        if (m.Open(path_) && m.Size() >= sizeof(h))
+        {
+            memcpy(&h, m.Data(), sizeof(h));
+            append = HeaderMatches(h) && (existing - sizeof(h)) % sizeof(LogRecord) == 0;
+        }
+    }
+    if (existing == 0)
+        return Create();
+    if (!append)
+    {
+        Rotate();
+        return f_ != nullptr;
+    }
+
+#ifdef _WIN32
+    if (_wfopen_s(&f_, path_.c_str(), L"ab") != 0)
+        f_ = nullptr;
+#else
+    f_ = std::fopen(WideToUtf8(path_).c_str(), "ab");
+#endif
+    size_ = existing;
+    return f_ != nullptr;
+}
+
+bool RotatingLogFile::Create()
+{
+#ifdef _WIN32
+    if (_wfopen_s(&f_, path_.c_str(), L"wb") != 0)
+        f_ = nullptr;
+#else
+    f_ = std::fopen(WideToUtf8(path_).c_str(), "wb");
+#endif
+    if (!f_)
+        return false;
+
+    LogFileHeader h{};
+    memcpy(h.Magic, KBLAY_LOG_FILE_MAGIC, sizeof(h.Magic));
+    h.Version = KBLAY_LOG_FILE_VERSION;
+    h.RecordSize = sizeof(LogRecord);
+    if (std::fwrite(&h, sizeof(h), 1, f_) != 1)
+    {
+        std::fclose(f_);
+        f_ = nullptr;
+        return false;
+    }
+    size_ = sizeof(h);
+    return true;
+}
+
+void RotatingLogFile::Rotate()
+{
+    if (f_)
+    {
+        std::fclose(f_);
+        f_ = nullptr;
+    }
+
+    std::error_code ec;
+    if (keep_ == 0)
+    {
+        std::filesystem::remove(FsPath(path_), ec);
+    }
+    else
+    {
+        for (unsigned i = keep_; i > 1; --i)
+            std::filesystem::rename(FsPath(path_ + L"." + std::to_wstring(i - 1)), FsPath(path_ + L"." + std::to_wstring(i)), ec);
+        std::filesystem::rename(FsPath(path_), FsPath(path_ + L".1"), ec);
+    }
+
+    // Starts over in place if the old file could not be moved.
+    Create();
+}
+
+void RotatingLogFile::Write(const LogRecord* records, size_t count)
+{
+    if (!f_ && !Open())
+        return;
+
+    while (count)
+    {
+        if (size_ > sizeof(LogFileHeader) && size_ + sizeof(LogRecord) > maxBytes_)
+        {
+            Rotate();
+            if (!f_)
+                return;
+        }
+
+        // As many as fit before the next rotation, at least one.
+        size_t n = count;
+        if (size_ + n * sizeof(LogRecord) > maxBytes_)
+        {
+            const uint64_t room = maxBytes_ > size_ ? (maxBytes_ - size_) / sizeof(LogRecord) : 0;
+            n = room ? (size_t)room : 1;
+        }
+        if (std::fwrite(records, sizeof(LogRecord), n, f_) != n)
+        {
+            // Disk full or gone: drop this batch and start over next time.
+            std::fclose(f_);
+            f_ = nullptr;
+            return;
+        }
+        size_ += n * sizeof(LogRecord);
+        records += n;
+        count -= n;
+    }
+}
+
+void RotatingLogFile::Flush()
+{
+    if (f_)
+        std::fflush(f_);
+}
+
+bool ReadLogFile(const std::wstring& path, std::vector<LogRecord>& out)
+{
+    out.clear();
+
+    MappedFile f;
+    if (!f.Open(path) || f.Size() < sizeof(LogFileHeader))
+        return false;
+
+    LogFileHeader h{};
+    memcpy(&h, f.Data(), sizeof(h));
+    if (!HeaderMatches(h))
+        return false;
+
+    // A record cut short by a crash mid-write is ignored.
+    const size_t count = (f.Size() - sizeof(h)) / sizeof(LogRecord);
+    out.resize(count);
+    if (count)
+        memcpy(out.data(), f.Data() + sizeof(h), count * sizeof(LogRecord));
+    return true;
+}
@@ -0,0 +1,252 @@
+#pragma once
+#include "../Shared/KbdLayPlatform.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Structured event log. A call copies its event id and typed fields into a
+// fixed-size record in a lock-free ring, with no allocation and no
+// formatting; a background thread hands the records to a sink, and text is
+// only made when someone reads them (kblayctl log, or the debugger sink).
+
+enum class LogEvent : uint16_t
+{
+#define KBLAY_LOG_EVENT(name, format) name,
+#include "LogEvents.inl"
+#undef KBLAY_LOG_EVENT
+    Count
+};
+
+enum class LogFieldType : uint8_t
+{
+    None = 0,
+    U64,
+    I64,
+    Guid,
+    Str,    // UINT8 length in UTF-16 units, then the units; cut to fit
+};
+
+#define KBLAY_LOG_MAX_FIELDS   8
+#define KBLAY_LOG_PAYLOAD      96
+
+#pragma pack(push, 1)
+struct LogRecord
+{
+    uint64_t Time;                         // ns since 1970-01-01 UTC
+    uint32_t Thread;                       // small per-process thread number
+    uint16_t Event;                        // LogEvent
+    uint8_t FieldCount;
+    uint8_t PayloadBytes;
+    uint8_t Types[KBLAY_LOG_MAX_FIELDS];   // LogFieldType per field
+    uint8_t Payload[KBLAY_LOG_PAYLOAD];    // fields back to back
+};
+
+// Log file: this header, then LogRecords.
+struct LogFileHeader
+{
+    char Magic[8];          // KBLAY_LOG_FILE_MAGIC
+    uint32_t Version;       // KBLAY_LOG_FILE_VERSION
+    uint32_t RecordSize;    // sizeof(LogRecord)
+};
+#pragma pack(pop)
+
+static_assert(sizeof(LogRecord) == 120, "LogRecord layout is stored in log files");
+
+#define KBLAY_LOG_FILE_MAGIC   "KBLAYLOG"
+#define KBLAY_LOG_FILE_VERSION 1u
+
+// Where the flusher puts records. Called from the flusher thread only.
+class LogSink
+{
+public:
+    virtual ~LogSink() = default;
+    virtual void Write(const LogRecord* records, size_t count) = 0;
+    virtual void Flush() {}
+};
+
+// Appends to `path`; past maxBytes it becomes path.1 (path.1 becomes
+// path.2, and so on up to `keep`) and a new file is started.
+class RotatingLogFile : public LogSink
+{
+public:
+    RotatingLogFile(std::wstring path, uint64_t maxBytes, unsigned keep);
+    ~RotatingLogFile() override;
+
+    bool Open();
+    void Write(const LogRecord* records, size_t count) override;
+    void Flush() override;
+
+private:
+    bool Create();
+    void Rotate();
+
+    std::wstring path_;
+    uint64_t maxBytes_;
+    unsigned keep_;
+    FILE* f_ = nullptr;
+    uint64_t size_ = 0;
+};
+
+// Formats each record and sends it to the debugger (stderr off Windows).
+class DebuggerLogSink : public LogSink
+{
+public:
+    void Write(const LogRecord* records, size_t count) override;
+};
+
+class EventLog
+{
+public:
+    // capacity is rounded up to a power of two.
+    explicit EventLog(size_t capacity = 4096);
+    ~EventLog();
+
+    EventLog(const EventLog&) = delete;
+    EventLog& operator=(const EventLog&) = delete;
+
+    // Starts the flusher; records logged before this wait in the ring.
+    void Start(std::unique_ptr<LogSink> sink, uint32_t flushIntervalMs = 100);
+
+    // Writes out everything logged so far and stops the flusher.
+    void Stop();
+
+    // Fields are integers, GUIDs and strings (const wchar_t*, std::wstring,
+    // std::wstring_view). Never blocks; when the ring is full the record is
+    // counted as dropped and a LogDropped event reports it later.
+    template <typename... Args>
+    void Log(LogEvent event, const Args&... args) noexcept
+    {
+        static_assert(sizeof...(Args) <= KBLAY_LOG_MAX_FIELDS, "too many log fields");
+
+        uint64_t pos = head_.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;)
+        {
+            slot = &slots_[pos & mask_];
+            const uint64_t seq = slot->Seq.load(std::memory_order_acquire);
+            const int64_t diff = (int64_t)(seq - pos);
+            if (diff == 0)
+            {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            else
+            {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+
+        LogRecord& r = slot->Record;
+        r.Time = NowNs();
+        r.Thread = ThreadNumber();
+        r.Event = (uint16_t)event;
+        r.FieldCount = 0;
+        r.PayloadBytes = 0;
+        (AddField(r, args), ...);
+        slot->Seq.store(pos + 1, std::memory_order_release);
+    }
+
+    uint64_t Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) Slot
+    {
+        std::atomic<uint64_t> Seq;
+        LogRecord Record;
+    };
+
+    static uint64_t NowNs() noexcept;
+    static uint32_t ThreadNumber() noexcept;
+
+    static void AddBytes(LogRecord& r, LogFieldType type, const void* data, size_t size) noexcept
+    {
+        if (r.PayloadBytes + size > KBLAY_LOG_PAYLOAD)
+            return;
+        memcpy(r.Payload + r.PayloadBytes, data, size);
+        r.PayloadBytes = (uint8_t)(r.PayloadBytes + size);
+        r.Types[r.FieldCount++] = (uint8_t)type;
+    }
+
+    static void AddString(LogRecord& r, const wchar_t* s, size_t len) noexcept
+    {
+        if (r.PayloadBytes + 1u > KBLAY_LOG_PAYLOAD)
+            return;
+        const size_t room = (KBLAY_LOG_PAYLOAD - r.PayloadBytes - 1u) / sizeof(char16_t);
+        const size_t n = len < room ? len : room;
+        uint8_t* p = r.Payload + r.PayloadBytes;
+        *p++ = (uint8_t)n;
+        for (size_t i = 0; i < n; ++i, p += sizeof(char16_t))
+        {
+            const char16_t c = (uint32_t)s[i] > 0xFFFF ? u'?' : (char16_t)s[i];
+            memcpy(p, &c, sizeof(c));
+        }
+        r.PayloadBytes = (uint8_t)(r.PayloadBytes + 1 + n * sizeof(char16_t));
+        r.Types[r.FieldCount++] = (uint8_t)LogFieldType::Str;
+    }
+
+    template <typename T>
+    static void AddField(LogRecord& r, const T& v) noexcept
+    {
+        if constexpr (std::is_integral_v<T> || std::is_enum_v<T>)
+        {
+            if constexpr (std::is_signed_v<T>)
+            {
+                const int64_t x = (int64_t)v;
+                AddBytes(r, LogFieldType::I64, &x, sizeof(x));
+            }
+            else
+            {
+                const uint64_t x = (uint64_t)v;
+                AddBytes(r, LogFieldType::U64, &x, sizeof(x));
+            }
+        }
+        else if constexpr (std::is_same_v<T, GUID>)
+        {
+            AddBytes(r, LogFieldType::Guid, &v, sizeof(v));
+        }
+        else if constexpr (std::is_convertible_v<const T&, std::wstring_view>)
+        {
+            const std::wstring_view s(v);
+            AddString(r, s.data(), s.size());
+        }
+        else
+        {
+            static_assert(sizeof(T) == 0, "unsupported log field type");
+        }
+    }
+
+    void FlusherLoop(uint32_t flushIntervalMs);
+    size_t Drain(std::vector<LogRecord>& out);
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<uint64_t> head_{ 0 };
+    alignas(64) uint64_t tail_ = 0;     // flusher only
+    std::atomic<uint64_t> dropped_{ 0 };
+    uint64_t reportedDropped_ = 0;      // flusher only
+
+    std::unique_ptr<LogSink> sink_;
+    std::thread flusher_;
+    std::mutex lock_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+};
+
+// "2026-01-31 12:34:56.789012Z t3 <message>"
+std::wstring FormatLogRecord(const LogRecord& r);
+
+bool ReadLogFile(const std::wstring& path, std::vector<LogRecord>& out);
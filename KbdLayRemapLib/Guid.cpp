@@ -0,0 +1,66 @@
+#include "Guid.hpp"
+#include <cwchar>
+
+static int HexValue(wchar_t c)
+{
+    if (c >= L'0' && c <= L'9') return c - L'0';
+    if (c >= L'a' && c <= L'f') return c - L'a' + 10;
+    if (c >= L'A' && c <= L'F') return c - L'A' + 10;
+    return -1;
+}
+
+static bool ParseHex(const wchar_t* p, size_t digits, UINT64& out)
+{
+    UINT64 v = 0;
+    for (size_t i = 0; i < digits; ++i)
+    {
+        const int h = HexValue(p[i]);
+        if (h < 0) return false;
+        v = (v << 4) | (UINT64)h;
+    }
+    out = v;
+    return true;
+}
+
+bool ParseGuid(std::wstring_view s, GUID& out)
+{
+    if (s.size() == 38 && s.front() == L'{' && s.back() == L'}')
+        s = s.substr(1, 36);
+    if (s.size() != 36 || s[8] != L'-' || s[13] != L'-' || s[18] != L'-' || s[23] != L'-')
+        return false;
+
+    const wchar_t* p = s.data();
+    UINT64 d1 = 0, d2 = 0, d3 = 0, d4 = 0, d5 = 0;
+    if (!ParseHex(p, 8, d1) || !ParseHex(p + 9, 4, d2) || !ParseHex(p + 14, 4, d3) ||
+        !ParseHex(p + 19, 4, d4) || !ParseHex(p + 24, 12, d5))
+        return false;
+
+    GUID g{};
+    g.Data1 = (UINT32)d1;
+    g.Data2 = (UINT16)d2;
+    g.Data3 = (UINT16)d3;
+    g.Data4[0] = (UINT8)(d4 >> 8);
+    g.Data4[1] = (UINT8)d4;
+    for (int i = 0; i < 6; ++i)
+        g.Data4[2 + i] = (UINT8)(d5 >> (8 * (5 - i)));
+    out = g;
+    return true;
+}
+
+std::vector<GUID> ParseGuidList(const std::wstring& semicolonSeparated)
+{
+    std::vector<GUID> v;
+    ForEachGuidInList(semicolonSeparated, [&](const GUID& g) { v.push_back(g); });
+    return v;
+}
+
+std::wstring GuidToString(const GUID& g)
+{
+    wchar_t buf[40]{};
+    swprintf(buf, sizeof(buf) / sizeof(buf[0]),
+        L"{%08lx-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+        (unsigned long)g.Data1, (unsigned)g.Data2, (unsigned)g.Data3,
+        (unsigned)g.Data4[0], (unsigned)g.Data4[1], (unsigned)g.Data4[2], (unsigned)g.Data4[3],
+        (unsigned)g.Data4[4], (unsigned)g.Data4[5], (unsigned)g.Data4[6], (unsigned)g.Data4[7]);
+    return buf;
+}
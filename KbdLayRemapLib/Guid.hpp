@@ -0,0 +1,64 @@
+#pragma once
+#include "../Shared/KbdLayPlatform.h"
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Accepts "xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx", optionally wrapped in braces.
+bool ParseGuid(std::wstring_view s, GUID& out);
+
+// Semicolon-separated GUIDs; blanks and unparsable tokens are skipped.
+std::vector<GUID> ParseGuidList(const std::wstring& semicolonSeparated);
+
+// Calls fn(std::wstring_view) for every non-blank token of a
+// semicolon-separated list, with surrounding whitespace trimmed.
+template <typename Fn>
+void ForEachListToken(std::wstring_view list, Fn&& fn);
+
+// Calls fn(const GUID&) for every GUID in a semicolon-separated list and
+// returns the number of non-blank tokens that failed to parse.
+template <typename Fn>
+size_t ForEachGuidInList(std::wstring_view list, Fn&& fn);
+
+std::wstring GuidToString(const GUID& g);
+
+static inline bool IsNullGuid(const GUID& g)
+{
+    static const GUID kNull{};
+    return !!IsEqualGUID(g, kNull);
+}
+
+template <typename Fn>
+void ForEachListToken(std::wstring_view list, Fn&& fn)
+{
+    size_t start = 0;
+    while (start <= list.size())
+    {
+        size_t end = list.find(L';', start);
+        if (end == std::wstring_view::npos) end = list.size();
+
+        size_t a = start;
+        size_t b = end;
+        while (a < b && (list[a] == L' ' || list[a] == L'\t' || list[a] == L'\r' || list[a] == L'\n')) ++a;
+        while (b > a && (list[b - 1] == L' ' || list[b - 1] == L'\t' || list[b - 1] == L'\r' || list[b - 1] == L'\n')) --b;
+
+        if (a < b)
+            fn(list.substr(a, b - a));
+
+        start = end + 1;
+    }
+}
+
+template <typename Fn>
+size_t ForEachGuidInList(std::wstring_view list, Fn&& fn)
+{
+    size_t bad = 0;
+    ForEachListToken(list, [&](std::wstring_view token) {
+        GUID g{};
+        if (ParseGuid(token, g))
+            fn(g);
+        else
+            ++bad;
+    });
+    return bad;
+}
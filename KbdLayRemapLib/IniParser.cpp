@@ -1,58 +1,252 @@
 #include "IniParser.hpp"
-#include <fstream>
-#include <sstream>
+#include "Utf16.hpp"
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
 
-static std::wstring Trim(const std::wstring& s)
+static constexpr uint64_t kFnvOffset = 14695981039346656037ull;
+static constexpr uint64_t kFnvPrime = 1099511628211ull;
+
+static uint64_t HashBytes(const unsigned char* p, size_t n)
+{
+    // FNV-1a over 64-bit words; only used to tell file revisions apart.
+    uint64_t h = kFnvOffset ^ (uint64_t)n;
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = (h ^ w) * kFnvPrime;
+    }
+    for (; i < n; ++i)
+        h = (h ^ p[i]) * kFnvPrime;
+    return h;
+}
+
+template <typename CharT>
+static uint64_t HashUnits(uint64_t h, const CharT* p, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        h = (h ^ (uint64_t)(std::make_unsigned_t<CharT>)p[i]) * kFnvPrime;
+    return h;
+}
+
+template <typename CharT>
+static uint64_t HashSectionKey(const CharT* section, size_t sectionLen, const CharT* key, size_t keyLen)
+{
+    uint64_t h = HashUnits(kFnvOffset, section, sectionLen);
+    h = (h ^ 0x10000u) * kFnvPrime; // separator outside any code unit range
+    return HashUnits(h, key, keyLen);
+}
+
+template <typename CharT>
+static bool IsSpace(CharT c)
+{
+    return c == (CharT)' ' || c == (CharT)'\t' || c == (CharT)'\r' || c == (CharT)'\n';
+}
+
+static std::u16string WideToUtf16(const std::wstring& s)
+{
+    if constexpr (sizeof(wchar_t) == 2)
+        return std::u16string(s.begin(), s.end());
+
+    std::u16string out;
+    out.reserve(s.size());
+    for (wchar_t wc : s)
+    {
+        char32_t cp = (char32_t)wc;
+        if (cp >= 0x10000 && cp <= 0x10FFFF)
+        {
+            cp -= 0x10000;
+            out.push_back((char16_t)(0xD800 + (cp >> 10)));
+            out.push_back((char16_t)(0xDC00 + (cp & 0x3FF)));
+        }
+        else
+        {
+            out.push_back((char16_t)cp);
+        }
+    }
+    return out;
+}
+
+static std::wstring Utf16ToWide(const char16_t* p, size_t n)
+{
+    if constexpr (sizeof(wchar_t) == 2)
+        return std::wstring(p, p + n);
+
+    std::wstring out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        char32_t cp = p[i];
+        if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < n && p[i + 1] >= 0xDC00 && p[i + 1] <= 0xDFFF)
+        {
+            cp = 0x10000 + ((cp - 0xD800) << 10) + ((char32_t)p[i + 1] - 0xDC00);
+            ++i;
+        }
+        out.push_back((wchar_t)cp);
+    }
+    return out;
+}
+
+bool IniParser::Map(const std::wstring& path)
 {
-    size_t a = s.find_first_not_of(L" \t\r\n");
-    if (a == std::wstring::npos) return L"";
-    size_t b = s.find_last_not_of(L" \t\r\n");
-    return s.substr(a, b - a + 1);
+    entries_.clear();
+    stamp_ = IniFileStamp{};
+
+    if (!file_.Open(path))
+        return false;
+
+    stamp_.Size = file_.Size();
+    stamp_.WriteTime = file_.WriteTime();
+    stamp_.Hash = HashBytes(file_.Data(), file_.Size());
+    return true;
 }
 
 bool IniParser::Load(const std::wstring& path)
 {
-    data_.clear();
-    std::wifstream ifs(path);
-    if (!ifs) return false;
-    try
+    if (!Map(path))
+        return false;
+    Parse();
+    return true;
+}
+
+bool IniParser::LoadIfChanged(const std::wstring& path, const IniFileStamp& previous, bool& changed)
+{
+    changed = false;
+
+    // Same size and write time: take it as unchanged without mapping or
+    // hashing anything. The hash only settles touched-but-equal files.
+    uint64_t size = 0;
+    uint64_t writeTime = 0;
+    if (MappedFile::Stat(path, size, writeTime) && size == previous.Size && writeTime == previous.WriteTime &&
+        previous != IniFileStamp{})
     {
-        ifs.imbue(std::locale(""));
+        entries_.clear();
+        file_.Close();
+        stamp_ = previous;
+        return true;
     }
-    catch (...)
+
+    if (!Map(path))
+        return false;
+
+    if (stamp_.Size == previous.Size && stamp_.Hash == previous.Hash && previous != IniFileStamp{})
     {
-        // Fallback to the default "C" locale if the system locale is unavailable.
+        file_.Close();
+        return true;
     }
 
-    std::wstring section;
-    std::wstring line;
-    while (std::getline(ifs, line))
+    changed = true;
+    Parse();
+    return true;
+}
+
+void IniParser::Parse()
+{
+    const unsigned char* p = file_.Data();
+    const size_t n = file_.Size();
+
+    if (n >= 2 && p[0] == 0xFF && p[1] == 0xFE)
     {
-        line = Trim(line);
-        if (line.empty()) continue;
-        if (line[0] == L';' || line[0] == L'#') continue;
+        encoding_ = Encoding::Utf16;
+        bodyOffset_ = 2;
+        ParseBody((const char16_t*)(p + 2), (n - 2) / sizeof(char16_t));
+        return;
+    }
 
-        if (line.front() == L'[' && line.back() == L']')
+    encoding_ = Encoding::Utf8;
+    bodyOffset_ = (n >= 3 && p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF) ? 3 : 0;
+    ParseBody((const char*)(p + bodyOffset_), n - bodyOffset_);
+}
+
+template <typename CharT>
+void IniParser::ParseBody(const CharT* body, size_t count)
+{
+    Span section{ 0, 0 };
+
+    size_t pos = 0;
+    while (pos < count)
+    {
+        size_t eol = pos;
+        while (eol < count && body[eol] != (CharT)'\n') ++eol;
+
+        size_t a = pos;
+        size_t b = eol;
+        pos = eol + 1;
+
+        while (a < b && IsSpace(body[a])) ++a;
+        while (b > a && IsSpace(body[b - 1])) --b;
+        if (a == b) continue;
+        if (body[a] == (CharT)';' || body[a] == (CharT)'#') continue;
+
+        if (body[a] == (CharT)'[' && body[b - 1] == (CharT)']' && b - a >= 2)
         {
-            section = Trim(line.substr(1, line.size() - 2));
+            size_t sa = a + 1;
+            size_t sb = b - 1;
+            while (sa < sb && IsSpace(body[sa])) ++sa;
+            while (sb > sa && IsSpace(body[sb - 1])) --sb;
+            section = Span{ (uint32_t)sa, (uint32_t)(sb - sa) };
             continue;
         }
 
-        size_t eq = line.find(L'=');
-        if (eq == std::wstring::npos) continue;
+        size_t eq = a;
+        while (eq < b && body[eq] != (CharT)'=') ++eq;
+        if (eq == b) continue;
+
+        size_t ka = a;
+        size_t kb = eq;
+        while (kb > ka && IsSpace(body[kb - 1])) --kb;
+
+        size_t va = eq + 1;
+        while (va < b && IsSpace(body[va])) ++va;
 
-        std::wstring key = Trim(line.substr(0, eq));
-        std::wstring val = Trim(line.substr(eq + 1));
-        data_[section][key] = val;
+        Entry e{};
+        e.Section = section;
+        e.Key = Span{ (uint32_t)ka, (uint32_t)(kb - ka) };
+        e.Value = Span{ (uint32_t)va, (uint32_t)(b - va) };
+        e.Hash = HashSectionKey(body + section.Offset, section.Length, body + ka, kb - ka);
+        entries_.push_back(e);
     }
-    return true;
+
+    std::stable_sort(entries_.begin(), entries_.end(),
+        [](const Entry& x, const Entry& y) { return x.Hash < y.Hash; });
+}
+
+template <typename CharT>
+std::wstring IniParser::Lookup(const CharT* body, const std::basic_string<CharT>& section,
+    const std::basic_string<CharT>& key, const std::wstring& def) const
+{
+    const uint64_t h = HashSectionKey(section.data(), section.size(), key.data(), key.size());
+    auto range = std::equal_range(entries_.begin(), entries_.end(), Entry{ h, {}, {}, {} },
+        [](const Entry& x, const Entry& y) { return x.Hash < y.Hash; });
+
+    // Later assignments win, as with the previous map-based parser.
+    for (auto it = range.second; it != range.first;)
+    {
+        --it;
+        if (it->Section.Length != section.size() || it->Key.Length != key.size())
+            continue;
+        if (!std::equal(section.begin(), section.end(), body + it->Section.Offset) ||
+            !std::equal(key.begin(), key.end(), body + it->Key.Offset))
+            continue;
+
+        const CharT* v = body + it->Value.Offset;
+        if constexpr (sizeof(CharT) == 1)
+            return Utf8ToWide(std::string_view(v, it->Value.Length));
+        else
+            return Utf16ToWide(v, it->Value.Length);
+    }
+    return def;
 }
 
 std::wstring IniParser::Get(const std::wstring& section, const std::wstring& key, const std::wstring& def) const
 {
-    auto itS = data_.find(section);
-    if (itS == data_.end()) return def;
-    auto itK = itS->second.find(key);
-    if (itK == itS->second.end()) return def;
-    return itK->second;
+    if (entries_.empty())
+        return def;
+
+    const unsigned char* body = file_.Data() + bodyOffset_;
+    if (encoding_ == Encoding::Utf16)
+        return Lookup((const char16_t*)body, WideToUtf16(section), WideToUtf16(key), def);
+    return Lookup((const char*)body, WideToUtf8(section), WideToUtf8(key), def);
 }
@@ -1,15 +1,66 @@
 #pragma once
+#include "MappedFile.hpp"
+#include <cstdint>
 #include <string>
-#include <unordered_map>
+#include <vector>
 
+// Identity of an INI file's contents, used to skip reparsing unchanged files.
+struct IniFileStamp
+{
+    uint64_t Size = 0;
+    uint64_t WriteTime = 0;
+    uint64_t Hash = 0;
+
+    bool operator==(const IniFileStamp& o) const { return Size == o.Size && WriteTime == o.WriteTime && Hash == o.Hash; }
+    bool operator!=(const IniFileStamp& o) const { return !(*this == o); }
+};
+
+// Parses directly out of a read-only file mapping: entries are offsets into
+// the mapped bytes and values are only decoded when asked for. The file is
+// UTF-8 unless it starts with a UTF-16LE BOM (a UTF-8 BOM is skipped).
 class IniParser
 {
 public:
     bool Load(const std::wstring& path);
+
+    // Like Load, but when the file still matches `previous` the contents are
+    // not parsed, `changed` is set to false and the parser is left empty.
+    // A matching size and write time is enough; the file is then not mapped.
+    // Otherwise it is mapped and hashed, and a touched but equal file is
+    // unchanged too: keep Stamp() so the next check can skip it again.
+    bool LoadIfChanged(const std::wstring& path, const IniFileStamp& previous, bool& changed);
+
     std::wstring Get(const std::wstring& section, const std::wstring& key, const std::wstring& def = L"") const;
 
+    const IniFileStamp& Stamp() const { return stamp_; }
+
 private:
-    using Key = std::wstring;
-    using Map = std::unordered_map<Key, std::wstring>;
-    std::unordered_map<Key, Map> data_;
+    enum class Encoding { Utf8, Utf16 };
+
+    struct Span
+    {
+        uint32_t Offset; // in code units from the start of the body
+        uint32_t Length;
+    };
+
+    struct Entry
+    {
+        uint64_t Hash; // of (section, key)
+        Span Section;
+        Span Key;
+        Span Value;
+    };
+
+    bool Map(const std::wstring& path);
+    void Parse();
+
+    template <typename CharT> void ParseBody(const CharT* body, size_t count);
+    template <typename CharT> std::wstring Lookup(const CharT* body, const std::basic_string<CharT>& section,
+        const std::basic_string<CharT>& key, const std::wstring& def) const;
+
+    MappedFile file_;
+    Encoding encoding_ = Encoding::Utf8;
+    size_t bodyOffset_ = 0; // bytes skipped for the BOM
+    std::vector<Entry> entries_; // sorted by Hash, file order within equal hashes
+    IniFileStamp stamp_;
 };
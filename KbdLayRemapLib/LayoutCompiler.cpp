@@ -0,0 +1,425 @@
+#include "LayoutCompiler.hpp"
+#include "IniParser.hpp"
+#include "MappedFile.hpp"
+#include "Utf16.hpp"
+#include "WorkStealingPool.hpp"
+#include "../Shared/KbdLayEngine.h"
+#include "../Shared/Public.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cwchar>
+#include <filesystem>
+
+std::vector<uint8_t> CompileLayoutPair(const LayoutKeys& base, const LayoutKeys& target)
+{
+    std::vector<KBLAY_RULE_ENTRY_V2> entries;
+    for (int s = 0; s <= 1; ++s)
+    {
+        for (const LayoutKey& k : target.Keys)
+        {
+            KBLAY_RULE_ENTRY_V2 e{};
+            if (PickLayoutRule(base.Keys.data(), base.Keys.size(), k, s != 0, e))
+                entries.push_back(e);
+        }
+    }
+
+    KBLAY_RULE_BLOB_HEADER h{};
+    h.Version = KBLAY_RULE_BLOB_VERSION_2;
+    h.EntryCount = (UINT32)entries.size();
+    h.TotalSizeBytes = (UINT32)(sizeof(h) + entries.size() * sizeof(KBLAY_RULE_ENTRY_V2));
+
+    std::vector<uint8_t> blob(h.TotalSizeBytes);
+    memcpy(blob.data(), &h, sizeof(h));
+    if (!entries.empty())
+        memcpy(blob.data() + sizeof(h), entries.data(), entries.size() * sizeof(KBLAY_RULE_ENTRY_V2));
+    return blob;
+}
+
+namespace
+{
+    // Cursor over one line of layout data.
+    struct LineReader
+    {
+        const char* p;
+        const char* end;
+
+        void SkipSpace()
+        {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                ++p;
+        }
+
+        bool Take(const char* token)
+        {
+            SkipSpace();
+            const size_t n = strlen(token);
+            if ((size_t)(end - p) < n || memcmp(p, token, n) != 0)
+                return false;
+            p += n;
+            return true;
+        }
+
+        bool AtEnd()
+        {
+            SkipSpace();
+            return p == end || (end - p >= 2 && p[0] == '/' && p[1] == '/');
+        }
+
+        bool Number(uint32_t& value)
+        {
+            SkipSpace();
+            const char* start = p;
+            int base = 10;
+            if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+            {
+                base = 16;
+                p += 2;
+            }
+            uint64_t v = 0;
+            const char* digits = p;
+            for (; p < end; ++p)
+            {
+                int d;
+                if (*p >= '0' && *p <= '9') d = *p - '0';
+                else if (base == 16 && *p >= 'a' && *p <= 'f') d = *p - 'a' + 10;
+                else if (base == 16 && *p >= 'A' && *p <= 'F') d = *p - 'A' + 10;
+                else break;
+                v = v * base + d;
+                if (v > 0xFFFFFFFFull)
+                    return false;
+            }
+            if (p == digits)
+            {
+                p = start;
+                return false;
+            }
+            value = (uint32_t)v;
+            return true;
+        }
+
+        // u'c' or a number.
+        bool Char(char16_t& c)
+        {
+            uint32_t v = 0;
+            if (Number(v))
+            {
+                if (v > 0xFFFF)
+                    return false;
+                c = (char16_t)v;
+                return true;
+            }
+            if (!Take("u'"))
+                return false;
+
+            std::string utf8;
+            while (p < end && *p != '\'')
+            {
+                if (*p == '\\')
+                {
+                    if (++p == end || (*p != '\\' && *p != '\'' && *p != '"'))
+                        return false;
+                }
+                utf8.push_back(*p++);
+            }
+            if (p == end)
+                return false;
+            ++p;
+
+            const std::wstring w = Utf8ToWide(utf8);
+            if (w.size() != 1 || (uint32_t)w[0] == 0xFFFD || (uint32_t)w[0] > 0xFFFF)
+                return false;
+            c = (char16_t)w[0];
+            return true;
+        }
+    };
+}
+
+bool ParseLayoutData(const unsigned char* data, size_t size, std::vector<LayoutKey>& keys, std::wstring& error)
+{
+    keys.clear();
+    error.clear();
+
+    const char* text = reinterpret_cast<const char*>(data);
+    const char* const end = text + size;
+    if (size >= 3 && memcmp(text, "\xEF\xBB\xBF", 3) == 0)
+        text += 3;
+
+    for (unsigned line = 1; text < end; ++line)
+    {
+        const char* eol = static_cast<const char*>(memchr(text, '\n', (size_t)(end - text)));
+        if (!eol)
+            eol = end;
+        LineReader r{ text, (eol > text && eol[-1] == '\r') ? eol - 1 : eol };
+        text = eol < end ? eol + 1 : end;
+
+        if (r.AtEnd())
+            continue;
+
+        uint32_t scan = 0;
+        LayoutKey k{};
+        if (!r.Take("KBLAY_LAYOUT_KEY(") || !r.Number(scan) || !r.Take(",") ||
+            !r.Char(k.Plain) || !r.Take(",") || !r.Char(k.Shifted) || !r.Take(")") || !r.AtEnd())
+        {
+            error = L"line " + std::to_wstring(line) + L": expected KBLAY_LAYOUT_KEY(scan, plain, shifted)";
+            return false;
+        }
+        if (scan == 0 || scan > 0x7F)
+        {
+            error = L"line " + std::to_wstring(line) + L": make code out of range";
+            return false;
+        }
+        k.Scan = (uint8_t)scan;
+        keys.push_back(k);
+    }
+
+    std::sort(keys.begin(), keys.end(), [](const LayoutKey& a, const LayoutKey& b) { return a.Scan < b.Scan; });
+    for (size_t i = 1; i < keys.size(); ++i)
+    {
+        if (keys[i].Scan == keys[i - 1].Scan)
+        {
+            error = L"make code " + std::to_wstring(keys[i].Scan) + L" listed twice";
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::wstring JoinPath(const std::wstring& dir, const std::wstring& name)
+{
+#ifdef _WIN32
+    const wchar_t sep = L'\\';
+#else
+    const wchar_t sep = L'/';
+#endif
+    if (dir.empty() || dir.back() == L'/' || dir.back() == L'\\')
+        return dir + name;
+    return dir + sep + name;
+}
+
+bool LayoutFileSource::Load(const std::wstring& klid, LayoutKeys& out)
+{
+    MappedFile f;
+    if (!f.Open(JoinPath(dir_, klid + L".inl")))
+        return false;
+
+    std::wstring error;
+    if (!ParseLayoutData(f.Data(), f.Size(), out.Keys, error))
+        return false;
+    out.Klid = klid;
+    return true;
+}
+
+bool LayoutSourceChain::Load(const std::wstring& klid, LayoutKeys& out)
+{
+    for (LayoutSource* s : sources_)
+        if (s->Load(klid, out))
+            return true;
+    return false;
+}
+
+static uint64_t MicrosSince(std::chrono::steady_clock::time_point t0)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+}
+
+CompileAllReport CompileAllLayoutPairs(LayoutSource& source, const std::vector<std::wstring>& requested, unsigned threads)
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<std::wstring> klids;
+    for (const auto& k : requested)
+        if (std::find(klids.begin(), klids.end(), k) == klids.end())
+            klids.push_back(k);
+
+    CompileAllReport report;
+    WorkStealingPool pool(threads);
+    report.Threads = pool.Threads();
+
+    // Each layout is loaded once and then only read, by every pair using it.
+    std::vector<LayoutKeys> layouts(klids.size());
+    std::vector<char> loaded(klids.size(), 0);
+
+    const auto t0 = Clock::now();
+    for (size_t i = 0; i < klids.size(); ++i)
+    {
+        pool.Submit([&, i] {
+            try
+            {
+                loaded[i] = source.Load(klids[i], layouts[i]) ? 1 : 0;
+            }
+            catch (...)
+            {
+                loaded[i] = 0;
+            }
+        });
+    }
+    pool.Wait();
+    report.LoadMicros = MicrosSince(t0);
+
+    for (size_t i = 0; i < klids.size(); ++i)
+        if (!loaded[i])
+            report.MissingLayouts.push_back(klids[i]);
+
+    for (size_t b = 0; b < klids.size(); ++b)
+    {
+        for (size_t t = 0; t < klids.size(); ++t)
+        {
+            if (b == t)
+                continue;
+            LayoutPairResult r;
+            r.BaseKlid = klids[b];
+            r.TargetKlid = klids[t];
+            report.Pairs.push_back(std::move(r));
+        }
+    }
+
+    const auto t1 = Clock::now();
+    size_t next = 0;
+    for (size_t b = 0; b < klids.size(); ++b)
+    {
+        for (size_t t = 0; t < klids.size(); ++t)
+        {
+            if (b == t)
+                continue;
+            LayoutPairResult* r = &report.Pairs[next++];
+            if (!loaded[b] || !loaded[t])
+                continue;
+            pool.Submit([r, &base = layouts[b], &target = layouts[t]] {
+                const auto start = Clock::now();
+                try
+                {
+                    r->Blob = CompileLayoutPair(base, target);
+                    r->Entries = (uint32_t)((r->Blob.size() - sizeof(KBLAY_RULE_BLOB_HEADER)) / sizeof(KBLAY_RULE_ENTRY_V2));
+                }
+                catch (...)
+                {
+                    r->Blob.clear();
+                }
+                r->Micros = MicrosSince(start);
+            });
+        }
+    }
+    pool.Wait();
+    report.CompileMicros = MicrosSince(t1);
+    return report;
+}
+
+static bool WriteFileBytes(const std::wstring& path, const void* data, size_t size)
+{
+    FILE* f = nullptr;
+#ifdef _WIN32
+    if (_wfopen_s(&f, path.c_str(), L"wb") != 0)
+        f = nullptr;
+#else
+    f = std::fopen(WideToUtf8(path).c_str(), "wb");
+#endif
+    if (!f)
+        return false;
+    const bool ok = (size == 0 || std::fwrite(data, size, 1, f) == 1);
+    return (std::fclose(f) == 0) && ok;
+}
+
+bool WriteRuleBlobCache(const std::wstring& dir, const CompileAllReport& report, std::wstring& error)
+{
+    std::error_code ec;
+#ifdef _WIN32
+    std::filesystem::create_directories(std::filesystem::path(dir), ec);
+#else
+    std::filesystem::create_directories(std::filesystem::path(WideToUtf8(dir)), ec);
+#endif
+    if (ec)
+    {
+        error = L"cannot create " + dir;
+        return false;
+    }
+
+    // Blobs first, so the manifest never names a file that is not there.
+    std::wstring manifest = L"; Rule blobs written by kblayctl compile-all.\n";
+    size_t written = 0;
+    for (const LayoutPairResult& r : report.Pairs)
+    {
+        if (r.Blob.empty())
+            continue;
+
+        const std::wstring name = r.BaseKlid + L"-" + r.TargetKlid;
+        const std::wstring file = name + L".kbl";
+        if (!WriteFileBytes(JoinPath(dir, file), r.Blob.data(), r.Blob.size()))
+        {
+            error = L"cannot write " + JoinPath(dir, file);
+            return false;
+        }
+
+        wchar_t hash[16];
+        swprintf(hash, 16, L"%08X", (unsigned)KbdLayRuleBlobHash(r.Blob.data(), r.Blob.size()));
+        manifest += L"\n[" + name + L"]\n"
+            L"Base=" + r.BaseKlid + L"\n"
+            L"Target=" + r.TargetKlid + L"\n"
+            L"File=" + file + L"\n"
+            L"Entries=" + std::to_wstring(r.Entries) + L"\n"
+            L"Bytes=" + std::to_wstring(r.Blob.size()) + L"\n"
+            L"Hash=" + hash + L"\n";
+        ++written;
+    }
+    manifest += L"\n[Cache]\nVersion=" + std::to_wstring(KBLAY_RULE_CACHE_VERSION) +
+        L"\nPairs=" + std::to_wstring(written) + L"\n";
+
+    const std::string utf8 = WideToUtf8(manifest);
+    if (!WriteFileBytes(JoinPath(dir, L"manifest.ini"), utf8.data(), utf8.size()))
+    {
+        error = L"cannot write " + JoinPath(dir, L"manifest.ini");
+        return false;
+    }
+    return true;
+}
+
+static bool ParseUnsigned(const std::wstring& text, int base, uint64_t& value)
+{
+    if (text.empty())
+        return false;
+    wchar_t* end = nullptr;
+    value = std::wcstoull(text.c_str(), &end, base);
+    return end && *end == L'\0';
+}
+
+std::vector<uint8_t> ReadRuleBlobCache(const std::wstring& dir, const std::wstring& baseKlid, const std::wstring& targetKlid)
+{
+    IniParser manifest;
+    if (!manifest.Load(JoinPath(dir, L"manifest.ini")))
+        return {};
+
+    uint64_t version = 0;
+    if (!ParseUnsigned(manifest.Get(L"Cache", L"Version"), 10, version) || version != KBLAY_RULE_CACHE_VERSION)
+        return {};
+
+    const std::wstring name = baseKlid + L"-" + targetKlid;
+    const std::wstring file = manifest.Get(name, L"File");
+    uint64_t bytes = 0;
+    uint64_t entries = 0;
+    uint64_t hash = 0;
+    if (file.empty() || file.find_first_of(L"/\\") != std::wstring::npos ||
+        manifest.Get(name, L"Base") != baseKlid || manifest.Get(name, L"Target") != targetKlid ||
+        !ParseUnsigned(manifest.Get(name, L"Bytes"), 10, bytes) ||
+        !ParseUnsigned(manifest.Get(name, L"Entries"), 10, entries) ||
+        !ParseUnsigned(manifest.Get(name, L"Hash"), 16, hash))
+    {
+        return {};
+    }
+
+    MappedFile f;
+    if (!f.Open(JoinPath(dir, file)) || f.Size() != bytes || bytes < sizeof(KBLAY_RULE_BLOB_HEADER))
+        return {};
+    if (KbdLayRuleBlobHash(f.Data(), f.Size()) != hash)
+        return {};
+
+    KBLAY_RULE_BLOB_HEADER h;
+    memcpy(&h, f.Data(), sizeof(h));
+    if (h.EntryCount != entries ||
+        !KbdLayEngineValidateRuleBlob(f.Data(), f.Size(), KBLAY_MAX_RULE_ENTRIES, KBLAY_MAX_RULE_BLOB_BYTES))
+    {
+        return {};
+    }
+    return std::vector<uint8_t>(f.Data(), f.Data() + f.Size());
+}
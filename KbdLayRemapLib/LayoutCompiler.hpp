@@ -0,0 +1,149 @@
+#pragma once
+#include "../Shared/KbdLayRules.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Turns pairs of keyboard layouts into rule blobs. A layout is described by
+// the characters its keys type; the same description comes from the data
+// files in Layouts/, from the tables built into LayoutTables.cpp, or on
+// Windows from an installed layout.
+
+struct LayoutKey
+{
+    uint8_t Scan;        // set-1 make code, no prefix
+    char16_t Plain;      // 0 = no character
+    char16_t Shifted;
+};
+
+// Keys in ascending make-code order, one entry per make code.
+struct LayoutKeys
+{
+    std::wstring Klid;
+    std::vector<LayoutKey> Keys;
+};
+
+constexpr char16_t LayoutChar(const LayoutKey& k, bool shift)
+{
+    return shift ? k.Shifted : k.Plain;
+}
+
+// The base key that types what `in` is labelled with, preferring the same
+// key and shift state, then the same key, then the same shift state; the
+// first such key in make-code order wins. False if nothing needs to change.
+constexpr bool PickLayoutRule(const LayoutKey* base, size_t baseCount, const LayoutKey& in, bool inShift, KBLAY_RULE_ENTRY_V2& out)
+{
+    const char16_t want = LayoutChar(in, inShift);
+    if (!want)
+        return false;
+
+    int bestCost = 4;
+    uint8_t bestScan = in.Scan;
+    bool bestShift = inShift;
+    for (int s = 0; s <= 1 && bestCost; ++s)
+    {
+        const bool outShift = s != 0;
+        for (size_t i = 0; i < baseCount && bestCost; ++i)
+        {
+            if (LayoutChar(base[i], outShift) != want)
+                continue;
+            const int cost = (base[i].Scan == in.Scan ? 0 : 2) + (outShift == inShift ? 0 : 1);
+            if (cost < bestCost)
+            {
+                bestCost = cost;
+                bestScan = base[i].Scan;
+                bestShift = outShift;
+            }
+        }
+    }
+
+    if (bestCost == 4 || (bestScan == in.Scan && bestShift == inShift))
+        return false;
+
+    out = KBLAY_RULE_ENTRY_V2{};
+    out.InMakeCode = in.Scan;
+    out.InFlags = (UINT8)(inShift ? KBLAY_FLAG_SHIFT : 0);
+    out.OutMakeCode = bestScan;
+    out.OutFlags = (UINT8)(bestShift ? KBLAY_FLAG_SHIFT : 0);
+    return true;
+}
+
+// v2 blob that makes a keyboard labelled for `target` type its labels while
+// the system runs `base`. Unshifted rules first, each group in make-code order.
+std::vector<uint8_t> CompileLayoutPair(const LayoutKeys& base, const LayoutKeys& target);
+
+// Parses layout data in the Layouts/*.inl form: one
+//   KBLAY_LAYOUT_KEY(0x02, u'1', u'!')
+// per key, // comments allowed. Characters are u'c' (UTF-8, \\ \' \" escapes)
+// or a number, 0 for none. Keys may come in any order; duplicates are an
+// error. On failure `error` says which line.
+bool ParseLayoutData(const unsigned char* data, size_t size, std::vector<LayoutKey>& keys, std::wstring& error);
+
+// Where compile-all gets layouts from. Load is called from several threads
+// at once.
+class LayoutSource
+{
+public:
+    virtual ~LayoutSource() = default;
+    virtual bool Load(const std::wstring& klid, LayoutKeys& out) = 0;
+};
+
+// <dir>/<KLID>.inl
+class LayoutFileSource : public LayoutSource
+{
+public:
+    explicit LayoutFileSource(std::wstring dir) : dir_(std::move(dir)) {}
+    bool Load(const std::wstring& klid, LayoutKeys& out) override;
+
+private:
+    std::wstring dir_;
+};
+
+// First source that has the layout.
+class LayoutSourceChain : public LayoutSource
+{
+public:
+    void Add(LayoutSource* source) { sources_.push_back(source); }
+    bool Load(const std::wstring& klid, LayoutKeys& out) override;
+
+private:
+    std::vector<LayoutSource*> sources_;
+};
+
+struct LayoutPairResult
+{
+    std::wstring BaseKlid;
+    std::wstring TargetKlid;
+    std::vector<uint8_t> Blob;     // empty if a layout was missing
+    uint32_t Entries = 0;
+    uint64_t Micros = 0;           // compile time of this pair
+};
+
+struct CompileAllReport
+{
+    std::vector<LayoutPairResult> Pairs;     // every ordered pair, in klids order
+    std::vector<std::wstring> MissingLayouts;
+    unsigned Threads = 0;
+    uint64_t LoadMicros = 0;                 // wall time loading layouts
+    uint64_t CompileMicros = 0;              // wall time compiling pairs
+};
+
+// Loads each layout once and compiles every ordered pair of distinct
+// layouts on a work-stealing pool; threads == 0 uses every core. Repeated
+// KLIDs count once.
+CompileAllReport CompileAllLayoutPairs(LayoutSource& source, const std::vector<std::wstring>& klids, unsigned threads);
+
+// Bumped whenever PickLayoutRule or the blob layout changes, so a cache
+// written by an older compiler is not used.
+#define KBLAY_RULE_CACHE_VERSION 1u
+
+// Writes <dir>/<base>-<target>.kbl for each compiled pair, then
+// <dir>/manifest.ini listing them with sizes and KbdLayRuleBlobHash.
+bool WriteRuleBlobCache(const std::wstring& dir, const CompileAllReport& report, std::wstring& error);
+
+// The blob WriteRuleBlobCache stored for (base, target) in `dir`. Empty if
+// there is no manifest or no entry for the pair, if the cache was written
+// by another compiler version, or if the file no longer has the size and
+// hash the manifest records or would not pass the driver's validator; the
+// caller then compiles the pair itself.
+std::vector<uint8_t> ReadRuleBlobCache(const std::wstring& dir, const std::wstring& baseKlid, const std::wstring& targetKlid);
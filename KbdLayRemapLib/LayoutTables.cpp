@@ -0,0 +1,145 @@
+#include "LayoutTables.hpp"
+
+#include <array>
+#include <iterator>
+#include <cstring>
+
+// The tables below are worked out by the compiler from the layout data in
+// Layouts/ with PickLayoutRule, the choice CompileLayoutPair makes at
+// runtime, so the common pairs cost nothing to produce and need no
+// installed layouts.
+
+namespace
+{
+#define KBLAY_LAYOUT_KEY(scan, plain, shifted) { scan, plain, shifted },
+    constexpr LayoutKey kUs0409[] = {
+#include "Layouts/00000409.inl"
+    };
+    constexpr LayoutKey kJis0411[] = {
+#include "Layouts/00000411.inl"
+    };
+#undef KBLAY_LAYOUT_KEY
+
+    // Rules come out in the runtime generator's order only if the keys are
+    // in its scan order and range.
+    template <size_t N>
+    constexpr bool InScanOrder(const LayoutKey (&keys)[N])
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            if (keys[i].Scan == 0 || keys[i].Scan > 0x7F)
+                return false;
+            if (i && keys[i].Scan <= keys[i - 1].Scan)
+                return false;
+        }
+        return true;
+    }
+
+    static_assert(InScanOrder(kUs0409), "00000409.inl: make codes must ascend within 0x01..0x7F");
+    static_assert(InScanOrder(kJis0411), "00000411.inl: make codes must ascend within 0x01..0x7F");
+
+    template <size_t B, size_t T>
+    constexpr size_t CountRules(const LayoutKey (&base)[B], const LayoutKey (&target)[T])
+    {
+        size_t n = 0;
+        KBLAY_RULE_ENTRY_V2 e{};
+        for (int s = 0; s <= 1; ++s)
+            for (size_t i = 0; i < T; ++i)
+                n += PickLayoutRule(base, B, target[i], s != 0, e) ? 1 : 0;
+        return n;
+    }
+
+    template <size_t N, size_t B, size_t T>
+    constexpr std::array<KBLAY_RULE_ENTRY_V2, N> BuildRules(const LayoutKey (&base)[B], const LayoutKey (&target)[T])
+    {
+        std::array<KBLAY_RULE_ENTRY_V2, N> rules{};
+        size_t n = 0;
+        for (int s = 0; s <= 1; ++s)
+            for (size_t i = 0; i < T; ++i)
+                if (PickLayoutRule(base, B, target[i], s != 0, rules[n]))
+                    ++n;
+        return rules;
+    }
+
+    // What the driver's validator would refuse, caught at build time.
+    template <size_t N>
+    constexpr bool Valid(const std::array<KBLAY_RULE_ENTRY_V2, N>& rules)
+    {
+        for (size_t i = 0; i < N; ++i)
+        {
+            const KBLAY_RULE_ENTRY_V2& e = rules[i];
+            if (e.InMakeCode == 0 || e.OutMakeCode == 0 || e.Reserved0 || e.Reserved1)
+                return false;
+            if ((e.InFlags | e.OutFlags) & ~KBLAY_FLAG_SHIFT)
+                return false;
+            for (size_t j = 0; j < i; ++j)
+                if (rules[j].InMakeCode == e.InMakeCode && rules[j].InFlags == e.InFlags)
+                    return false;
+        }
+        return N != 0;
+    }
+
+    // JIS-labelled keyboard on a US system, and the reverse.
+    constexpr auto kJisOnUs = BuildRules<CountRules(kUs0409, kJis0411)>(kUs0409, kJis0411);
+    constexpr auto kUsOnJis = BuildRules<CountRules(kJis0411, kUs0409)>(kJis0411, kUs0409);
+    static_assert(Valid(kJisOnUs), "JIS-on-US table failed validation");
+    static_assert(Valid(kUsOnJis), "US-on-JIS table failed validation");
+
+    struct BuiltInPair
+    {
+        const wchar_t* BaseKlid;
+        const wchar_t* TargetKlid;
+        const KBLAY_RULE_ENTRY_V2* Rules;
+        size_t Count;
+    };
+
+    constexpr BuiltInPair kPairs[] = {
+        { L"00000409", L"00000411", kJisOnUs.data(), kJisOnUs.size() },
+        { L"00000411", L"00000409", kUsOnJis.data(), kUsOnJis.size() },
+    };
+
+    struct BuiltInLayout
+    {
+        const wchar_t* Klid;
+        const LayoutKey* Keys;
+        size_t Count;
+    };
+
+    constexpr BuiltInLayout kLayouts[] = {
+        { L"00000409", kUs0409, std::size(kUs0409) },
+        { L"00000411", kJis0411, std::size(kJis0411) },
+    };
+}
+
+bool BuiltInLayoutSource::Load(const std::wstring& klid, LayoutKeys& out)
+{
+    for (const BuiltInLayout& l : kLayouts)
+    {
+        if (klid != l.Klid)
+            continue;
+        out.Klid = klid;
+        out.Keys.assign(l.Keys, l.Keys + l.Count);
+        return true;
+    }
+    return false;
+}
+
+std::vector<uint8_t> BuiltInRuleBlob(const std::wstring& baseKlid, const std::wstring& targetKlid)
+{
+    for (const BuiltInPair& p : kPairs)
+    {
+        if (baseKlid != p.BaseKlid || targetKlid != p.TargetKlid)
+            continue;
+
+        KBLAY_RULE_BLOB_HEADER h{};
+        h.Version = KBLAY_RULE_BLOB_VERSION_2;
+        h.EntryCount = (UINT32)p.Count;
+        h.TotalSizeBytes = (UINT32)(sizeof(h) + p.Count * sizeof(KBLAY_RULE_ENTRY_V2));
+
+        std::vector<uint8_t> blob(h.TotalSizeBytes);
+        memcpy(blob.data(), &h, sizeof(h));
+        memcpy(blob.data() + sizeof(h), p.Rules, p.Count * sizeof(KBLAY_RULE_ENTRY_V2));
+        return blob;
+    }
+    return {};
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include "LayoutCompiler.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Rules for a layout pair this library carries built in, as a v2 blob that
+// makes a keyboard labelled for targetKlid type its labels while the system
+// runs baseKlid. Empty if the pair is not built in; BuildUsJisRuleBlob then
+// generates it from the installed layouts.
+std::vector<uint8_t> BuiltInRuleBlob(const std::wstring& baseKlid, const std::wstring& targetKlid);
+
+// The layouts the built-in tables are made from, for compile-all.
+class BuiltInLayoutSource : public LayoutSource
+{
+public:
+    bool Load(const std::wstring& klid, LayoutKeys& out) override;
+};
@@ -0,0 +1,29 @@
+// US (00000409): characters ToUnicodeEx gives for each set-1 make code
+// without and with Shift; 0 = none. Ascending make codes. Keys that give
+// the same character at the same position in every layout (letters,
+// Space, Enter, Tab, ...) are left out: they never yield a rule.
+KBLAY_LAYOUT_KEY(0x02, u'1',  u'!')
+KBLAY_LAYOUT_KEY(0x03, u'2',  u'@')
+KBLAY_LAYOUT_KEY(0x04, u'3',  u'#')
+KBLAY_LAYOUT_KEY(0x05, u'4',  u'$')
+KBLAY_LAYOUT_KEY(0x06, u'5',  u'%')
+KBLAY_LAYOUT_KEY(0x07, u'6',  u'^')
+KBLAY_LAYOUT_KEY(0x08, u'7',  u'&')
+KBLAY_LAYOUT_KEY(0x09, u'8',  u'*')
+KBLAY_LAYOUT_KEY(0x0A, u'9',  u'(')
+KBLAY_LAYOUT_KEY(0x0B, u'0',  u')')
+KBLAY_LAYOUT_KEY(0x0C, u'-',  u'_')
+KBLAY_LAYOUT_KEY(0x0D, u'=',  u'+')
+KBLAY_LAYOUT_KEY(0x1A, u'[',  u'{')
+KBLAY_LAYOUT_KEY(0x1B, u']',  u'}')
+KBLAY_LAYOUT_KEY(0x27, u';',  u':')
+KBLAY_LAYOUT_KEY(0x28, u'\'', u'"')
+KBLAY_LAYOUT_KEY(0x29, u'`',  u'~')
+KBLAY_LAYOUT_KEY(0x2B, u'\\', u'|')
+KBLAY_LAYOUT_KEY(0x33, u',',  u'<')
+KBLAY_LAYOUT_KEY(0x34, u'.',  u'>')
+KBLAY_LAYOUT_KEY(0x35, u'/',  u'?')
+KBLAY_LAYOUT_KEY(0x37, u'*',  u'*')   // keypad
+KBLAY_LAYOUT_KEY(0x4A, u'-',  u'-')   // keypad
+KBLAY_LAYOUT_KEY(0x4E, u'+',  u'+')   // keypad
+KBLAY_LAYOUT_KEY(0x56, u'\\', u'|')   // VK_OEM_102
@@ -0,0 +1,22 @@
+// Service log events: KBLAY_LOG_EVENT(Name, format). Each {} in the format
+// takes the next field of the record. Append only; the numbers are stored
+// in log files.
+KBLAY_LOG_EVENT(LogDropped,          L"{} log records dropped by a full ring.")
+KBLAY_LOG_EVENT(WorkerStarted,       L"Worker started. INI={}")
+KBLAY_LOG_EVENT(WorkerExiting,       L"Worker exiting.")
+KBLAY_LOG_EVENT(ApplyThrew,          L"ApplyOnce threw an exception.")
+KBLAY_LOG_EVENT(ApplyThrewLoop,      L"ApplyOnce threw an exception (loop).")
+KBLAY_LOG_EVENT(DispatcherFailed,    L"StartServiceCtrlDispatcher failed: error {}")
+KBLAY_LOG_EVENT(ConfigReloaded,      L"Config reloaded: {}")
+KBLAY_LOG_EVENT(ConfigBadGuids,      L"Ignored {} malformed ContainerId(s) in [Mapping].")
+KBLAY_LOG_EVENT(ConfigConflict,      L"ContainerId listed as both US and JIS, or with two targets; leaving it bypassed: {}")
+KBLAY_LOG_EVENT(PnpUnavailable,      L"PnP notifications unavailable; re-enumerating every pass.")
+KBLAY_LOG_EVENT(OpenControlFailed,   L"OpenControlDevice failed: error {}")
+KBLAY_LOG_EVENT(NoFilterDevices,     L"No filter devices found (driver not installed / interface missing).")
+KBLAY_LOG_EVENT(NullContainer,       L"Skip device with null ContainerId: {}")
+KBLAY_LOG_EVENT(NoRuleBlob,          L"No rule blob for {} -> {}; leaving device bypassed.")
+KBLAY_LOG_EVENT(Reconciled,          L"Reconcile: devices={} converged={} failed={} deferred={} ops={} convergenceMs={}")
+KBLAY_LOG_EVENT(ControlGone,         L"Control device went away; reopening next pass.")
+KBLAY_LOG_EVENT(MetricsUnavailable,  L"Metrics endpoint could not start: error {}")
+KBLAY_LOG_EVENT(RuleCacheMiss,       L"No current cached rule blob for {} -> {} in {}; compiling it.")
+KBLAY_LOG_EVENT(ConfigBadTargetKlid, L"[Options] TargetKlid is not a KLID; pairing with the base layout.")
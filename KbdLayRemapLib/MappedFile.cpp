@@ -0,0 +1,148 @@
+#include "MappedFile.hpp"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include "Utf16.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::Open(const std::wstring& path)
+{
+    Close();
+
+    // FILE_SHARE_DELETE lets editors replace the file while we hold it.
+    HANDLE f = CreateFileW(
+        path.c_str(),
+        GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+        nullptr);
+    if (f == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size{};
+    FILETIME wt{};
+    if (!GetFileSizeEx(f, &size) || !GetFileTime(f, nullptr, nullptr, &wt) ||
+        (ULONGLONG)size.QuadPart > (ULONGLONG)SIZE_MAX)
+    {
+        CloseHandle(f);
+        return false;
+    }
+
+    file_ = f;
+    size_ = (size_t)size.QuadPart;
+    writeTime_ = ((uint64_t)wt.dwHighDateTime << 32) | wt.dwLowDateTime;
+
+    // Zero-length files cannot be mapped; expose them as an empty view.
+    if (size_ == 0)
+        return true;
+
+    HANDLE s = CreateFileMappingW(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!s)
+    {
+        Close();
+        return false;
+    }
+    section_ = s;
+
+    data_ = (const unsigned char*)MapViewOfFile(s, FILE_MAP_READ, 0, 0, 0);
+    if (!data_)
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool MappedFile::Stat(const std::wstring& path, uint64_t& size, uint64_t& writeTime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA a{};
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &a))
+        return false;
+
+    size = ((uint64_t)a.nFileSizeHigh << 32) | a.nFileSizeLow;
+    writeTime = ((uint64_t)a.ftLastWriteTime.dwHighDateTime << 32) | a.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data_) UnmapViewOfFile(data_);
+    if (section_) CloseHandle((HANDLE)section_);
+    if (file_) CloseHandle((HANDLE)file_);
+    data_ = nullptr;
+    section_ = nullptr;
+    file_ = nullptr;
+    size_ = 0;
+    writeTime_ = 0;
+}
+
+#else
+
+bool MappedFile::Open(const std::wstring& path)
+{
+    Close();
+
+    int fd = open(WideToUtf8(path).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st {};
+    if (fstat(fd, &st) != 0 || st.st_size < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    fd_ = fd;
+    size_ = (size_t)st.st_size;
+    writeTime_ = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+
+    if (size_ == 0)
+        return true;
+
+    void* p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    data_ = (const unsigned char*)p;
+    return true;
+}
+
+bool MappedFile::Stat(const std::wstring& path, uint64_t& size, uint64_t& writeTime)
+{
+    struct stat st {};
+    if (stat(WideToUtf8(path).c_str(), &st) != 0 || st.st_size < 0)
+        return false;
+
+    size = (uint64_t)st.st_size;
+    writeTime = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + (uint64_t)st.st_mtim.tv_nsec;
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (data_) munmap((void*)data_, size_);
+    if (fd_ >= 0) close(fd_);
+    data_ = nullptr;
+    fd_ = -1;
+    size_ = 0;
+    writeTime_ = 0;
+}
+
+#endif
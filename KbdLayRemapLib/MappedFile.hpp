@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only view of a whole file. The mapping lives as long as the object;
+// callers may hand out pointers/views into Data() for that lifetime.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool Open(const std::wstring& path);
+    void Close();
+
+    // Size and last write time without opening a mapping.
+    static bool Stat(const std::wstring& path, uint64_t& size, uint64_t& writeTime);
+
+    const unsigned char* Data() const { return data_; }
+    size_t Size() const { return size_; }
+
+    // Last write time in platform units (FILETIME ticks on Windows, ns on POSIX).
+    uint64_t WriteTime() const { return writeTime_; }
+
+private:
+    const unsigned char* data_ = nullptr;
+    size_t size_ = 0;
+    uint64_t writeTime_ = 0;
+
+#ifdef _WIN32
+    void* file_ = nullptr;
+    void* section_ = nullptr;
+#else
+    int fd_ = -1;
+#endif
+};
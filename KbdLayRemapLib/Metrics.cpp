@@ -0,0 +1,226 @@
+#include "Metrics.hpp"
+#include "Guid.hpp"
+#include "Utf16.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+namespace
+{
+    // Appends Prometheus text; values are unsigned or seconds.
+    struct PromWriter
+    {
+        std::string& out;
+
+        void Header(const char* name, const char* type, const char* help)
+        {
+            out += "# HELP ";
+            out += name;
+            out += ' ';
+            out += help;
+            out += "\n# TYPE ";
+            out += name;
+            out += ' ';
+            out += type;
+            out += '\n';
+        }
+
+        void Value(const char* name, const char* labels, uint64_t v)
+        {
+            char line[256];
+            snprintf(line, sizeof(line), "%s%s %llu\n", name, labels, (unsigned long long)v);
+            out += line;
+        }
+
+        void Seconds(const char* name, const char* labels, uint64_t us)
+        {
+            char line[256];
+            snprintf(line, sizeof(line), "%s%s %.6f\n", name, labels, us / 1e6);
+            out += line;
+        }
+    };
+
+    const char* const kPhaseNames[] = { "config", "rules", "inventory", "reconcile", "total" };
+    static_assert(sizeof(kPhaseNames) / sizeof(kPhaseNames[0]) == (size_t)ApplyPhase::Count, "phase names out of sync");
+
+    struct DeviceCounter
+    {
+        const char* Name;
+        const char* Type;
+        const char* Help;
+        uint64_t (*Get)(const KBLAY_STATUS_OUTPUT&);
+    };
+
+    const DeviceCounter kDeviceCounters[] = {
+        { "kblay_remap_events_total", "counter", "Key events the driver remapped.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.RemapHitCount; } },
+        { "kblay_pass_events_total", "counter", "Key events passed through unchanged.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.PassThroughCount; } },
+        { "kblay_unmapped_events_total", "counter", "Key events with no rule while remapping.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.UnmappedCount; } },
+        { "kblay_shift_toggles_total", "counter", "Remaps that had to toggle Shift around the key.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.ShiftToggleCount; } },
+        { "kblay_debounce_drops_total", "counter", "Key events dropped as switch chatter.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.DebounceDropCount; } },
+        { "kblay_device_role", "gauge", "KBLAY_ROLE of the device.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.Role; } },
+        { "kblay_device_state", "gauge", "KBLAY_STATE of the device.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.State; } },
+        { "kblay_device_last_ntstatus", "gauge", "Last NTSTATUS error the device recorded.",
+            [](const KBLAY_STATUS_OUTPUT& s) -> uint64_t { return s.LastErrorNtStatus; } },
+    };
+}
+
+std::string FormatPrometheus(const ServiceMetrics& service, const std::vector<DriverSample>& devices,
+    uint64_t sampleUnixMs, uint64_t sampleFailures)
+{
+    std::string out;
+    out.reserve(2048 + devices.size() * 640);
+    PromWriter w{ out };
+
+    std::vector<std::string> labels;
+    labels.reserve(devices.size());
+    for (const auto& d : devices)
+        labels.push_back("{container=\"" + WideToUtf8(GuidToString(d.ContainerId)) + "\"}");
+
+    for (const DeviceCounter& c : kDeviceCounters)
+    {
+        w.Header(c.Name, c.Type, c.Help);
+        for (size_t i = 0; i < devices.size(); ++i)
+            w.Value(c.Name, labels[i].c_str(), c.Get(devices[i].Status));
+    }
+
+    w.Header("kblay_driver_sample_timestamp_seconds", "gauge", "When the driver counters above were read (Unix time).");
+    w.Seconds("kblay_driver_sample_timestamp_seconds", "", sampleUnixMs * 1000);
+    w.Header("kblay_driver_sample_failures_total", "counter", "Driver samples that could not list devices.");
+    w.Value("kblay_driver_sample_failures_total", "", sampleFailures);
+
+    w.Header("kblay_config_generation", "gauge", "Times the service has parsed its INI file.");
+    w.Value("kblay_config_generation", "", service.ConfigGeneration);
+
+    w.Header("kblay_apply_phase_seconds", "summary", "Time spent in each phase of a service pass.");
+    for (size_t p = 0; p < (size_t)ApplyPhase::Count; ++p)
+    {
+        char l[64];
+        snprintf(l, sizeof(l), "{phase=\"%s\"}", kPhaseNames[p]);
+        w.Seconds("kblay_apply_phase_seconds_sum", l, service.Phases[p].SumUs);
+        w.Value("kblay_apply_phase_seconds_count", l, service.Phases[p].Count);
+    }
+    w.Header("kblay_apply_phase_max_seconds", "gauge", "Longest time seen in each phase of a service pass.");
+    for (size_t p = 0; p < (size_t)ApplyPhase::Count; ++p)
+    {
+        char l[64];
+        snprintf(l, sizeof(l), "{phase=\"%s\"}", kPhaseNames[p]);
+        w.Seconds("kblay_apply_phase_max_seconds", l, service.Phases[p].MaxUs);
+    }
+
+    w.Header("kblay_reconcile_converged_total", "counter", "Devices brought to their desired state.");
+    w.Value("kblay_reconcile_converged_total", "", service.Converged);
+    w.Header("kblay_reconcile_failed_total", "counter", "Device passes that failed and backed off.");
+    w.Value("kblay_reconcile_failed_total", "", service.Failed);
+    w.Header("kblay_convergence_last_seconds", "gauge", "Latest time from a desired-state change (config or hotplug) to the driver confirming it.");
+    w.Seconds("kblay_convergence_last_seconds", "", service.LastConvergenceMs * 1000);
+    w.Header("kblay_convergence_max_seconds", "gauge", "Longest such convergence time.");
+    w.Seconds("kblay_convergence_max_seconds", "", service.MaxConvergenceMs * 1000);
+
+    w.Header("kblay_ioctl_latency_seconds", "summary", "Control-device IOCTL round trips.");
+    w.Seconds("kblay_ioctl_latency_seconds_sum", "", service.IoctlSumUs);
+    w.Value("kblay_ioctl_latency_seconds_count", "", service.IoctlCompleted);
+    w.Header("kblay_ioctl_latency_max_seconds", "gauge", "Slowest control-device IOCTL round trip.");
+    w.Seconds("kblay_ioctl_latency_max_seconds", "", service.IoctlMaxUs);
+    w.Header("kblay_ioctl_timeouts_total", "counter", "Control-device IOCTLs abandoned at their deadline.");
+    w.Value("kblay_ioctl_timeouts_total", "", service.IoctlTimedOut);
+
+    return out;
+}
+
+MetricsStore::MetricsStore()
+{
+    std::lock_guard<std::mutex> g(lock_);
+    Publish();
+}
+
+void MetricsStore::Publish()
+{
+    auto text = std::make_shared<const std::string>(FormatPrometheus(service_, devices_, sampleUnixMs_, sampleFailures_));
+    std::atomic_store(&text_, std::shared_ptr<const std::string>(std::move(text)));
+}
+
+void MetricsStore::SetService(const ServiceMetrics& m)
+{
+    std::lock_guard<std::mutex> g(lock_);
+    service_ = m;
+    Publish();
+}
+
+void MetricsStore::SetDevices(std::vector<DriverSample> devices, uint64_t unixMs, bool ok)
+{
+    std::lock_guard<std::mutex> g(lock_);
+    if (ok)
+    {
+        devices_ = std::move(devices);
+        sampleUnixMs_ = unixMs;
+    }
+    else
+    {
+        ++sampleFailures_;
+    }
+    Publish();
+}
+
+std::shared_ptr<const std::string> MetricsStore::Text() const
+{
+    return std::atomic_load(&text_);
+}
+
+void MetricsSampler::SampleOnce()
+{
+    std::vector<GUID> ids;
+    std::vector<DriverSample> devices;
+    const bool ok = source_.ListContainers(ids);
+    if (ok)
+    {
+        devices.reserve(ids.size());
+        for (const GUID& id : ids)
+        {
+            DriverSample s;
+            s.ContainerId = id;
+            if (source_.QueryStatus(id, s.Status))
+                devices.push_back(s);
+        }
+    }
+
+    const uint64_t nowMs = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    store_.SetDevices(std::move(devices), nowMs, ok);
+}
+
+void MetricsSampler::Start(uint32_t intervalMs)
+{
+    if (thread_.joinable())
+        return;
+    stop_ = false;
+    thread_ = std::thread([this, intervalMs]
+    {
+        std::unique_lock<std::mutex> l(lock_);
+        while (!stop_)
+        {
+            l.unlock();
+            SampleOnce();
+            l.lock();
+            wake_.wait_for(l, std::chrono::milliseconds(intervalMs), [this] { return stop_; });
+        }
+    });
+}
+
+void MetricsSampler::Stop()
+{
+    if (!thread_.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    thread_.join();
+}
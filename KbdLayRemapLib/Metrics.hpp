@@ -0,0 +1,142 @@
+#pragma once
+#include "StatusRates.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Service and driver metrics in Prometheus text exposition format. Whoever
+// has new numbers (the service worker, the driver sampler) hands them to a
+// MetricsStore, which renders the text once; a scrape only copies the last
+// rendering, so it never waits on the driver or on a reconcile pass.
+
+enum class ApplyPhase
+{
+    Config,      // reading / reloading the INI
+    Rules,       // building or looking up the rule blob
+    Inventory,   // current device list
+    Reconcile,   // driving devices to their desired state
+    Total,
+    Count
+};
+
+struct DurationStat
+{
+    uint64_t Count = 0;
+    uint64_t SumUs = 0;
+    uint64_t MaxUs = 0;
+
+    void Add(uint64_t us)
+    {
+        ++Count;
+        SumUs += us;
+        if (us > MaxUs) MaxUs = us;
+    }
+};
+
+struct ServiceMetrics
+{
+    uint64_t ConfigGeneration = 0;               // bumped whenever the INI is (re)parsed
+    DurationStat Phases[(size_t)ApplyPhase::Count];
+    uint64_t Converged = 0;                      // devices brought to their desired state
+    uint64_t Failed = 0;                         // device passes that failed
+    uint64_t LastConvergenceMs = 0;              // desired change -> driver confirmed
+    uint64_t MaxConvergenceMs = 0;
+    uint64_t IoctlCompleted = 0;
+    uint64_t IoctlTimedOut = 0;
+    uint64_t IoctlSumUs = 0;
+    uint64_t IoctlMaxUs = 0;
+};
+
+struct DriverSample
+{
+    GUID ContainerId{};
+    KBLAY_STATUS_OUTPUT Status{};
+};
+
+class MetricsStore
+{
+public:
+    MetricsStore();
+
+    void SetService(const ServiceMetrics& m);
+
+    // ok = false keeps the previous devices and counts a failed sample.
+    void SetDevices(std::vector<DriverSample> devices, uint64_t unixMs, bool ok);
+
+    // The last rendering; never blocks on a producer for longer than a copy.
+    std::shared_ptr<const std::string> Text() const;
+
+private:
+    void Publish();   // lock_ held
+
+    mutable std::mutex lock_;
+    ServiceMetrics service_;
+    std::vector<DriverSample> devices_;
+    uint64_t sampleUnixMs_ = 0;
+    uint64_t sampleFailures_ = 0;
+    std::shared_ptr<const std::string> text_;
+};
+
+std::string FormatPrometheus(const ServiceMetrics& service, const std::vector<DriverSample>& devices,
+    uint64_t sampleUnixMs, uint64_t sampleFailures);
+
+// Polls a StatusSource on its own thread and feeds the store.
+class MetricsSampler
+{
+public:
+    MetricsSampler(StatusSource& source, MetricsStore& store) : source_(source), store_(store) {}
+    ~MetricsSampler() { Stop(); }
+
+    MetricsSampler(const MetricsSampler&) = delete;
+    MetricsSampler& operator=(const MetricsSampler&) = delete;
+
+    void Start(uint32_t intervalMs);
+    void Stop();
+
+    // One pass, on the calling thread.
+    void SampleOnce();
+
+private:
+    StatusSource& source_;
+    MetricsStore& store_;
+    std::thread thread_;
+    std::mutex lock_;
+    std::condition_variable wake_;
+    bool stop_ = false;
+};
+
+// Serves the store's text on a local endpoint: a named pipe on Windows
+// (\\.\pipe\<name>), a Unix socket elsewhere (a path). A client that sends
+// an HTTP GET gets an HTTP/1.0 response; one that sends nothing within a
+// moment just gets the text. Only local clients can connect.
+class MetricsServer
+{
+public:
+    explicit MetricsServer(MetricsStore& store) : store_(store) {}
+    ~MetricsServer() { Stop(); }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    bool Start(const std::wstring& endpoint);
+    void Stop();
+
+private:
+    void Serve();
+    std::string Response(const char* request, size_t size) const;
+
+    MetricsStore& store_;
+    std::wstring endpoint_;
+    std::thread thread_;
+    std::atomic<bool> stop_{ false };
+#ifdef _WIN32
+    void* stopEvent_ = nullptr;
+#else
+    int listen_ = -1;
+#endif
+};
@@ -0,0 +1,214 @@
+#include "Metrics.hpp"
+#include "Utf16.hpp"
+
+#include <cstring>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// How long a client gets to send its request before it is answered anyway.
+static constexpr int kRequestWaitMs = 200;
+
+std::string MetricsServer::Response(const char* request, size_t size) const
+{
+    const std::shared_ptr<const std::string> body = store_.Text();
+    if (size < 4 || memcmp(request, "GET ", 4) != 0)
+        return *body;
+
+    std::string r = "HTTP/1.0 200 OK\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: " + std::to_string(body->size()) + "\r\n"
+        "Connection: close\r\n\r\n";
+    r += *body;
+    return r;
+}
+
+#ifdef _WIN32
+
+bool MetricsServer::Start(const std::wstring& endpoint)
+{
+    if (thread_.joinable())
+        return true;
+
+    stopEvent_ = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!stopEvent_)
+        return false;
+    endpoint_ = endpoint;
+    stop_ = false;
+    thread_ = std::thread([this] { Serve(); });
+    return true;
+}
+
+void MetricsServer::Stop()
+{
+    if (!thread_.joinable())
+        return;
+    stop_ = true;
+    SetEvent(stopEvent_);
+    thread_.join();
+    CloseHandle(stopEvent_);
+    stopEvent_ = nullptr;
+}
+
+// Waits for an overlapped operation on `pipe`; gives up (and cancels it)
+// after timeoutMs or when the server stops. Returns the bytes moved.
+static bool FinishOverlapped(HANDLE pipe, OVERLAPPED& ov, HANDLE stopEvent, DWORD timeoutMs, DWORD& bytes)
+{
+    HANDLE waits[2] = { stopEvent, ov.hEvent };
+    if (WaitForMultipleObjects(2, waits, FALSE, timeoutMs) != WAIT_OBJECT_0 + 1)
+        CancelIo(pipe);
+    bytes = 0;
+    return GetOverlappedResult(pipe, &ov, &bytes, TRUE) != FALSE;
+}
+
+void MetricsServer::Serve()
+{
+    HANDLE io = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!io)
+        return;
+
+    while (!stop_)
+    {
+        // One instance at a time; a scrape is a single cached copy.
+        HANDLE pipe = CreateNamedPipeW(
+            endpoint_.c_str(),
+            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+            1,
+            64 * 1024,
+            4096,
+            0,
+            nullptr);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            WaitForSingleObject(stopEvent_, 1000);
+            continue;
+        }
+
+        OVERLAPPED ov{};
+        ov.hEvent = io;
+        ResetEvent(io);
+        DWORD bytes = 0;
+        bool connected = ConnectNamedPipe(pipe, &ov) != FALSE;
+        if (!connected)
+        {
+            const DWORD e = GetLastError();
+            if (e == ERROR_PIPE_CONNECTED)
+                connected = true;
+            else if (e == ERROR_IO_PENDING)
+                connected = FinishOverlapped(pipe, ov, stopEvent_, INFINITE, bytes);
+        }
+        if (!connected || stop_)
+        {
+            CloseHandle(pipe);
+            continue;
+        }
+
+        char request[4096];
+        DWORD got = 0;
+        ov = OVERLAPPED{};
+        ov.hEvent = io;
+        ResetEvent(io);
+        if (!ReadFile(pipe, request, sizeof(request), &got, &ov))
+        {
+            if (GetLastError() != ERROR_IO_PENDING || !FinishOverlapped(pipe, ov, stopEvent_, kRequestWaitMs, got))
+                got = 0;
+        }
+
+        const std::string response = Response(request, got);
+        ov = OVERLAPPED{};
+        ov.hEvent = io;
+        ResetEvent(io);
+        if (!WriteFile(pipe, response.data(), (DWORD)response.size(), &bytes, &ov) && GetLastError() == ERROR_IO_PENDING)
+            FinishOverlapped(pipe, ov, stopEvent_, 2000, bytes);
+
+        // Closing (rather than disconnecting) leaves the response readable.
+        CloseHandle(pipe);
+    }
+
+    CloseHandle(io);
+}
+
+#else
+
+bool MetricsServer::Start(const std::wstring& endpoint)
+{
+    if (thread_.joinable())
+        return true;
+
+    const std::string path = WideToUtf8(endpoint);
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+        return false;
+    memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+    const int s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s < 0)
+        return false;
+    unlink(path.c_str());
+    if (bind(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || listen(s, 4) != 0)
+    {
+        close(s);
+        return false;
+    }
+
+    listen_ = s;
+    endpoint_ = endpoint;
+    stop_ = false;
+    thread_ = std::thread([this] { Serve(); });
+    return true;
+}
+
+void MetricsServer::Stop()
+{
+    if (!thread_.joinable())
+        return;
+    stop_ = true;
+    thread_.join();
+    close(listen_);
+    listen_ = -1;
+    unlink(WideToUtf8(endpoint_).c_str());
+}
+
+void MetricsServer::Serve()
+{
+    while (!stop_)
+    {
+        pollfd p{ listen_, POLLIN, 0 };
+        if (poll(&p, 1, 200) <= 0)
+            continue;
+
+        const int c = accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (c < 0)
+            continue;
+
+        // A client that stops reading cannot hold the server past this.
+        timeval sendTimeout{ 2, 0 };
+        setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+        char request[4096];
+        ssize_t got = 0;
+        pollfd q{ c, POLLIN, 0 };
+        if (poll(&q, 1, kRequestWaitMs) > 0)
+            got = recv(c, request, sizeof(request), 0);
+
+        const std::string response = Response(request, got > 0 ? (size_t)got : 0);
+        for (size_t sent = 0; sent < response.size();)
+        {
+            const ssize_t n = send(c, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += (size_t)n;
+        }
+        close(c);
+    }
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include "DeviceInventory.hpp"
+#include "..\\Shared\\Public.h"
+
+#include <cfgmgr32.h>
+#include <initguid.h>
+#include <ntddkbd.h>
+
+#pragma comment(lib, "Cfgmgr32.lib")
+
+namespace
+{
+    // Our own interface gives precise deltas. Plain keyboard interface
+    // changes only matter when enumeration had to fall back to them, so they
+    // just ask for a rescan, which the inventory defers to its next reader:
+    // nothing slow runs in the CM_Register_Notification callback.
+    class PnpNotificationBackend final : public DeviceNotificationBackend
+    {
+    public:
+        ~PnpNotificationBackend() override { Unsubscribe(); }
+
+        std::vector<FilterDeviceInfo> Enumerate() override
+        {
+            return EnumerateKbdLayFilterDevices();
+        }
+
+        bool Subscribe(Sink sink) override
+        {
+            Unsubscribe();
+            sink_ = std::move(sink);
+
+            if (!Register(GUID_DEVINTERFACE_KbdLayRemap, &filter_))
+            {
+                sink_ = nullptr;
+                return false;
+            }
+            (void)Register(GUID_DEVINTERFACE_KEYBOARD, &keyboard_);
+            return true;
+        }
+
+        void Unsubscribe() override
+        {
+            // CM_Unregister_Notification waits for in-flight callbacks.
+            if (filter_) CM_Unregister_Notification(filter_);
+            if (keyboard_) CM_Unregister_Notification(keyboard_);
+            filter_ = nullptr;
+            keyboard_ = nullptr;
+            sink_ = nullptr;
+        }
+
+    private:
+        bool Register(const GUID& cls, HCMNOTIFICATION* out)
+        {
+            CM_NOTIFY_FILTER f{};
+            f.cbSize = sizeof(f);
+            f.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+            f.u.DeviceInterface.ClassGuid = cls;
+            return CM_Register_Notification(&f, this, &PnpNotificationBackend::OnNotify, out) == CR_SUCCESS;
+        }
+
+        static DWORD CALLBACK OnNotify(
+            HCMNOTIFICATION hNotify,
+            PVOID context,
+            CM_NOTIFY_ACTION action,
+            PCM_NOTIFY_EVENT_DATA data,
+            DWORD dataSize)
+        {
+            UNREFERENCED_PARAMETER(dataSize);
+
+            auto* self = static_cast<PnpNotificationBackend*>(context);
+            if (!self->sink_ || !data || data->FilterType != CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE)
+                return ERROR_SUCCESS;
+
+            if (hNotify != self->filter_)
+            {
+                if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL || action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL)
+                {
+                    DeviceChange c;
+                    c.Action = DeviceChange::Kind::Rescan;
+                    self->sink_(c);
+                }
+                return ERROR_SUCCESS;
+            }
+
+            DeviceChange c;
+            c.Device.DevicePath = data->u.DeviceInterface.SymbolicLink;
+            if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL)
+            {
+                c.Action = DeviceChange::Kind::Arrival;
+                if (!QueryFilterDeviceInfo(c.Device.DevicePath, c.Device))
+                    c.Action = DeviceChange::Kind::Rescan;
+            }
+            else if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL)
+            {
+                c.Action = DeviceChange::Kind::Removal;
+            }
+            else
+            {
+                return ERROR_SUCCESS;
+            }
+
+            self->sink_(c);
+            return ERROR_SUCCESS;
+        }
+
+        Sink sink_;
+        HCMNOTIFICATION filter_ = nullptr;
+        HCMNOTIFICATION keyboard_ = nullptr;
+    };
+}
+
+std::unique_ptr<DeviceNotificationBackend> CreatePnpNotificationBackend()
+{
+    return std::make_unique<PnpNotificationBackend>();
+}
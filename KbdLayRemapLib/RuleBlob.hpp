@@ -1,6 +1,15 @@
 #pragma once
-#include <Windows.h>
+#include <cstdint>
 #include <vector>
 #include <string>
+#include "LayoutCompiler.hpp"
 
-std::vector<BYTE> BuildUsJisRuleBlob(const std::wstring& baseKlid, const std::wstring& targetKlid);
+// Reads a layout installed on this system through ToUnicodeEx.
+class InstalledLayoutSource : public LayoutSource
+{
+public:
+    bool Load(const std::wstring& klid, LayoutKeys& out) override;
+};
+
+// v2 blob for a pair of installed layouts; empty if either will not load.
+std::vector<uint8_t> BuildUsJisRuleBlob(const std::wstring& baseKlid, const std::wstring& targetKlid);
@@ -0,0 +1,99 @@
+#include "StatusRates.hpp"
+#include <cwchar>
+
+static uint64_t Delta(UINT64 prev, UINT64 cur, bool& reset)
+{
+    if (cur >= prev)
+        return cur - prev;
+    // Counters restart from zero when the filter device is re-created.
+    reset = true;
+    return cur;
+}
+
+DeviceRates ComputeRates(const KBLAY_STATUS_OUTPUT& prev, const KBLAY_STATUS_OUTPUT& cur, uint64_t intervalUs)
+{
+    DeviceRates r;
+    r.ContainerId = cur.ContainerId;
+    r.Role = cur.Role;
+    r.State = cur.State;
+    r.IntervalUs = intervalUs;
+    r.LastErrorNtStatus = cur.LastErrorNtStatus;
+    r.PreviousNtStatus = prev.LastErrorNtStatus;
+    r.NtStatusChanged = cur.LastErrorNtStatus != prev.LastErrorNtStatus;
+
+    bool reset = false;
+    const uint64_t remap = Delta(prev.RemapHitCount, cur.RemapHitCount, reset);
+    const uint64_t pass = Delta(prev.PassThroughCount, cur.PassThroughCount, reset);
+    const uint64_t unmapped = Delta(prev.UnmappedCount, cur.UnmappedCount, reset);
+    const uint64_t toggle = Delta(prev.ShiftToggleCount, cur.ShiftToggleCount, reset);
+    const uint64_t debounced = Delta(prev.DebounceDropCount, cur.DebounceDropCount, reset);
+
+    // The driver's own count of what it sent up covers macros and dual-role
+    // keys; without it, only shift toggles are known to add events.
+    const bool reported = prev.EventsOutCount != KBLAY_STATUS_NOT_REPORTED && cur.EventsOutCount != KBLAY_STATUS_NOT_REPORTED;
+    const uint64_t in = remap + pass + unmapped + debounced;
+    const uint64_t out = reported ? Delta(prev.EventsOutCount, cur.EventsOutCount, reset) : in - debounced + 2 * toggle;
+    r.CountersReset = reset;
+    r.Amplification = in ? (double)out / (double)in : 1.0;
+
+    if (intervalUs == 0)
+        return r;
+
+    const double perSec = 1e6 / (double)intervalUs;
+    r.RemapPerSec = (double)remap * perSec;
+    r.PassPerSec = (double)pass * perSec;
+    r.UnmappedPerSec = (double)unmapped * perSec;
+    r.ShiftTogglePerSec = (double)toggle * perSec;
+    r.DebouncePerSec = (double)debounced * perSec;
+    r.EventsInPerSec = (double)in * perSec;
+    r.EventsOutPerSec = (double)out * perSec;
+    return r;
+}
+
+bool StatusSampler::Sample(uint64_t nowUs, std::vector<DeviceRates>& out)
+{
+    out.clear();
+    ids_.clear();
+    if (!source_.ListContainers(ids_))
+        return false;
+
+    std::vector<Last> next;
+    next.reserve(ids_.size());
+
+    for (const auto& id : ids_)
+    {
+        KBLAY_STATUS_OUTPUT st{};
+        if (!source_.QueryStatus(id, st))
+            continue;
+
+        for (const auto& l : last_)
+        {
+            if (IsEqualGUID(l.ContainerId, id))
+            {
+                out.push_back(ComputeRates(l.Status, st, nowUs - l.TimeUs));
+                out.back().ContainerId = id;
+                break;
+            }
+        }
+        next.push_back({ id, st, nowUs });
+    }
+
+    last_.swap(next);
+    return true;
+}
+
+std::wstring FormatRatesJson(const DeviceRates& r, uint64_t timestampUs)
+{
+    wchar_t buf[512];
+    swprintf(buf, sizeof(buf) / sizeof(buf[0]),
+        L"{\"ts_us\":%llu,\"container\":\"%ls\",\"role\":%u,\"state\":%u,\"interval_us\":%llu,"
+        L"\"remap_ps\":%.2f,\"pass_ps\":%.2f,\"unmapped_ps\":%.2f,\"shift_toggle_ps\":%.2f,\"debounce_ps\":%.2f,"
+        L"\"in_ps\":%.2f,\"out_ps\":%.2f,\"amplification\":%.4f,"
+        L"\"last_nt\":\"0x%08X\",\"last_nt_changed\":%ls,\"reset\":%ls}",
+        (unsigned long long)timestampUs, GuidToString(r.ContainerId).c_str(),
+        r.Role, r.State, (unsigned long long)r.IntervalUs,
+        r.RemapPerSec, r.PassPerSec, r.UnmappedPerSec, r.ShiftTogglePerSec, r.DebouncePerSec,
+        r.EventsInPerSec, r.EventsOutPerSec, r.Amplification,
+        r.LastErrorNtStatus, r.NtStatusChanged ? L"true" : L"false", r.CountersReset ? L"true" : L"false");
+    return buf;
+}
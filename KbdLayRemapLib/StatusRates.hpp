@@ -0,0 +1,77 @@
+#pragma once
+#include "Guid.hpp"
+#include "../Shared/KbdLayIoctl.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Where the sampler gets driver status from: ControlDeviceStatusSource over
+// the control device in kblayctl and the service, canned counters in tests.
+class StatusSource
+{
+public:
+    virtual ~StatusSource() = default;
+
+    // ContainerIds the driver currently knows about.
+    virtual bool ListContainers(std::vector<GUID>& out) = 0;
+    virtual bool QueryStatus(const GUID& containerId, KBLAY_STATUS_OUTPUT& out) = 0;
+};
+
+// Per-second rates for one device over one sampling interval.
+struct DeviceRates
+{
+    GUID ContainerId{};
+    UINT32 Role = 0;
+    UINT32 State = 0;
+    uint64_t IntervalUs = 0;
+
+    double RemapPerSec = 0;
+    double PassPerSec = 0;
+    double UnmappedPerSec = 0;
+    double ShiftTogglePerSec = 0;
+    double DebouncePerSec = 0;
+
+    // Every input event is counted exactly once as remap, pass, unmapped or
+    // debounced. Events out is the driver's EventsOutCount; from a driver
+    // that does not report it, an estimate where a shift toggle adds two
+    // events and a debounced input none.
+    double EventsInPerSec = 0;
+    double EventsOutPerSec = 0;
+    double Amplification = 1.0; // events out per event in; 1.0 when idle
+
+    UINT32 LastErrorNtStatus = 0;
+    UINT32 PreviousNtStatus = 0;
+    bool NtStatusChanged = false;
+    bool CountersReset = false; // a counter went backwards (device re-added)
+};
+
+// Rates between two cumulative snapshots of the same device.
+DeviceRates ComputeRates(const KBLAY_STATUS_OUTPUT& prev, const KBLAY_STATUS_OUTPUT& cur, uint64_t intervalUs);
+
+// Samples every device from a StatusSource and turns consecutive snapshots
+// into rates. The first sample of a device only primes it; devices that
+// disappear are dropped.
+class StatusSampler
+{
+public:
+    explicit StatusSampler(StatusSource& source) : source_(source) {}
+
+    // `nowUs` is a monotonic timestamp. Returns false if the device list
+    // could not be read; per-device query failures just skip that device.
+    bool Sample(uint64_t nowUs, std::vector<DeviceRates>& out);
+
+private:
+    struct Last
+    {
+        GUID ContainerId;
+        KBLAY_STATUS_OUTPUT Status;
+        uint64_t TimeUs;
+    };
+
+    StatusSource& source_;
+    std::vector<Last> last_;
+    std::vector<GUID> ids_;
+};
+
+// One JSON object per line, for collectors.
+std::wstring FormatRatesJson(const DeviceRates& r, uint64_t timestampUs);
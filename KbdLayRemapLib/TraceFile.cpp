@@ -0,0 +1,231 @@
+#include "TraceFile.hpp"
+#include "MappedFile.hpp"
+#include "Utf16.hpp"
+#include "../Shared/Public.h"
+
+#include <chrono>
+#include <cstring>
+#include <memory>
+
+bool TraceWriter::Open(const std::wstring& path, const GUID& containerId, uint64_t frequency, const std::vector<uint8_t>& ruleBlob)
+{
+    Close();
+
+#ifdef _WIN32
+    if (_wfopen_s(&f_, path.c_str(), L"wb") != 0)
+        f_ = nullptr;
+#else
+    f_ = std::fopen(WideToUtf8(path).c_str(), "wb");
+#endif
+    if (!f_)
+        return false;
+
+    KBLAY_TRACE_FILE_HEADER h{};
+    memcpy(h.Magic, KBLAY_TRACE_FILE_MAGIC, sizeof(h.Magic));
+    h.Version = KBLAY_TRACE_FILE_VERSION;
+    h.RecordSize = sizeof(KBLAY_TRACE_RECORD);
+    h.Frequency = frequency;
+    h.ContainerId = containerId;
+    h.RuleBlobSize = static_cast<UINT32>(ruleBlob.size());
+
+    if (std::fwrite(&h, sizeof(h), 1, f_) != 1 ||
+        (!ruleBlob.empty() && std::fwrite(ruleBlob.data(), ruleBlob.size(), 1, f_) != 1))
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool TraceWriter::Append(const KBLAY_TRACE_RECORD* records, size_t count)
+{
+    if (!f_)
+        return false;
+    if (count == 0)
+        return true;
+    if (std::fwrite(records, sizeof(KBLAY_TRACE_RECORD), count, f_) != count)
+        return false;
+    count_ += count;
+    return std::fflush(f_) == 0;
+}
+
+void TraceWriter::Close()
+{
+    if (f_)
+    {
+        std::fclose(f_);
+        f_ = nullptr;
+    }
+}
+
+bool ReadTraceFile(const std::wstring& path, TraceCapture& out)
+{
+    MappedFile file;
+    if (!file.Open(path))
+        return false;
+
+    KBLAY_TRACE_FILE_HEADER h{};
+    if (file.Size() < sizeof(h))
+        return false;
+    memcpy(&h, file.Data(), sizeof(h));
+
+    if (memcmp(h.Magic, KBLAY_TRACE_FILE_MAGIC, sizeof(h.Magic)) != 0 ||
+        h.Version != KBLAY_TRACE_FILE_VERSION ||
+        h.RecordSize != sizeof(KBLAY_TRACE_RECORD))
+        return false;
+
+    const size_t body = file.Size() - sizeof(h);
+    if (h.RuleBlobSize > body)
+        return false;
+
+    out.ContainerId = h.ContainerId;
+    out.Frequency = h.Frequency;
+
+    const unsigned char* p = file.Data() + sizeof(h);
+    out.RuleBlob.assign(p, p + h.RuleBlobSize);
+
+    // A recording cut short may end in a partial record; ignore it.
+    const size_t n = (body - h.RuleBlobSize) / sizeof(KBLAY_TRACE_RECORD);
+    out.Records.resize(n);
+    if (n)
+        memcpy(out.Records.data(), p + h.RuleBlobSize, n * sizeof(KBLAY_TRACE_RECORD));
+    return true;
+}
+
+static bool SameOutput(const KBLAY_TRACE_RECORD& r, const KBLAY_KEY_EVENT* out, size_t n, KBLAY_ENGINE_RESULT result)
+{
+    if (n != r.OutCount || (UINT8)result != r.Result)
+        return false;
+    // Records keep only the first KBLAY_TRACE_RECORD_OUT outputs.
+    for (size_t i = 0; i < n && i < KBLAY_TRACE_RECORD_OUT; ++i)
+    {
+        if (out[i].MakeCode != r.Out[i].MakeCode || out[i].Flags != r.Out[i].Flags ||
+            out[i].UnitId != r.Out[i].UnitId || out[i].ExtraInformation != r.Out[i].ExtraInformation)
+            return false;
+    }
+    return true;
+}
+
+// The engine clock the driver derived from the same counter value.
+static uint64_t RecordMs(const KBLAY_TRACE_RECORD& r, uint64_t frequency)
+{
+    if (!frequency)
+        return 0;
+    return (r.Timestamp / frequency) * 1000 + (r.Timestamp % frequency) * 1000 / frequency;
+}
+
+// One record through the engine: an input event, or a timer tick with none.
+static size_t ReplayRecord(KBLAY_ENGINE* engine, const KBLAY_TRACE_RECORD& r, uint64_t frequency, KBLAY_KEY_EVENT* out, KBLAY_ENGINE_RESULT& result)
+{
+    const uint64_t nowMs = RecordMs(r, frequency);
+    if (r.DebounceMs != engine->Debounce.WindowMs)
+        KbdLayEngineSetDebounce(engine, r.DebounceMs, nowMs);
+    if (r.Result == KBLAY_ENGINE_TIMER)
+    {
+        result = KBLAY_ENGINE_TIMER;
+        return KbdLayEngineAdvance(engine, nowMs, out, KBLAY_ENGINE_MAX_OUTPUT);
+    }
+    return KbdLayEngineProcess(engine, r.State, r.Role, nowMs, &r.In, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+}
+
+bool ReplayTrace(const TraceCapture& capture, TraceReplayReport& report)
+{
+    report = TraceReplayReport{};
+    report.Events = capture.Records.size();
+
+    // The engine (debounce history) and the rule table are large; keep them off the stack.
+    auto engine = std::make_unique<KBLAY_ENGINE>();
+    auto table = std::make_unique<KBLAY_RULE_TABLE>();
+    KbdLayEngineInit(engine.get());
+
+    report.RulesValid = !capture.RuleBlob.empty() &&
+        KbdLayEngineValidateRuleBlob(capture.RuleBlob.data(), capture.RuleBlob.size(), KBLAY_MAX_RULE_ENTRIES, KBLAY_MAX_RULE_BLOB_BYTES);
+    if (report.RulesValid)
+    {
+        KbdLayEngineBuildRuleTable(capture.RuleBlob.data(), capture.RuleBlob.size(), table.get());
+        KbdLayEngineSetRuleTable(engine.get(), table.get());
+    }
+
+    uint64_t recordedTicks = 0;
+    KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+    KBLAY_MOD_SHARE share{};
+
+    for (size_t i = 0; i < capture.Records.size(); ++i)
+    {
+        const KBLAY_TRACE_RECORD& r = capture.Records[i];
+        recordedTicks += r.EngineTicks;
+
+        // Leave the pool before the modifier state is touched below.
+        KbdLayEngineSetModShare(engine.get(), nullptr);
+
+        const bool gap = i > 0 && r.Sequence != capture.Records[i - 1].Sequence + 1;
+        if (gap)
+            report.DroppedRecords += r.Sequence - capture.Records[i - 1].Sequence - 1;
+
+        bool mismatch = false;
+        if (i == 0)
+            KbdLayEngineResetState(engine.get(), RecordMs(r, capture.Frequency));
+        if (i == 0 || gap)
+        {
+            KbdLayEngineModsFromBits(r.Mods, &engine->Mods);
+            ++report.Resyncs;
+        }
+        else if (KbdLayEngineModsToBits(&engine->Mods) != r.Mods)
+        {
+            // Our modifier tracking diverged from the driver's; follow the driver.
+            mismatch = true;
+            KbdLayEngineModsFromBits(r.Mods, &engine->Mods);
+        }
+
+        // The driver pooled modifiers with other keyboards: stand in for
+        // them with what it saw, and join that pool with ours.
+        if (r.SharedMods & ~r.Mods)
+        {
+            share.Counts = (INT64)KbdLayModShareSpread((UINT8)(r.SharedMods & ~r.Mods));
+            KbdLayEngineSetModShare(engine.get(), &share);
+        }
+
+        KBLAY_ENGINE_RESULT result = KBLAY_ENGINE_PASS;
+        const size_t n = ReplayRecord(engine.get(), r, capture.Frequency, out, result);
+        if (!SameOutput(r, out, n, result))
+            mismatch = true;
+
+        if (mismatch)
+        {
+            ++report.Mismatches;
+            if (report.MismatchIndices.size() < 16)
+                report.MismatchIndices.push_back(i);
+        }
+    }
+
+    if (report.Events && capture.Frequency)
+        report.RecordedNsPerEvent = (double)recordedTicks * 1e9 / (double)capture.Frequency / (double)report.Events;
+
+    // Timing pass: the same stream without bookkeeping, repeated until the
+    // measurement is long enough to mean something.
+    KbdLayEngineSetModShare(engine.get(), nullptr);
+    if (report.Events)
+    {
+        using Clock = std::chrono::steady_clock;
+        const auto minDuration = std::chrono::milliseconds(20);
+        size_t processed = 0;
+        size_t sink = 0;
+        const auto start = Clock::now();
+        do
+        {
+            KbdLayEngineResetState(engine.get(), RecordMs(capture.Records[0], capture.Frequency));
+            KbdLayEngineModsFromBits(capture.Records[0].Mods, &engine->Mods);
+            for (const auto& r : capture.Records)
+            {
+                KBLAY_ENGINE_RESULT result;
+                sink += ReplayRecord(engine.get(), r, capture.Frequency, out, result);
+            }
+            processed += capture.Records.size();
+        } while (Clock::now() - start < minDuration);
+        const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        report.HostNsPerEvent = (double)elapsed / (double)processed;
+        (void)sink;
+    }
+
+    return true;
+}
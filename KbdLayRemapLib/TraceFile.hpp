@@ -0,0 +1,57 @@
+#pragma once
+#include "../Shared/KbdLayTrace.h"
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Contents of a kblayctl trace file.
+struct TraceCapture
+{
+    GUID ContainerId{};
+    uint64_t Frequency = 0;          // performance counter ticks per second
+    std::vector<uint8_t> RuleBlob;   // rules active when recording started
+    std::vector<KBLAY_TRACE_RECORD> Records;
+};
+
+// Appends drained records to a trace file.
+class TraceWriter
+{
+public:
+    TraceWriter() = default;
+    ~TraceWriter() { Close(); }
+
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    bool Open(const std::wstring& path, const GUID& containerId, uint64_t frequency, const std::vector<uint8_t>& ruleBlob);
+    bool Append(const KBLAY_TRACE_RECORD* records, size_t count);
+    void Close();
+
+    uint64_t RecordCount() const { return count_; }
+
+private:
+    std::FILE* f_ = nullptr;
+    uint64_t count_ = 0;
+};
+
+bool ReadTraceFile(const std::wstring& path, TraceCapture& out);
+
+struct TraceReplayReport
+{
+    size_t Events = 0;
+    size_t Mismatches = 0;         // output, result or modifier state differs
+    size_t Resyncs = 0;            // modifier state reloaded (start, dropped records)
+    size_t DroppedRecords = 0;     // from sequence gaps
+    std::vector<size_t> MismatchIndices; // first few, for display
+    bool RulesValid = false;
+
+    double RecordedNsPerEvent = 0; // engine time measured in the driver
+    double HostNsPerEvent = 0;     // engine time replaying here
+};
+
+// Feeds the recorded input through the portable engine with the recorded
+// rules, state and role, and compares every output with what the driver
+// produced. Modifier state is seeded from the record at the start and after
+// every gap, since the dropped events may have changed it.
+bool ReplayTrace(const TraceCapture& capture, TraceReplayReport& report);
@@ -16,3 +16,110 @@ std::wstring FileNameOnly(std::wstring fullPath)
     if (p == std::wstring::npos) return fullPath;
     return fullPath.substr(p + 1);
 }
+
+static void AppendCodePoint(std::wstring& out, char32_t cp)
+{
+    if constexpr (sizeof(wchar_t) == 2)
+    {
+        if (cp >= 0x10000)
+        {
+            cp -= 0x10000;
+            out.push_back((wchar_t)(0xD800 + (cp >> 10)));
+            out.push_back((wchar_t)(0xDC00 + (cp & 0x3FF)));
+            return;
+        }
+    }
+    out.push_back((wchar_t)cp);
+}
+
+std::wstring Utf8ToWide(std::string_view s)
+{
+    std::wstring out;
+    out.reserve(s.size());
+
+    size_t i = 0;
+    while (i < s.size())
+    {
+        const unsigned char c = (unsigned char)s[i];
+        if (c < 0x80)
+        {
+            out.push_back((wchar_t)c);
+            ++i;
+            continue;
+        }
+
+        size_t len = 0;
+        char32_t cp = 0;
+        char32_t min = 0;
+        if ((c & 0xE0) == 0xC0) { len = 2; cp = c & 0x1F; min = 0x80; }
+        else if ((c & 0xF0) == 0xE0) { len = 3; cp = c & 0x0F; min = 0x800; }
+        else if ((c & 0xF8) == 0xF0) { len = 4; cp = c & 0x07; min = 0x10000; }
+
+        bool ok = len != 0 && i + len <= s.size();
+        for (size_t k = 1; ok && k < len; ++k)
+        {
+            const unsigned char cc = (unsigned char)s[i + k];
+            if ((cc & 0xC0) != 0x80) ok = false;
+            else cp = (cp << 6) | (cc & 0x3F);
+        }
+        if (ok && (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)))
+            ok = false;
+
+        if (!ok)
+        {
+            out.push_back((wchar_t)0xFFFD);
+            ++i;
+            continue;
+        }
+
+        AppendCodePoint(out, cp);
+        i += len;
+    }
+    return out;
+}
+
+std::string WideToUtf8(std::wstring_view s)
+{
+    std::string out;
+    out.reserve(s.size());
+
+    for (size_t i = 0; i < s.size(); ++i)
+    {
+        char32_t cp = (char32_t)s[i];
+        if constexpr (sizeof(wchar_t) == 2)
+        {
+            if (cp >= 0xD800 && cp <= 0xDBFF && i + 1 < s.size() &&
+                s[i + 1] >= 0xDC00 && s[i + 1] <= 0xDFFF)
+            {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + ((char32_t)s[i + 1] - 0xDC00);
+                ++i;
+            }
+        }
+        if ((cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+            cp = 0xFFFD;
+
+        if (cp < 0x80)
+        {
+            out.push_back((char)cp);
+        }
+        else if (cp < 0x800)
+        {
+            out.push_back((char)(0xC0 | (cp >> 6)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+        else if (cp < 0x10000)
+        {
+            out.push_back((char)(0xE0 | (cp >> 12)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+        else
+        {
+            out.push_back((char)(0xF0 | (cp >> 18)));
+            out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+            out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+            out.push_back((char)(0x80 | (cp & 0x3F)));
+        }
+    }
+    return out;
+}
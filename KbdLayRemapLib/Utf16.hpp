@@ -1,6 +1,12 @@
 #pragma once
 #include <string>
+#include <string_view>
 #include <vector>
 
 std::wstring ToLowerAscii(std::wstring s);
 std::wstring FileNameOnly(std::wstring fullPath);
+
+// UTF-8 <-> wide conversion. wchar_t is UTF-16 on Windows and UTF-32 elsewhere.
+// Invalid sequences decode to U+FFFD.
+std::wstring Utf8ToWide(std::string_view s);
+std::string WideToUtf8(std::wstring_view s);
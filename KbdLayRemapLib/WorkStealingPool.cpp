@@ -0,0 +1,119 @@
+#include "WorkStealingPool.hpp"
+
+// Pool and deque of the calling worker; t_pool is null off any pool.
+static thread_local const WorkStealingPool* t_pool = nullptr;
+static thread_local unsigned t_index = 0;
+
+WorkStealingPool::WorkStealingPool(unsigned threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    queues_.reserve(threads);
+    for (unsigned i = 0; i < threads; ++i)
+        queues_.push_back(std::make_unique<Queue>());
+
+    workers_.reserve(threads);
+    for (unsigned i = 0; i < threads; ++i)
+        workers_.emplace_back([this, i] { Run(i); });
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& t : workers_)
+        t.join();
+}
+
+void WorkStealingPool::Submit(std::function<void()> task)
+{
+    unsigned target = t_index;
+    if (t_pool != this)
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        target = next_;
+        next_ = (next_ + 1) % Threads();
+    }
+
+    // Counted before it is visible, so a worker that takes and finishes it
+    // at once cannot bring pending_ to zero under a Wait.
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        ++queued_;
+        ++pending_;
+    }
+    {
+        std::lock_guard<std::mutex> g(queues_[target]->Lock);
+        queues_[target]->Tasks.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+void WorkStealingPool::Wait()
+{
+    std::unique_lock<std::mutex> l(lock_);
+    idle_.wait(l, [this] { return pending_ == 0; });
+}
+
+bool WorkStealingPool::TryTake(unsigned self, std::function<void()>& task)
+{
+    const unsigned n = Threads();
+    for (unsigned k = 0; k < n; ++k)
+    {
+        Queue& q = *queues_[(self + k) % n];
+        std::lock_guard<std::mutex> g(q.Lock);
+        if (q.Tasks.empty())
+            continue;
+        if (k == 0)
+        {
+            // Own deque: newest first, its data is most likely still cached.
+            task = std::move(q.Tasks.back());
+            q.Tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(q.Tasks.front());
+            q.Tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::Run(unsigned self)
+{
+    t_pool = this;
+    t_index = self;
+
+    for (;;)
+    {
+        std::function<void()> task;
+        if (TryTake(self, task))
+        {
+            {
+                std::lock_guard<std::mutex> g(lock_);
+                --queued_;
+            }
+            task();
+            task = nullptr;
+
+            std::lock_guard<std::mutex> g(lock_);
+            if (--pending_ == 0)
+                idle_.notify_all();
+            continue;
+        }
+
+        // queued_ may count a task whose push has not landed yet; that only
+        // means another pass.
+        std::unique_lock<std::mutex> l(lock_);
+        wake_.wait(l, [this] { return stop_ || queued_ != 0; });
+        if (stop_ && queued_ == 0)
+            return;
+    }
+}
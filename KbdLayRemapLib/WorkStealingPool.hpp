@@ -0,0 +1,55 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads, each with its own task deque. A worker runs
+// its own tasks newest first and, when it runs dry, steals the oldest task
+// from another worker, so uneven tasks still spread over every core.
+// Tasks must not throw.
+class WorkStealingPool
+{
+public:
+    // threads == 0 uses one per hardware thread.
+    explicit WorkStealingPool(unsigned threads = 0);
+    ~WorkStealingPool();
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // From a worker the task goes on that worker's deque, otherwise the
+    // deques are filled in turn.
+    void Submit(std::function<void()> task);
+
+    // Returns once every task submitted so far, and any they submitted,
+    // has finished.
+    void Wait();
+
+    unsigned Threads() const { return static_cast<unsigned>(workers_.size()); }
+
+private:
+    struct Queue
+    {
+        std::mutex Lock;
+        std::deque<std::function<void()>> Tasks;
+    };
+
+    void Run(unsigned self);
+    bool TryTake(unsigned self, std::function<void()>& task);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex lock_;
+    std::condition_variable wake_;   // queued_ became nonzero, or stop_
+    std::condition_variable idle_;   // pending_ reached zero
+    size_t queued_ = 0;              // in a deque
+    size_t pending_ = 0;             // queued or running
+    unsigned next_ = 0;              // deque for the next outside Submit
+    bool stop_ = false;
+};
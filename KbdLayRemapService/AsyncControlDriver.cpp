@@ -0,0 +1,118 @@
+#include "AsyncControlDriver.hpp"
+#include "../Shared/KbdLayIoctl.h"
+
+#include <cstring>
+
+template <class T>
+static std::vector<uint8_t> ToBytes(const T& v)
+{
+    std::vector<uint8_t> b(sizeof(T));
+    memcpy(b.data(), &v, sizeof(T));
+    return b;
+}
+
+void AsyncControlDriver::QueryState(const GUID& containerId, DriverDeviceState* out, Done done)
+{
+    if (!client_)
+    {
+        done(false);
+        return;
+    }
+
+    KBLAY_GET_STATUS_EX_INPUT in{};
+    in.ContainerId = containerId;
+
+    client_->Submit(IOCTL_KBLAY_GET_STATUS_EX, ToBytes(in), sizeof(KBLAY_STATUS_OUTPUT),
+        [out, done](const IoctlResult& r)
+        {
+            // An older driver returns only the V1 prefix; the rest stays zero.
+            if (!r.Ok || r.Output.size() < KBLAY_STATUS_OUTPUT_V1_SIZE)
+            {
+                done(false);
+                return;
+            }
+            KBLAY_STATUS_OUTPUT st{};
+            memcpy(&st, r.Output.data(), r.Output.size() < sizeof(st) ? r.Output.size() : sizeof(st));
+            out->Role = st.Role;
+            out->State = st.State;
+            out->RuleBlobHash = st.RuleBlobHash;
+            done(true);
+        });
+}
+
+void AsyncControlDriver::SetRole(const GUID& containerId, UINT32 role, Done done)
+{
+    if (!client_)
+    {
+        done(false);
+        return;
+    }
+
+    KBLAY_SET_ROLE_EX_INPUT in{};
+    in.ContainerId = containerId;
+    in.Role = role;
+    client_->Submit(IOCTL_KBLAY_SET_ROLE_EX, ToBytes(in), 0,
+        [done](const IoctlResult& r) { done(r.Ok); });
+}
+
+void AsyncControlDriver::SetState(const GUID& containerId, UINT32 state, Done done)
+{
+    if (!client_)
+    {
+        done(false);
+        return;
+    }
+
+    KBLAY_SET_STATE_EX_INPUT in{};
+    in.ContainerId = containerId;
+    in.State = state;
+    client_->Submit(IOCTL_KBLAY_SET_STATE_EX, ToBytes(in), 0,
+        [done](const IoctlResult& r) { done(r.Ok); });
+}
+
+void AsyncControlDriver::SetRuleBlob(const GUID& containerId, std::shared_ptr<const std::vector<BYTE>> blob, Done done)
+{
+    if (!client_ || !blob || blob->empty())
+    {
+        done(false);
+        return;
+    }
+
+    if (!directBlob_)
+    {
+        SetRuleBlobBuffered(containerId, *blob, std::move(done));
+        return;
+    }
+
+    // The header goes through the system buffer; every device shares the
+    // one blob buffer, which the driver reads in place.
+    KBLAY_SET_RULE_BLOB_DIRECT_INPUT in;
+    KbdLayEncodeRuleBlobDirect(&in, &containerId, blob->size());
+
+    const GUID id = containerId;
+    client_->SubmitDirect(IOCTL_KBLAY_SET_RULE_BLOB_EX_DIRECT, ToBytes(in), blob,
+        [this, id, blob, done](const IoctlResult& r)
+        {
+            if (r.Ok || r.Error != ERROR_INVALID_FUNCTION)
+            {
+                done(r.Ok);
+                return;
+            }
+            // Older driver: remember, and send this one the buffered way.
+            directBlob_ = false;
+            SetRuleBlobBuffered(id, *blob, done);
+        });
+}
+
+void AsyncControlDriver::SetRuleBlobBuffered(const GUID& containerId, const std::vector<BYTE>& blob, Done done)
+{
+    const size_t header = FIELD_OFFSET(KBLAY_SET_RULE_BLOB_EX_INPUT, Blob);
+    std::vector<uint8_t> buf(header + blob.size());
+    auto* in = reinterpret_cast<KBLAY_SET_RULE_BLOB_EX_INPUT*>(buf.data());
+    in->ContainerId = containerId;
+    in->BlobSize = static_cast<UINT32>(blob.size());
+    memcpy(buf.data() + header, blob.data(), blob.size());
+
+    client_->Submit(IOCTL_KBLAY_SET_RULE_BLOB_EX, std::move(buf), 0,
+        [done](const IoctlResult& r) { done(r.Ok); });
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <atomic>
+
+#include "AsyncIoctl.hpp"
+#include "Reconciler.hpp"
+
+// DriverControl over the control device's EX IOCTLs, issued through an
+// AsyncIoctlClient so operations on different devices overlap. Does not own
+// the client; with no client every operation fails.
+class AsyncControlDriver final : public DriverControl
+{
+public:
+    explicit AsyncControlDriver(AsyncIoctlClient* client = nullptr) : client_(client) {}
+    void SetClient(AsyncIoctlClient* client) { client_ = client; }
+
+    void QueryState(const GUID& containerId, DriverDeviceState* out, Done done) override;
+    void SetRole(const GUID& containerId, UINT32 role, Done done) override;
+    void SetState(const GUID& containerId, UINT32 state, Done done) override;
+    void SetRuleBlob(const GUID& containerId, std::shared_ptr<const std::vector<BYTE>> blob, Done done) override;
+
+private:
+    void SetRuleBlobBuffered(const GUID& containerId, const std::vector<BYTE>& blob, Done done);
+
+    AsyncIoctlClient* client_;
+    std::atomic<bool> directBlob_{ true }; // cleared if the driver lacks the direct IOCTL
+};
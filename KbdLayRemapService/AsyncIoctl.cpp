@@ -0,0 +1,180 @@
+#include "AsyncIoctl.hpp"
+
+AsyncIoctlClient::AsyncIoctlClient(std::unique_ptr<IoctlTransport> transport, uint32_t timeoutMs)
+    : transport_(std::move(transport)), timeout_(timeoutMs)
+{
+    pump_ = std::thread([this] { Pump(); });
+}
+
+AsyncIoctlClient::~AsyncIoctlClient()
+{
+    std::vector<uint64_t> tags;
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        stopping_ = true;
+        for (const auto& p : pending_)
+            tags.push_back(p.first);
+    }
+    for (uint64_t t : tags)
+        transport_->Cancel(t);
+    transport_->Wake();
+    pump_.join();
+}
+
+void AsyncIoctlClient::Submit(uint32_t code, std::vector<uint8_t> in, uint32_t outCb, Callback cb)
+{
+    auto p = std::make_unique<Pending>();
+    p->In = std::move(in);
+    p->Out.resize(outCb);
+    p->Cb = std::move(cb);
+
+    void* out = p->Out.empty() ? nullptr : p->Out.data();
+    Start(std::move(p), code, out, outCb);
+}
+
+void AsyncIoctlClient::SubmitDirect(uint32_t code, std::vector<uint8_t> in, std::shared_ptr<const std::vector<uint8_t>> data, Callback cb)
+{
+    auto p = std::make_unique<Pending>();
+    p->In = std::move(in);
+    p->Data = std::move(data);
+    p->Cb = std::move(cb);
+
+    // The driver only reads it (METHOD_IN_DIRECT), whatever the parameter's type says.
+    void* out = (p->Data && !p->Data->empty()) ? const_cast<uint8_t*>(p->Data->data()) : nullptr;
+    const uint32_t outCb = out ? (uint32_t)p->Data->size() : 0;
+    Start(std::move(p), code, out, outCb);
+}
+
+void AsyncIoctlClient::Start(std::unique_ptr<Pending> p, uint32_t code, void* out, uint32_t outCb)
+{
+    p->Started = Clock::now();
+    p->Deadline = p->Started + timeout_;
+
+    Pending* raw = p.get();
+    uint64_t tag = 0;
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        if (!stopping_)
+        {
+            tag = nextTag_++;
+            pending_.emplace(tag, std::move(p));
+        }
+    }
+
+    uint32_t error = 0;
+    if (tag != 0 &&
+        transport_->Submit(tag, code, raw->In.data(), (uint32_t)raw->In.size(), out, outCb, error))
+        return;
+
+    // Not accepted: no completion will come, so finish it here.
+    Callback done;
+    if (tag != 0)
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        auto it = pending_.find(tag);
+        done = std::move(it->second->Cb);
+        pending_.erase(it);
+    }
+    else
+    {
+        done = std::move(p->Cb);
+    }
+
+    if (error) lastError_ = error;
+    IoctlResult r;
+    r.Error = error;
+    if (done) done(r);
+}
+
+IoctlLatency AsyncIoctlClient::Latency() const
+{
+    IoctlLatency l;
+    l.Completed = completed_.load(std::memory_order_relaxed);
+    l.TimedOut = timedOut_.load(std::memory_order_relaxed);
+    l.SumUs = sumUs_.load(std::memory_order_relaxed);
+    l.MaxUs = maxUs_.load(std::memory_order_relaxed);
+    return l;
+}
+
+std::future<IoctlResult> AsyncIoctlClient::Submit(uint32_t code, std::vector<uint8_t> in, uint32_t outCb)
+{
+    auto promise = std::make_shared<std::promise<IoctlResult>>();
+    auto f = promise->get_future();
+    Submit(code, std::move(in), outCb, [promise](const IoctlResult& r) { promise->set_value(r); });
+    return f;
+}
+
+void AsyncIoctlClient::Pump()
+{
+    for (;;)
+    {
+        // Fire callbacks for anything past its deadline, then wait until the
+        // next deadline (bounded so shutdown is noticed).
+        std::vector<std::pair<uint64_t, Callback>> expired;
+        Clock::time_point next = Clock::now() + std::chrono::milliseconds(250);
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            if (stopping_ && pending_.empty())
+                return;
+
+            const auto now = Clock::now();
+            for (auto& kv : pending_)
+            {
+                Pending& p = *kv.second;
+                if (p.Abandoned)
+                    continue;
+                if (p.Deadline <= now)
+                {
+                    p.Abandoned = true;
+                    expired.emplace_back(kv.first, std::move(p.Cb));
+                }
+                else if (p.Deadline < next)
+                {
+                    next = p.Deadline;
+                }
+            }
+        }
+
+        if (!expired.empty())
+            timedOut_.fetch_add(expired.size(), std::memory_order_relaxed);
+        for (auto& e : expired)
+        {
+            transport_->Cancel(e.first);
+            IoctlResult r;
+            r.TimedOut = true;
+            if (e.second) e.second(r);
+        }
+
+        const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now());
+        IoctlCompletion c;
+        if (!transport_->Dequeue(c, wait.count() > 0 ? (uint32_t)wait.count() : 0))
+            continue;
+
+        std::unique_ptr<Pending> p;
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            auto it = pending_.find(c.Tag);
+            if (it == pending_.end())
+                continue;
+            p = std::move(it->second);
+            pending_.erase(it);
+        }
+
+        if (!c.Ok && c.Error) lastError_ = c.Error;
+        if (p->Abandoned)
+            continue; // caller already got TimedOut; buffers can go now
+
+        const uint64_t us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - p->Started).count();
+        completed_.fetch_add(1, std::memory_order_relaxed);
+        sumUs_.fetch_add(us, std::memory_order_relaxed);
+        if (us > maxUs_.load(std::memory_order_relaxed))
+            maxUs_.store(us, std::memory_order_relaxed);
+
+        IoctlResult r;
+        r.Ok = c.Ok;
+        r.Error = c.Error;
+        if (c.Ok)
+            r.Output.assign(p->Out.begin(), p->Out.begin() + (c.BytesReturned < p->Out.size() ? c.BytesReturned : p->Out.size()));
+        if (p->Cb) p->Cb(r);
+    }
+}
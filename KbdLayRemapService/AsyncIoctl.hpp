@@ -0,0 +1,124 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct IoctlCompletion
+{
+    uint64_t Tag = 0;
+    bool Ok = false;
+    uint32_t Error = 0;         // platform error code when !Ok
+    uint32_t BytesReturned = 0;
+};
+
+// Submission/completion queue over one device handle. Submit never blocks on
+// the device; every accepted request yields exactly one completion.
+class IoctlTransport
+{
+public:
+    virtual ~IoctlTransport() = default;
+
+    // Buffers must stay valid until the completion for `tag` is dequeued.
+    virtual bool Submit(uint64_t tag, uint32_t code, const void* in, uint32_t inCb, void* out, uint32_t outCb, uint32_t& error) = 0;
+
+    // Waits up to timeoutMs for one completion. Returns false on timeout or Wake().
+    virtual bool Dequeue(IoctlCompletion& c, uint32_t timeoutMs) = 0;
+
+    // Asks the device to abandon `tag`; its completion still arrives (usually !Ok).
+    virtual void Cancel(uint64_t tag) = 0;
+
+    // Makes a blocked Dequeue return false promptly.
+    virtual void Wake() = 0;
+};
+
+struct IoctlResult
+{
+    bool Ok = false;
+    bool TimedOut = false;
+    uint32_t Error = 0;
+    std::vector<uint8_t> Output; // BytesReturned bytes
+};
+
+// Totals since the client was created. Completed counts requests the device
+// answered in time; TimedOut those whose deadline passed first.
+struct IoctlLatency
+{
+    uint64_t Completed = 0;
+    uint64_t TimedOut = 0;
+    uint64_t SumUs = 0;
+    uint64_t MaxUs = 0;
+};
+
+// Runs requests concurrently over an IoctlTransport and completes them from a
+// single pump thread. Each request has a deadline; when it passes, the
+// callback fires with TimedOut=true and the request is cancelled, so one
+// wedged device cannot hold up the others.
+class AsyncIoctlClient
+{
+public:
+    using Callback = std::function<void(const IoctlResult&)>;
+
+    AsyncIoctlClient(std::unique_ptr<IoctlTransport> transport, uint32_t timeoutMs);
+    ~AsyncIoctlClient();
+
+    AsyncIoctlClient(const AsyncIoctlClient&) = delete;
+    AsyncIoctlClient& operator=(const AsyncIoctlClient&) = delete;
+
+    // `cb` runs on the pump thread, or inline if the submit itself fails.
+    void Submit(uint32_t code, std::vector<uint8_t> in, uint32_t outCb, Callback cb);
+    std::future<IoctlResult> Submit(uint32_t code, std::vector<uint8_t> in, uint32_t outCb);
+
+    // For METHOD_IN_DIRECT codes: `data` is passed as the output buffer and
+    // read by the driver in place. It is held until the request completes
+    // (or its deadline passes and the cancelled request drains), so callers
+    // can share one buffer across requests. Result.Output is empty.
+    void SubmitDirect(uint32_t code, std::vector<uint8_t> in, std::shared_ptr<const std::vector<uint8_t>> data, Callback cb);
+
+    // Last error seen by any request (0 if none yet); lets the owner detect a dead handle.
+    uint32_t LastError() const { return lastError_; }
+
+    // Submit-to-completion times; safe to call from any thread.
+    IoctlLatency Latency() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Pending
+    {
+        std::vector<uint8_t> In;
+        std::vector<uint8_t> Out;
+        std::shared_ptr<const std::vector<uint8_t>> Data; // direct-I/O buffer
+        Callback Cb;
+        Clock::time_point Started;
+        Clock::time_point Deadline;
+        bool Abandoned = false; // callback already fired on timeout
+    };
+
+    void Start(std::unique_ptr<Pending> p, uint32_t code, void* out, uint32_t outCb);
+    void Pump();
+
+    std::unique_ptr<IoctlTransport> transport_;
+    const std::chrono::milliseconds timeout_;
+
+    std::mutex lock_;
+    std::unordered_map<uint64_t, std::unique_ptr<Pending>> pending_;
+    uint64_t nextTag_ = 1;
+    bool stopping_ = false;
+    std::atomic<uint32_t> lastError_{ 0 };
+
+    // Written only by the pump thread.
+    std::atomic<uint64_t> completed_{ 0 };
+    std::atomic<uint64_t> timedOut_{ 0 };
+    std::atomic<uint64_t> sumUs_{ 0 };
+    std::atomic<uint64_t> maxUs_{ 0 };
+
+    std::thread pump_;
+};
@@ -1,6 +1,8 @@
 #include "DriverClient.hpp"
 #include "..\\Shared\\Public.h"
 #include <cstddef>
+#include <mutex>
+#include <unordered_map>
 
 static bool Ioctl(HANDLE h, DWORD code, const void* inBuf, DWORD inCb)
 {
@@ -8,16 +10,17 @@ static bool Ioctl(HANDLE h, DWORD code, const void* inBuf, DWORD inCb)
     return !!DeviceIoControl(h, code, (void*)inBuf, inCb, nullptr, 0, &ret, nullptr);
 }
 
-HANDLE OpenControlDevice(DWORD desiredAccess)
+// METHOD_IN_DIRECT: `data` goes down as the output buffer and is read in place.
+static bool IoctlDirect(HANDLE h, DWORD code, const void* inBuf, DWORD inCb, const void* data, DWORD dataCb)
 {
-    return CreateFileW(
-        KBLAY_CONTROL_DEVICE_DOS_NAME,
-        desiredAccess,
-        FILE_SHARE_READ | FILE_SHARE_WRITE,
-        nullptr,
-        OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
-        nullptr);
+    DWORD ret = 0;
+    return !!DeviceIoControl(h, code, (void*)inBuf, inCb, (void*)data, dataCb, &ret, nullptr);
+}
+
+// A driver without the direct IOCTLs fails them as unknown requests.
+static bool IsUnknownIoctl()
+{
+    return GetLastError() == ERROR_INVALID_FUNCTION;
 }
 
 bool DeviceIoctlSetRole(HANDLE h, UINT32 role)
@@ -34,10 +37,17 @@ bool DeviceIoctlSetState(HANDLE h, UINT32 state)
     return Ioctl(h, IOCTL_KBLAY_SET_STATE, &in, sizeof(in));
 }
 
+bool DeviceIoctlSetRuleBlob(HANDLE h, const void* blob, size_t size)
+{
+    if (!blob || size == 0 || size > KBLAY_MAX_RULE_BLOB_BYTES) return false;
+    if (IoctlDirect(h, IOCTL_KBLAY_SET_RULE_BLOB_DIRECT, nullptr, 0, blob, (DWORD)size))
+        return true;
+    return IsUnknownIoctl() && Ioctl(h, IOCTL_KBLAY_SET_RULE_BLOB, blob, (DWORD)size);
+}
+
 bool DeviceIoctlSetRuleBlob(HANDLE h, const std::vector<BYTE>& blob)
 {
-    if (blob.empty()) return false;
-    return Ioctl(h, IOCTL_KBLAY_SET_RULE_BLOB, blob.data(), (DWORD)blob.size());
+    return DeviceIoctlSetRuleBlob(h, blob.data(), blob.size());
 }
 
 bool DeviceIoctlSetRoleEx(HANDLE h, const GUID& containerId, UINT32 role)
@@ -56,18 +66,148 @@ bool DeviceIoctlSetStateEx(HANDLE h, const GUID& containerId, UINT32 state)
     return Ioctl(h, IOCTL_KBLAY_SET_STATE_EX, &in, sizeof(in));
 }
 
-bool DeviceIoctlSetRuleBlobEx(HANDLE h, const GUID& containerId, const std::vector<BYTE>& blob)
+bool DeviceIoctlSetRuleBlobEx(HANDLE h, const GUID& containerId, const void* blob, size_t size)
 {
-    if (blob.empty()) return false;
+    if (!blob || size == 0 || size > KBLAY_MAX_RULE_BLOB_BYTES) return false;
 
-    const size_t header = offsetof(KBLAY_SET_RULE_BLOB_EX_INPUT, Blob);
-    const size_t total = header + blob.size();
+    // Header and blob go down as separate buffers; nothing is concatenated.
+    KBLAY_SET_RULE_BLOB_DIRECT_INPUT in;
+    KbdLayEncodeRuleBlobDirect(&in, &containerId, size);
+    if (IoctlDirect(h, IOCTL_KBLAY_SET_RULE_BLOB_EX_DIRECT, &in, sizeof(in), blob, static_cast<DWORD>(size)))
+        return true;
+    if (!IsUnknownIoctl())
+        return false;
 
-    std::vector<BYTE> buf(total);
-    auto* in = reinterpret_cast<KBLAY_SET_RULE_BLOB_EX_INPUT*>(buf.data());
-    in->ContainerId = containerId;
-    in->BlobSize = static_cast<UINT32>(blob.size());
-    memcpy(in->Blob, blob.data(), blob.size());
+    const size_t header = offsetof(KBLAY_SET_RULE_BLOB_EX_INPUT, Blob);
+    std::vector<BYTE> buf(header + size);
+    auto* ex = reinterpret_cast<KBLAY_SET_RULE_BLOB_EX_INPUT*>(buf.data());
+    ex->ContainerId = containerId;
+    ex->BlobSize = static_cast<UINT32>(size);
+    memcpy(ex->Blob, blob, size);
 
     return Ioctl(h, IOCTL_KBLAY_SET_RULE_BLOB_EX, buf.data(), static_cast<DWORD>(buf.size()));
 }
+
+bool DeviceIoctlSetRuleBlobEx(HANDLE h, const GUID& containerId, const std::vector<BYTE>& blob)
+{
+    return DeviceIoctlSetRuleBlobEx(h, containerId, blob.data(), blob.size());
+}
+
+namespace
+{
+    struct OverlappedRequest
+    {
+        OVERLAPPED Ov{};
+        uint64_t Tag = 0;
+    };
+
+    class OverlappedIoctlTransport final : public IoctlTransport
+    {
+    public:
+        OverlappedIoctlTransport(HANDLE h, HANDLE port) : h_(h), port_(port) {}
+
+        ~OverlappedIoctlTransport() override
+        {
+            // Closing the handle cancels anything still queued; drain the port
+            // so no OVERLAPPED is freed while the kernel still owns it.
+            CancelIoEx(h_, nullptr);
+            for (;;)
+            {
+                {
+                    std::lock_guard<std::mutex> g(lock_);
+                    if (inFlight_.empty()) break;
+                }
+                IoctlCompletion c;
+                if (!Dequeue(c, 1000)) break;
+            }
+            CloseHandle(h_);
+            CloseHandle(port_);
+        }
+
+        bool Submit(uint64_t tag, uint32_t code, const void* in, uint32_t inCb, void* out, uint32_t outCb, uint32_t& error) override
+        {
+            auto req = std::make_unique<OverlappedRequest>();
+            req->Tag = tag;
+            OverlappedRequest* raw = req.get();
+            {
+                std::lock_guard<std::mutex> g(lock_);
+                inFlight_.emplace(tag, std::move(req));
+            }
+
+            // Without FILE_SKIP_COMPLETION_PORT_ON_SUCCESS, both immediate
+            // success and ERROR_IO_PENDING post a packet to the port.
+            if (DeviceIoControl(h_, code, const_cast<void*>(in), inCb, out, outCb, nullptr, &raw->Ov) ||
+                GetLastError() == ERROR_IO_PENDING)
+                return true;
+
+            error = GetLastError();
+            std::lock_guard<std::mutex> g(lock_);
+            inFlight_.erase(tag);
+            return false;
+        }
+
+        bool Dequeue(IoctlCompletion& c, uint32_t timeoutMs) override
+        {
+            DWORD bytes = 0;
+            ULONG_PTR key = 0;
+            OVERLAPPED* ov = nullptr;
+            const BOOL ok = GetQueuedCompletionStatus(port_, &bytes, &key, &ov, timeoutMs);
+            if (!ov)
+                return false; // timeout or Wake()
+
+            auto* req = CONTAINING_RECORD(ov, OverlappedRequest, Ov);
+            c.Tag = req->Tag;
+            c.Ok = !!ok;
+            c.Error = ok ? 0 : GetLastError();
+            c.BytesReturned = bytes;
+
+            std::lock_guard<std::mutex> g(lock_);
+            inFlight_.erase(c.Tag);
+            return true;
+        }
+
+        void Cancel(uint64_t tag) override
+        {
+            std::lock_guard<std::mutex> g(lock_);
+            auto it = inFlight_.find(tag);
+            if (it != inFlight_.end())
+                CancelIoEx(h_, &it->second->Ov);
+        }
+
+        void Wake() override
+        {
+            PostQueuedCompletionStatus(port_, 0, 0, nullptr);
+        }
+
+    private:
+        HANDLE h_;
+        HANDLE port_;
+        std::mutex lock_;
+        std::unordered_map<uint64_t, std::unique_ptr<OverlappedRequest>> inFlight_;
+    };
+}
+
+std::unique_ptr<IoctlTransport> OpenControlDeviceTransport()
+{
+    HANDLE h = CreateFileW(
+        KBLAY_CONTROL_DEVICE_DOS_NAME,
+        GENERIC_READ | GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED,
+        nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+    HANDLE port = CreateIoCompletionPort(h, nullptr, 0, 1);
+    if (!port)
+    {
+        DWORD e = GetLastError();
+        CloseHandle(h);
+        SetLastError(e);
+        return nullptr;
+    }
+
+    return std::make_unique<OverlappedIoctlTransport>(h, port);
+}
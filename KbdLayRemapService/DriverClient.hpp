@@ -1,14 +1,27 @@
 #pragma once
 #include <Windows.h>
+#include <memory>
 #include <vector>
 #include <string>
 
-HANDLE OpenControlDevice(DWORD desiredAccess);
+#include "AsyncIoctl.hpp"
+#include "..\\Shared\\KbdLayIoctl.h"
+#include "..\\KbdLayRemapLib\\ControlDevice.hpp"
 
 bool DeviceIoctlSetRole(HANDLE h, UINT32 role);
 bool DeviceIoctlSetState(HANDLE h, UINT32 state);
+// The rule blob setters use the direct-I/O IOCTLs, so the blob is read from
+// the caller's buffer in place; against a driver without them they fall
+// back to the buffered ones.
 bool DeviceIoctlSetRuleBlob(HANDLE h, const std::vector<BYTE>& blob);
+bool DeviceIoctlSetRuleBlob(HANDLE h, const void* blob, size_t size);
 
 bool DeviceIoctlSetRoleEx(HANDLE h, const GUID& containerId, UINT32 role);
 bool DeviceIoctlSetStateEx(HANDLE h, const GUID& containerId, UINT32 state);
 bool DeviceIoctlSetRuleBlobEx(HANDLE h, const GUID& containerId, const std::vector<BYTE>& blob);
+bool DeviceIoctlSetRuleBlobEx(HANDLE h, const GUID& containerId, const void* blob, size_t size);
+
+// Opens the control device for overlapped I/O and returns a transport whose
+// completions arrive on a private I/O completion port. Meant to be kept open
+// for the life of the service; returns null (and sets GetLastError) on failure.
+std::unique_ptr<IoctlTransport> OpenControlDeviceTransport();
@@ -0,0 +1,256 @@
+#include "Reconciler.hpp"
+#include "../Shared/KbdLayIoctl.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+// Counts device chains down to zero; Reconcile waits on it.
+class Reconciler::Barrier
+{
+public:
+    explicit Barrier(size_t count) : count_(count) {}
+
+    void Arrive()
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        if (--count_ == 0)
+            cv_.notify_all();
+    }
+
+    void Wait()
+    {
+        std::unique_lock<std::mutex> g(lock_);
+        cv_.wait(g, [this] { return count_ == 0; });
+    }
+
+private:
+    std::mutex lock_;
+    std::condition_variable cv_;
+    size_t count_;
+};
+
+Reconciler::Reconciler(DriverControl& driver, uint64_t baseRetryMs, uint64_t maxRetryMs, Clock clock)
+    : driver_(driver), clock_(std::move(clock)), baseRetryMs_(baseRetryMs), maxRetryMs_(maxRetryMs)
+{
+    if (!clock_)
+    {
+        clock_ = []
+        {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        };
+    }
+}
+
+void Reconciler::Track(const DesiredDeviceState& d, UINT32 blobHash, uint64_t nowMs, std::vector<Tracked>& next)
+{
+    Tracked t;
+    bool known = false;
+    for (const auto& x : tracked_)
+    {
+        if (IsEqualGUID(x.ContainerId, d.ContainerId))
+        {
+            t = x;
+            known = true;
+            break;
+        }
+    }
+
+    if (!known || t.Role != d.Role || t.State != d.State || t.BlobHash != blobHash)
+    {
+        t.ContainerId = d.ContainerId;
+        t.Role = d.Role;
+        t.State = d.State;
+        t.BlobHash = blobHash;
+        t.DesiredGeneration++;
+        t.DesiredSinceMs = nowMs;
+        // New intent: don't make it wait out a backoff earned by the old one.
+        t.Failures = 0;
+        t.RetryAtMs = 0;
+    }
+
+    next.push_back(t);
+}
+
+void Reconciler::Plan(Job& job)
+{
+    const DesiredDeviceState& d = *job.Desired;
+    const DriverDeviceState& cur = job.Current;
+
+    const bool needBlob = d.Role == KBLAY_ROLE_REMAP && cur.RuleBlobHash != job.BlobHash;
+    const bool needRole = cur.Role != d.Role;
+    const bool needState = cur.State != d.State;
+
+    job.InSync = !needBlob && !needRole && !needState;
+    if (job.InSync)
+        return;
+
+    if (needBlob)
+        job.Ops.push_back({ OpKind::Blob, 0 });
+
+    // Leave ACTIVE before changing role; enter it only after role and rules are in place.
+    const bool stateFirst = d.State != KBLAY_STATE_ACTIVE;
+    if (needState && stateFirst)
+        job.Ops.push_back({ OpKind::State, d.State });
+    if (needRole)
+        job.Ops.push_back({ OpKind::Role, d.Role });
+    if (needState && !stateFirst)
+        job.Ops.push_back({ OpKind::State, d.State });
+}
+
+void Reconciler::RunNext(Job& job, Barrier& barrier)
+{
+    if (job.Step == job.Ops.size())
+    {
+        job.Ok = true;
+        barrier.Arrive();
+        return;
+    }
+
+    const Op op = job.Ops[job.Step++];
+    const GUID& id = job.Desired->ContainerId;
+    ++job.Issued;
+
+    auto next = [this, &job, &barrier](bool ok)
+    {
+        if (ok)
+            RunNext(job, barrier);
+        else
+            FallBackToBypass(job, barrier);
+    };
+
+    switch (op.Kind)
+    {
+    case OpKind::Blob:
+        if (!job.Desired->Blob || job.Desired->Blob->empty())
+        {
+            FallBackToBypass(job, barrier);
+            return;
+        }
+        driver_.SetRuleBlob(id, job.Desired->Blob, next);
+        break;
+    case OpKind::Role:
+        driver_.SetRole(id, op.Value, next);
+        break;
+    case OpKind::State:
+        driver_.SetState(id, op.Value, next);
+        break;
+    }
+}
+
+void Reconciler::FallBackToBypass(Job& job, Barrier& barrier)
+{
+    // Best-effort fallback to safe state
+    job.Ok = false;
+    job.Issued += 2;
+    const GUID id = job.Desired->ContainerId;
+    driver_.SetState(id, KBLAY_STATE_BYPASS_HARD, [this, id, &barrier](bool)
+    {
+        driver_.SetRole(id, KBLAY_ROLE_NONE, [&barrier](bool) { barrier.Arrive(); });
+    });
+}
+
+ReconcileStats Reconciler::Reconcile(const std::vector<DesiredDeviceState>& desired, uint64_t nowMs)
+{
+    ReconcileStats stats;
+    stats.Devices = desired.size();
+
+    // Devices that left the desired set are forgotten with this swap.
+    std::vector<Tracked> next;
+    next.reserve(desired.size());
+
+    std::vector<Job> jobs;
+    jobs.reserve(desired.size());
+
+    for (const auto& d : desired)
+    {
+        const UINT32 blobHash = (d.Role == KBLAY_ROLE_REMAP && d.Blob && !d.Blob->empty())
+            ? KbdLayRuleBlobHash(d.Blob->data(), d.Blob->size())
+            : 0;
+        Track(d, blobHash, nowMs, next);
+
+        if (next.back().RetryAtMs > nowMs)
+        {
+            ++stats.Deferred;
+            continue;
+        }
+
+        Job job;
+        job.Desired = &d;
+        job.TrackedIndex = next.size() - 1;
+        job.BlobHash = blobHash;
+        jobs.push_back(std::move(job));
+    }
+
+    // Start every chain, then wait for all of them. `jobs` is not resized
+    // from here on, so the callbacks can hold references into it.
+    Barrier barrier(jobs.size() + 1);
+    for (auto& job : jobs)
+    {
+        driver_.QueryState(job.Desired->ContainerId, &job.Current, [this, &job, &barrier](bool ok)
+        {
+            if (!ok)
+            {
+                FallBackToBypass(job, barrier);
+                return;
+            }
+            job.Queried = true;
+            Plan(job);
+            RunNext(job, barrier);
+        });
+    }
+    barrier.Arrive();
+    barrier.Wait();
+
+    // Convergence ends when the driver confirmed it, not when the pass began.
+    const uint64_t doneMs = clock_();
+
+    for (const auto& job : jobs)
+    {
+        Tracked& t = next[job.TrackedIndex];
+        stats.Operations += job.Issued;
+
+        if (job.Ok && job.InSync)
+        {
+            ++stats.InSync;
+            if (t.AppliedGeneration != t.DesiredGeneration)
+            {
+                // Someone (or an earlier partial pass) already got it there.
+                t.AppliedGeneration = t.DesiredGeneration;
+                t.Failures = 0;
+            }
+            continue;
+        }
+
+        if (job.Queried && t.AppliedGeneration == t.DesiredGeneration)
+        {
+            // Driver drifted from a state we had applied (e.g. device re-added).
+            t.DesiredGeneration++;
+            t.DesiredSinceMs = nowMs;
+        }
+
+        if (!job.Ok)
+        {
+            ++stats.Failed;
+            const uint32_t shift = t.Failures < 20 ? t.Failures : 20;
+            uint64_t delay = baseRetryMs_ << shift;
+            if (delay > maxRetryMs_) delay = maxRetryMs_;
+            t.Failures++;
+            t.RetryAtMs = nowMs + delay;
+            continue;
+        }
+
+        ++stats.Converged;
+        t.AppliedGeneration = t.DesiredGeneration;
+        t.Failures = 0;
+        t.RetryAtMs = 0;
+
+        const uint64_t latency = doneMs > t.DesiredSinceMs ? doneMs - t.DesiredSinceMs : 0;
+        stats.LastConvergenceMs = latency;
+        if (latency > stats.MaxConvergenceMs) stats.MaxConvergenceMs = latency;
+    }
+
+    tracked_.swap(next);
+    return stats;
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include "../KbdLayRemapLib/Guid.hpp"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// What the driver currently reports for one ContainerId.
+struct DriverDeviceState
+{
+    UINT32 Role = 0;
+    UINT32 State = 0;
+    UINT32 RuleBlobHash = 0;
+};
+
+// The driver operations the reconciler needs. The service implements this
+// over the control device; tests can substitute an in-memory driver.
+//
+// Operations are asynchronous: `done` runs exactly once, either inline or on
+// another thread, and must not be assumed to run on the caller's thread.
+// For QueryState, `out` must stay valid until `done` runs.
+class DriverControl
+{
+public:
+    using Done = std::function<void(bool ok)>;
+
+    virtual ~DriverControl() = default;
+
+    virtual void QueryState(const GUID& containerId, DriverDeviceState* out, Done done) = 0;
+    virtual void SetRole(const GUID& containerId, UINT32 role, Done done) = 0;
+    virtual void SetState(const GUID& containerId, UINT32 state, Done done) = 0;
+    virtual void SetRuleBlob(const GUID& containerId, std::shared_ptr<const std::vector<BYTE>> blob, Done done) = 0;
+};
+
+struct DesiredDeviceState
+{
+    GUID ContainerId{};
+    UINT32 Role = 0;
+    UINT32 State = 0;
+    std::shared_ptr<const std::vector<BYTE>> Blob; // required for KBLAY_ROLE_REMAP
+};
+
+struct ReconcileStats
+{
+    size_t Devices = 0;
+    size_t InSync = 0;     // nothing to do
+    size_t Converged = 0;  // reached the desired state this pass
+    size_t Failed = 0;     // an operation failed; backing off
+    size_t Deferred = 0;   // still in a backoff window
+    size_t Operations = 0; // state-changing IOCTLs issued (queries excluded)
+    uint64_t LastConvergenceMs = 0; // desired-change -> converged, most recent
+    uint64_t MaxConvergenceMs = 0;
+};
+
+// Drives each device from what the driver reports to what the config wants,
+// issuing only the operations that differ. Every change to a device's desired
+// state bumps its generation; convergence is measured from that change until
+// the driver confirms it. Failures back off exponentially per device.
+//
+// Devices are driven concurrently: each runs its own query -> operations
+// chain, and Reconcile returns once every chain has finished, so a slow
+// device only delays itself.
+class Reconciler
+{
+public:
+    // Milliseconds on the same base as Reconcile's nowMs; read again once a
+    // pass's chains finish, to time convergence. Defaults to steady_clock.
+    using Clock = std::function<uint64_t()>;
+
+    explicit Reconciler(DriverControl& driver, uint64_t baseRetryMs = 1000, uint64_t maxRetryMs = 5 * 60 * 1000,
+        Clock clock = nullptr);
+
+    ReconcileStats Reconcile(const std::vector<DesiredDeviceState>& desired, uint64_t nowMs);
+
+private:
+    struct Tracked
+    {
+        GUID ContainerId{};
+        UINT32 Role = 0;
+        UINT32 State = 0;
+        UINT32 BlobHash = 0;
+        uint64_t DesiredGeneration = 0;
+        uint64_t AppliedGeneration = 0;
+        uint64_t DesiredSinceMs = 0;
+        uint32_t Failures = 0;
+        uint64_t RetryAtMs = 0;
+    };
+
+    enum class OpKind { Blob, Role, State };
+
+    struct Op
+    {
+        OpKind Kind;
+        UINT32 Value;
+    };
+
+    // One device's chain for this pass.
+    struct Job
+    {
+        const DesiredDeviceState* Desired = nullptr;
+        size_t TrackedIndex = 0;
+        UINT32 BlobHash = 0;
+        DriverDeviceState Current;
+        std::vector<Op> Ops;
+        size_t Step = 0;
+        size_t Issued = 0;
+        bool Queried = false;
+        bool InSync = false;
+        bool Ok = false;
+    };
+
+    class Barrier;
+
+    void Track(const DesiredDeviceState& d, UINT32 blobHash, uint64_t nowMs, std::vector<Tracked>& next);
+    void Plan(Job& job);
+    void RunNext(Job& job, Barrier& barrier);
+    void FallBackToBypass(Job& job, Barrier& barrier);
+
+    DriverControl& driver_;
+    Clock clock_;
+    uint64_t baseRetryMs_;
+    uint64_t maxRetryMs_;
+    std::vector<Tracked> tracked_;
+};
@@ -1,5 +1,4 @@
 #include "ServiceConfig.hpp"
-#include "..\\KbdLayRemapLib\\IniParser.hpp"
 #include "..\\KbdLayRemapLib\\DeviceId.hpp"
 
 static std::wstring DetectCurrentKlid()
@@ -10,6 +9,37 @@ static std::wstring DetectCurrentKlid()
     return L"00000411";
 }
 
+// The layout the built-in tables pair with `base`.
+static std::wstring PairedKlid(const std::wstring& base)
+{
+    return base == L"00000411" ? L"00000409" : L"00000411";
+}
+
+static void BuildConfig(const IniParser& ini, ServiceConfig& c)
+{
+    c.Stamp = ini.Stamp();
+
+    ContainerPolicyLists lists;
+    lists.Remap = ini.Get(L"Mapping", L"US", L"");
+    lists.Base = ini.Get(L"Mapping", L"JIS", L"");
+    c.InvalidGuidCount = CompileContainerPolicy(lists, c.Containers);
+
+    c.BaseKlid = ini.Get(L"Options", L"BaseKlid", L"Auto");
+    c.BaseKlidAuto = (c.BaseKlid == L"Auto" || c.BaseKlid.empty());
+    if (c.BaseKlidAuto)
+        c.BaseKlid = DetectCurrentKlid();
+
+    const std::wstring target = ini.Get(L"Options", L"TargetKlid", L"Auto");
+    UINT32 klid = 0;
+    c.TargetKlidAuto = (target == L"Auto" || target.empty());
+    c.TargetKlidInvalid = !c.TargetKlidAuto && !ParseKlid(target, klid);
+    if (c.TargetKlidInvalid)
+        c.TargetKlidAuto = true;
+    c.TargetKlid = c.TargetKlidAuto ? PairedKlid(c.BaseKlid) : KlidToString(klid);
+
+    c.RuleCacheDir = ini.Get(L"Options", L"RuleCache", L"");
+}
+
 ServiceConfig LoadConfigOrDie(const std::wstring& iniPath)
 {
     IniParser ini;
@@ -18,13 +48,29 @@ ServiceConfig LoadConfigOrDie(const std::wstring& iniPath)
 
     ServiceConfig c{};
     c.IniPath = iniPath;
+    BuildConfig(ini, c);
+    return c;
+}
+
+bool ReloadConfigIfChanged(ServiceConfig& cfg)
+{
+    IniParser ini;
+    bool changed = false;
+    if (!ini.LoadIfChanged(cfg.IniPath, cfg.Stamp, changed))
+        throw std::runtime_error("INI load failed");
 
-    c.UsContainers = ParseGuidList(ini.Get(L"Mapping", L"US", L""));
-    c.JisContainers = ParseGuidList(ini.Get(L"Mapping", L"JIS", L""));
+    if (!changed)
+    {
+        cfg.Stamp = ini.Stamp();
 
-    c.BaseKlid = ini.Get(L"Options", L"BaseKlid", L"Auto");
-    if (c.BaseKlid == L"Auto" || c.BaseKlid.empty())
-        c.BaseKlid = DetectCurrentKlid();
+        // The file is the same, but "Auto" follows the active layout.
+        if (cfg.BaseKlidAuto)
+            cfg.BaseKlid = DetectCurrentKlid();
+        if (cfg.TargetKlidAuto)
+            cfg.TargetKlid = PairedKlid(cfg.BaseKlid);
+        return false;
+    }
 
-    return c;
+    BuildConfig(ini, cfg);
+    return true;
 }
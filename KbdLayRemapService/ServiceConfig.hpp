@@ -4,14 +4,31 @@
 #include <stdexcept>
 #include <guiddef.h>
 
+#include "..\\KbdLayRemapLib\\IniParser.hpp"
+#include "..\\KbdLayRemapLib\\ContainerPolicy.hpp"
+
 struct ServiceConfig
 {
     std::wstring IniPath;
+    IniFileStamp Stamp;      // contents this config was built from
 
-    std::vector<GUID> UsContainers;
-    std::vector<GUID> JisContainers;
+    ContainerPolicy Containers; // [Mapping] US / JIS
+    size_t InvalidGuidCount = 0;
 
     std::wstring BaseKlid;   // "00000411" or "00000409" or "Auto"
+    bool BaseKlidAuto = false;
+
+    // Layout REMAP containers without a target of their own are made to
+    // type. "Auto" (or a malformed value) pairs 00000409 with 00000411.
+    std::wstring TargetKlid;
+    bool TargetKlidAuto = false;
+    bool TargetKlidInvalid = false;
+
+    std::wstring RuleCacheDir; // kblayctl compile-all output; empty = RuleCache next to the exe
 };
 
 ServiceConfig LoadConfigOrDie(const std::wstring& iniPath);
+
+// Reloads `cfg` only if its INI file changed since it was built.
+// Returns true if the contents were reparsed; throws if the file cannot be read.
+bool ReloadConfigIfChanged(ServiceConfig& cfg);
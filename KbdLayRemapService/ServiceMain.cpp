@@ -1,15 +1,24 @@
 #include <Windows.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <string>
 #include <vector>
 #include <iostream>
 
 #include "ServiceConfig.hpp"
+#include "AsyncControlDriver.hpp"
 #include "DriverClient.hpp"
+#include "Reconciler.hpp"
 #include "..\\Shared\\KbdLayIoctl.h"
 
 #include "..\\KbdLayRemapLib\\DeviceId.hpp"
+#include "..\\KbdLayRemapLib\\DeviceInventory.hpp"
+#include "..\\KbdLayRemapLib\\EventLog.hpp"
+#include "..\\KbdLayRemapLib\\LayoutTables.hpp"
+#include "..\\KbdLayRemapLib\\MappedFile.hpp"
+#include "..\\KbdLayRemapLib\\Metrics.hpp"
 #include "..\\KbdLayRemapLib\\RuleBlob.hpp"
-#include "..\\KbdLayRemapLib\\WinError.hpp"
 
 static constexpr wchar_t kServiceName[] = L"KbdLayRemapService";
 
@@ -18,10 +27,35 @@ static SERVICE_STATUS g_status{};
 static HANDLE g_stopEvent = nullptr;
 static HANDLE g_workerThread = nullptr;
 static std::wstring g_iniPath;
-
-static void LogDbg(const std::wstring& s)
+static std::unique_ptr<DeviceInventory> g_inventory;
+static std::unique_ptr<AsyncIoctlClient> g_driverClient;
+
+// Per-IOCTL deadline; a device that misses it is cancelled and backed off.
+static constexpr uint32_t kIoctlTimeoutMs = 2000;
+
+// Service log: KbdLayRemapService.kbllog next to the exe, read with kblayctl log.
+static EventLog g_log;
+static constexpr uint64_t kLogFileBytes = 4ull << 20;
+static constexpr unsigned kLogFilesKept = 3;
+
+// Prometheus-format metrics on a local named pipe. The worker publishes its
+// numbers after each pass and driver counters are sampled on their own
+// thread, so a scrape never waits on either.
+static constexpr wchar_t kMetricsPipe[] = L"\\\\.\\pipe\\KbdLayRemapMetrics";
+static constexpr uint32_t kMetricsSampleMs = 10000;
+static MetricsStore g_metrics;
+static ServiceMetrics g_serviceMetrics;   // worker thread only
+static IoctlLatency g_ioctlRetired;       // totals of clients already reset
+
+static std::wstring PathNextToExe(const wchar_t* fileName)
 {
-    OutputDebugStringW((s + L"\n").c_str());
+    wchar_t path[MAX_PATH]{};
+    GetModuleFileNameW(nullptr, path, MAX_PATH);
+    std::wstring p(path);
+    auto pos = p.find_last_of(L"\\/");
+    if (pos != std::wstring::npos) p = p.substr(0, pos + 1);
+    p += fileName;
+    return p;
 }
 
 static void SetSvcState(DWORD state, DWORD win32ExitCode = NO_ERROR, DWORD waitHintMs = 0)
@@ -57,121 +91,270 @@ static void SetSvcState(DWORD state, DWORD win32ExitCode = NO_ERROR, DWORD waitH
         SetServiceStatus(g_svcHandle, &g_status);
 }
 
-static bool GuidInList(const GUID& g, const std::vector<GUID>& list)
+static void LogConfigProblems(const ServiceConfig& cfg)
+{
+    if (cfg.InvalidGuidCount)
+        g_log.Log(LogEvent::ConfigBadGuids, cfg.InvalidGuidCount);
+    for (const auto& g : cfg.Containers.Conflicts())
+        g_log.Log(LogEvent::ConfigConflict, g);
+    if (cfg.TargetKlidInvalid)
+        g_log.Log(LogEvent::ConfigBadTargetKlid);
+}
+
+static std::shared_ptr<const DeviceInventorySnapshot> CurrentDevices()
 {
-    for (const auto& x : list) if (IsEqualGUID(g, x)) return true;
-    return false;
+    if (!g_inventory)
+    {
+        g_inventory = std::make_unique<DeviceInventory>(CreatePnpNotificationBackend());
+        if (!g_inventory->Start())
+            g_log.Log(LogEvent::PnpUnavailable);
+    }
+    else if (!g_inventory->Live())
+    {
+        g_inventory->Rescan();
+    }
+    return g_inventory->Snapshot();
 }
 
-static bool IsNullGuid(const GUID& g)
+static void AddIoctlLatency(IoctlLatency& total, const IoctlLatency& l)
 {
-    return !!IsEqualGUID(g, GUID_NULL);
+    total.Completed += l.Completed;
+    total.TimedOut += l.TimedOut;
+    total.SumUs += l.SumUs;
+    total.MaxUs = (std::max)(total.MaxUs, l.MaxUs);
 }
 
+static void ResetDriverClient()
+{
+    if (g_driverClient)
+        AddIoctlLatency(g_ioctlRetired, g_driverClient->Latency());
+    g_driverClient.reset();
+}
+
+// Times the phases of one ApplyOnce and publishes the service metrics when
+// the pass ends, however it ends.
+class ApplyTimer
+{
+public:
+    ApplyTimer() : start_(Clock::now()), last_(start_) {}
+
+    ~ApplyTimer()
+    {
+        Phase(ApplyPhase::Total, start_);
+        IoctlLatency l = g_ioctlRetired;
+        if (g_driverClient)
+            AddIoctlLatency(l, g_driverClient->Latency());
+        g_serviceMetrics.IoctlCompleted = l.Completed;
+        g_serviceMetrics.IoctlTimedOut = l.TimedOut;
+        g_serviceMetrics.IoctlSumUs = l.SumUs;
+        g_serviceMetrics.IoctlMaxUs = l.MaxUs;
+        try { g_metrics.SetService(g_serviceMetrics); }
+        catch (...) {}
+    }
+
+    // Ends the phase that began at the previous EndPhase (or construction).
+    void EndPhase(ApplyPhase p)
+    {
+        last_ = Phase(p, last_);
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static Clock::time_point Phase(ApplyPhase p, Clock::time_point since)
+    {
+        const auto now = Clock::now();
+        g_serviceMetrics.Phases[(size_t)p].Add(
+            (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(now - since).count());
+        return now;
+    }
+
+    Clock::time_point start_;
+    Clock::time_point last_;
+};
+
 static bool ApplyOnce()
 {
-    auto cfg = LoadConfigOrDie(g_iniPath);
+    ApplyTimer timer;
+
+    // Keep the parsed config across passes; the INI is only reparsed when it changes.
+    static ServiceConfig s_cfg;
+    static bool s_haveCfg = false;
+    if (!s_haveCfg || s_cfg.IniPath != g_iniPath)
+    {
+        s_cfg = LoadConfigOrDie(g_iniPath);
+        s_haveCfg = true;
+        ++g_serviceMetrics.ConfigGeneration;
+        LogConfigProblems(s_cfg);
+    }
+    else if (ReloadConfigIfChanged(s_cfg))
+    {
+        g_log.Log(LogEvent::ConfigReloaded, g_iniPath);
+        ++g_serviceMetrics.ConfigGeneration;
+        LogConfigProblems(s_cfg);
+    }
+    const auto& cfg = s_cfg;
+    timer.EndPhase(ApplyPhase::Config);
 
     const std::wstring base = cfg.BaseKlid;
-    const std::wstring other = (base == L"00000411") ? L"00000409" : L"00000411";
 
-    // rules for (base -> other) on ROLE_REMAP device
+    // Rules for base -> target on ROLE_REMAP devices: one blob per target in
+    // use, [Options] TargetKlid and any [Mapping] US ":<KLID>" suffixes.
+    using BlobPtr = std::shared_ptr<const std::vector<BYTE>>;
     static std::wstring s_lastBase;
-    static std::wstring s_lastOther;
-    static std::vector<BYTE> s_cachedBlob;
-
-    if (s_cachedBlob.empty() || s_lastBase != base || s_lastOther != other)
+    static std::wstring s_lastCacheDir;
+    static uint64_t s_lastManifestSize = 0;
+    static uint64_t s_lastManifestTime = 0;
+    static std::map<std::wstring, BlobPtr> s_blobs;   // target KLID -> blob
+
+    // A rewritten compile-all cache is picked up on the next pass.
+    const std::wstring cacheDir = cfg.RuleCacheDir.empty() ? PathNextToExe(L"RuleCache") : cfg.RuleCacheDir;
+    uint64_t manifestSize = 0;
+    uint64_t manifestTime = 0;
+    if (!MappedFile::Stat(cacheDir + L"\\manifest.ini", manifestSize, manifestTime))
+        manifestSize = manifestTime = 0;
+
+    if (s_lastBase != base || s_lastCacheDir != cacheDir ||
+        s_lastManifestSize != manifestSize || s_lastManifestTime != manifestTime)
     {
-        auto newBlob = BuildUsJisRuleBlob(base, other);
-        s_cachedBlob.clear();
+        s_blobs.clear();
         s_lastBase = base;
-        s_lastOther = other;
-        if (!newBlob.empty())
-            s_cachedBlob = std::move(newBlob);
+        s_lastCacheDir = cacheDir;
+        s_lastManifestSize = manifestSize;
+        s_lastManifestTime = manifestTime;
     }
 
-    const auto& blob = s_cachedBlob;
+    std::vector<std::wstring> targets{ cfg.TargetKlid };
+    for (const UINT32 p : cfg.Containers.Profiles())
+        targets.push_back(KlidToString(p));
+    for (const auto& target : targets)
+    {
+        BlobPtr& blob = s_blobs[target];
+        if (blob)
+            continue;
 
-    HANDLE hCtrl = OpenControlDevice(GENERIC_READ | GENERIC_WRITE);
-    if (hCtrl == INVALID_HANDLE_VALUE)
+        // The cache first; then the built-in pairs, and only for others the
+        // installed layouts.
+        auto newBlob = ReadRuleBlobCache(cacheDir, base, target);
+        if (newBlob.empty())
+        {
+            if (manifestSize != 0)
+                g_log.Log(LogEvent::RuleCacheMiss, base, target, cacheDir);
+            newBlob = BuiltInRuleBlob(base, target);
+        }
+        if (newBlob.empty())
+            newBlob = BuildUsJisRuleBlob(base, target);
+        if (!newBlob.empty())
+            blob = std::make_shared<const std::vector<BYTE>>(std::move(newBlob));
+    }
+    timer.EndPhase(ApplyPhase::Rules);
+
+    // One overlapped handle for the life of the service; reopened only if it goes away.
+    if (!g_driverClient)
     {
-        LogDbg(L"[SVC] OpenControlDevice failed: " + WinErrorMessage(GetLastError()));
-        return false;
+        auto transport = OpenControlDeviceTransport();
+        if (!transport)
+        {
+            g_log.Log(LogEvent::OpenControlFailed, GetLastError());
+            return false;
+        }
+        g_driverClient = std::make_unique<AsyncIoctlClient>(std::move(transport), kIoctlTimeoutMs);
     }
 
-    auto devs = EnumerateKbdLayFilterDevices();
+    const auto snapshot = CurrentDevices();
+    const auto& devs = snapshot->Devices;
+    timer.EndPhase(ApplyPhase::Inventory);
     if (devs.empty())
     {
-        LogDbg(L"[SVC] No filter devices found (driver not installed / interface missing).");
-        CloseHandle(hCtrl);
+        g_log.Log(LogEvent::NoFilterDevices);
         return false;
     }
 
-    for (auto& d : devs)
+    // Desired state per ContainerId (several interfaces may share one).
+    std::vector<DesiredDeviceState> desired;
+    desired.reserve(devs.size());
+    for (const auto& d : devs)
     {
         if (IsNullGuid(d.ContainerId))
         {
-            LogDbg(L"[SVC] Skip device with null ContainerId: " + d.DevicePath);
+            g_log.Log(LogEvent::NullContainer, d.DevicePath);
             continue;
         }
 
-        const bool isUs = GuidInList(d.ContainerId, cfg.UsContainers);
-        const bool isJis = GuidInList(d.ContainerId, cfg.JisContainers);
+        bool seen = false;
+        for (const auto& x : desired)
+            if (IsEqualGUID(x.ContainerId, d.ContainerId)) { seen = true; break; }
+        if (seen)
+            continue;
 
-        UINT32 role = KBLAY_ROLE_NONE;
-        UINT32 state = KBLAY_STATE_BYPASS_HARD;
+        const ContainerAssignment& a = cfg.Containers.Resolve(d.ContainerId);
 
-        if (isUs && !isJis)
+        DesiredDeviceState want;
+        want.ContainerId = d.ContainerId;
+        want.Role = a.Role;
+        want.State = a.State;
+        if (a.Role == KBLAY_ROLE_REMAP)
         {
-            role = KBLAY_ROLE_REMAP;
-            state = KBLAY_STATE_ACTIVE;
-            if (!DeviceIoctlSetRuleBlobEx(hCtrl, d.ContainerId, blob))
+            const std::wstring target = a.Profile ? KlidToString(a.Profile) : cfg.TargetKlid;
+            want.Blob = s_blobs[target];
+            if (!want.Blob)
             {
-                LogDbg(L"[SVC] IOCTL_KBLAY_SET_RULE_BLOB failed: " + WinErrorMessage(GetLastError()));
-                role = KBLAY_ROLE_NONE;
-                state = KBLAY_STATE_BYPASS_HARD;
+                g_log.Log(LogEvent::NoRuleBlob, base, target);
+                want.Role = KBLAY_ROLE_NONE;
+                want.State = KBLAY_STATE_BYPASS_HARD;
             }
         }
-        else if (isJis && !isUs)
-        {
-            role = KBLAY_ROLE_BASE;
-            state = KBLAY_STATE_ACTIVE; // BASE role is pass-through by driver logic
-        }
+        desired.push_back(std::move(want));
+    }
 
-        bool okRole = DeviceIoctlSetRoleEx(hCtrl, d.ContainerId, role);
-        if (!okRole) LogDbg(L"[SVC] IOCTL_KBLAY_SET_ROLE failed: " + WinErrorMessage(GetLastError()));
+    static AsyncControlDriver s_driver;
+    static Reconciler s_reconciler(s_driver, 1000, 5 * 60 * 1000, [] { return (uint64_t)GetTickCount64(); });
 
-        bool okState = DeviceIoctlSetStateEx(hCtrl, d.ContainerId, state);
-        if (!okState) LogDbg(L"[SVC] IOCTL_KBLAY_SET_STATE failed: " + WinErrorMessage(GetLastError()));
+    s_driver.SetClient(g_driverClient.get());
+    const ReconcileStats st = s_reconciler.Reconcile(desired, GetTickCount64());
+    s_driver.SetClient(nullptr);
+    timer.EndPhase(ApplyPhase::Reconcile);
 
-        if (!okRole || !okState)
-        {
-            // Best-effort fallback to safe state
-            DeviceIoctlSetStateEx(hCtrl, d.ContainerId, KBLAY_STATE_BYPASS_HARD);
-            DeviceIoctlSetRoleEx(hCtrl, d.ContainerId, KBLAY_ROLE_NONE);
-        }
+    g_serviceMetrics.Converged += st.Converged;
+    g_serviceMetrics.Failed += st.Failed;
+    if (st.Converged)
+    {
+        g_serviceMetrics.LastConvergenceMs = st.LastConvergenceMs;
+        g_serviceMetrics.MaxConvergenceMs = (std::max)(g_serviceMetrics.MaxConvergenceMs, st.LastConvergenceMs);
+    }
+
+    if (st.Converged || st.Failed)
+    {
+        g_log.Log(LogEvent::Reconciled, st.Devices, st.Converged, st.Failed, st.Deferred, st.Operations, st.LastConvergenceMs);
+    }
+
+    if (st.Failed && IsControlHandleGone(g_driverClient->LastError()))
+    {
+        g_log.Log(LogEvent::ControlGone);
+        ResetDriverClient();
     }
 
-    CloseHandle(hCtrl);
     return true;
 }
 
 static DWORD WINAPI WorkerThread(LPVOID)
 {
-    LogDbg(L"[SVC] Worker started. INI=" + g_iniPath);
+    g_log.Log(LogEvent::WorkerStarted, g_iniPath);
 
     // Initial apply
     try { (void)ApplyOnce(); }
-    catch (...) { LogDbg(L"[SVC] ApplyOnce threw an exception."); }
+    catch (...) { g_log.Log(LogEvent::ApplyThrew); }
 
     // Minimal keep-alive loop: re-apply periodically to catch hotplug/re-enumeration.
     while (WaitForSingleObject(g_stopEvent, 5000) == WAIT_TIMEOUT)
     {
         try { (void)ApplyOnce(); }
-        catch (...) { LogDbg(L"[SVC] ApplyOnce threw an exception (loop)."); }
+        catch (...) { g_log.Log(LogEvent::ApplyThrewLoop); }
     }
 
-    LogDbg(L"[SVC] Worker exiting.");
+    g_inventory.reset();
+    ResetDriverClient();
+    g_log.Log(LogEvent::WorkerExiting);
     return 0;
 }
 
@@ -202,19 +385,38 @@ static void WINAPI ServiceMain(DWORD /*argc*/, LPWSTR* /*argv*/)
 
     SetSvcState(SERVICE_START_PENDING, NO_ERROR, 5000);
 
+    auto logFile = std::make_unique<RotatingLogFile>(PathNextToExe(L"KbdLayRemapService.kbllog"), kLogFileBytes, kLogFilesKept);
+    if (logFile->Open())
+        g_log.Start(std::move(logFile));
+    else
+        g_log.Start(std::make_unique<DebuggerLogSink>());
+
     g_stopEvent = CreateEventW(nullptr, TRUE, FALSE, nullptr);
     if (!g_stopEvent)
     {
-        SetSvcState(SERVICE_STOPPED, GetLastError(), 0);
+        DWORD e = GetLastError();
+        g_log.Stop();
+        SetSvcState(SERVICE_STOPPED, e, 0);
         return;
     }
 
+    // Metrics are best effort: the service runs the same without them.
+    ControlDeviceStatusSource statusSource;
+    MetricsSampler sampler(statusSource, g_metrics);
+    MetricsServer metricsServer(g_metrics);
+    sampler.Start(kMetricsSampleMs);
+    if (!metricsServer.Start(kMetricsPipe))
+        g_log.Log(LogEvent::MetricsUnavailable, GetLastError());
+
     g_workerThread = CreateThread(nullptr, 0, WorkerThread, nullptr, 0, nullptr);
     if (!g_workerThread)
     {
         DWORD e = GetLastError();
         CloseHandle(g_stopEvent);
         g_stopEvent = nullptr;
+        metricsServer.Stop();
+        sampler.Stop();
+        g_log.Stop();
         SetSvcState(SERVICE_STOPPED, e, 0);
         return;
     }
@@ -239,24 +441,17 @@ static void WINAPI ServiceMain(DWORD /*argc*/, LPWSTR* /*argv*/)
         g_stopEvent = nullptr;
     }
 
+    metricsServer.Stop();
+    sampler.Stop();
+    g_log.Stop();
     SetSvcState(SERVICE_STOPPED);
 }
 
-static std::wstring DefaultIniPathNextToExe()
-{
-    wchar_t path[MAX_PATH]{};
-    GetModuleFileNameW(nullptr, path, MAX_PATH);
-    std::wstring p(path);
-    auto pos = p.find_last_of(L"\\/");
-    if (pos != std::wstring::npos) p = p.substr(0, pos + 1);
-    p += L"KbdLayRemap.ini";
-    return p;
-}
 
 int wmain(int argc, wchar_t** argv)
 {
     // INI path: arg1 or "next to exe"
-    g_iniPath = (argc >= 2) ? argv[1] : DefaultIniPathNextToExe();
+    g_iniPath = (argc >= 2) ? argv[1] : PathNextToExe(L"KbdLayRemap.ini");
 
     SERVICE_TABLE_ENTRYW table[] = {
         { const_cast<LPWSTR>(kServiceName), ServiceMain },
@@ -269,14 +464,18 @@ int wmain(int argc, wchar_t** argv)
     // If not started by SCM, StartServiceCtrlDispatcher fails with ERROR_FAILED_SERVICE_CONTROLLER_CONNECT (1063).
     // In that case, run once for debugging.
     DWORD e = GetLastError();
-    LogDbg(L"[SVC] StartServiceCtrlDispatcher failed: " + WinErrorMessage(e));
+    g_log.Log(LogEvent::DispatcherFailed, e);
+    g_log.Start(std::make_unique<DebuggerLogSink>());
+    int rc = 1;
     try
     {
         bool ok = ApplyOnce();
-        return ok ? 0 : 2;
+        g_driverClient.reset();
+        rc = ok ? 0 : 2;
     }
     catch (...)
     {
-        return 1;
     }
+    g_log.Stop();
+    return rc;
 }
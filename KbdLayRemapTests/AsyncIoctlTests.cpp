@@ -0,0 +1,140 @@
+#include "FakeIoctlTransport.hpp"
+#include "KbdLayTest.hpp"
+
+namespace
+{
+    using Fake = FakeIoctlTransport;
+
+    const uint32_t kEcho = 1;
+    const uint32_t kSlow = 2;
+    const uint32_t kHang = 3;
+    const uint32_t kRefuse = 4;
+    const uint32_t kFail = 5;
+
+    std::shared_ptr<Fake::Shared> Script()
+    {
+        auto s = std::make_shared<Fake::Shared>();
+        s->Codes[kEcho] = { Fake::Mode::Echo, 0, 0 };
+        s->Codes[kSlow] = { Fake::Mode::Delay, 30, 0 };
+        s->Codes[kHang] = { Fake::Mode::Hang, 0, 0 };
+        s->Codes[kRefuse] = { Fake::Mode::Refuse, 0, 6 };     // ERROR_INVALID_HANDLE
+        s->Codes[kFail] = { Fake::Mode::Fail, 0, 1167 };      // ERROR_DEVICE_NOT_CONNECTED
+        return s;
+    }
+
+    double ElapsedMs(std::chrono::steady_clock::time_point since)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+    }
+}
+
+KBLAY_TEST(AsyncIoctlCompletesWithOutput)
+{
+    auto s = Script();
+    AsyncIoctlClient client(std::make_unique<Fake>(s), 1000);
+
+    const IoctlResult r = client.Submit(kEcho, { 1, 2, 3 }, 8).get();
+    CHECK(r.Ok);
+    CHECK(!r.TimedOut);
+    CHECK(r.Output == std::vector<uint8_t>({ 1, 2, 3 }));
+
+    const IoctlLatency l = client.Latency();
+    CHECK_EQ(l.Completed, (uint64_t)1);
+    CHECK_EQ(l.TimedOut, (uint64_t)0);
+    CHECK(l.MaxUs >= l.SumUs / l.Completed);
+}
+
+KBLAY_TEST(AsyncIoctlTimesOutAndCancelsHungRequest)
+{
+    auto s = Script();
+    AsyncIoctlClient client(std::make_unique<Fake>(s), 50);
+
+    const auto start = std::chrono::steady_clock::now();
+    const IoctlResult r = client.Submit(kHang, { 9 }, 4).get();
+    const double ms = ElapsedMs(start);
+
+    CHECK(r.TimedOut);
+    CHECK(!r.Ok);
+    CHECK(ms >= 45);
+    CHECK(ms < 1000);
+    {
+        std::lock_guard<std::mutex> g(s->Lock);
+        CHECK_EQ(s->Cancelled.size(), (size_t)1);
+    }
+    CHECK_EQ(client.Latency().TimedOut, (uint64_t)1);
+    CHECK_EQ(client.Latency().Completed, (uint64_t)0);
+}
+
+KBLAY_TEST(AsyncIoctlWedgedRequestDoesNotHoldOthers)
+{
+    auto s = Script();
+    AsyncIoctlClient client(std::make_unique<Fake>(s), 200);
+
+    auto hung = client.Submit(kHang, {}, 0);
+    const auto start = std::chrono::steady_clock::now();
+    const IoctlResult slow = client.Submit(kSlow, { 5 }, 1).get();
+    const IoctlResult fast = client.Submit(kEcho, { 6 }, 1).get();
+    CHECK(slow.Ok && fast.Ok);
+    CHECK(ElapsedMs(start) < 150);
+
+    CHECK(hung.get().TimedOut);
+}
+
+KBLAY_TEST(AsyncIoctlKeepsDirectBufferUntilAbandonedRequestDrains)
+{
+    auto s = Script();
+    auto data = std::make_shared<const std::vector<uint8_t>>(64, 0xAB);
+
+    {
+        AsyncIoctlClient client(std::make_unique<Fake>(s), 30);
+        std::promise<IoctlResult> done;
+        client.SubmitDirect(kHang, {}, data, [&](const IoctlResult& r) { done.set_value(r); });
+        CHECK(done.get_future().get().TimedOut);
+
+        // The cancel completes the request on the pump thread; the buffer
+        // is released then, never before.
+        for (int i = 0; i < 200 && data.use_count() > 1; ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        CHECK_EQ(data.use_count(), (long)1);
+        CHECK_EQ(client.LastError(), (uint32_t)995);
+    }
+}
+
+KBLAY_TEST(AsyncIoctlReportsRefusedAndFailedRequests)
+{
+    auto s = Script();
+    AsyncIoctlClient client(std::make_unique<Fake>(s), 1000);
+
+    bool inline_ = false;
+    const auto caller = std::this_thread::get_id();
+    client.Submit(kRefuse, {}, 0, [&](const IoctlResult& r) {
+        inline_ = std::this_thread::get_id() == caller;
+        CHECK(!r.Ok);
+        CHECK_EQ(r.Error, (uint32_t)6);
+    });
+    CHECK(inline_);
+    CHECK_EQ(client.LastError(), (uint32_t)6);
+
+    const IoctlResult r = client.Submit(kFail, {}, 0).get();
+    CHECK(!r.Ok);
+    CHECK(!r.TimedOut);
+    CHECK_EQ(r.Error, (uint32_t)1167);
+    CHECK_EQ(client.LastError(), (uint32_t)1167);
+}
+
+KBLAY_TEST(AsyncIoctlShutdownCancelsPendingRequests)
+{
+    auto s = Script();
+    std::promise<IoctlResult> done;
+    auto f = done.get_future();
+    {
+        AsyncIoctlClient client(std::make_unique<Fake>(s), 60000);
+        client.Submit(kHang, {}, 0, [&](const IoctlResult& r) { done.set_value(r); });
+    }
+    // Destruction cancelled the request and waited for its completion.
+    CHECK(f.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+    CHECK(!f.get().Ok);
+    std::lock_guard<std::mutex> g(s->Lock);
+    CHECK(s->Destroyed);
+    CHECK(s->Hung.empty());
+}
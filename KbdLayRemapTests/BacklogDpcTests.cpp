@@ -0,0 +1,260 @@
+#include "FakeClassDriver.hpp"
+#include "KbdLayTest.hpp"
+#include <deque>
+#include <random>
+
+// BacklogDpc's scheduling over a simulated clock: KbdLayDefer,
+// KbdLayReleaseArena, KbdLayStallDelivery and RetryTimer as KeyboardConnect.c
+// has them, with one DPC queue shared by the devices as on one processor.
+
+namespace
+{
+    const uint64_t kRetryMicros = 8000;  // KBDLAY_DELIVER_RETRY_MS
+
+    struct SimDevice
+    {
+        TestEngine Engine;
+        FakeClassDriver Upper{ Engine };
+        KBLAY_OUTBOX Box{};
+        KBLAY_BACKLOG Backlog{};
+        std::vector<KBLAY_KEY_EVENT> Input;  // everything deferred, in order
+
+        bool Queued = false;                 // BacklogDpc inserted
+        bool Stalled = false;                // DeliveryStalled
+        uint64_t RetryAt = 0;                // RetryTimer due; 0 when not set
+        uint32_t Runs = 0;
+        std::vector<KBLAY_DELIVER_STATUS> Statuses;
+
+        SimDevice() { Engine.Load(TestBlob().Rule(0x1E, 0, 0x30, 0).Bytes()); }
+    };
+
+    struct SimCpu
+    {
+        KBLAY_BUDGET_CONFIG Budget{ 64, 0 };
+        uint64_t Now = 0;                    // microseconds
+        std::deque<SimDevice*> Dpcs;
+        std::vector<SimDevice*> Order;       // devices in the order their DPCs ran
+
+        void Insert(SimDevice& d)
+        {
+            if (!d.Queued)
+            {
+                d.Queued = true;
+                Dpcs.push_back(&d);
+            }
+        }
+
+        // KbdLayDefer: a callback hands its input over and queues the DPC.
+        void Defer(SimDevice& d, const std::vector<KBLAY_KEY_EVENT>& in)
+        {
+            const UINT32 n = KbdLayBacklogPush(&d.Backlog, in.data(), (UINT32)in.size());
+            d.Input.insert(d.Input.end(), in.begin(), in.begin() + n);
+            Insert(d);
+        }
+
+        // KbdLayBacklogDpc followed by KbdLayReleaseArena.
+        void Run(SimDevice& d)
+        {
+            d.Stalled = false;
+            ++d.Runs;
+            Order.push_back(&d);
+
+            d.Upper.Clock = Now;
+            KBLAY_BUDGET budget;
+            KbdLayBudgetStart(&budget, &Budget, d.Upper.Clock, 1000000);
+            const KBLAY_DELIVER_STATUS status = KbdLayDeliverBacklog(&d.Box, &d.Backlog, &FakeClassDriver::Ops, &d.Upper, &budget);
+            d.Statuses.push_back(status);
+            Now = d.Upper.Clock;
+
+            if (status == KBLAY_DELIVER_FULL)
+            {
+                d.Stalled = true;
+                d.RetryAt = Now + kRetryMicros;
+            }
+            if (d.Backlog.Count != 0 && !d.Stalled)
+                Insert(d);
+        }
+
+        // Runs queued DPCs in order, at most `limit`; returns how many ran.
+        size_t Drain(size_t limit = 10000)
+        {
+            size_t ran = 0;
+            while (!Dpcs.empty() && ran < limit)
+            {
+                SimDevice* d = Dpcs.front();
+                Dpcs.pop_front();
+                d->Queued = false;
+                Run(*d);
+                ++ran;
+            }
+            return ran;
+        }
+
+        // Moves the clock to the earliest RetryTimer and lets it queue the DPC.
+        bool FireRetry(std::initializer_list<SimDevice*> devices)
+        {
+            SimDevice* next = nullptr;
+            for (SimDevice* d : devices)
+                if (d->RetryAt != 0 && (next == nullptr || d->RetryAt < next->RetryAt))
+                    next = d;
+            if (next == nullptr)
+                return false;
+            if (Now < next->RetryAt)
+                Now = next->RetryAt;
+            next->RetryAt = 0;
+            Insert(*next);
+            return true;
+        }
+    };
+
+    std::vector<KBLAY_KEY_EVENT> Taps(uint32_t seed, size_t events)
+    {
+        std::mt19937 rng(seed);
+        std::vector<KBLAY_KEY_EVENT> s;
+        while (s.size() < events)
+        {
+            const uint16_t k = (uint16_t)(0x10 + rng() % 16);
+            s.push_back(KeyDown(k));
+            if (s.size() < events)
+                s.push_back(KeyUp(k));
+        }
+        return s;
+    }
+
+    std::vector<KBLAY_KEY_EVENT> Expected(const std::vector<KBLAY_KEY_EVENT>& in)
+    {
+        TestEngine t;
+        t.Load(TestBlob().Rule(0x1E, 0, 0x30, 0).Bytes());
+        std::vector<KBLAY_KEY_EVENT> out;
+        for (const auto& e : in)
+        {
+            const auto o = t.Feed(e);
+            out.insert(out.end(), o.begin(), o.end());
+        }
+        return out;
+    }
+}
+
+KBLAY_TEST(BacklogDpcRequeuesOnlyWhenTheBudgetRunsOut)
+{
+    SimCpu cpu;
+    SimDevice d;
+    cpu.Defer(d, Taps(1, 200));
+
+    // 64, 64 and 64 out of budget, then the last 8.
+    CHECK_EQ(cpu.Drain(), (size_t)4);
+    CHECK_EQ(d.Statuses.size(), (size_t)4);
+    CHECK_EQ(d.Statuses[0], KBLAY_DELIVER_BUDGET);
+    CHECK_EQ(d.Statuses[2], KBLAY_DELIVER_BUDGET);
+    CHECK_EQ(d.Statuses[3], KBLAY_DELIVER_DONE);
+    CHECK_EQ(d.Backlog.Count, 0u);
+    CHECK_EQ(d.Upper.Translated, (uint64_t)200);
+    CHECK(SameKeys(d.Upper.Received, Expected(d.Input)));
+
+    // A time budget alone: 250 us a clock reading against a 200 us slice
+    // leaves one engine call per run.
+    SimDevice slow;
+    slow.Upper.TicksPerRead = 250;
+    cpu.Budget = { 0, 200 };
+    cpu.Defer(slow, Taps(2, 200));
+    const uint64_t start = cpu.Now;
+    CHECK(cpu.Drain() > 1);
+    CHECK_EQ(slow.Upper.Translated, (uint64_t)200);
+    CHECK(SameKeys(slow.Upper.Received, Expected(slow.Input)));
+    CHECK(cpu.Now - start <= 2 * 250 * (uint64_t)slow.Runs);
+}
+
+KBLAY_TEST(BacklogDpcWaitsForRetryWhenTheClassDriverIsFull)
+{
+    SimCpu cpu;
+    SimDevice d;
+    d.Upper.Accept = [](uint32_t) { return 0u; };
+    cpu.Defer(d, Taps(3, 100));
+
+    // One run fills the outbox and stops; nothing queues it again.
+    CHECK_EQ(cpu.Drain(), (size_t)1);
+    CHECK_EQ(d.Statuses.back(), KBLAY_DELIVER_FULL);
+    CHECK(d.Stalled);
+    CHECK(cpu.Dpcs.empty());
+    CHECK(d.Backlog.Count != 0);
+    const uint64_t translated = d.Upper.Translated;
+    CHECK(translated != 0);
+    CHECK_EQ(translated + d.Backlog.Count, (uint64_t)100);
+
+    // Short accepts: each retry moves some output and takes no more input
+    // than the outbox has room for; the next callback also retries.
+    d.Upper.Accept = [](uint32_t offered) { return offered < 5 ? offered : 5u; };
+    size_t runs = 0;
+    for (int i = 0; i < 1000 && (d.Backlog.Count != 0 || d.Box.Count != 0); ++i)
+    {
+        if (i == 3)
+            cpu.Defer(d, Taps(4, 20));
+        else
+            CHECK(cpu.FireRetry({ &d }));
+        runs += cpu.Drain();
+    }
+    CHECK(runs < 1000);
+    CHECK_EQ(d.Backlog.Count, 0u);
+    CHECK_EQ(d.Box.Count, 0u);
+    CHECK_EQ(d.Upper.Translated, (uint64_t)120);
+    CHECK(SameKeys(d.Upper.Received, Expected(d.Input)));
+
+    // The retries were timer-paced, not back to back.
+    CHECK(cpu.Now >= kRetryMicros * (runs - 2));
+}
+
+KBLAY_TEST(BacklogDpcWrapsWithoutRetranslating)
+{
+    SimCpu cpu;
+    SimDevice d;
+    cpu.Defer(d, Taps(5, 200));
+    cpu.Drain();
+    CHECK_EQ(d.Backlog.Head, 200u);
+
+    // 150 more wrap the ring at KBLAY_BACKLOG_EVENTS; the class driver takes
+    // a random share, so spans are popped partly and retried.
+    std::mt19937 rng(5);
+    d.Upper.Accept = [&rng](uint32_t offered) { return (uint32_t)(rng() % (offered + 1)); };
+    cpu.Budget = { 24, 0 };
+    cpu.Defer(d, Taps(6, 150));
+    for (int i = 0; i < 10000 && (d.Backlog.Count != 0 || d.Box.Count != 0); ++i)
+    {
+        cpu.Drain();
+        cpu.FireRetry({ &d });
+    }
+    CHECK_EQ(d.Backlog.Count, 0u);
+    CHECK_EQ(d.Backlog.Head, (200u + 150u) % KBLAY_BACKLOG_EVENTS);
+    CHECK_EQ(d.Upper.Translated, (uint64_t)350);
+    CHECK(SameKeys(d.Upper.Received, Expected(d.Input)));
+}
+
+KBLAY_TEST(BacklogDpcsTakeTurnsAcrossDevices)
+{
+    SimCpu cpu;
+    SimDevice a;
+    SimDevice b;
+    cpu.Defer(a, Taps(7, 256));
+    cpu.Defer(b, Taps(8, 10));
+
+    // B's short backlog goes out right after A's first slice, not after all
+    // of A's.
+    CHECK_EQ(cpu.Drain(2), (size_t)2);
+    CHECK(cpu.Order[0] == &a);
+    CHECK(cpu.Order[1] == &b);
+    CHECK_EQ(b.Backlog.Count, 0u);
+    CHECK_EQ(a.Backlog.Count, 256u - 64u);
+
+    // A full class driver behind C does not hold A back either.
+    SimDevice c;
+    c.Upper.Accept = [](uint32_t) { return 0u; };
+    cpu.Defer(c, Taps(9, 100));
+    cpu.Drain();
+    CHECK_EQ(a.Backlog.Count, 0u);
+    CHECK_EQ(a.Runs, 4u);
+    CHECK_EQ(c.Runs, 1u);
+    CHECK(c.Stalled);
+
+    CHECK(SameKeys(a.Upper.Received, Expected(a.Input)));
+    CHECK(SameKeys(b.Upper.Received, Expected(b.Input)));
+    CHECK_EQ(a.Upper.Translated + b.Upper.Translated, (uint64_t)266);
+}
@@ -0,0 +1,107 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <cstdio>
+#include <random>
+
+// Per-variant engine cost, one KbdLayEngineProcess call per event against
+// KbdLayEngineProcessBatch over runs of 32: hard bypass, soft bypass, base
+// role, remap without shift synthesis and remap with it.
+
+namespace
+{
+    std::vector<uint8_t> Rules(bool shift)
+    {
+        TestBlob b;
+        for (uint16_t k = 0x10; k <= 0x19; ++k)
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0, KBLAY_MODGROUP_SHIFT, 0);
+        b.Rule(0x1A, 0, 0x1B, 0, KBLAY_MODGROUP_SHIFT, 0);
+        if (shift)
+        {
+            b.Rule(0x28, 0, 0x08, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0)
+             .Rule(0x0D, 0, 0x0C, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0)
+             .Rule(0x03, 0, 0x1A, 0, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT);
+        }
+        return b.Bytes();
+    }
+
+    std::vector<KBLAY_KEY_EVENT> Stream()
+    {
+        static const uint16_t keys[] = { 0x10, 0x12, 0x15, 0x18, 0x1A, 0x28, 0x0D, 0x03, 0x1E, 0x39 };
+        std::mt19937 rng(42);
+        std::vector<KBLAY_KEY_EVENT> s;
+        for (int i = 0; i < 2048; ++i)
+        {
+            const bool shifted = rng() % 8 == 0;
+            const uint16_t k = keys[rng() % 10];
+            if (shifted) s.push_back(KeyDown(KBLAY_MAKE_LSHIFT));
+            s.push_back(KeyDown(k));
+            s.push_back(KeyUp(k));
+            if (shifted) s.push_back(KeyUp(KBLAY_MAKE_LSHIFT));
+        }
+        return s;
+    }
+
+    struct Variant
+    {
+        const char* Name;
+        uint32_t State;
+        uint32_t Role;
+        bool Shift;
+    };
+
+    void Run(BenchContext& ctx, const Variant& v, const std::vector<KBLAY_KEY_EVENT>& s, bool batched)
+    {
+        TestEngine t;
+        t.Load(Rules(v.Shift));
+        std::vector<KBLAY_KEY_EVENT> out(32 * KBLAY_ENGINE_MAX_OUTPUT);
+        const uint64_t target = ctx.Iterations(4000000);
+        uint64_t events = 0;
+        uint64_t produced = 0;
+
+        BenchTimer timer;
+        while (events < target)
+        {
+            if (batched)
+            {
+                for (size_t next = 0; next < s.size();)
+                {
+                    const size_t run = s.size() - next < 32 ? s.size() - next : 32;
+                    KBLAY_ENGINE_BATCH batch;
+                    next += KbdLayEngineProcessBatch(t.Engine.get(), v.State, v.Role, t.NowMs, s.data() + next, run,
+                        out.data(), out.size(), nullptr, &batch);
+                    produced += batch.Produced;
+                }
+            }
+            else
+            {
+                KBLAY_ENGINE_RESULT result;
+                for (const auto& e : s)
+                    produced += KbdLayEngineProcess(t.Engine.get(), v.State, v.Role, t.NowMs, &e, out.data(), KBLAY_ENGINE_MAX_OUTPUT, &result);
+            }
+            events += s.size();
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(produced);
+
+        char detail[32];
+        std::snprintf(detail, sizeof(detail), "stages 0x%02X", (unsigned)t.Engine->Stages);
+        ctx.Report(std::string("batch/") + v.Name + (batched ? "/batch-32" : "/per-event"), events, seconds, detail);
+    }
+}
+
+KBLAY_BENCH(BatchVariants)
+{
+    const Variant variants[] = {
+        { "bypass-hard", KBLAY_STATE_BYPASS_HARD, KBLAY_ROLE_REMAP, true },
+        { "bypass-soft", KBLAY_STATE_BYPASS_SOFT, KBLAY_ROLE_REMAP, true },
+        { "base-role", KBLAY_STATE_ACTIVE, KBLAY_ROLE_BASE, true },
+        { "remap-no-shift", KBLAY_STATE_ACTIVE, KBLAY_ROLE_REMAP, false },
+        { "remap-shift", KBLAY_STATE_ACTIVE, KBLAY_ROLE_REMAP, true },
+    };
+    const auto s = Stream();
+    for (const auto& v : variants)
+    {
+        Run(ctx, v, s, false);
+        Run(ctx, v, s, true);
+    }
+}
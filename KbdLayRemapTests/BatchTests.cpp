@@ -0,0 +1,117 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <random>
+
+// KbdLayEngineProcessBatch against KbdLayEngineProcess one event at a time:
+// the same output, InputEnd after each input, result tallies, and where a
+// batch stops when Out runs short.
+
+namespace
+{
+    const uint16_t kMacroKey = 0x21;
+
+    // Remap-with-shift rules (the shift stage is on) plus one macro.
+    std::vector<uint8_t> Rules()
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_4);
+        std::vector<KBLAY_MACRO_STEP> steps;
+        for (uint16_t k = 0x10; k < 0x18; ++k)
+        {
+            steps.push_back(MacroDown(k));
+            steps.push_back(MacroUp(k));
+        }
+        b.Rule(kMacroKey, 0, b.Macro(steps), KBLAY_FLAG_MACRO)
+         .Rule(0x1A, 0, 0x1B, 0)
+         .Rule(0x28, 0, 0x08, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0)
+         .Rule(0x0D, 0, 0x0C, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0);
+        return b.Bytes();
+    }
+
+    std::vector<KBLAY_KEY_EVENT> Stream(uint32_t seed, size_t count)
+    {
+        static const uint16_t keys[] = { 0x1A, 0x28, 0x0D, KBLAY_MAKE_LSHIFT, 0x10, kMacroKey, 0x39 };
+        std::mt19937 rng(seed);
+        std::vector<KBLAY_KEY_EVENT> s;
+        for (size_t i = 0; i < count; ++i)
+            s.push_back(KeyDown(keys[rng() % 7], (uint16_t)(rng() % 2 ? KBLAY_KEY_BREAK : 0)));
+        return s;
+    }
+}
+
+KBLAY_TEST(BatchMatchesOneEventAtATime)
+{
+    const auto rules = Rules();
+    for (uint32_t seed = 1; seed <= 16; ++seed)
+    {
+        for (uint32_t state = KBLAY_STATE_BYPASS_HARD; state <= KBLAY_STATE_ACTIVE; ++state)
+        {
+            for (uint32_t role = KBLAY_ROLE_NONE; role <= KBLAY_ROLE_REMAP; ++role)
+            {
+                const auto in = Stream(seed, 300);
+                TestEngine single;
+                TestEngine batched;
+                CHECK(single.Load(rules));
+                CHECK(batched.Load(rules));
+                single.State = batched.State = state;
+                single.Role = batched.Role = role;
+
+                std::vector<KBLAY_KEY_EVENT> want;
+                std::vector<uint16_t> wantEnds;
+                uint32_t wantResults[KBLAY_ENGINE_RESULT_KINDS] = {};
+                for (const auto& e : in)
+                {
+                    KBLAY_ENGINE_RESULT r;
+                    const auto o = single.Feed(e, &r);
+                    want.insert(want.end(), o.begin(), o.end());
+                    wantEnds.push_back((uint16_t)want.size());
+                    ++wantResults[r];
+                }
+
+                // Out is big enough for everything: one call takes it all.
+                std::vector<KBLAY_KEY_EVENT> out(in.size() * KBLAY_ENGINE_MAX_OUTPUT);
+                std::vector<uint16_t> ends(in.size());
+                KBLAY_ENGINE_BATCH batch;
+                const size_t taken = KbdLayEngineProcessBatch(batched.Engine.get(), state, role, batched.NowMs,
+                    in.data(), in.size(), out.data(), out.size(), ends.data(), &batch);
+                CHECK_EQ(taken, in.size());
+                out.resize(batch.Produced);
+                CHECK(SameKeys(out, want));
+                CHECK(ends == wantEnds);
+                for (uint32_t k = 0; k < KBLAY_ENGINE_RESULT_KINDS; ++k)
+                    CHECK_EQ(batch.Results[k], wantResults[k]);
+            }
+        }
+    }
+}
+
+KBLAY_TEST(BatchStopsWhenOutCannotHoldAFullExpansion)
+{
+    TestEngine t;
+    CHECK(t.Load(Rules()));
+    const KBLAY_KEY_EVENT in[] = { KeyDown(kMacroKey), KeyUp(kMacroKey), KeyDown(0x1A) };
+
+    // Room for one worst case and 15 more: after the macro's 16 events the
+    // next input would not be sure of room.
+    KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT + 15];
+    KBLAY_ENGINE_BATCH batch;
+    size_t taken = KbdLayEngineProcessBatch(t.Engine.get(), t.State, t.Role, t.NowMs, in, 3, out,
+        KBLAY_ENGINE_MAX_OUTPUT + 15, nullptr, &batch);
+    CHECK_EQ(taken, (size_t)1);
+    CHECK_EQ(batch.Produced, 16u);
+    CHECK_EQ(batch.Results[KBLAY_ENGINE_MACRO], 1u);
+
+    // Too little room for even one input: nothing is taken.
+    taken = KbdLayEngineProcessBatch(t.Engine.get(), t.State, t.Role, t.NowMs, in + 1, 2, out,
+        KBLAY_ENGINE_MAX_OUTPUT - 1, nullptr, &batch);
+    CHECK_EQ(taken, (size_t)0);
+    CHECK_EQ(batch.Produced, 0u);
+
+    // Resuming where it stopped gives what one long batch would have.
+    taken = KbdLayEngineProcessBatch(t.Engine.get(), t.State, t.Role, t.NowMs, in + 1, 2, out,
+        KBLAY_ENGINE_MAX_OUTPUT + 15, nullptr, &batch);
+    CHECK_EQ(taken, (size_t)2);
+    CHECK_EQ(batch.Produced, 1u);
+    CHECK_EQ(batch.Results[KBLAY_ENGINE_MACRO], 1u);
+    CHECK_EQ(batch.Results[KBLAY_ENGINE_REMAP], 1u);
+    CHECK(SameKey(out[0], KeyDown(0x1B)));
+}
@@ -0,0 +1,7 @@
+int RunRegisteredBenches(int argc, char** argv);
+
+// kblay_bench [--quick] [--trace=FILE...] [name-filter...]
+int main(int argc, char** argv)
+{
+    return RunRegisteredBenches(argc, argv);
+}
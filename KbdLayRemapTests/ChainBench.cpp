@@ -0,0 +1,82 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <cstdio>
+#include <random>
+
+// Specialized stage chains against the chain with every stage on: the same
+// keymap and stream, once with only the stages it needs and once with a
+// macro, a dual-role key, a shifted output and debounce on but never hit.
+
+namespace
+{
+    std::vector<uint8_t> Rules(bool everyStage)
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_5);
+        for (uint16_t k = 0x10; k <= 0x19; ++k)
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0, KBLAY_MODGROUP_SHIFT, 0);
+        for (uint16_t k = 0x1E; k <= 0x26; ++k)
+            b.Rule(k, 0, (uint16_t)(0x2C + (k - 0x1E) % 7), 0, KBLAY_MODGROUP_SHIFT, 0);
+        if (everyStage)
+        {
+            b.Rule(0x3B, 0, b.Macro({ MacroDown(0x20), MacroUp(0x20) }), KBLAY_FLAG_MACRO)
+             .Rule(0x3C, 0, b.TapHold(0x3C, KBLAY_MAKE_LSHIFT, 200), KBLAY_FLAG_TAPHOLD)
+             .Rule(0x3D, 0, 0x08, KBLAY_FLAG_SHIFT);
+        }
+        return b.Bytes();
+    }
+
+    std::vector<KBLAY_KEY_EVENT> Stream()
+    {
+        std::mt19937 rng(41);
+        std::vector<KBLAY_KEY_EVENT> s;
+        for (int i = 0; i < 2048; ++i)
+        {
+            const uint16_t k = (uint16_t)(0x10 + rng() % 23);
+            s.push_back(KeyDown(k));
+            s.push_back(KeyUp(k));
+        }
+        return s;
+    }
+
+    void Run(BenchContext& ctx, const std::string& name, uint32_t state, bool everyStage, const std::vector<KBLAY_KEY_EVENT>& s)
+    {
+        TestEngine t;
+        t.Load(Rules(everyStage));
+        if (everyStage)
+            KbdLayEngineSetDebounce(t.Engine.get(), 1, t.NowMs);
+
+        KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+        KBLAY_ENGINE_RESULT result;
+        const uint64_t target = ctx.Iterations(4000000);
+        uint64_t now = t.NowMs;
+        uint64_t events = 0;
+        uint64_t produced = 0;
+
+        BenchTimer timer;
+        while (events < target)
+        {
+            for (const auto& e : s)
+            {
+                now += 2;
+                produced += KbdLayEngineProcess(t.Engine.get(), state, KBLAY_ROLE_REMAP, now, &e, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+            }
+            events += s.size();
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(produced);
+
+        char detail[32];
+        std::snprintf(detail, sizeof(detail), "stages 0x%02X", (unsigned)t.Engine->Stages);
+        ctx.Report("chain/" + name + (everyStage ? "/every-stage" : "/specialized"), events, seconds, detail);
+    }
+}
+
+KBLAY_BENCH(ChainSpecialization)
+{
+    const auto s = Stream();
+    for (bool everyStage : { false, true })
+    {
+        Run(ctx, "active", KBLAY_STATE_ACTIVE, everyStage, s);
+        Run(ctx, "bypass-soft", KBLAY_STATE_BYPASS_SOFT, everyStage, s);
+    }
+}
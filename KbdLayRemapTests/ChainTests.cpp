@@ -0,0 +1,129 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <random>
+
+// Stage chains: which stages an engine runs for its State, Role, table and
+// debounce window, and that a chain with stages left out translates exactly
+// as the chain with every stage on.
+
+namespace
+{
+    // Remaps on the letter rows while Shift is up; no stage beyond the
+    // keymap needs them.
+    void PlainRules(TestBlob& b)
+    {
+        for (uint16_t k = 0x10; k <= 0x19; ++k)
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0, KBLAY_MODGROUP_SHIFT, 0);
+        b.Rule(0x1E, 0, 0x30, 0, KBLAY_MODGROUP_SHIFT, 0);
+    }
+
+    // The same rules plus a macro, a dual-role key and a shifted output on
+    // keys the streams below never press, so every stage is on and idle.
+    std::vector<uint8_t> EveryStageRules()
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_5);
+        PlainRules(b);
+        b.Rule(0x3B, 0, b.Macro({ MacroDown(0x20), MacroUp(0x20) }), KBLAY_FLAG_MACRO)
+         .Rule(0x3C, 0, b.TapHold(0x3C, KBLAY_MAKE_LSHIFT, 200), KBLAY_FLAG_TAPHOLD)
+         .Rule(0x3D, 0, 0x08, KBLAY_FLAG_SHIFT);
+        return b.Bytes();
+    }
+
+    std::vector<uint8_t> KeymapRules()
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_5);
+        PlainRules(b);
+        return b.Bytes();
+    }
+
+    uint32_t StagesFor(TestEngine& t, uint32_t state, uint32_t role)
+    {
+        t.State = state;
+        t.Role = role;
+        t.Feed(KeyUp(0x50));
+        return t.Engine->Stages;
+    }
+}
+
+KBLAY_TEST(ChainStagesFollowStateRoleAndTable)
+{
+    TestEngine t;
+    CHECK(t.Load(KeymapRules()));
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_ACTIVE, KBLAY_ROLE_REMAP), (uint32_t)KBLAY_STAGE_KEYMAP);
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_ACTIVE, KBLAY_ROLE_BASE), 0u);
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_BYPASS_SOFT, KBLAY_ROLE_REMAP), 0u);
+
+    // Macro and shift stages only where the keymap runs; the clock always.
+    CHECK(t.Load(EveryStageRules()));
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_ACTIVE, KBLAY_ROLE_REMAP),
+        (uint32_t)(KBLAY_STAGE_TAPHOLD | KBLAY_STAGE_KEYMAP | KBLAY_STAGE_MACRO | KBLAY_STAGE_SHIFT));
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_BYPASS_SOFT, KBLAY_ROLE_REMAP), (uint32_t)KBLAY_STAGE_TAPHOLD);
+
+    // Debounce runs in every state but hard bypass.
+    KbdLayEngineSetDebounce(t.Engine.get(), 10, t.NowMs);
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_ACTIVE, KBLAY_ROLE_REMAP), (uint32_t)KBLAY_STAGE_ALL);
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_BYPASS_SOFT, KBLAY_ROLE_NONE), (uint32_t)(KBLAY_STAGE_TAPHOLD | KBLAY_STAGE_DEBOUNCE));
+    CHECK_EQ(StagesFor(t, KBLAY_STATE_BYPASS_HARD, KBLAY_ROLE_REMAP), (uint32_t)KBLAY_STAGE_TAPHOLD);
+}
+
+KBLAY_TEST(ChainIsPickedAgainOnlyWhenItsInputsChange)
+{
+    TestEngine t;
+    CHECK(t.Load(EveryStageRules()));
+    t.Feed(KeyDown(0x10));
+    KBLAY_ENGINE_CHAIN* const chain = t.Engine->Chain;
+    const uint32_t key = t.Engine->ChainKey;
+    t.Feed(KeyUp(0x10));
+    CHECK(t.Engine->Chain == chain);
+    CHECK_EQ(t.Engine->ChainKey, key);
+
+    t.State = KBLAY_STATE_BYPASS_SOFT;
+    t.Feed(KeyDown(0x10));
+    CHECK(t.Engine->Chain != chain);
+
+    // A dual-role key in flight keeps the clock stage on under a table
+    // without one, so its release still resolves it.
+    t.State = KBLAY_STATE_ACTIVE;
+    CHECK(t.Feed(KeyDown(0x3C)).empty());
+    CHECK(t.Load(KeymapRules()));
+    t.Feed(KeyUp(0x10));
+    CHECK(t.Engine->Stages & KBLAY_STAGE_TAPHOLD);
+    CHECK(SameKeys(t.Feed(KeyUp(0x3C)), { KeyDown(0x3C), KeyUp(0x3C) }));
+}
+
+KBLAY_TEST(ChainsWithStagesLeftOutMatchTheFullChain)
+{
+    static const uint16_t keys[] = { 0x10, 0x13, 0x17, 0x1E, 0x1F, 0x2A, 0x36, 0x39, 0x4B };
+    for (uint32_t seed = 1; seed <= 8; ++seed)
+    {
+        for (uint32_t state = KBLAY_STATE_BYPASS_HARD; state <= KBLAY_STATE_ACTIVE; ++state)
+        {
+            for (uint32_t role = KBLAY_ROLE_NONE; role <= KBLAY_ROLE_REMAP; ++role)
+            {
+                TestEngine lean;
+                TestEngine full;
+                CHECK(lean.Load(KeymapRules()));
+                CHECK(full.Load(EveryStageRules()));
+                // A window shorter than any gap below drops nothing.
+                KbdLayEngineSetDebounce(full.Engine.get(), 1, full.NowMs);
+                lean.State = full.State = state;
+                lean.Role = full.Role = role;
+
+                std::mt19937 rng(seed);
+                for (int i = 0; i < 500; ++i)
+                {
+                    const uint16_t k = keys[rng() % (sizeof(keys) / sizeof(keys[0]))];
+                    const KBLAY_KEY_EVENT in = KeyDown(k, (uint16_t)(rng() % 2 ? KBLAY_KEY_BREAK : 0));
+                    lean.NowMs = full.NowMs += 1 + rng() % 40;
+
+                    KBLAY_ENGINE_RESULT leanResult, fullResult;
+                    const auto leanOut = lean.Feed(in, &leanResult);
+                    const auto fullOut = full.Feed(in, &fullResult);
+                    CHECK(SameKeys(leanOut, fullOut));
+                    CHECK_EQ(leanResult, fullResult);
+                }
+                CHECK(lean.Engine->Stages != full.Engine->Stages);
+            }
+        }
+    }
+}
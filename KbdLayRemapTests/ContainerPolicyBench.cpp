@@ -0,0 +1,49 @@
+#include "ContainerPolicy.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+
+// Resolve cost for random and single-field-sequential ContainerIds, hits and
+// misses, at config sizes from a handful of keyboards to a large fleet list.
+
+KBLAY_BENCH(ContainerPolicyResolve)
+{
+    ContainerAssignment a;
+    a.Role = KBLAY_ROLE_REMAP;
+    a.State = KBLAY_STATE_ACTIVE;
+
+    for (size_t count : { (size_t)8, (size_t)1024, (size_t)65536 })
+    {
+        for (int pattern = 0; pattern < 2; ++pattern)
+        {
+            std::vector<GUID> ids = RandomGuids(count, 11);
+            if (pattern == 1)
+            {
+                for (uint32_t i = 0; i < count; ++i)
+                    ids[i] = SequentialGuid(i);
+            }
+            const std::vector<GUID> misses = RandomGuids(count, 12);
+
+            ContainerPolicy p;
+            BenchTimer build;
+            for (const auto& id : ids)
+                p.Add(id, a);
+            const double buildSeconds = build.Seconds();
+
+            const std::string name = std::string("container-policy/") + (pattern ? "sequential/" : "random/") + std::to_string(count);
+            ctx.Report(name + "/add", count, buildSeconds);
+
+            for (int miss = 0; miss < 2; ++miss)
+            {
+                const std::vector<GUID>& keys = miss ? misses : ids;
+                const uint64_t lookups = ctx.Iterations(20000000);
+                uint64_t sum = 0;
+                BenchTimer timer;
+                for (uint64_t i = 0; i < lookups; ++i)
+                    sum += p.Resolve(keys[i % keys.size()]).Role;
+                const double seconds = timer.Seconds();
+                KeepValue(sum);
+                ctx.Report(name + (miss ? "/resolve-miss" : "/resolve-hit"), lookups, seconds);
+            }
+        }
+    }
+}
@@ -0,0 +1,137 @@
+#include "ContainerPolicy.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+
+static ContainerAssignment Assign(UINT32 role)
+{
+    ContainerAssignment a;
+    a.Role = role;
+    a.State = KBLAY_STATE_ACTIVE;
+    return a;
+}
+
+KBLAY_TEST(ContainerPolicyResolvesAddedIds)
+{
+    ContainerPolicy p;
+    const auto ids = RandomGuids(3, 1);
+    CHECK(p.Add(ids[0], Assign(KBLAY_ROLE_REMAP)));
+    CHECK(p.Add(ids[1], Assign(KBLAY_ROLE_BASE)));
+
+    CHECK_EQ(p.Resolve(ids[0]).Role, (UINT32)KBLAY_ROLE_REMAP);
+    CHECK_EQ(p.Resolve(ids[1]).Role, (UINT32)KBLAY_ROLE_BASE);
+    CHECK_EQ(p.Resolve(ids[2]).Role, (UINT32)KBLAY_ROLE_NONE);
+    CHECK_EQ(p.Resolve(ids[2]).State, (UINT32)KBLAY_STATE_BYPASS_HARD);
+    CHECK_EQ(p.Size(), (size_t)2);
+}
+
+KBLAY_TEST(ContainerPolicyIgnoresNullGuid)
+{
+    ContainerPolicy p;
+    CHECK(p.Add(GUID{}, Assign(KBLAY_ROLE_REMAP)));
+    CHECK_EQ(p.Size(), (size_t)0);
+    CHECK_EQ(p.Resolve(GUID{}).Role, (UINT32)KBLAY_ROLE_NONE);
+}
+
+KBLAY_TEST(ContainerPolicyDemotesConflictingRoles)
+{
+    ContainerPolicy p;
+    const GUID id = SequentialGuid(7);
+    CHECK(p.Add(id, Assign(KBLAY_ROLE_REMAP)));
+    CHECK(p.Add(id, Assign(KBLAY_ROLE_REMAP)));      // same role twice is fine
+    CHECK(!p.Add(id, Assign(KBLAY_ROLE_BASE)));
+    CHECK(!p.Add(id, Assign(KBLAY_ROLE_REMAP)));     // stays demoted
+
+    CHECK_EQ(p.Resolve(id).Role, (UINT32)KBLAY_ROLE_NONE);
+    CHECK_EQ(p.Conflicts().size(), (size_t)1);
+    CHECK(IsEqualGUID(p.Conflicts()[0], id));
+}
+
+KBLAY_TEST(ContainerPolicyKeepsEveryIdAcrossGrowth)
+{
+    for (int pattern = 0; pattern < 2; ++pattern)
+    {
+        ContainerPolicy p;
+        std::vector<GUID> ids = RandomGuids(5000, 2);
+        if (pattern == 1)
+        {
+            for (uint32_t i = 0; i < ids.size(); ++i)
+                ids[i] = SequentialGuid(i);
+        }
+
+        for (size_t i = 0; i < ids.size(); ++i)
+            CHECK(p.Add(ids[i], Assign(i % 2 ? KBLAY_ROLE_BASE : KBLAY_ROLE_REMAP)));
+        CHECK_EQ(p.Size(), ids.size());
+
+        size_t wrong = 0;
+        for (size_t i = 0; i < ids.size(); ++i)
+            wrong += p.Resolve(ids[i]).Role != (i % 2 ? KBLAY_ROLE_BASE : KBLAY_ROLE_REMAP);
+        CHECK_EQ(wrong, (size_t)0);
+
+        for (const auto& miss : RandomGuids(1000, 3))
+            wrong += p.Resolve(miss).Role != KBLAY_ROLE_NONE;
+        CHECK_EQ(wrong, (size_t)0);
+    }
+}
+
+KBLAY_TEST(CompileContainerPolicyCountsBadTokensAndConflicts)
+{
+    const std::wstring a = L"{8a1b2c00-1234-5678-0000-000000000001}";
+    const std::wstring b = L"8a1b2c00-1234-5678-0000-000000000002";
+
+    ContainerPolicyLists lists;
+    lists.Remap = a + L"; not-a-guid ;" + b + L";;";
+    lists.Base = L" " + b + L" ; {zz}";
+
+    ContainerPolicy p;
+    CHECK_EQ(CompileContainerPolicy(lists, p), (size_t)2);
+
+    GUID ga{}, gb{};
+    CHECK(ParseGuid(a, ga));
+    CHECK(ParseGuid(b, gb));
+    CHECK_EQ(p.Resolve(ga).Role, (UINT32)KBLAY_ROLE_REMAP);
+    CHECK_EQ(p.Resolve(gb).Role, (UINT32)KBLAY_ROLE_NONE);
+    CHECK_EQ(p.Conflicts().size(), (size_t)1);
+}
+
+KBLAY_TEST(CompileContainerPolicyReadsPerContainerTargets)
+{
+    const std::wstring a = L"{8a1b2c00-1234-5678-0000-000000000001}";
+    const std::wstring b = L"{8a1b2c00-1234-5678-0000-000000000002}";
+    const std::wstring c = L"{8a1b2c00-1234-5678-0000-000000000003}";
+    const std::wstring d = L"{8a1b2c00-1234-5678-0000-000000000004}";
+
+    // b and d pick a layout; c names two and is bypassed; bad KLIDs are bad tokens.
+    ContainerPolicyLists lists;
+    lists.Remap = a + L"; " + b + L":0000040c ;" + c + L":00000407;" + c + L":0000040C;" + d + L":00000407;" +
+        a + L":1234; " + a + L":00000000; " + a + L":0000040G";
+    ContainerPolicy p;
+    CHECK_EQ(CompileContainerPolicy(lists, p), (size_t)3);
+
+    GUID ga{}, gb{}, gc{}, gd{};
+    CHECK(ParseGuid(a, ga) && ParseGuid(b, gb) && ParseGuid(c, gc) && ParseGuid(d, gd));
+    CHECK_EQ(p.Resolve(ga).Role, (UINT32)KBLAY_ROLE_REMAP);
+    CHECK_EQ(p.Resolve(ga).Profile, (UINT32)0);
+    CHECK_EQ(p.Resolve(gb).Role, (UINT32)KBLAY_ROLE_REMAP);
+    CHECK_EQ(p.Resolve(gb).Profile, (UINT32)0x0000040C);
+    CHECK_EQ(p.Resolve(gc).Role, (UINT32)KBLAY_ROLE_NONE);
+    CHECK_EQ(p.Resolve(gd).Profile, (UINT32)0x00000407);
+    CHECK(p.Conflicts().size() == 1 && IsEqualGUID(p.Conflicts()[0], gc));
+
+    // Each layout once, in the order first seen; c's first target counts.
+    CHECK(p.Profiles() == std::vector<UINT32>({ 0x0000040C, 0x00000407 }));
+}
+
+KBLAY_TEST(KlidRoundTrips)
+{
+    UINT32 k = 0;
+    CHECK(ParseKlid(L"00000411", k));
+    CHECK_EQ(k, (UINT32)0x411);
+    CHECK(ParseKlid(L"0001040c", k));
+    CHECK(KlidToString(k) == L"0001040C");
+    CHECK(!ParseKlid(L"", k));
+    CHECK(!ParseKlid(L"0000409", k));
+    CHECK(!ParseKlid(L"000004090", k));
+    CHECK(!ParseKlid(L" 0000409", k));
+    CHECK(!ParseKlid(L"00000000", k));
+    CHECK_EQ(k, (UINT32)0x1040C);
+}
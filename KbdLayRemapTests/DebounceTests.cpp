@@ -0,0 +1,241 @@
+#include "KbdLayTest.hpp"
+#include "TraceRecorder.hpp"
+#include <map>
+#include <random>
+
+// The chatter filter on a virtual clock: what falls inside a window and what
+// does not, per key and prefix, across states and the 32-bit clock wrap,
+// and recorded chatter replayed through the trace path.
+
+namespace
+{
+    const uint16_t kA = 0x1E;
+    const uint16_t kB = 0x30;
+    const uint16_t kCtrl = 0x1D;
+
+    std::vector<uint8_t> Rules()
+    {
+        return TestBlob().Rule(kA, 0, kB, 0).Rule(0x58, 0, 0x57, 0).Bytes();
+    }
+
+    struct Clocked
+    {
+        TestEngine T;
+        explicit Clocked(uint32_t windowMs, uint64_t startMs = 1000)
+        {
+            T.NowMs = startMs;
+            KbdLayEngineResetState(T.Engine.get(), startMs);
+            T.Load(Rules());
+            KbdLayEngineSetDebounce(T.Engine.get(), windowMs, startMs);
+        }
+
+        // The event at `atMs`; DEBOUNCED events leave no output.
+        KBLAY_ENGINE_RESULT At(uint64_t atMs, const KBLAY_KEY_EVENT& in, std::vector<KBLAY_KEY_EVENT>* out = nullptr)
+        {
+            T.NowMs = atMs;
+            KBLAY_ENGINE_RESULT r;
+            const auto o = T.Feed(in, &r);
+            if (out) out->insert(out->end(), o.begin(), o.end());
+            return r;
+        }
+    };
+}
+
+KBLAY_TEST(DebounceDropsReleaseChatterAndItsBreak)
+{
+    Clocked c(20);
+    std::vector<KBLAY_KEY_EVENT> out;
+    CHECK_EQ(c.At(1000, KeyDown(kA), &out), KBLAY_ENGINE_REMAP);
+    CHECK_EQ(c.At(1080, KeyUp(kA), &out), KBLAY_ENGINE_REMAP);
+
+    // The switch bounces 3 ms after release: make and break both go.
+    CHECK_EQ(c.At(1083, KeyDown(kA), &out), KBLAY_ENGINE_DEBOUNCED);
+    CHECK_EQ(c.At(1084, KeyUp(kA), &out), KBLAY_ENGINE_DEBOUNCED);
+
+    // Each bounce pushes the window out from its own break.
+    CHECK_EQ(c.At(1103, KeyDown(kA), &out), KBLAY_ENGINE_DEBOUNCED);
+    CHECK_EQ(c.At(1104, KeyUp(kA), &out), KBLAY_ENGINE_DEBOUNCED);
+
+    // A real press after the window passes.
+    CHECK_EQ(c.At(1124, KeyDown(kA), &out), KBLAY_ENGINE_REMAP);
+    CHECK_EQ(c.At(1200, KeyUp(kA), &out), KBLAY_ENGINE_REMAP);
+    CHECK(SameKeys(out, { KeyDown(kB), KeyUp(kB), KeyDown(kB), KeyUp(kB) }));
+}
+
+KBLAY_TEST(DebounceWindowEdgesAndTypematicRecovery)
+{
+    Clocked c(20);
+    c.At(1000, KeyDown(kA));
+    c.At(1050, KeyUp(kA));
+    CHECK_EQ(c.At(1069, KeyDown(kA)), KBLAY_ENGINE_DEBOUNCED);  // window - 1
+    CHECK_EQ(c.At(1070, KeyDown(kA)), KBLAY_ENGINE_REMAP);      // window: a repeat recovers the key
+
+    // Press chatter: the bounce's make is swallowed with the break that
+    // ends it, so nothing is left down; the first repeat brings it back.
+    Clocked p(20);
+    std::vector<KBLAY_KEY_EVENT> out;
+    p.At(1000, KeyDown(kA), &out);
+    p.At(1002, KeyUp(kA), &out);
+    CHECK_EQ(p.At(1004, KeyDown(kA), &out), KBLAY_ENGINE_DEBOUNCED);
+    CHECK_EQ(p.At(1500, KeyDown(kA), &out), KBLAY_ENGINE_REMAP);
+    CHECK_EQ(p.At(1533, KeyDown(kA), &out), KBLAY_ENGINE_REMAP);
+    CHECK_EQ(p.At(1540, KeyUp(kA), &out), KBLAY_ENGINE_REMAP);
+    CHECK(SameKeys(out, { KeyDown(kB), KeyUp(kB), KeyDown(kB), KeyDown(kB), KeyUp(kB) }));
+}
+
+KBLAY_TEST(DebounceKeepsE0KeysApart)
+{
+    Clocked c(30);
+    c.At(1000, KeyDown(kCtrl, KBLAY_KEY_E0));
+    c.At(1010, KeyUp(kCtrl, KBLAY_KEY_E0));
+
+    // Left Ctrl shares the make code with Right Ctrl but not the prefix.
+    CHECK_EQ(c.At(1012, KeyDown(kCtrl)), KBLAY_ENGINE_UNMAPPED);
+    CHECK_EQ(c.At(1014, KeyDown(kCtrl, KBLAY_KEY_E0)), KBLAY_ENGINE_DEBOUNCED);
+
+    // E1 sequences are never filtered.
+    const KBLAY_KEY_EVENT pause = KeyDown(kCtrl, KBLAY_KEY_E1);
+    CHECK(c.At(1016, pause) != KBLAY_ENGINE_DEBOUNCED);
+    CHECK(c.At(1017, KeyUp(kCtrl, KBLAY_KEY_E1)) != KBLAY_ENGINE_DEBOUNCED);
+    CHECK(c.At(1018, pause) != KBLAY_ENGINE_DEBOUNCED);
+}
+
+KBLAY_TEST(DebounceWindowIsClampedAndOffAtZero)
+{
+    Clocked wide(1000);
+    CHECK_EQ(wide.T.Engine->Debounce.WindowMs, (UINT32)KBLAY_DEBOUNCE_MAX_MS);
+    wide.At(1000, KeyUp(kA));
+    CHECK_EQ(wide.At(1000 + KBLAY_DEBOUNCE_MAX_MS - 1, KeyDown(kA)), KBLAY_ENGINE_DEBOUNCED);
+    CHECK_EQ(wide.At(1000 + KBLAY_DEBOUNCE_MAX_MS, KeyDown(kA)), KBLAY_ENGINE_REMAP);
+
+    Clocked off(0);
+    off.At(1000, KeyUp(kA));
+    CHECK_EQ(off.At(1000, KeyDown(kA)), KBLAY_ENGINE_REMAP);
+    CHECK_EQ(off.T.Engine->Stages & KBLAY_STAGE_DEBOUNCE, 0);
+}
+
+KBLAY_TEST(DebounceRunsInSoftBypassButNotHard)
+{
+    Clocked soft(20);
+    soft.T.State = KBLAY_STATE_BYPASS_SOFT;
+    soft.At(1000, KeyUp(kA));
+    CHECK_EQ(soft.At(1005, KeyDown(kA)), KBLAY_ENGINE_DEBOUNCED);
+
+    Clocked hard(20);
+    hard.T.State = KBLAY_STATE_BYPASS_HARD;
+    hard.At(1000, KeyUp(kA));
+    CHECK_EQ(hard.At(1005, KeyDown(kA)), KBLAY_ENGINE_PASS);
+}
+
+KBLAY_TEST(DebounceSurvivesTheClockWrap)
+{
+    // The table keeps the low 32 bits of the clock.
+    const uint64_t wrap = 0x100000000ull;
+    Clocked c(20, wrap - 100);
+    c.At(wrap - 5, KeyDown(kA));
+    c.At(wrap - 2, KeyUp(kA));
+    CHECK_EQ(c.At(wrap + 3, KeyDown(kA)), KBLAY_ENGINE_DEBOUNCED);
+    CHECK_EQ(c.At(wrap + 4, KeyUp(kA)), KBLAY_ENGINE_DEBOUNCED);
+    CHECK_EQ(c.At(wrap + 30, KeyDown(kA)), KBLAY_ENGINE_REMAP);
+
+    // A key untouched since long before the wrap is not in its window.
+    CHECK_EQ(c.At(wrap + 31, KeyDown(kCtrl)), KBLAY_ENGINE_UNMAPPED);
+}
+
+KBLAY_TEST(DebounceNeverLeavesAKeyDown)
+{
+    static const uint16_t keys[] = { kA, kCtrl, 0x2A, 0x10, 0x39 };
+    for (uint32_t seed = 1; seed <= 32; ++seed)
+    {
+        std::mt19937 rng(seed);
+        Clocked c(1 + rng() % 40);
+        std::vector<KBLAY_KEY_EVENT> out;
+        std::map<uint16_t, bool> down;
+        uint64_t ms = 1000;
+        uint32_t dropped = 0;
+
+        // Presses with chatter on either edge, then every key released.
+        for (int i = 0; i < 400; ++i)
+        {
+            const uint16_t k = keys[rng() % 5];
+            const bool isDown = down[k];
+            ms += rng() % 3 == 0 ? rng() % 4 : 5 + rng() % 80;
+            dropped += c.At(ms, isDown ? KeyUp(k) : KeyDown(k), &out) == KBLAY_ENGINE_DEBOUNCED;
+            down[k] = !isDown;
+        }
+        for (auto& kv : down)
+        {
+            if (kv.second)
+                c.At(ms += 1, KeyUp(kv.first), &out);
+        }
+        CHECK(dropped != 0);
+
+        // Whatever got through ends with every key up.
+        std::map<uint16_t, bool> outDown;
+        for (const auto& e : out)
+            outDown[e.MakeCode] = !(e.Flags & KBLAY_KEY_BREAK);
+        for (const auto& kv : outDown)
+            CHECK(!kv.second);
+    }
+}
+
+KBLAY_TEST(DebounceCountsDropsInBatchTallies)
+{
+    Clocked c(20);
+    const KBLAY_KEY_EVENT in[] = { KeyDown(kA), KeyUp(kA), KeyDown(kA), KeyUp(kA), KeyDown(kB) };
+    KBLAY_KEY_EVENT out[8 * KBLAY_ENGINE_MAX_OUTPUT];
+    KBLAY_ENGINE_BATCH batch;
+    // One clock reading for the whole batch: the second tap is chatter.
+    const size_t taken = KbdLayEngineProcessBatch(c.T.Engine.get(), c.T.State, c.T.Role, 1000, in, 5, out, 8 * KBLAY_ENGINE_MAX_OUTPUT, nullptr, &batch);
+    CHECK_EQ(taken, (size_t)5);
+    CHECK_EQ(batch.Results[KBLAY_ENGINE_DEBOUNCED], 2u);
+    CHECK_EQ(batch.Results[KBLAY_ENGINE_REMAP], 2u);
+    CHECK_EQ(batch.Results[KBLAY_ENGINE_UNMAPPED], 1u);
+    CHECK_EQ(batch.Produced, 3u);
+}
+
+KBLAY_TEST(DebounceReplaysRecordedChatter)
+{
+    TraceRecorder rec(Rules());
+    KbdLayEngineSetDebounce(rec.Engine().Engine.get(), 15, 1000);
+
+    // A worn switch: bounces on most releases, some presses.
+    std::mt19937 rng(45);
+    uint64_t ms = 1000;
+    for (int i = 0; i < 200; ++i)
+    {
+        const uint16_t k = i % 3 ? kA : 0x10;
+        rec.Key(KeyDown(k), ms += 60 + rng() % 60);
+        if (rng() % 4 == 0)
+        {
+            rec.Key(KeyUp(k), ms += 1);
+            rec.Key(KeyDown(k), ms += 1 + rng() % 3);
+        }
+        rec.Key(KeyUp(k), ms += 40 + rng() % 40);
+        if (rng() % 2 == 0)
+        {
+            rec.Key(KeyDown(k), ms += 1 + rng() % 10);
+            rec.Key(KeyUp(k), ms += 1 + rng() % 3);
+        }
+    }
+
+    size_t debounced = 0;
+    for (const auto& r : rec.Capture().Records)
+    {
+        debounced += r.Result == KBLAY_ENGINE_DEBOUNCED;
+        CHECK_EQ(r.DebounceMs, (UINT16)15);
+    }
+    CHECK(debounced > 50);
+
+    // The window travels in the records, so a replay drops the same events.
+    TraceReplayReport report;
+    CHECK(ReplayTrace(rec.Capture(), report));
+    CHECK_EQ(report.Mismatches, (size_t)0);
+
+    // And one that ignored it would not.
+    TraceCapture off = rec.Capture();
+    for (auto& r : off.Records)
+        r.DebounceMs = 0;
+    CHECK(ReplayTrace(off, report));
+    CHECK(report.Mismatches >= debounced);
+}
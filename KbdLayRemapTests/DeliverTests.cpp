@@ -0,0 +1,219 @@
+#include "FakeClassDriver.hpp"
+#include "KbdLayTest.hpp"
+#include <algorithm>
+#include <random>
+
+// Delivery through the outbox when the class driver takes less than it is
+// offered: every input is translated once, and output reaches the class
+// driver once and in order.
+
+namespace
+{
+    const uint16_t kA = 0x1E;
+    const uint16_t kB = 0x30;
+    const uint16_t kF = 0x21;
+    const uint16_t kG = 0x22;
+
+    // F types "abab..." (16 events); G types a shifted B.
+    std::vector<uint8_t> MacroRules()
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_4);
+        std::vector<KBLAY_MACRO_STEP> steps;
+        for (int i = 0; i < 4; ++i)
+        {
+            steps.push_back(MacroDown(kA));
+            steps.push_back(MacroUp(kA));
+            steps.push_back(MacroDown(kB));
+            steps.push_back(MacroUp(kB));
+        }
+        const uint16_t abab = b.Macro(steps);
+        const uint16_t shiftB = b.Macro({ MacroDown(KBLAY_MAKE_LSHIFT), MacroDown(kB), MacroUp(kB), MacroUp(KBLAY_MAKE_LSHIFT) });
+        b.Rule(kF, 0, abab, KBLAY_FLAG_MACRO)
+         .Rule(kG, 0, shiftB, KBLAY_FLAG_MACRO)
+         .Rule(kA, 0, kB, 0);
+        return b.Bytes();
+    }
+
+    std::vector<KBLAY_KEY_EVENT> MacroStream(uint32_t seed, size_t taps)
+    {
+        static const uint16_t keys[] = { kF, kG, kA, kB, 0x10, kF };
+        std::mt19937 rng(seed);
+        std::vector<KBLAY_KEY_EVENT> s;
+        for (size_t i = 0; i < taps; ++i)
+        {
+            const uint16_t k = keys[rng() % 6];
+            s.push_back(KeyDown(k));
+            s.push_back(KeyUp(k));
+        }
+        return s;
+    }
+
+    // What a class driver that takes everything would see.
+    std::vector<KBLAY_KEY_EVENT> Expected(const std::vector<uint8_t>& rules, const std::vector<KBLAY_KEY_EVENT>& in)
+    {
+        TestEngine t;
+        t.Load(rules);
+        std::vector<KBLAY_KEY_EVENT> out;
+        for (const auto& e : in)
+        {
+            const auto o = t.Feed(e);
+            out.insert(out.end(), o.begin(), o.end());
+        }
+        return out;
+    }
+}
+
+KBLAY_TEST(DeliverKeepsWhatTheClassDriverLeaves)
+{
+    const auto rules = MacroRules();
+    const std::vector<KBLAY_KEY_EVENT> in = { KeyDown(kF), KeyDown(kA), KeyUp(kA), KeyUp(kF) };
+
+    TestEngine t;
+    CHECK(t.Load(rules));
+    FakeClassDriver upper(t);
+    upper.Accept = [](uint32_t offered) { return offered < 3 ? offered : 3u; };
+    KBLAY_OUTBOX box{};
+
+    // Everything is translated at once; the class driver takes 3 of 18.
+    KBLAY_BUDGET budget = EventBudget(0);
+    UINT32 taken = 0;
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, in.data(), (UINT32)in.size(), &budget, &taken), KBLAY_DELIVER_FULL);
+    CHECK_EQ(taken, (UINT32)in.size());
+    CHECK_EQ(upper.Translated, (uint64_t)in.size());
+    CHECK_EQ(upper.Received.size(), (size_t)3);
+    CHECK_EQ(box.Count, 15u);
+
+    // Later calls only drain the outbox.
+    while (box.Count != 0)
+    {
+        budget = EventBudget(0);
+        const KBLAY_DELIVER_STATUS status = KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, nullptr, 0, &budget, &taken);
+        CHECK_EQ(taken, 0u);
+        CHECK_EQ(status, box.Count ? KBLAY_DELIVER_FULL : KBLAY_DELIVER_DONE);
+    }
+    CHECK_EQ(upper.Translated, (uint64_t)in.size());
+    CHECK(SameKeys(upper.Received, Expected(rules, in)));
+}
+
+KBLAY_TEST(DeliverTranslatesNothingWhileOutputIsOwed)
+{
+    const auto rules = MacroRules();
+    TestEngine t;
+    CHECK(t.Load(rules));
+    FakeClassDriver upper(t);
+    KBLAY_OUTBOX box{};
+
+    // A full class driver: the macro is translated and kept.
+    upper.Accept = [](uint32_t) { return 0u; };
+    const KBLAY_KEY_EVENT first[] = { KeyDown(kG) };
+    KBLAY_BUDGET budget = EventBudget(0);
+    UINT32 taken = 0;
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, first, 1, &budget, &taken), KBLAY_DELIVER_FULL);
+    CHECK_EQ(taken, 1u);
+    CHECK_EQ(box.Count, 4u);
+
+    // Newer input stays untouched until the owed output has gone.
+    const KBLAY_KEY_EVENT second[] = { KeyDown(kA), KeyUp(kA) };
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, second, 2, &budget, &taken), KBLAY_DELIVER_FULL);
+    CHECK_EQ(taken, 0u);
+    CHECK_EQ(upper.Translated, (uint64_t)1);
+
+    upper.Accept = nullptr;
+    budget = EventBudget(0);
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, second, 2, &budget, &taken), KBLAY_DELIVER_DONE);
+    CHECK_EQ(taken, 2u);
+    CHECK(SameKeys(upper.Received, { KeyDown(KBLAY_MAKE_LSHIFT), KeyDown(kB), KeyUp(kB), KeyUp(KBLAY_MAKE_LSHIFT), KeyDown(kB), KeyUp(kB) }));
+}
+
+KBLAY_TEST(DeliverStopsWhenTheBudgetRunsOut)
+{
+    const auto rules = MacroRules();
+    TestEngine t;
+    CHECK(t.Load(rules));
+    FakeClassDriver upper(t);
+    KBLAY_OUTBOX box{};
+
+    const auto in = MacroStream(7, 100);
+    KBLAY_BUDGET budget = EventBudget(4);
+    UINT32 taken = 0;
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, in.data(), (UINT32)in.size(), &budget, &taken), KBLAY_DELIVER_BUDGET);
+    CHECK_EQ(taken, 4u);
+    CHECK_EQ(box.Count, 0u);
+
+    // Time runs out too: a 50 us slice is over at the second clock reading,
+    // after one engine call's worth of input.
+    upper.TicksPerRead = 60;
+    budget = EventBudget(0, 50, upper.Clock);
+    UINT32 more = 0;
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, in.data() + taken, (UINT32)in.size() - taken, &budget, &more),
+        KBLAY_DELIVER_BUDGET);
+    CHECK(more != 0);
+    CHECK(taken + more < in.size());
+}
+
+KBLAY_TEST(DeliverMatchesTheEngineUnderShortAccepts)
+{
+    const auto rules = MacroRules();
+    for (uint32_t seed = 1; seed <= 64; ++seed)
+    {
+        const auto in = MacroStream(seed, 200);
+        TestEngine t;
+        CHECK(t.Load(rules));
+        FakeClassDriver upper(t);
+        std::mt19937 rng(seed);
+        upper.Accept = [&rng](uint32_t offered) { return rng() % 4 == 0 ? offered : (uint32_t)(rng() % (offered + 1)); };
+        KBLAY_OUTBOX box{};
+
+        // The port driver offers whatever was not taken yet, in runs of up
+        // to 8, until input and outbox are both empty.
+        size_t next = 0;
+        int calls = 0;
+        while ((next < in.size() || box.Count != 0) && ++calls < 100000)
+        {
+            const UINT32 run = (UINT32)std::min<size_t>(in.size() - next, 1 + rng() % 8);
+            KBLAY_BUDGET budget = EventBudget(1 + rng() % 6);
+            UINT32 taken = 0;
+            KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, in.data() + next, run, &budget, &taken);
+            CHECK(taken <= run);
+            next += taken;
+        }
+
+        CHECK_EQ(upper.Translated, (uint64_t)in.size());
+        CHECK(SameKeys(upper.Received, Expected(rules, in)));
+    }
+}
+
+KBLAY_TEST(DeliverQueuesTimerOutputBehindOwedOutput)
+{
+    // Space: tap Space, hold past 200 ms for Left Shift.
+    TestBlob b(KBLAY_RULE_BLOB_VERSION_5);
+    const uint16_t hold = b.TapHold(0x39, KBLAY_MAKE_LSHIFT, 200);
+    TestEngine t;
+    CHECK(t.Load(b.Rule(0x39, 0, hold, KBLAY_FLAG_TAPHOLD).Rule(kA, 0, kB, 0).Bytes()));
+    FakeClassDriver upper(t);
+    upper.Accept = [](uint32_t) { return 0u; };
+    KBLAY_OUTBOX box{};
+
+    const KBLAY_KEY_EVENT in[] = { KeyDown(kA), KeyDown(0x39) };
+    KBLAY_BUDGET budget = EventBudget(0);
+    UINT32 taken = 0;
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, in, 2, &budget, &taken), KBLAY_DELIVER_FULL);
+    CHECK_EQ(taken, 2u);
+    CHECK_EQ(box.Count, 1u);
+
+    // What the tap-hold timer does: the hold goes in behind B, and stays
+    // there while the class driver is full.
+    t.NowMs += 250;
+    box.Count += (UINT32)KbdLayEngineAdvance(t.Engine.get(), t.NowMs, box.Events + box.Count, KBLAY_OUTBOX_EVENTS - box.Count);
+    CHECK_EQ(box.Count, 2u);
+    CHECK(!KbdLayOutboxFlush(&box, &FakeClassDriver::Ops, &upper));
+    CHECK_EQ(box.Count, 2u);
+
+    // One at a time, in order, and the release goes out after both.
+    upper.Accept = [](uint32_t) { return 1u; };
+    CHECK(!KbdLayOutboxFlush(&box, &FakeClassDriver::Ops, &upper));
+    const KBLAY_KEY_EVENT up[] = { KeyUp(0x39) };
+    budget = EventBudget(0);
+    CHECK_EQ(KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, up, 1, &budget, &taken), KBLAY_DELIVER_DONE);
+    CHECK(SameKeys(upper.Received, { KeyDown(kB), KeyDown(KBLAY_MAKE_LSHIFT), KeyUp(KBLAY_MAKE_LSHIFT) }));
+}
@@ -0,0 +1,191 @@
+#include "DeviceInventory.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+#include "ScriptedPnpBackend.hpp"
+#include <cwctype>
+
+static FilterDeviceInfo Keyboard(uint32_t n, const wchar_t* name = L"Keyboard")
+{
+    FilterDeviceInfo d;
+    d.DevicePath = L"\\\\?\\HID#VID_04FE&PID_" + std::to_wstring(n) + L"#{kblay}";
+    d.ContainerId = SequentialGuid(n);
+    d.FriendlyName = name;
+    return d;
+}
+
+static bool Has(DeviceInventory& inv, const FilterDeviceInfo& d)
+{
+    for (const auto& x : inv.Snapshot()->Devices)
+    {
+        if (x.DevicePath == d.DevicePath && IsEqualGUID(x.ContainerId, d.ContainerId) && x.FriendlyName == d.FriendlyName)
+            return true;
+    }
+    return false;
+}
+
+KBLAY_TEST(InventoryStartEnumeratesAndSubscribes)
+{
+    PnpScript pnp;
+    pnp.Arrive(Keyboard(1), false);
+    pnp.Arrive(Keyboard(2), false);
+
+    DeviceInventory inv(pnp.Backend());
+    CHECK(inv.Start());
+    CHECK(inv.Live());
+    CHECK(pnp.Subscribed());
+    CHECK_EQ(inv.Snapshot()->Devices.size(), (size_t)2);
+    CHECK_EQ(inv.Version(), (uint64_t)1);
+
+    inv.Stop();
+    CHECK(!pnp.Subscribed());
+}
+
+KBLAY_TEST(InventoryTracksArrivalRemovalAndReAdd)
+{
+    PnpScript pnp;
+    pnp.Arrive(Keyboard(1), false);
+    DeviceInventory inv(pnp.Backend());
+    CHECK(inv.Start());
+    const uint64_t v0 = inv.Version();
+
+    pnp.Arrive(Keyboard(2));
+    CHECK(Has(inv, Keyboard(2)));
+    CHECK_EQ(inv.Version(), v0 + 1);
+
+    // A repeated arrival with the same properties changes nothing.
+    pnp.Arrive(Keyboard(2));
+    CHECK_EQ(inv.Version(), v0 + 1);
+
+    // Removal matches the path case-insensitively.
+    std::wstring upper = Keyboard(2).DevicePath;
+    for (auto& c : upper)
+        c = (wchar_t)towupper(c);
+    pnp.Remove(upper);
+    CHECK(!Has(inv, Keyboard(2)));
+    CHECK_EQ(inv.Snapshot()->Devices.size(), (size_t)1);
+    CHECK_EQ(inv.Version(), v0 + 2);
+
+    // Removing it again is a no-op.
+    pnp.Remove(upper);
+    CHECK_EQ(inv.Version(), v0 + 2);
+
+    // Re-plugged, renamed: back with its new name.
+    pnp.Arrive(Keyboard(2, L"Keyboard (re-added)"));
+    CHECK(Has(inv, Keyboard(2, L"Keyboard (re-added)")));
+    CHECK_EQ(inv.Version(), v0 + 3);
+
+    // A property refresh replaces the entry in place.
+    pnp.Arrive(Keyboard(2, L"Keyboard (renamed)"));
+    CHECK(Has(inv, Keyboard(2, L"Keyboard (renamed)")));
+    CHECK_EQ(inv.Snapshot()->Devices.size(), (size_t)2);
+}
+
+KBLAY_TEST(InventorySnapshotsAreImmutable)
+{
+    PnpScript pnp;
+    pnp.Arrive(Keyboard(1), false);
+    DeviceInventory inv(pnp.Backend());
+    inv.Start();
+
+    auto before = inv.Snapshot();
+    pnp.Remove(Keyboard(1).DevicePath);
+    CHECK_EQ(before->Devices.size(), (size_t)1);
+    CHECK_EQ(inv.Snapshot()->Devices.size(), (size_t)0);
+}
+
+KBLAY_TEST(InventoryRescanNotificationRecoversLostDeltas)
+{
+    PnpScript pnp;
+    pnp.Arrive(Keyboard(1), false);
+    DeviceInventory inv(pnp.Backend());
+    inv.Start();
+
+    // Lost notifications: the set changed without a delta.
+    pnp.Remove(Keyboard(1).DevicePath, false);
+    pnp.Arrive(Keyboard(3), false);
+    CHECK(Has(inv, Keyboard(1)));
+
+    // The notification thread only marks the inventory, however many come;
+    // the next reader enumerates once.
+    const uint64_t before = inv.Version();
+    for (int i = 0; i < 5; ++i)
+        pnp.NotifyFromThread({ DeviceChange::Kind::Rescan, {} });
+    CHECK(inv.RescanPending());
+    CHECK_EQ(pnp.State().Enumerations, (size_t)1);
+    CHECK_EQ(inv.Version(), before);
+    CHECK(!Has(inv, Keyboard(1)));
+    CHECK(Has(inv, Keyboard(3)));
+    CHECK(!inv.RescanPending());
+    CHECK_EQ(pnp.State().Enumerations, (size_t)2);
+    inv.Snapshot();
+    CHECK_EQ(pnp.State().Enumerations, (size_t)2);
+
+    // A rescan that finds a new device publishes; one that finds the same
+    // set in another order does not.
+    const uint64_t v = inv.Version();
+    pnp.Arrive(Keyboard(4), false);
+    inv.Rescan();
+    CHECK_EQ(inv.Version(), v + 1);
+    pnp.Remove(Keyboard(3).DevicePath, false);
+    pnp.Arrive(Keyboard(3), false);
+    inv.Rescan();
+    CHECK_EQ(inv.Version(), v + 1);
+}
+
+KBLAY_TEST(InventoryKeepsChangesDeliveredDuringEnumeration)
+{
+    PnpScript pnp;
+    pnp.Arrive(Keyboard(1), false);
+    pnp.Arrive(Keyboard(2), false);
+
+    // The list Enumerate returns predates both deltas.
+    pnp.State().DuringEnumerate = [&] {
+        pnp.Arrive(Keyboard(3));
+        pnp.Remove(Keyboard(2).DevicePath, false);
+        pnp.NotifyFromThread({ DeviceChange::Kind::Removal, Keyboard(2) });
+    };
+    DeviceInventory inv(pnp.Backend());
+    CHECK(inv.Start());
+    CHECK(Has(inv, Keyboard(1)));
+    CHECK(!Has(inv, Keyboard(2)));
+    CHECK(Has(inv, Keyboard(3)));
+    CHECK_EQ(inv.Snapshot()->Devices.size(), (size_t)2);
+
+    // Arrival then removal, both mid-enumeration: gone.
+    pnp.State().DuringEnumerate = [&] {
+        pnp.Arrive(Keyboard(5));
+        pnp.Remove(Keyboard(5).DevicePath);
+    };
+    inv.Rescan();
+    CHECK(!Has(inv, Keyboard(5)));
+    CHECK_EQ(inv.Snapshot()->Devices.size(), (size_t)2);
+
+    // A rescan asked for mid-enumeration may see a newer list than the one
+    // being read, so it stays pending for the next reader.
+    pnp.State().DuringEnumerate = [&] {
+        pnp.Arrive(Keyboard(6), false);
+        pnp.NotifyFromThread({ DeviceChange::Kind::Rescan, {} });
+    };
+    const size_t enumerations = pnp.State().Enumerations;
+    inv.Rescan();
+    CHECK(inv.RescanPending());
+    CHECK(Has(inv, Keyboard(6)));
+    CHECK_EQ(pnp.State().Enumerations, enumerations + 2);
+}
+
+KBLAY_TEST(InventoryWithoutNotificationsNeedsRescan)
+{
+    PnpScript pnp;
+    pnp.State().FailSubscribe = true;
+    pnp.Arrive(Keyboard(1), false);
+
+    DeviceInventory inv(pnp.Backend());
+    CHECK(!inv.Start());
+    CHECK(!inv.Live());
+    CHECK(Has(inv, Keyboard(1)));
+
+    pnp.Arrive(Keyboard(2));       // nobody is listening
+    CHECK(!Has(inv, Keyboard(2)));
+    inv.Rescan();
+    CHECK(Has(inv, Keyboard(2)));
+}
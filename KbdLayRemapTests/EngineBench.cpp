@@ -0,0 +1,217 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include "TraceFile.hpp"
+#include "Utf16.hpp"
+#include <cstdio>
+#include <random>
+#include <string>
+
+// Engine throughput per input stream and State/Role pair: events/s, ns per
+// event and amplification (output events per input event).
+
+namespace
+{
+    struct TimedKey
+    {
+        KBLAY_KEY_EVENT Key;
+        uint32_t DeltaMs;   // since the previous event
+    };
+
+    struct Stream
+    {
+        std::string Name;
+        std::vector<TimedKey> Events;
+        std::vector<uint8_t> Rules;  // empty: the bench's own rules
+    };
+
+    // US-on-JIS style rules: plain remaps, shift-conditioned symbols.
+    std::vector<uint8_t> BenchRules()
+    {
+        TestBlob b;
+        b.Rule(0x1A, 0, 0x1B, 0)                                               // [ -> ]
+         .Rule(0x03, 0, 0x1A, 0, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT)    // @
+         .Rule(0x07, 0, 0x0D, 0, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT)    // ^ -> &
+         .Rule(0x28, 0, 0x08, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0)        // ' -> Shift+7
+         .Rule(0x28, 0, 0x03, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT)
+         .Rule(0x0D, 0, 0x0C, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0)        // = -> Shift+-
+         .Rule(0x27, 0, 0x27, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT);
+        for (uint16_t k = 0x10; k <= 0x19; ++k)
+            b.Rule(k, 0, k, 0);
+        return b.Bytes();
+    }
+
+    void Tap(std::vector<TimedKey>& s, uint16_t make, uint16_t flags, uint32_t downMs, uint32_t upMs)
+    {
+        s.push_back({ KeyDown(make, flags), downMs });
+        s.push_back({ KeyUp(make, flags), upMs });
+    }
+
+    // Prose-like typing: 60-180 ms between keys, some shifted capitals and symbols.
+    Stream Typing()
+    {
+        static const uint16_t keys[] = { 0x10, 0x11, 0x12, 0x13, 0x14, 0x1E, 0x1F, 0x20, 0x21, 0x22, 0x2C, 0x2D, 0x2E, 0x39, 0x39, 0x28, 0x1A, 0x0D };
+        std::mt19937 rng(1);
+        Stream s{ "typing", {}, {} };
+        for (int i = 0; i < 2048; ++i)
+        {
+            const uint16_t k = keys[rng() % (sizeof(keys) / sizeof(keys[0]))];
+            const bool shifted = rng() % 10 == 0;
+            if (shifted) s.Events.push_back({ KeyDown(KBLAY_MAKE_LSHIFT), (uint32_t)(60 + rng() % 60) });
+            Tap(s.Events, k, 0, shifted ? 40 : 60 + rng() % 120, 40 + rng() % 50);
+            if (shifted) s.Events.push_back({ KeyUp(KBLAY_MAKE_LSHIFT), 20 });
+        }
+        return s;
+    }
+
+    // Barcode scanner: 13 digits and Enter at sub-millisecond spacing, then idle.
+    Stream ScannerBursts()
+    {
+        std::mt19937 rng(2);
+        Stream s{ "scanner-burst", {}, {} };
+        for (int burst = 0; burst < 256; ++burst)
+        {
+            for (int d = 0; d < 13; ++d)
+                Tap(s.Events, (uint16_t)(0x02 + rng() % 10), 0, d == 0 ? 500 : 0, 0);
+            Tap(s.Events, 0x1C, 0, 0, 0);
+        }
+        return s;
+    }
+
+    // One key held through typematic repeat (30/s), with an arrow key (E0) half the time.
+    Stream AutoRepeat()
+    {
+        Stream s{ "auto-repeat", {}, {} };
+        for (int hold = 0; hold < 64; ++hold)
+        {
+            const uint16_t make = hold % 2 ? 0x4D : 0x1A;
+            const uint16_t flags = hold % 2 ? KBLAY_KEY_E0 : 0;
+            s.Events.push_back({ KeyDown(make, flags), 200 });
+            for (int r = 0; r < 62; ++r)
+                s.Events.push_back({ KeyDown(make, flags), r == 0 ? 500u : 33u });
+            s.Events.push_back({ KeyUp(make, flags), 40 });
+        }
+        return s;
+    }
+
+    // Symbol-heavy code: Shift around most keys, many of them shift-conditioned.
+    Stream ShiftHeavy()
+    {
+        static const uint16_t keys[] = { 0x03, 0x07, 0x28, 0x0D, 0x27, 0x1A, 0x0A, 0x0B };
+        std::mt19937 rng(3);
+        Stream s{ "shift-heavy", {}, {} };
+        for (int i = 0; i < 1024; ++i)
+        {
+            const uint16_t shift = rng() % 2 ? KBLAY_MAKE_LSHIFT : KBLAY_MAKE_RSHIFT;
+            s.Events.push_back({ KeyDown(shift), 80 });
+            Tap(s.Events, keys[rng() % 8], 0, 30, 40);
+            if (rng() % 2)
+                Tap(s.Events, keys[rng() % 8], 0, 50, 40);
+            s.Events.push_back({ KeyUp(shift), 20 });
+            Tap(s.Events, keys[rng() % 8], 0, 70, 40);
+        }
+        return s;
+    }
+
+    // A kblayctl trace file: its recorded inputs, timing and rules.
+    bool LoadRecorded(const std::string& path, Stream& s)
+    {
+        TraceCapture capture;
+        if (!ReadTraceFile(Utf8ToWide(path), capture) || capture.Frequency == 0)
+            return false;
+
+        s.Rules = capture.RuleBlob;
+        uint64_t lastMs = 0;
+        for (const auto& r : capture.Records)
+        {
+            // Timer records have no input; Advance regenerates them.
+            if (r.Result == KBLAY_ENGINE_TIMER)
+                continue;
+            const uint64_t ms = r.Timestamp * 1000 / capture.Frequency;
+            s.Events.push_back({ r.In, s.Events.empty() ? 0u : (uint32_t)(ms - lastMs) });
+            lastMs = ms;
+        }
+
+        s.Name = "recorded:" + path.substr(path.find_last_of("/\\") + 1);
+        return !s.Events.empty();
+    }
+
+    const char* StateName(uint32_t state)
+    {
+        switch (state)
+        {
+        case KBLAY_STATE_BYPASS_HARD: return "bypass-hard";
+        case KBLAY_STATE_BYPASS_SOFT: return "bypass-soft";
+        default: return "active";
+        }
+    }
+
+    const char* RoleName(uint32_t role)
+    {
+        switch (role)
+        {
+        case KBLAY_ROLE_NONE: return "none";
+        case KBLAY_ROLE_BASE: return "base";
+        default: return "remap";
+        }
+    }
+
+    void RunStream(BenchContext& ctx, const Stream& s)
+    {
+        const std::vector<uint8_t> rules = s.Rules.empty() ? BenchRules() : s.Rules;
+        const uint64_t target = ctx.Iterations(4000000);
+
+        for (uint32_t state = KBLAY_STATE_BYPASS_HARD; state <= KBLAY_STATE_ACTIVE; ++state)
+        {
+            for (uint32_t role = KBLAY_ROLE_NONE; role <= KBLAY_ROLE_REMAP; ++role)
+            {
+                TestEngine t;
+                if (!t.Load(rules))
+                {
+                    std::printf("%s: rule blob does not validate\n", s.Name.c_str());
+                    return;
+                }
+
+                KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+                KBLAY_ENGINE_RESULT result;
+                uint64_t now = t.NowMs;
+                uint64_t events = 0;
+                uint64_t produced = 0;
+
+                BenchTimer timer;
+                while (events < target)
+                {
+                    for (const auto& e : s.Events)
+                    {
+                        now += e.DeltaMs;
+                        produced += KbdLayEngineProcess(t.Engine.get(), state, role, now, &e.Key, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+                    }
+                    events += s.Events.size();
+                }
+                const double seconds = timer.Seconds();
+                KeepValue(produced);
+
+                char detail[64];
+                std::snprintf(detail, sizeof(detail), "amplification %.3f", (double)produced / (double)events);
+                ctx.Report("engine/" + s.Name + "/" + StateName(state) + "/" + RoleName(role), events, seconds, detail);
+            }
+        }
+    }
+}
+
+KBLAY_BENCH(EngineStreams)
+{
+    const Stream streams[] = { Typing(), ScannerBursts(), AutoRepeat(), ShiftHeavy() };
+    for (const auto& s : streams)
+        RunStream(ctx, s);
+
+    for (const auto& path : ctx.Values("trace"))
+    {
+        Stream recorded;
+        if (!LoadRecorded(path, recorded))
+        {
+            std::printf("%s: not a readable trace file\n", path.c_str());
+            continue;
+        }
+        RunStream(ctx, recorded);
+    }
+}
@@ -0,0 +1,253 @@
+#pragma once
+#include "../Shared/KbdLayEngine.h"
+#include "../Shared/KbdLayIoctl.h"
+#include <cstring>
+#include <initializer_list>
+#include <memory>
+#include <set>
+#include <vector>
+
+// Helpers for driving the portable engine from host tests and benchmarks.
+
+// Builds rule blobs of any version. Rules are written in the version's own
+// entry shape; macros and tap-hold definitions only go into v4/v5.
+class TestBlob
+{
+public:
+    explicit TestBlob(uint32_t version = KBLAY_RULE_BLOB_VERSION_3) : version_(version) {}
+
+    // v3+ rule; ModMask/ModValue are KBLAY_MODGROUP_*. For v1/v2 a ModMask
+    // of KBLAY_MODGROUP_SHIFT becomes InFlags' KBLAY_FLAG_SHIFT.
+    TestBlob& Rule(uint16_t in, uint8_t inFlags, uint16_t out, uint8_t outFlags, uint8_t modMask = 0, uint8_t modValue = 0)
+    {
+        KBLAY_RULE_ENTRY_V3 e{};
+        e.InMakeCode = in;
+        e.InFlags = inFlags;
+        e.OutMakeCode = out;
+        e.OutFlags = outFlags;
+        e.ModMask = modMask;
+        e.ModValue = modValue;
+        rules_.push_back(e);
+        return *this;
+    }
+
+    // Returns the macro index for a KBLAY_FLAG_MACRO rule.
+    uint16_t Macro(std::initializer_list<KBLAY_MACRO_STEP> steps)
+    {
+        return Macro(std::vector<KBLAY_MACRO_STEP>(steps));
+    }
+
+    uint16_t Macro(const std::vector<KBLAY_MACRO_STEP>& steps)
+    {
+        KBLAY_MACRO_DEF d{};
+        d.FirstStep = (uint16_t)steps_.size();
+        d.StepCount = (uint8_t)steps.size();
+        macros_.push_back(d);
+        steps_.insert(steps_.end(), steps.begin(), steps.end());
+        return (uint16_t)(macros_.size() - 1);
+    }
+
+    // Returns the definition index for a KBLAY_FLAG_TAPHOLD rule.
+    uint16_t TapHold(uint16_t tap, uint16_t hold, uint16_t holdAfterMs, uint8_t tapFlags = 0, uint8_t holdFlags = 0)
+    {
+        KBLAY_TAPHOLD_DEF d{};
+        d.TapMakeCode = tap;
+        d.HoldMakeCode = hold;
+        d.TapFlags = tapFlags;
+        d.HoldFlags = holdFlags;
+        d.HoldAfterMs = holdAfterMs;
+        tapHolds_.push_back(d);
+        return (uint16_t)(tapHolds_.size() - 1);
+    }
+
+    std::vector<uint8_t> Bytes() const
+    {
+        std::vector<uint8_t> out(sizeof(KBLAY_RULE_BLOB_HEADER));
+        for (const auto& e : rules_)
+            AppendEntry(out, e);
+
+        if (version_ >= KBLAY_RULE_BLOB_VERSION_4)
+        {
+            KBLAY_MACRO_SECTION sec{ (uint32_t)macros_.size(), (uint32_t)steps_.size() };
+            Append(out, &sec, sizeof(sec));
+            Append(out, macros_.data(), macros_.size() * sizeof(KBLAY_MACRO_DEF));
+            Append(out, steps_.data(), steps_.size() * sizeof(KBLAY_MACRO_STEP));
+        }
+        if (version_ >= KBLAY_RULE_BLOB_VERSION_5)
+        {
+            KBLAY_TAPHOLD_SECTION sec{ (uint32_t)tapHolds_.size(), 0 };
+            Append(out, &sec, sizeof(sec));
+            Append(out, tapHolds_.data(), tapHolds_.size() * sizeof(KBLAY_TAPHOLD_DEF));
+        }
+
+        KBLAY_RULE_BLOB_HEADER h{};
+        h.Version = version_;
+        h.EntryCount = (uint32_t)rules_.size();
+        h.TotalSizeBytes = (uint32_t)out.size();
+        std::memcpy(out.data(), &h, sizeof(h));
+        return out;
+    }
+
+private:
+    static void Append(std::vector<uint8_t>& out, const void* p, size_t n)
+    {
+        const auto* b = static_cast<const uint8_t*>(p);
+        out.insert(out.end(), b, b + n);
+    }
+
+    void AppendEntry(std::vector<uint8_t>& out, const KBLAY_RULE_ENTRY_V3& e) const
+    {
+        const uint8_t shiftIn = (e.ModMask & KBLAY_MODGROUP_SHIFT) && (e.ModValue & KBLAY_MODGROUP_SHIFT) ? KBLAY_FLAG_SHIFT : 0;
+        if (version_ == KBLAY_RULE_BLOB_VERSION)
+        {
+            KBLAY_RULE_ENTRY v1{ (uint8_t)e.InMakeCode, (uint8_t)(e.InFlags | shiftIn), (uint8_t)e.OutMakeCode, e.OutFlags };
+            Append(out, &v1, sizeof(v1));
+        }
+        else if (version_ == KBLAY_RULE_BLOB_VERSION_2)
+        {
+            KBLAY_RULE_ENTRY_V2 v2{};
+            v2.InMakeCode = e.InMakeCode;
+            v2.InFlags = (uint8_t)(e.InFlags | shiftIn);
+            v2.OutMakeCode = e.OutMakeCode;
+            v2.OutFlags = e.OutFlags;
+            Append(out, &v2, sizeof(v2));
+        }
+        else
+        {
+            Append(out, &e, sizeof(e));
+        }
+    }
+
+    uint32_t version_;
+    std::vector<KBLAY_RULE_ENTRY_V3> rules_;
+    std::vector<KBLAY_MACRO_DEF> macros_;
+    std::vector<KBLAY_MACRO_STEP> steps_;
+    std::vector<KBLAY_TAPHOLD_DEF> tapHolds_;
+};
+
+inline KBLAY_MACRO_STEP MacroDown(uint16_t makeCode, uint8_t flags = 0)
+{
+    return KBLAY_MACRO_STEP{ makeCode, flags, 0 };
+}
+
+inline KBLAY_MACRO_STEP MacroUp(uint16_t makeCode, uint8_t flags = 0)
+{
+    return KBLAY_MACRO_STEP{ makeCode, (uint8_t)(flags | KBLAY_FLAG_BREAK), 0 };
+}
+
+inline KBLAY_KEY_EVENT KeyDown(uint16_t makeCode, uint16_t flags = 0)
+{
+    KBLAY_KEY_EVENT e{};
+    e.MakeCode = makeCode;
+    e.Flags = flags;
+    return e;
+}
+
+inline KBLAY_KEY_EVENT KeyUp(uint16_t makeCode, uint16_t flags = 0)
+{
+    return KeyDown(makeCode, (uint16_t)(flags | KBLAY_KEY_BREAK));
+}
+
+inline bool SameKey(const KBLAY_KEY_EVENT& a, const KBLAY_KEY_EVENT& b)
+{
+    return a.MakeCode == b.MakeCode && a.Flags == b.Flags;
+}
+
+inline bool SameKeys(const std::vector<KBLAY_KEY_EVENT>& a, const std::vector<KBLAY_KEY_EVENT>& b)
+{
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        if (!SameKey(a[i], b[i]))
+            return false;
+    }
+    return true;
+}
+
+// The engine and its lowered table are large, so tests keep them on the heap.
+struct TestEngine
+{
+    std::unique_ptr<KBLAY_ENGINE> Engine{ new KBLAY_ENGINE };
+    std::unique_ptr<KBLAY_RULE_TABLE> Table;
+    uint32_t State = KBLAY_STATE_ACTIVE;
+    uint32_t Role = KBLAY_ROLE_REMAP;
+    uint64_t NowMs = 1000;
+
+    TestEngine()
+    {
+        KbdLayEngineInit(Engine.get());
+        KbdLayEngineResetState(Engine.get(), NowMs);
+    }
+
+    // FALSE if the blob does not validate.
+    bool Load(const std::vector<uint8_t>& blob)
+    {
+        if (!KbdLayEngineValidateRuleBlob(blob.data(), blob.size(), 8192, 1u << 20))
+            return false;
+        std::unique_ptr<KBLAY_RULE_TABLE> table(new KBLAY_RULE_TABLE);
+        KbdLayEngineBuildRuleTable(blob.data(), blob.size(), table.get());
+        KbdLayEngineSetRuleTable(Engine.get(), table.get());
+        Table = std::move(table);
+        return true;
+    }
+
+    std::vector<KBLAY_KEY_EVENT> Feed(const KBLAY_KEY_EVENT& in, KBLAY_ENGINE_RESULT* result = nullptr)
+    {
+        KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+        KBLAY_ENGINE_RESULT r = KBLAY_ENGINE_PASS;
+        const size_t n = KbdLayEngineProcess(Engine.get(), State, Role, NowMs, &in, out, KBLAY_ENGINE_MAX_OUTPUT, &r);
+        if (result) *result = r;
+        return std::vector<KBLAY_KEY_EVENT>(out, out + n);
+    }
+
+    std::vector<KBLAY_KEY_EVENT> Feed(std::initializer_list<KBLAY_KEY_EVENT> in)
+    {
+        std::vector<KBLAY_KEY_EVENT> all;
+        for (const auto& e : in)
+        {
+            auto out = Feed(e);
+            all.insert(all.end(), out.begin(), out.end());
+        }
+        return all;
+    }
+
+    std::vector<KBLAY_KEY_EVENT> Advance(uint64_t toMs)
+    {
+        NowMs = toMs;
+        KBLAY_KEY_EVENT out[KBLAY_TAPHOLD_MAX_ACTIVE];
+        const size_t n = KbdLayEngineAdvance(Engine.get(), NowMs, out, KBLAY_TAPHOLD_MAX_ACTIVE);
+        return std::vector<KBLAY_KEY_EVENT>(out, out + n);
+    }
+};
+
+// 64-byte lines of engine and rule-table state one untraced lookup reads,
+// by offset from each structure's start (the driver line-aligns both): the
+// engine's hot fields, the class index, the page directory byte for codes
+// above 0xFF, and the rule cell.
+inline size_t EventLinesTouched(const KBLAY_ENGINE* engine, const KBLAY_KEY_EVENT& in)
+{
+    std::set<size_t> engineLines;
+    for (size_t off = 0; off < KBLAY_ENGINE_HOT_BYTES; ++off)
+        engineLines.insert(off / 64);
+
+    const KBLAY_RULE_TABLE* t = engine->Table;
+    const auto offsetOf = [t](const void* p) { return (size_t)((const uint8_t*)p - (const uint8_t*)t); };
+    const uint32_t prefix = (in.Flags & KBLAY_KEY_E1) ? 2u : (in.Flags & KBLAY_KEY_E0) ? 1u : 0u;
+    const uint8_t cls = t->ModClass[engine->Mods.Groups];
+
+    std::set<size_t> tableLines;
+    tableLines.insert(offsetOf(&t->ModClass[engine->Mods.Groups]) / 64);
+    if (in.MakeCode <= 0xFF)
+    {
+        tableLines.insert(offsetOf(&t->Low[cls][prefix][in.MakeCode]) / 64);
+    }
+    else
+    {
+        const uint8_t page = t->HighDir[cls][prefix][in.MakeCode >> 8];
+        tableLines.insert(offsetOf(&t->HighDir[cls][prefix][in.MakeCode >> 8]) / 64);
+        if (page != 0)
+            tableLines.insert(offsetOf(&t->High[page - 1][in.MakeCode & 0xFF]) / 64);
+    }
+    return engineLines.size() + tableLines.size();
+}
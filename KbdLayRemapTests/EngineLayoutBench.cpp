@@ -0,0 +1,79 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <cstdio>
+#include <random>
+
+// Per-event cost when the device's state is not in cache: events go round
+// robin over many engines, each with its own table, so every event starts
+// cold. The cost then follows the lines an event touches, which is reported
+// next to it.
+
+namespace
+{
+    std::vector<uint8_t> LayoutRules()
+    {
+        TestBlob b;
+        for (uint16_t k = 0x10; k <= 0x32; ++k)
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0);
+        b.Rule(0x1E, 0, 0x2C, 0, KBLAY_MODGROUP_CTRL, KBLAY_MODGROUP_CTRL);
+        return b.Bytes();
+    }
+
+    void RunDevices(BenchContext& ctx, size_t devices, uint64_t target)
+    {
+        const auto rules = LayoutRules();
+        std::vector<std::unique_ptr<TestEngine>> engines;
+        for (size_t i = 0; i < devices; ++i)
+        {
+            engines.emplace_back(new TestEngine);
+            engines.back()->Load(rules);
+        }
+
+        std::mt19937 rng(5);
+        std::vector<KBLAY_KEY_EVENT> keys;
+        for (int i = 0; i < 512; ++i)
+        {
+            const uint16_t k = (uint16_t)(0x10 + rng() % 0x23);
+            keys.push_back(KeyDown(k));
+            keys.push_back(KeyUp(k));
+        }
+
+        double lines = 0;
+        for (const auto& k : keys)
+            lines += (double)EventLinesTouched(engines[0]->Engine.get(), k);
+        lines /= (double)keys.size();
+
+        KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+        KBLAY_ENGINE_RESULT result;
+        uint64_t events = 0;
+        uint64_t produced = 0;
+        size_t d = 0;
+
+        BenchTimer timer;
+        while (events < target)
+        {
+            for (const auto& k : keys)
+            {
+                TestEngine& t = *engines[d];
+                d = d + 1 == devices ? 0 : d + 1;
+                produced += KbdLayEngineProcess(t.Engine.get(), t.State, t.Role, t.NowMs, &k, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+            }
+            events += keys.size();
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(produced);
+
+        char detail[64];
+        std::snprintf(detail, sizeof(detail), "%.2f lines/event", lines);
+        char name[64];
+        std::snprintf(name, sizeof(name), "engine-layout/%zu-devices", devices);
+        ctx.Report(name, events, seconds, detail);
+    }
+}
+
+KBLAY_BENCH(EngineLayout)
+{
+    const uint64_t target = ctx.Iterations(2000000);
+    for (size_t devices : { 1, 64, 1024 })
+        RunDevices(ctx, devices, target);
+}
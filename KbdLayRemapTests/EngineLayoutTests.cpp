@@ -0,0 +1,54 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+
+// Where the engine keeps what every event reads: one line from its start,
+// with the once-per-batch and rarely used state after it.
+
+namespace
+{
+    template <typename T>
+    size_t End(size_t offset) { return offset + sizeof(T); }
+}
+
+KBLAY_TEST(EngineHotFieldsShareTheFirstLine)
+{
+    CHECK(End<KBLAY_ENGINE_CHAIN*>(offsetof(KBLAY_ENGINE, Chain)) <= 64);
+    CHECK(End<const KBLAY_RULE_TABLE*>(offsetof(KBLAY_ENGINE, Table)) <= 64);
+    CHECK(End<UINT32>(offsetof(KBLAY_ENGINE, ChainKey)) <= 64);
+    CHECK(End<UINT16>(offsetof(KBLAY_ENGINE, Stages)) <= 64);
+    CHECK(End<KBLAY_ENGINE_MODS>(offsetof(KBLAY_ENGINE, Mods)) <= 64);
+    CHECK(End<KBLAY_MOD_SHARE*>(offsetof(KBLAY_ENGINE, Share)) <= 64);
+    CHECK(End<UINT32>(offsetof(KBLAY_ENGINE, TapHold.Active)) <= 64);
+    CHECK(End<UINT64>(offsetof(KBLAY_ENGINE, TapHold.Wheel.Now)) <= 64);
+    CHECK(End<UINT32>(offsetof(KBLAY_ENGINE, TapHold.Wheel.Armed)) <= 64);
+    CHECK_EQ((size_t)KBLAY_ENGINE_HOT_BYTES, End<UINT32>(offsetof(KBLAY_ENGINE, TapHold.Wheel.Armed)));
+}
+
+KBLAY_TEST(EngineColdFieldsStayOutOfTheHotLine)
+{
+    CHECK(offsetof(KBLAY_ENGINE, TapHold.Wheel.Slots) >= KBLAY_ENGINE_HOT_BYTES);
+    CHECK(offsetof(KBLAY_ENGINE, TapHold.Slots) >= 64);
+    CHECK(offsetof(KBLAY_ENGINE, Debounce) >= 64);
+    CHECK(offsetof(KBLAY_ENGINE, BatchChain) >= 64);
+}
+
+KBLAY_TEST(EngineEventReadsThreeLinesForLowCodes)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob()
+        .Rule(0x1E, 0, 0x30, 0)
+        .Rule(0x1E, 0, 0x31, 0, KBLAY_MODGROUP_CTRL, KBLAY_MODGROUP_CTRL)
+        .Rule(0x0150, KBLAY_FLAG_E0, 0x30, 0)
+        .Bytes()));
+
+    // Engine line, class index, rule cell; every class and prefix alike.
+    CHECK_EQ(EventLinesTouched(t.Engine.get(), KeyDown(0x1E)), (size_t)3);
+    CHECK_EQ(EventLinesTouched(t.Engine.get(), KeyDown(0x4D, KBLAY_KEY_E0)), (size_t)3);
+    t.Feed(KeyDown(KBLAY_MAKE_CTRL));
+    CHECK_EQ(EventLinesTouched(t.Engine.get(), KeyDown(0x1E)), (size_t)3);
+    t.Feed(KeyUp(KBLAY_MAKE_CTRL));
+
+    // High codes add the page directory, and the page when there is one.
+    CHECK_EQ(EventLinesTouched(t.Engine.get(), KeyDown(0x0150, KBLAY_KEY_E0)), (size_t)4);
+    CHECK_EQ(EventLinesTouched(t.Engine.get(), KeyDown(0x0350)), (size_t)3);
+}
@@ -0,0 +1,132 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+
+// Core translation: states, roles, plain remaps and shift synthesis.
+
+static const uint16_t kA = 0x1E;
+static const uint16_t kB = 0x30;
+static const uint16_t kQuote = 0x28;
+static const uint16_t k2 = 0x03;
+
+static std::vector<uint8_t> BasicRules()
+{
+    return TestBlob()
+        .Rule(kA, 0, kB, 0)
+        // US " on a JIS board: Shift+2 -> Shift+' and unshifted ' -> Shift+2.
+        .Rule(k2, 0, kQuote, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT)
+        .Rule(kQuote, 0, k2, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0)
+        .Bytes();
+}
+
+KBLAY_TEST(EngineRemapsInActiveRemapRole)
+{
+    TestEngine t;
+    CHECK(t.Load(BasicRules()));
+
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(kA), &r), { KeyDown(kB) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP);
+    CHECK(SameKeys(t.Feed(KeyUp(kA), &r), { KeyUp(kB) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP);
+}
+
+KBLAY_TEST(EnginePassesInEveryOtherStateAndRole)
+{
+    const uint32_t states[] = { KBLAY_STATE_BYPASS_HARD, KBLAY_STATE_BYPASS_SOFT, KBLAY_STATE_ACTIVE };
+    const uint32_t roles[] = { KBLAY_ROLE_NONE, KBLAY_ROLE_BASE, KBLAY_ROLE_REMAP };
+
+    for (uint32_t state : states)
+    {
+        for (uint32_t role : roles)
+        {
+            if (state == KBLAY_STATE_ACTIVE && role == KBLAY_ROLE_REMAP)
+                continue;
+            TestEngine t;
+            CHECK(t.Load(BasicRules()));
+            t.State = state;
+            t.Role = role;
+
+            KBLAY_ENGINE_RESULT r;
+            CHECK(SameKeys(t.Feed(KeyDown(kA), &r), { KeyDown(kA) }));
+            CHECK_EQ(r, KBLAY_ENGINE_PASS);
+        }
+    }
+}
+
+KBLAY_TEST(EngineLeavesKeysWithoutRulesUnmapped)
+{
+    TestEngine t;
+    CHECK(t.Load(BasicRules()));
+
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(0x10), &r), { KeyDown(0x10) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    CHECK(SameKeys(t.Feed(KeyDown(kA, KBLAY_KEY_E0), &r), { KeyDown(kA, KBLAY_KEY_E0) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+}
+
+KBLAY_TEST(EngineSynthesizesShiftAroundRemappedKey)
+{
+    TestEngine t;
+    CHECK(t.Load(BasicRules()));
+
+    // Unshifted ' wants Shift: down, key, up.
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(kQuote), &r),
+        { KeyDown(KBLAY_MAKE_LSHIFT), KeyDown(k2), KeyUp(KBLAY_MAKE_LSHIFT) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP_TOGGLE);
+
+    // Shift+2 already has Shift held: no toggle.
+    CHECK(SameKeys(t.Feed(KeyDown(KBLAY_MAKE_LSHIFT), &r), { KeyDown(KBLAY_MAKE_LSHIFT) }));
+    CHECK(SameKeys(t.Feed(KeyDown(k2), &r), { KeyDown(kQuote) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP);
+    t.Feed(KeyUp(KBLAY_MAKE_LSHIFT));
+
+    // Unshifted 2 has no rule.
+    CHECK(SameKeys(t.Feed(KeyDown(k2), &r), { KeyDown(k2) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+}
+
+KBLAY_TEST(EngineReleasesShiftAroundKeyThatMustBeUnshifted)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob().Rule(kA, 0, kB, 0, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT).Bytes()));
+
+    t.Feed(KeyDown(KBLAY_MAKE_RSHIFT));
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(kA), &r),
+        { KeyUp(KBLAY_MAKE_LSHIFT), KeyDown(kB), KeyDown(KBLAY_MAKE_LSHIFT) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP_TOGGLE);
+}
+
+KBLAY_TEST(EngineRejectsMalformedBlobs)
+{
+    auto blob = BasicRules();
+    TestEngine t;
+    CHECK(!t.Load(std::vector<uint8_t>(blob.begin(), blob.begin() + 8)));
+
+    auto truncated = blob;
+    truncated.pop_back();
+    CHECK(!t.Load(truncated));
+
+    auto badVersion = blob;
+    badVersion[2] = 0x7F;
+    CHECK(!t.Load(badVersion));
+}
+
+KBLAY_TEST(EngineKeepsUnitIdAndExtraInformation)
+{
+    TestEngine t;
+    CHECK(t.Load(BasicRules()));
+
+    KBLAY_KEY_EVENT in = KeyDown(kQuote);
+    in.UnitId = 3;
+    in.ExtraInformation = 0xABCD;
+    auto out = t.Feed(in);
+    CHECK_EQ(out.size(), (size_t)3);
+    for (const auto& e : out)
+    {
+        CHECK_EQ(e.UnitId, (USHORT)3);
+        CHECK_EQ(e.ExtraInformation, (ULONG)0xABCD);
+    }
+}
@@ -0,0 +1,91 @@
+#include "EventLog.hpp"
+#include "KbdLayTest.hpp"
+#include <atomic>
+#include <cstdio>
+#include <thread>
+
+// EventLog::Log from 1..N threads at once into a sink that throws records
+// away, so what is timed is the ring: claiming a slot, stamping it and
+// copying the fields. A dropped record would be cheaper than a kept one,
+// so each round fits in the ring; the detail says if any were dropped.
+
+namespace
+{
+    const size_t kRing = 1 << 18;
+
+    class DiscardSink : public LogSink
+    {
+    public:
+        void Write(const LogRecord* records, size_t count) override { KeepValue(records[count - 1].Time); }
+    };
+
+    // One round: `threads` writers released together, each logging its share
+    // of half the ring, so the flusher is racing them but nothing is dropped.
+    double Round(unsigned threads, uint64_t perThread, bool strings, uint64_t& dropped)
+    {
+        EventLog log(kRing);
+        log.Start(std::make_unique<DiscardSink>(), 1);
+
+        std::atomic<unsigned> ready{ 0 };
+        std::atomic<bool> go{ false };
+        std::vector<std::thread> writers;
+        for (unsigned w = 0; w < threads; ++w)
+        {
+            writers.emplace_back([&, w] {
+                const std::wstring path = L"\\\\?\\HID#VID_046D&PID_C31C&MI_00#7&1b4b0e7f&0&0000";
+                ready.fetch_add(1);
+                while (!go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                for (uint64_t i = 0; i < perThread; ++i)
+                {
+                    if (strings)
+                        log.Log(LogEvent::NullContainer, path);
+                    else
+                        log.Log(LogEvent::Reconciled, w, i, 0, 0, i * 3, 17ull);
+                }
+            });
+        }
+        while (ready.load() != threads)
+            std::this_thread::yield();
+
+        BenchTimer timer;
+        go.store(true, std::memory_order_release);
+        for (auto& t : writers)
+            t.join();
+        const double seconds = timer.Seconds();
+        log.Stop();
+        dropped += log.Dropped();
+        return seconds;
+    }
+
+    void RunWriters(BenchContext& ctx, unsigned threads, bool strings)
+    {
+        const uint64_t perThread = kRing / 2 / threads;
+        const uint64_t rounds = ctx.Iterations(32);
+        double seconds = 0;
+        uint64_t dropped = 0;
+        for (uint64_t r = 0; r < rounds; ++r)
+            seconds += Round(threads, perThread, strings, dropped);
+
+        const uint64_t calls = perThread * threads * rounds;
+        char detail[96];
+        std::snprintf(detail, sizeof(detail), "%.1f ns/call per thread, %llu dropped",
+            seconds * 1e9 * threads / (double)calls, (unsigned long long)dropped);
+        char name[64];
+        std::snprintf(name, sizeof(name), "log/%s/%u-threads", strings ? "path" : "6-ints", threads);
+        ctx.Report(name, calls, seconds, detail);
+    }
+}
+
+KBLAY_BENCH(EventLog)
+{
+    const unsigned cores = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+    std::vector<unsigned> counts;
+    for (unsigned n = 1; n < cores; n *= 2)
+        counts.push_back(n);
+    counts.push_back(cores);
+
+    for (const bool strings : { false, true })
+        for (const unsigned n : counts)
+            RunWriters(ctx, n, strings);
+}
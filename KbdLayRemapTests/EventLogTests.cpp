@@ -0,0 +1,247 @@
+#include "EventLog.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+#include "TestFiles.hpp"
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+// Service log records: how fields are encoded into the fixed payload and
+// cut to fit, how FormatLogRecord reads them back, log files through
+// rotation and ReadLogFile, and the ring under a full buffer and several
+// writers.
+
+namespace
+{
+    // Records the flusher hands over, kept after the log lets go of the sink.
+    struct Captured
+    {
+        std::mutex Lock;
+        std::vector<LogRecord> Records;
+    };
+
+    class CaptureSink : public LogSink
+    {
+    public:
+        explicit CaptureSink(Captured& to) : to_(to) {}
+        void Write(const LogRecord* records, size_t count) override
+        {
+            std::lock_guard<std::mutex> g(to_.Lock);
+            to_.Records.insert(to_.Records.end(), records, records + count);
+        }
+
+    private:
+        Captured& to_;
+    };
+
+    // Logs one record through a real EventLog and returns it.
+    template <typename... Args>
+    LogRecord One(LogEvent event, const Args&... args)
+    {
+        Captured c;
+        EventLog log(4);
+        log.Log(event, args...);
+        log.Start(std::make_unique<CaptureSink>(c), 1000);
+        log.Stop();
+        CHECK_EQ(c.Records.size(), (size_t)1);
+        return c.Records.empty() ? LogRecord{} : c.Records[0];
+    }
+
+    // The message, without the timestamp and thread in front of it.
+    std::wstring Message(const LogRecord& r)
+    {
+        const std::wstring s = FormatLogRecord(r);
+        const size_t at = s.find(L' ', s.find(L" t") + 1);
+        return at == std::wstring::npos ? s : s.substr(at + 1);
+    }
+
+    std::string Narrow(const std::wstring& s)
+    {
+        return std::string(s.begin(), s.end());
+    }
+}
+
+KBLAY_TEST(EventLogEncodesEachFieldType)
+{
+    const LogRecord r = One(LogEvent::Reconciled, 3u, (uint16_t)2, (int64_t)-1, 0, (size_t)7, 1ull << 40);
+    CHECK_EQ(r.Event, (uint16_t)LogEvent::Reconciled);
+    CHECK_EQ(r.FieldCount, (uint8_t)6);
+    CHECK_EQ(r.PayloadBytes, (uint8_t)(6 * 8));
+    // Signedness picks the type; every integer is 8 bytes.
+    const LogFieldType u = LogFieldType::U64, i = LogFieldType::I64;
+    const LogFieldType types[] = { u, u, i, i, u, u };
+    for (int f = 0; f < 6; ++f)
+        CHECK_EQ(r.Types[f], (uint8_t)types[f]);
+    int64_t minusOne = 0;
+    std::memcpy(&minusOne, r.Payload + 16, sizeof(minusOne));
+    CHECK_EQ(minusOne, (int64_t)-1);
+    CHECK_EQ(Narrow(Message(r)), std::string("Reconcile: devices=3 converged=2 failed=-1 deferred=0 ops=7 convergenceMs=1099511627776"));
+
+    // A GUID is its 16 bytes; a string is a length byte and UTF-16 units.
+    const GUID id = SequentialGuid(9);
+    const LogRecord g = One(LogEvent::ConfigConflict, id);
+    CHECK_EQ(g.PayloadBytes, (uint8_t)sizeof(GUID));
+    CHECK(std::memcmp(g.Payload, &id, sizeof(id)) == 0);
+    CHECK(Message(g) == L"ContainerId listed as both US and JIS, or with two targets; leaving it bypassed: " + GuidToString(id));
+
+    const LogRecord s = One(LogEvent::NoRuleBlob, L"00000409", std::wstring(L"00000411"));
+    CHECK_EQ(s.FieldCount, (uint8_t)2);
+    CHECK_EQ(s.PayloadBytes, (uint8_t)(2 * (1 + 8 * 2)));
+    CHECK_EQ(s.Payload[0], (uint8_t)8);
+    CHECK_EQ(s.Types[0], (uint8_t)LogFieldType::Str);
+    CHECK_EQ(Narrow(Message(s)), std::string("No rule blob for 00000409 -> 00000411; leaving device bypassed."));
+}
+
+KBLAY_TEST(EventLogCutsFieldsToFitThePayload)
+{
+    // A string takes what room is left, down to just its length byte.
+    const std::wstring path(200, L'x');
+    const LogRecord r = One(LogEvent::NoRuleBlob, path, L"00000411");
+    CHECK_EQ(r.Payload[0], (uint8_t)((KBLAY_LOG_PAYLOAD - 1) / 2));
+    CHECK_EQ(r.FieldCount, (uint8_t)2);
+    CHECK_EQ(r.PayloadBytes, (uint8_t)KBLAY_LOG_PAYLOAD);
+    CHECK(Message(r) == L"No rule blob for " + std::wstring((KBLAY_LOG_PAYLOAD - 1) / 2, L'x') + L" -> ; leaving device bypassed.");
+
+    // Eight fields at most, and none that would run past the payload: six
+    // GUIDs fill its 96 bytes and the seventh is left out.
+    const LogRecord full = One(LogEvent::Reconciled, 1, 2, 3, 4, 5, 6, 7, 8);
+    CHECK_EQ(full.FieldCount, (uint8_t)8);
+    CHECK_EQ(full.PayloadBytes, (uint8_t)64);
+    const LogRecord after = One(LogEvent::Reconciled, SequentialGuid(1), SequentialGuid(2), SequentialGuid(3),
+        SequentialGuid(4), SequentialGuid(5), SequentialGuid(6), SequentialGuid(7));
+    CHECK_EQ(after.FieldCount, (uint8_t)6);
+    CHECK_EQ(after.PayloadBytes, (uint8_t)96);
+
+    // Characters outside UTF-16's basic plane are replaced, not split.
+    std::wstring wide = L"a";
+    wide.push_back((wchar_t)0x1F600);
+    const LogRecord q = One(LogEvent::ConfigReloaded, wide);
+    CHECK_EQ(q.Payload[0], (uint8_t)2);
+    CHECK(Message(q) == L"Config reloaded: a?");
+}
+
+KBLAY_TEST(EventLogFormatsTimeThreadAndBadRecords)
+{
+    LogRecord r{};
+    r.Time = 1769862896789012345ull;   // 2026-01-31 12:34:56.789012345
+    r.Thread = 3;
+    r.Event = (uint16_t)LogEvent::WorkerExiting;
+    CHECK_EQ(Narrow(FormatLogRecord(r)), std::string("2026-01-31 12:34:56.789012Z t3 Worker exiting."));
+
+    // An event this build does not know.
+    r.Event = (uint16_t)LogEvent::Count + 5;
+    CHECK(Message(r) == L"event " + std::to_wstring((unsigned)LogEvent::Count + 5));
+
+    // A record that claims more than it holds reads no further than its payload.
+    LogRecord bad{};
+    bad.Event = (uint16_t)LogEvent::NoRuleBlob;
+    bad.FieldCount = 200;
+    bad.PayloadBytes = 255;
+    bad.Types[0] = (uint8_t)LogFieldType::Str;
+    bad.Payload[0] = 255;
+    bad.Types[1] = 77;
+    CHECK(Message(bad) == L"No rule blob for  -> ?; leaving device bypassed.");
+}
+
+KBLAY_TEST(EventLogFilesRotateAndReadBack)
+{
+    TestDir dir;
+    const std::wstring path = dir.Path("svc.kbllog").wstring();
+    const size_t perFile = 4;
+
+    {
+        EventLog log(64);
+        log.Start(std::make_unique<RotatingLogFile>(path, sizeof(LogFileHeader) + perFile * sizeof(LogRecord), 2), 1000);
+        for (unsigned i = 0; i < 10; ++i)
+            log.Log(LogEvent::OpenControlFailed, i);
+        log.Stop();
+    }
+
+    // Ten records: two in the live file, four in each of .1 and .2.
+    std::vector<LogRecord> live, one, two;
+    CHECK(ReadLogFile(path, live));
+    CHECK(ReadLogFile(path + L".1", one));
+    CHECK(ReadLogFile(path + L".2", two));
+    CHECK_EQ(live.size(), (size_t)2);
+    CHECK_EQ(one.size(), perFile);
+    CHECK_EQ(two.size(), perFile);
+    if (live.size() == 2 && one.size() == perFile && two.size() == perFile)
+    {
+        CHECK_EQ(Narrow(Message(two[0])), std::string("OpenControlDevice failed: error 0"));
+        CHECK_EQ(Narrow(Message(one[0])), std::string("OpenControlDevice failed: error 4"));
+        CHECK_EQ(Narrow(Message(live[1])), std::string("OpenControlDevice failed: error 9"));
+    }
+
+    // A record cut short by a crash is left out.
+    {
+        std::ofstream f(dir.Path("svc.kbllog"), std::ios::binary | std::ios::app);
+        f.write("partial", 7);
+    }
+    CHECK(ReadLogFile(path, live));
+    CHECK_EQ(live.size(), (size_t)2);
+
+    // Files of another format are refused, and moved aside rather than appended to.
+    dir.Write("other.kbllog", std::string("KBLAYLOG\x02\0\0\0x\0\0\0", 16));
+    std::vector<LogRecord> none;
+    CHECK(!ReadLogFile(dir.Path("other.kbllog").wstring(), none));
+    RotatingLogFile other(dir.Path("other.kbllog").wstring(), 1 << 20, 1);
+    CHECK(other.Open());
+    other.Flush();
+    CHECK(ReadLogFile(dir.Path("other.kbllog").wstring(), none));
+    CHECK(none.empty());
+    CHECK(std::filesystem::exists(dir.Path("other.kbllog.1")));
+}
+
+KBLAY_TEST(EventLogCountsDropsAndKeepsEveryWritersRecords)
+{
+    // With no flusher running, a full ring drops and counts the rest.
+    Captured c;
+    {
+        EventLog log(8);
+        for (unsigned i = 0; i < 20; ++i)
+            log.Log(LogEvent::OpenControlFailed, i);
+        CHECK_EQ(log.Dropped(), (uint64_t)12);
+        log.Start(std::make_unique<CaptureSink>(c), 1000);
+        log.Stop();
+    }
+    CHECK_EQ(c.Records.size(), (size_t)9);
+    if (c.Records.size() == 9)
+    {
+        CHECK_EQ(Narrow(Message(c.Records[7])), std::string("OpenControlDevice failed: error 7"));
+        CHECK_EQ(Narrow(Message(c.Records[8])), std::string("12 log records dropped by a full ring."));
+    }
+
+    // Four writers against a ring big enough for all of them: every record
+    // arrives once, and each writer's in the order it wrote them.
+    Captured all;
+    {
+        EventLog log(1 << 14);
+        log.Start(std::make_unique<CaptureSink>(all), 1);
+        std::vector<std::thread> writers;
+        for (unsigned w = 0; w < 4; ++w)
+        {
+            writers.emplace_back([&log, w] {
+                for (unsigned i = 0; i < 2000; ++i)
+                    log.Log(LogEvent::Reconciled, w, i, 0, 0, 0, 0);
+            });
+        }
+        for (auto& t : writers)
+            t.join();
+        log.Stop();
+        CHECK_EQ(log.Dropped(), (uint64_t)0);
+    }
+    CHECK_EQ(all.Records.size(), (size_t)8000);
+    uint64_t next[4] = {};
+    size_t outOfOrder = 0;
+    for (const auto& r : all.Records)
+    {
+        uint64_t w = 0, i = 0;
+        std::memcpy(&w, r.Payload, sizeof(w));
+        std::memcpy(&i, r.Payload + 8, sizeof(i));
+        if (w >= 4 || i != next[w])
+            ++outOfOrder;
+        else
+            ++next[w];
+    }
+    CHECK_EQ(outOfOrder, (size_t)0);
+}
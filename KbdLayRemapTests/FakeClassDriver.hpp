@@ -0,0 +1,77 @@
+#pragma once
+#include "EngineHarness.hpp"
+#include "../Shared/KbdLayDeliver.h"
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// KBLAY_DELIVER_OPS over a TestEngine and a keyboard class driver that takes
+// at most Accept() events per call, as the driver's adapters do over
+// KbdLayRemapBatch and the real class service callback.
+struct FakeClassDriver
+{
+    TestEngine* Engine = nullptr;
+
+    // Events the class driver takes from the next call; all by default.
+    std::function<uint32_t(uint32_t offered)> Accept;
+
+    std::vector<KBLAY_KEY_EVENT> Received;
+    uint64_t Translated = 0;  // inputs the engine was given
+    uint64_t Sends = 0;
+
+    // Ticks Now returns, moved on by TicksPerRead at every reading.
+    uint64_t Clock = 0;
+    uint64_t TicksPerRead = 0;
+
+    explicit FakeClassDriver(TestEngine& engine) : Engine(&engine) {}
+
+    static const KBLAY_DELIVER_OPS Ops;
+
+private:
+    static UINT32 Translate(VOID* context, const KBLAY_KEY_EVENT* in, UINT32 count, KBLAY_KEY_EVENT* out, UINT32 outCap, UINT32* produced)
+    {
+        auto* self = static_cast<FakeClassDriver*>(context);
+        KBLAY_ENGINE_BATCH batch;
+        const size_t taken = KbdLayEngineProcessBatch(self->Engine->Engine.get(), self->Engine->State, self->Engine->Role,
+            self->Engine->NowMs, in, count, out, outCap, nullptr, &batch);
+        self->Translated += taken;
+        *produced = batch.Produced;
+        return (UINT32)taken;
+    }
+
+    static UINT32 Send(VOID* context, const KBLAY_KEY_EVENT* events, UINT32 count)
+    {
+        auto* self = static_cast<FakeClassDriver*>(context);
+        ++self->Sends;
+        uint32_t n = self->Accept ? self->Accept(count) : count;
+        if (n > count) n = count;
+        self->Received.insert(self->Received.end(), events, events + n);
+        return n;
+    }
+
+    static UINT64 Now(VOID* context)
+    {
+        auto* self = static_cast<FakeClassDriver*>(context);
+        const uint64_t now = self->Clock;
+        self->Clock += self->TicksPerRead;
+        return now;
+    }
+
+    static VOID Lock(VOID* context) { static_cast<FakeClassDriver*>(context)->BacklogLock.lock(); }
+    static VOID Unlock(VOID* context) { static_cast<FakeClassDriver*>(context)->BacklogLock.unlock(); }
+
+    std::mutex BacklogLock;
+};
+
+inline const KBLAY_DELIVER_OPS FakeClassDriver::Ops = {
+    &FakeClassDriver::Translate, &FakeClassDriver::Send, &FakeClassDriver::Now, &FakeClassDriver::Lock, &FakeClassDriver::Unlock };
+
+// A budget of maxEvents per slice on a 1 MHz clock (0: no limit).
+inline KBLAY_BUDGET EventBudget(uint32_t maxEvents, uint32_t maxMicros = 0, uint64_t now = 0)
+{
+    const KBLAY_BUDGET_CONFIG config{ maxEvents, maxMicros };
+    KBLAY_BUDGET budget;
+    KbdLayBudgetStart(&budget, &config, now, 1000000);
+    return budget;
+}
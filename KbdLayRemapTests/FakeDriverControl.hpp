@@ -0,0 +1,145 @@
+#pragma once
+#include "Reconciler.hpp"
+#include "../Shared/KbdLayIoctl.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// In-memory driver for the reconciler. Every operation advances a fake
+// millisecond clock by OpMs before it completes, either inline or from a
+// new thread. Failures are injected per operation kind.
+class FakeDriverControl final : public DriverControl
+{
+public:
+    struct Device
+    {
+        DriverDeviceState State;
+        bool Present = true;
+    };
+
+    std::atomic<uint64_t> NowMs{ 1000 };
+    uint64_t OpMs = 5;
+    bool Async = false;
+    bool FailQuery = false;
+    bool FailSetRuleBlob = false;
+    bool FailSetRole = false;
+    bool FailSetState = false;
+
+    ~FakeDriverControl() override { JoinAll(); }
+
+    uint64_t Now() const { return NowMs.load(); }
+
+    void Plug(const GUID& id, const DriverDeviceState& s = {})
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        devices_[Key(id)] = Device{ s, true };
+    }
+
+    DriverDeviceState StateOf(const GUID& id)
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        return devices_[Key(id)].State;
+    }
+
+    // State-changing calls by kind, in order ("blob", "role", "state").
+    std::vector<std::string> Calls()
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        return calls_;
+    }
+
+    void ClearCalls()
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        calls_.clear();
+    }
+
+    void QueryState(const GUID& id, DriverDeviceState* out, Done done) override
+    {
+        Complete([this, id, out] {
+            std::lock_guard<std::mutex> g(lock_);
+            auto it = devices_.find(Key(id));
+            if (FailQuery || it == devices_.end() || !it->second.Present)
+                return false;
+            *out = it->second.State;
+            return true;
+        }, std::move(done));
+    }
+
+    void SetRole(const GUID& id, UINT32 role, Done done) override
+    {
+        Complete([this, id, role] { return Mutate(id, "role", FailSetRole, [role](DriverDeviceState& s) { s.Role = role; }); }, std::move(done));
+    }
+
+    void SetState(const GUID& id, UINT32 state, Done done) override
+    {
+        Complete([this, id, state] { return Mutate(id, "state", FailSetState, [state](DriverDeviceState& s) { s.State = state; }); }, std::move(done));
+    }
+
+    void SetRuleBlob(const GUID& id, std::shared_ptr<const std::vector<BYTE>> blob, Done done) override
+    {
+        const UINT32 hash = KbdLayRuleBlobHash(blob->data(), blob->size());
+        Complete([this, id, hash] { return Mutate(id, "blob", FailSetRuleBlob, [hash](DriverDeviceState& s) { s.RuleBlobHash = hash; }); }, std::move(done));
+    }
+
+private:
+    static std::vector<uint8_t> Key(const GUID& id)
+    {
+        return std::vector<uint8_t>((const uint8_t*)&id, (const uint8_t*)&id + sizeof(id));
+    }
+
+    template <typename Fn>
+    bool Mutate(const GUID& id, const char* kind, bool fail, Fn fn)
+    {
+        std::lock_guard<std::mutex> g(lock_);
+        calls_.push_back(kind);
+        auto it = devices_.find(Key(id));
+        if (fail || it == devices_.end() || !it->second.Present)
+            return false;
+        fn(it->second.State);
+        return true;
+    }
+
+    template <typename Op>
+    void Complete(Op op, Done done)
+    {
+        auto run = [this, op, done] {
+            NowMs += OpMs;
+            done(op());
+        };
+        if (!Async)
+        {
+            run();
+            return;
+        }
+        std::lock_guard<std::mutex> g(threadsLock_);
+        threads_.emplace_back(run);
+    }
+
+    void JoinAll()
+    {
+        // Completions start further completions; keep joining until none are left.
+        for (;;)
+        {
+            std::vector<std::thread> batch;
+            {
+                std::lock_guard<std::mutex> g(threadsLock_);
+                batch.swap(threads_);
+            }
+            if (batch.empty())
+                return;
+            for (auto& t : batch)
+                t.join();
+        }
+    }
+
+    std::mutex lock_;
+    std::map<std::vector<uint8_t>, Device> devices_;
+    std::vector<std::string> calls_;
+
+    std::mutex threadsLock_;
+    std::vector<std::thread> threads_;
+};
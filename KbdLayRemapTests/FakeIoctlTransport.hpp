@@ -0,0 +1,128 @@
+#pragma once
+#include "AsyncIoctl.hpp"
+#include <cstring>
+#include <deque>
+#include <map>
+#include <set>
+
+// Scripted IoctlTransport. Each control code behaves one way: answer at
+// once (echoing the input into the output), answer after a delay, hang
+// until cancelled, or refuse the submit. Delayed answers come from a timer
+// thread; everything else is queued from the calling thread.
+class FakeIoctlTransport final : public IoctlTransport
+{
+public:
+    enum class Mode { Echo, Delay, Hang, Refuse, Fail };
+
+    struct Behavior
+    {
+        Mode How = Mode::Echo;
+        uint32_t DelayMs = 0;
+        uint32_t Error = 0;   // Refuse / Fail
+    };
+
+    struct Shared
+    {
+        std::mutex Lock;
+        std::condition_variable Cv;
+        std::map<uint32_t, Behavior> Codes;
+        std::deque<IoctlCompletion> Ready;
+        std::map<uint64_t, std::pair<void*, uint32_t>> Hung;  // tag -> output buffer
+        std::set<uint64_t> Cancelled;
+        size_t Submitted = 0;
+        bool Woken = false;
+        bool Destroyed = false;
+    };
+
+    explicit FakeIoctlTransport(std::shared_ptr<Shared> s) : s_(std::move(s)) {}
+
+    ~FakeIoctlTransport() override
+    {
+        for (auto& t : timers_)
+            t.join();
+        std::lock_guard<std::mutex> g(s_->Lock);
+        s_->Destroyed = true;
+    }
+
+    bool Submit(uint64_t tag, uint32_t code, const void* in, uint32_t inCb, void* out, uint32_t outCb, uint32_t& error) override
+    {
+        std::unique_lock<std::mutex> g(s_->Lock);
+        const Behavior b = s_->Codes[code];
+        if (b.How == Mode::Refuse)
+        {
+            error = b.Error;
+            return false;
+        }
+        ++s_->Submitted;
+
+        IoctlCompletion c;
+        c.Tag = tag;
+        c.Ok = b.How != Mode::Fail;
+        c.Error = b.How == Mode::Fail ? b.Error : 0;
+        if (c.Ok && out && in)
+        {
+            c.BytesReturned = inCb < outCb ? inCb : outCb;
+            std::memcpy(out, in, c.BytesReturned);
+        }
+
+        switch (b.How)
+        {
+        case Mode::Hang:
+            s_->Hung[tag] = { out, outCb };
+            break;
+        case Mode::Delay:
+            g.unlock();
+            timers_.emplace_back([s = s_, c, b] {
+                std::this_thread::sleep_for(std::chrono::milliseconds(b.DelayMs));
+                std::lock_guard<std::mutex> lg(s->Lock);
+                s->Ready.push_back(c);
+                s->Cv.notify_all();
+            });
+            break;
+        default:
+            s_->Ready.push_back(c);
+            s_->Cv.notify_all();
+            break;
+        }
+        return true;
+    }
+
+    bool Dequeue(IoctlCompletion& c, uint32_t timeoutMs) override
+    {
+        std::unique_lock<std::mutex> g(s_->Lock);
+        s_->Cv.wait_for(g, std::chrono::milliseconds(timeoutMs), [this] { return !s_->Ready.empty() || s_->Woken; });
+        s_->Woken = false;
+        if (s_->Ready.empty())
+            return false;
+        c = s_->Ready.front();
+        s_->Ready.pop_front();
+        return true;
+    }
+
+    // A hung request completes as cancelled (ERROR_OPERATION_ABORTED).
+    void Cancel(uint64_t tag) override
+    {
+        std::lock_guard<std::mutex> g(s_->Lock);
+        s_->Cancelled.insert(tag);
+        auto it = s_->Hung.find(tag);
+        if (it == s_->Hung.end())
+            return;
+        s_->Hung.erase(it);
+        IoctlCompletion c;
+        c.Tag = tag;
+        c.Error = 995;
+        s_->Ready.push_back(c);
+        s_->Cv.notify_all();
+    }
+
+    void Wake() override
+    {
+        std::lock_guard<std::mutex> g(s_->Lock);
+        s_->Woken = true;
+        s_->Cv.notify_all();
+    }
+
+private:
+    std::shared_ptr<Shared> s_;
+    std::vector<std::thread> timers_;  // only touched from Submit's callers (test thread)
+};
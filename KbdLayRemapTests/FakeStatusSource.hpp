@@ -0,0 +1,54 @@
+#pragma once
+#include "StatusRates.hpp"
+#include <map>
+
+// Canned driver status: the test sets each device's cumulative counters
+// before every sample. Devices can be made to fail their query, and the
+// whole list can be made unreadable.
+class FakeStatusSource final : public StatusSource
+{
+public:
+    bool FailList = false;
+
+    KBLAY_STATUS_OUTPUT& Device(const GUID& id)
+    {
+        auto& e = devices_[Key(id)];
+        e.Status.ContainerId = id;
+        return e.Status;
+    }
+
+    void Remove(const GUID& id) { devices_.erase(Key(id)); }
+    void FailQuery(const GUID& id, bool fail) { devices_[Key(id)].Fail = fail; }
+
+    bool ListContainers(std::vector<GUID>& out) override
+    {
+        if (FailList)
+            return false;
+        for (const auto& kv : devices_)
+            out.push_back(kv.second.Status.ContainerId);
+        return true;
+    }
+
+    bool QueryStatus(const GUID& id, KBLAY_STATUS_OUTPUT& out) override
+    {
+        auto it = devices_.find(Key(id));
+        if (it == devices_.end() || it->second.Fail)
+            return false;
+        out = it->second.Status;
+        return true;
+    }
+
+private:
+    struct Entry
+    {
+        KBLAY_STATUS_OUTPUT Status{};
+        bool Fail = false;
+    };
+
+    static std::vector<uint8_t> Key(const GUID& id)
+    {
+        return std::vector<uint8_t>((const uint8_t*)&id, (const uint8_t*)&id + sizeof(id));
+    }
+
+    std::map<std::vector<uint8_t>, Entry> devices_;
+};
@@ -0,0 +1,34 @@
+#pragma once
+#include "Guid.hpp"
+#include <cstring>
+#include <random>
+#include <vector>
+
+inline GUID RandomGuid(std::mt19937_64& rng)
+{
+    GUID g{};
+    const uint64_t a = rng();
+    const uint64_t b = rng();
+    std::memcpy(&g, &a, sizeof(a));
+    std::memcpy((uint8_t*)&g + sizeof(a), &b, sizeof(b));
+    return g;
+}
+
+// ContainerIds that differ in one field only, as some vendors assign them.
+inline GUID SequentialGuid(uint32_t n)
+{
+    GUID g{};
+    g.Data1 = 0x8A1B2C00u + n;
+    g.Data2 = 0x1234;
+    g.Data3 = 0x5678;
+    return g;
+}
+
+inline std::vector<GUID> RandomGuids(size_t count, uint64_t seed)
+{
+    std::mt19937_64 rng(seed);
+    std::vector<GUID> v;
+    for (size_t i = 0; i < count; ++i)
+        v.push_back(RandomGuid(rng));
+    return v;
+}
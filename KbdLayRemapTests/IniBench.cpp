@@ -0,0 +1,62 @@
+#include "IniParser.hpp"
+#include "KbdLayTest.hpp"
+#include "TestFiles.hpp"
+#include <cstdio>
+
+// Parse throughput on large generated configs, and the cost of a reload
+// check on an unchanged file (the service's every-pass case).
+
+namespace
+{
+    std::string GenerateIni(size_t sections, size_t keysPerSection)
+    {
+        std::string s = "; generated\n";
+        for (size_t i = 0; i < sections; ++i)
+        {
+            s += "[Device" + std::to_string(i) + "]\n";
+            for (size_t k = 0; k < keysPerSection; ++k)
+                s += "Key" + std::to_string(k) + " = value-" + std::to_string(i * keysPerSection + k) + "\n";
+            s += "\n";
+        }
+        return s;
+    }
+}
+
+KBLAY_BENCH(IniParse)
+{
+    TestDir dir;
+    const size_t sizes[][2] = { { 16, 16 }, { 256, 64 }, { 2048, 64 } };
+    for (const auto& size : sizes)
+    {
+        const std::string text = GenerateIni(size[0], size[1]);
+        const auto path = dir.Write("bench.ini", text);
+        const uint64_t loads = ctx.Iterations(1 + (512ull << 20) / text.size());
+
+        BenchTimer timer;
+        for (uint64_t i = 0; i < loads; ++i)
+        {
+            IniParser ini;
+            ini.Load(path.wstring());
+            KeepValue(ini.Stamp().Hash);
+        }
+        const double seconds = timer.Seconds();
+
+        char detail[64];
+        std::snprintf(detail, sizeof(detail), "%.1f MB/s, %zu keys",
+            (double)text.size() * (double)loads / seconds / 1e6, size[0] * size[1]);
+        ctx.Report("ini/load/" + std::to_string(text.size() / 1024) + "KiB", loads, seconds, detail);
+
+        IniParser first;
+        first.Load(path.wstring());
+        const uint64_t checks = ctx.Iterations(200000);
+        BenchTimer unchanged;
+        for (uint64_t i = 0; i < checks; ++i)
+        {
+            IniParser ini;
+            bool changed = false;
+            ini.LoadIfChanged(path.wstring(), first.Stamp(), changed);
+            KeepValue(changed);
+        }
+        ctx.Report("ini/unchanged-check/" + std::to_string(text.size() / 1024) + "KiB", checks, unchanged.Seconds());
+    }
+}
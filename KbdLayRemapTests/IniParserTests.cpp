@@ -0,0 +1,99 @@
+#include "IniParser.hpp"
+#include "KbdLayTest.hpp"
+#include "TestFiles.hpp"
+
+KBLAY_TEST(IniParsesSectionsKeysAndComments)
+{
+    TestDir dir;
+    const auto path = dir.Write("a.ini",
+        "\xEF\xBB\xBF; comment\n"
+        "[Service]\n"
+        "  PollMs = 250 \r\n"
+        "# another\n"
+        "[Layout]\n"
+        "Base=Auto\n"
+        "Base = 0411\n");
+
+    IniParser ini;
+    CHECK(ini.Load(path.wstring()));
+    CHECK(ini.Get(L"Service", L"PollMs") == L"250");
+    CHECK(ini.Get(L"Layout", L"Base") == L"0411");   // later assignment wins
+    CHECK(ini.Get(L"Layout", L"PollMs", L"x") == L"x");
+}
+
+KBLAY_TEST(IniLoadIfChangedSkipsFilesWithSameSizeAndWriteTime)
+{
+    TestDir dir;
+    const auto path = dir.Write("b.ini", "[S]\nK=1\n");
+
+    IniParser first;
+    CHECK(first.Load(path.wstring()));
+    const IniFileStamp stamp = first.Stamp();
+
+    // Same size, same write time: not even hashed, so the edit goes unseen.
+    const auto mtime = std::filesystem::last_write_time(path);
+    dir.Write("b.ini", "[S]\nK=2\n");
+    std::filesystem::last_write_time(path, mtime);
+
+    IniParser again;
+    bool changed = true;
+    CHECK(again.LoadIfChanged(path.wstring(), stamp, changed));
+    CHECK(!changed);
+    CHECK(again.Stamp() == stamp);
+    CHECK(again.Get(L"S", L"K", L"none") == L"none");
+}
+
+KBLAY_TEST(IniLoadIfChangedHashesTouchedFiles)
+{
+    TestDir dir;
+    const auto path = dir.Write("c.ini", "[S]\nK=1\n");
+
+    IniParser first;
+    CHECK(first.Load(path.wstring()));
+    const IniFileStamp stamp = first.Stamp();
+
+    // Rewritten with the same bytes: the hash says unchanged.
+    std::filesystem::last_write_time(path, std::filesystem::last_write_time(path) + std::chrono::seconds(5));
+    IniParser touched;
+    bool changed = true;
+    CHECK(touched.LoadIfChanged(path.wstring(), stamp, changed));
+    CHECK(!changed);
+    CHECK(touched.Stamp().Hash == stamp.Hash);
+    CHECK(touched.Stamp().WriteTime != stamp.WriteTime);
+
+    // New contents: parsed.
+    dir.Write("c.ini", "[S]\nK=22\n");
+    IniParser edited;
+    CHECK(edited.LoadIfChanged(path.wstring(), stamp, changed));
+    CHECK(changed);
+    CHECK(edited.Get(L"S", L"K") == L"22");
+    CHECK(edited.Stamp() != stamp);
+}
+
+KBLAY_TEST(IniLoadIfChangedFailsForMissingFile)
+{
+    TestDir dir;
+    IniParser ini;
+    bool changed = true;
+    IniFileStamp previous;
+    previous.Size = 8;
+    previous.WriteTime = 1;
+    CHECK(!ini.LoadIfChanged(dir.Path("missing.ini").wstring(), previous, changed));
+    CHECK(!changed);
+}
+
+KBLAY_TEST(IniReadsUtf16LittleEndian)
+{
+    TestDir dir;
+    std::string bytes = "\xFF\xFE";
+    for (char c : std::string("[S]\r\nName=Caf\xE9\r\n"))
+    {
+        bytes.push_back(c);
+        bytes.push_back('\0');
+    }
+    const auto path = dir.Write("u.ini", bytes);
+
+    IniParser ini;
+    CHECK(ini.Load(path.wstring()));
+    CHECK(ini.Get(L"S", L"Name") == L"Café");
+}
@@ -0,0 +1,125 @@
+#include "KbdLayTest.hpp"
+#include <cstdio>
+#include <vector>
+
+struct RegisteredTest
+{
+    const char* Name;
+    TestFn Fn;
+};
+
+struct RegisteredBench
+{
+    const char* Name;
+    BenchFn Fn;
+};
+
+static std::vector<RegisteredTest>& Tests()
+{
+    static std::vector<RegisteredTest> tests;
+    return tests;
+}
+
+static std::vector<RegisteredBench>& Benches()
+{
+    static std::vector<RegisteredBench> benches;
+    return benches;
+}
+
+static int g_failures = 0;
+
+bool RegisterTest(const char* name, TestFn fn)
+{
+    Tests().push_back({ name, fn });
+    return true;
+}
+
+bool RegisterBench(const char* name, BenchFn fn)
+{
+    Benches().push_back({ name, fn });
+    return true;
+}
+
+void ReportCheckFailure(const char* file, int line, const std::string& what)
+{
+    std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what.c_str());
+    ++g_failures;
+}
+
+void BenchContext::Report(const std::string& name, uint64_t ops, double seconds, const std::string& detail) const
+{
+    const double ns = ops ? seconds * 1e9 / (double)ops : 0.0;
+    const double rate = seconds > 0 ? (double)ops / seconds : 0.0;
+    std::printf("%-44s %12llu ops %10.2f ns/op %14.0f ops/s  %s\n",
+        name.c_str(), (unsigned long long)ops, ns, rate, detail.c_str());
+    std::fflush(stdout);
+}
+
+std::vector<std::string> BenchContext::Values(const char* name) const
+{
+    const std::string prefix = std::string("--") + name + "=";
+    std::vector<std::string> values;
+    for (const auto& a : args_)
+    {
+        if (a.compare(0, prefix.size(), prefix) == 0)
+            values.push_back(a.substr(prefix.size()));
+    }
+    return values;
+}
+
+static bool Matches(const char* name, int argc, char** argv, int first)
+{
+    bool anyFilter = false;
+    for (int i = first; i < argc; ++i)
+    {
+        if (argv[i][0] == '-')
+            continue;
+        anyFilter = true;
+        if (std::string(name).find(argv[i]) != std::string::npos)
+            return true;
+    }
+    return !anyFilter;
+}
+
+// Runs every registered test whose name contains one of the arguments (all
+// of them without arguments). Returns nonzero if any check failed.
+int RunRegisteredTests(int argc, char** argv)
+{
+    int failedTests = 0;
+    int ran = 0;
+    for (const auto& t : Tests())
+    {
+        if (!Matches(t.Name, argc, argv, 1))
+            continue;
+        const int before = g_failures;
+        t.Fn();
+        ++ran;
+        const bool ok = g_failures == before;
+        if (!ok) ++failedTests;
+        std::printf("[%s] %s\n", ok ? " OK " : "FAIL", t.Name);
+    }
+    std::printf("%d test(s), %d failed\n", ran, failedTests);
+    return failedTests == 0 ? 0 : 1;
+}
+
+// Runs the registered benchmarks the arguments select; --quick shrinks them
+// and --name=value options are left for the benchmarks (BenchContext::Values).
+int RunRegisteredBenches(int argc, char** argv)
+{
+    bool quick = false;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        args.push_back(argv[i]);
+        if (args.back() == "--quick")
+            quick = true;
+    }
+
+    BenchContext ctx(quick, args);
+    for (const auto& b : Benches())
+    {
+        if (Matches(b.Name, argc, argv, 1))
+            b.Fn(ctx);
+    }
+    return 0;
+}
@@ -0,0 +1,103 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Minimal test and benchmark registry for the host (CMake) build. Each test
+// source registers its cases with KBLAY_TEST; TestMain.cpp runs them, and
+// BenchMain.cpp does the same for KBLAY_BENCH.
+
+using TestFn = void (*)();
+
+bool RegisterTest(const char* name, TestFn fn);
+void ReportCheckFailure(const char* file, int line, const std::string& what);
+
+template <typename T>
+std::string DescribeValue(const T& v)
+{
+    if constexpr (std::is_same_v<T, bool>)
+        return v ? "true" : "false";
+    else if constexpr (std::is_enum_v<T>)
+        return std::to_string((long long)v);
+    else if constexpr (std::is_integral_v<T>)
+        return std::to_string(v);
+    else if constexpr (std::is_convertible_v<const T&, std::string>)
+        return "\"" + std::string(v) + "\"";
+    else
+        return "?";
+}
+
+#define KBLAY_TEST(Name) \
+    static void Name(); \
+    static const bool Name##Registered = RegisterTest(#Name, Name); \
+    static void Name()
+
+#define CHECK(expr) \
+    do { if (!(expr)) ReportCheckFailure(__FILE__, __LINE__, #expr); } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        const auto& kblayA_ = (a); \
+        const auto& kblayB_ = (b); \
+        if (!(kblayA_ == kblayB_)) \
+            ReportCheckFailure(__FILE__, __LINE__, std::string(#a " == " #b ": ") + \
+                DescribeValue(kblayA_) + " vs " + DescribeValue(kblayB_)); \
+    } while (0)
+
+// Benchmarks. Quick runs (ctest) scale every loop down so the suite only
+// proves it still runs; full runs are for numbers.
+class BenchContext
+{
+public:
+    BenchContext(bool quick, std::vector<std::string> args) : quick_(quick), args_(std::move(args)) {}
+
+    bool Quick() const { return quick_; }
+
+    // Values of every --name=value argument, in order.
+    std::vector<std::string> Values(const char* name) const;
+    uint64_t Iterations(uint64_t full) const { return quick_ ? (full / 1000 ? full / 1000 : 1) : full; }
+
+    // One result line: ops in seconds, plus free-form detail.
+    void Report(const std::string& name, uint64_t ops, double seconds, const std::string& detail = std::string()) const;
+
+private:
+    bool quick_;
+    std::vector<std::string> args_;
+};
+
+using BenchFn = void (*)(BenchContext&);
+
+bool RegisterBench(const char* name, BenchFn fn);
+
+#define KBLAY_BENCH(Name) \
+    static void Name(BenchContext&); \
+    static const bool Name##Registered = RegisterBench(#Name, Name); \
+    static void Name(BenchContext& ctx)
+
+class BenchTimer
+{
+public:
+    BenchTimer() : start_(std::chrono::steady_clock::now()) {}
+    double Seconds() const
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count();
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Keeps the optimizer from discarding a benchmark's result.
+template <typename T>
+inline void KeepValue(const T& v)
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "r,m"(v) : "memory");
+#else
+    static volatile const T* sink;
+    sink = &v;
+#endif
+}
@@ -0,0 +1,150 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include "LayoutTables.hpp"
+#include "../Shared/Public.h"
+#include <map>
+
+// The built-in US/JIS tables against the runtime compiler: the constexpr
+// blobs match what CompileLayoutPair makes of the Layouts/*.inl data files
+// byte for byte, and through the engine every key types its label.
+
+namespace
+{
+    const wchar_t* const kUs = L"00000409";
+    const wchar_t* const kJis = L"00000411";
+
+    std::wstring LayoutDir()
+    {
+        const std::string dir = KBLAY_LAYOUT_DIR;
+        return std::wstring(dir.begin(), dir.end());
+    }
+
+    LayoutKeys FromFile(const std::wstring& klid)
+    {
+        LayoutFileSource files(LayoutDir());
+        LayoutKeys keys;
+        CHECK(files.Load(klid, keys));
+        return keys;
+    }
+
+    bool SameKeyList(const std::vector<LayoutKey>& a, const std::vector<LayoutKey>& b)
+    {
+        if (a.size() != b.size())
+            return false;
+        for (size_t i = 0; i < a.size(); ++i)
+            if (a[i].Scan != b[i].Scan || a[i].Plain != b[i].Plain || a[i].Shifted != b[i].Shifted)
+                return false;
+        return true;
+    }
+
+    // What the system running `base` types for one key of `target`, pressed
+    // with or without Shift, after the engine has applied `blob`.
+    struct Typed
+    {
+        uint16_t Scan = 0;
+        bool Shift = false;
+    };
+
+    Typed TypeThrough(const std::vector<uint8_t>& blob, uint8_t scan, bool shift)
+    {
+        TestEngine t;
+        CHECK(t.Load(blob));
+        bool shiftDown = false;
+        Typed typed;
+        std::vector<KBLAY_KEY_EVENT> out;
+        if (shift)
+            out = t.Feed(KeyDown(KBLAY_MAKE_LSHIFT));
+        const auto key = t.Feed(KeyDown(scan));
+        out.insert(out.end(), key.begin(), key.end());
+        for (const auto& e : out)
+        {
+            if (e.MakeCode == KBLAY_MAKE_LSHIFT || e.MakeCode == KBLAY_MAKE_RSHIFT)
+                shiftDown = !(e.Flags & KBLAY_KEY_BREAK);
+            else if (!(e.Flags & KBLAY_KEY_BREAK))
+            {
+                typed.Scan = e.MakeCode;
+                typed.Shift = shiftDown;
+            }
+        }
+        return typed;
+    }
+}
+
+KBLAY_TEST(BuiltInLayoutsMatchTheirDataFiles)
+{
+    // The constexpr tables include the same files the runtime parser reads.
+    BuiltInLayoutSource builtIn;
+    for (const wchar_t* klid : { kUs, kJis })
+    {
+        LayoutKeys compiled;
+        CHECK(builtIn.Load(klid, compiled));
+        CHECK(compiled.Klid == klid);
+        CHECK(SameKeyList(compiled.Keys, FromFile(klid).Keys));
+    }
+
+    LayoutKeys none;
+    CHECK(!builtIn.Load(L"00000407", none));
+}
+
+KBLAY_TEST(BuiltInBlobsMatchTheRuntimeCompiler)
+{
+    const std::pair<const wchar_t*, const wchar_t*> pairs[] = { { kUs, kJis }, { kJis, kUs } };
+    for (const auto& p : pairs)
+    {
+        const auto builtIn = BuiltInRuleBlob(p.first, p.second);
+        const auto runtime = CompileLayoutPair(FromFile(p.first), FromFile(p.second));
+        CHECK(!builtIn.empty());
+        CHECK(builtIn == runtime);
+        CHECK(KbdLayEngineValidateRuleBlob(builtIn.data(), builtIn.size(), KBLAY_MAX_RULE_ENTRIES, KBLAY_MAX_RULE_BLOB_BYTES));
+
+        const auto* h = reinterpret_cast<const KBLAY_RULE_BLOB_HEADER*>(builtIn.data());
+        CHECK_EQ(h->Version, (UINT32)KBLAY_RULE_BLOB_VERSION_2);
+        CHECK_EQ(h->TotalSizeBytes, (UINT32)builtIn.size());
+    }
+
+    // Only those two pairs are built in.
+    CHECK(BuiltInRuleBlob(kUs, kUs).empty());
+    CHECK(BuiltInRuleBlob(kUs, L"00000407").empty());
+}
+
+KBLAY_TEST(BuiltInBlobsTypeEveryLabelTheBaseLayoutHas)
+{
+    const std::pair<const wchar_t*, const wchar_t*> pairs[] = { { kUs, kJis }, { kJis, kUs } };
+    for (const auto& p : pairs)
+    {
+        const LayoutKeys base = FromFile(p.first);
+        const LayoutKeys target = FromFile(p.second);
+        const auto blob = BuiltInRuleBlob(p.first, p.second);
+
+        std::map<uint16_t, const LayoutKey*> baseByScan;
+        for (const auto& k : base.Keys)
+            baseByScan[k.Scan] = &k;
+        auto baseTypes = [&](char16_t c)
+        {
+            for (const auto& k : base.Keys)
+                if (k.Plain == c || k.Shifted == c)
+                    return true;
+            return false;
+        };
+
+        for (const auto& k : target.Keys)
+        {
+            for (const bool shift : { false, true })
+            {
+                const char16_t want = LayoutChar(k, shift);
+                const Typed typed = TypeThrough(blob, k.Scan, shift);
+                if (!want || !baseTypes(want))
+                {
+                    // Nothing to type it with: the key goes through as it is.
+                    CHECK_EQ(typed.Scan, (uint16_t)k.Scan);
+                    CHECK_EQ(typed.Shift, shift);
+                    continue;
+                }
+                const auto it = baseByScan.find(typed.Scan);
+                CHECK(it != baseByScan.end());
+                if (it != baseByScan.end())
+                    CHECK_EQ(LayoutChar(*it->second, typed.Shift), want);
+            }
+        }
+    }
+}
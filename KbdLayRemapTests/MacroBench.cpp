@@ -0,0 +1,138 @@
+#include "FakeClassDriver.hpp"
+#include "KbdLayTest.hpp"
+#include <cstdio>
+#include <random>
+
+// Macro expansion throughput: input events/s and output events/s for
+// streams where most keys are macros, through the engine alone and through
+// the outbox with a class driver that takes everything or only part.
+
+namespace
+{
+    // Macros of 4, 8, 16 and 32 steps on the home row; other keys remap.
+    std::vector<uint8_t> MacroRules()
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_4);
+        const uint16_t homeRow[] = { 0x1E, 0x1F, 0x20, 0x21 };
+        uint32_t length = 4;
+        for (uint16_t key : homeRow)
+        {
+            std::vector<KBLAY_MACRO_STEP> steps;
+            for (uint32_t i = 0; i < length / 2; ++i)
+            {
+                const uint16_t code = (uint16_t)(0x10 + i % 10);
+                steps.push_back(MacroDown(code));
+                steps.push_back(MacroUp(code));
+            }
+            b.Rule(key, 0, b.Macro(steps), KBLAY_FLAG_MACRO);
+            length *= 2;
+        }
+        for (uint16_t k = 0x10; k <= 0x19; ++k)
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0);
+        return b.Bytes();
+    }
+
+    // Taps where one key in `every` is a macro key.
+    std::vector<KBLAY_KEY_EVENT> Stream(uint32_t every)
+    {
+        std::mt19937 rng(every);
+        std::vector<KBLAY_KEY_EVENT> s;
+        for (int i = 0; i < 1024; ++i)
+        {
+            const uint16_t k = (rng() % every == 0) ? (uint16_t)(0x1E + rng() % 4) : (uint16_t)(0x10 + rng() % 10);
+            s.push_back(KeyDown(k));
+            s.push_back(KeyUp(k));
+        }
+        return s;
+    }
+
+    void ReportRates(BenchContext& ctx, const std::string& name, uint64_t in, uint64_t out, double seconds)
+    {
+        char detail[96];
+        std::snprintf(detail, sizeof(detail), "%.0f out events/s, amplification %.2f",
+            seconds > 0 ? (double)out / seconds : 0.0, (double)out / (double)in);
+        ctx.Report(name, in, seconds, detail);
+    }
+
+    void RunEngine(BenchContext& ctx, const std::string& name, const std::vector<KBLAY_KEY_EVENT>& s, uint64_t target)
+    {
+        TestEngine t;
+        t.Load(MacroRules());
+        std::vector<KBLAY_KEY_EVENT> out(KBLAY_OUTBOX_EVENTS);
+        uint64_t in = 0;
+        uint64_t produced = 0;
+
+        BenchTimer timer;
+        while (in < target)
+        {
+            size_t next = 0;
+            while (next < s.size())
+            {
+                KBLAY_ENGINE_BATCH batch;
+                next += KbdLayEngineProcessBatch(t.Engine.get(), t.State, t.Role, t.NowMs, s.data() + next, s.size() - next,
+                    out.data(), out.size(), nullptr, &batch);
+                produced += batch.Produced;
+            }
+            in += s.size();
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(produced);
+        ReportRates(ctx, "macro/engine/" + name, in, produced, seconds);
+    }
+
+    // The port driver offers each run of 16 again from what was not taken.
+    void RunDeliver(BenchContext& ctx, const std::string& name, const std::vector<KBLAY_KEY_EVENT>& s, uint64_t target,
+        uint32_t acceptDivisor)
+    {
+        TestEngine t;
+        t.Load(MacroRules());
+        FakeClassDriver upper(t);
+        if (acceptDivisor > 1)
+            upper.Accept = [acceptDivisor](uint32_t offered) { return (offered + acceptDivisor - 1) / acceptDivisor; };
+        KBLAY_OUTBOX box{};
+        uint64_t in = 0;
+        uint64_t received = 0;
+
+        BenchTimer timer;
+        while (in < target)
+        {
+            size_t next = 0;
+            while (next < s.size() || box.Count != 0)
+            {
+                const UINT32 run = (UINT32)(s.size() - next < 16 ? s.size() - next : 16);
+                KBLAY_BUDGET budget = EventBudget(KBLAY_BUDGET_DEFAULT_EVENTS);
+                UINT32 taken = 0;
+                KbdLayDeliver(&box, &FakeClassDriver::Ops, &upper, s.data() + next, run, &budget, &taken);
+                next += taken;
+            }
+            in += s.size();
+            received += upper.Received.size();
+            upper.Received.clear();
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(received);
+
+        char suffix[32];
+        std::snprintf(suffix, sizeof(suffix), acceptDivisor > 1 ? "/accept-1of%u" : "/accept-all", acceptDivisor);
+        ReportRates(ctx, "macro/deliver/" + name + suffix, in, received, seconds);
+    }
+}
+
+KBLAY_BENCH(MacroExpansion)
+{
+    struct Case
+    {
+        const char* Name;
+        uint32_t Every;
+    };
+    const Case cases[] = { { "quarter-macros", 4 }, { "half-macros", 2 }, { "all-macros", 1 } };
+
+    const uint64_t target = ctx.Iterations(2000000);
+    for (const auto& c : cases)
+    {
+        const auto s = Stream(c.Every);
+        RunEngine(ctx, c.Name, s, target);
+        RunDeliver(ctx, c.Name, s, target, 1);
+        RunDeliver(ctx, c.Name, s, target, 3);
+    }
+}
@@ -0,0 +1,299 @@
+#include "FakeStatusSource.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+#include "Metrics.hpp"
+#include "TestFiles.hpp"
+#include "Utf16.hpp"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Prometheus text from the metrics store: driver counters sampled from a
+// fake status source, service pass timings, the exposition format itself,
+// and the local endpoint that serves it.
+
+namespace
+{
+    // One rendering, checked against the text format as it is parsed:
+    // every series belongs to a family with one HELP and one TYPE before
+    // it, names are valid and no series appears twice.
+    struct Scrape
+    {
+        std::map<std::string, std::string> Series;   // name{labels} -> value
+        std::map<std::string, std::string> Types;
+        std::vector<std::string> Problems;
+
+        explicit Scrape(const std::string& text)
+        {
+            std::set<std::string> helped;
+            std::istringstream in(text);
+            std::string line;
+            while (std::getline(in, line))
+            {
+                if (line.rfind("# HELP ", 0) == 0 || line.rfind("# TYPE ", 0) == 0)
+                {
+                    std::istringstream l(line.substr(7));
+                    std::string name, rest;
+                    l >> name >> rest;
+                    if (!ValidName(name) || rest.empty())
+                        Problems.push_back("bad comment: " + line);
+                    if (line[2] == 'H' && !helped.insert(name).second)
+                        Problems.push_back("second HELP: " + name);
+                    if (line[2] == 'T' && !Types.emplace(name, rest).second)
+                        Problems.push_back("second TYPE: " + name);
+                    continue;
+                }
+
+                const size_t space = line.rfind(' ');
+                if (space == std::string::npos)
+                {
+                    Problems.push_back("no value: " + line);
+                    continue;
+                }
+                const std::string series = line.substr(0, space);
+                const std::string value = line.substr(space + 1);
+                const std::string name = series.substr(0, series.find('{'));
+                char* end = nullptr;
+                std::strtod(value.c_str(), &end);
+                if (!ValidName(name) || value.empty() || *end != '\0')
+                    Problems.push_back("bad sample: " + line);
+                if (!Types.count(Family(name)) || !helped.count(Family(name)))
+                    Problems.push_back("untyped sample: " + line);
+                if (!Series.emplace(series, value).second)
+                    Problems.push_back("repeated series: " + series);
+            }
+        }
+
+        std::string Family(const std::string& name) const
+        {
+            for (const char* suffix : { "_sum", "_count" })
+            {
+                const size_t n = std::strlen(suffix);
+                if (name.size() > n && name.compare(name.size() - n, n, suffix) == 0)
+                {
+                    const auto it = Types.find(name.substr(0, name.size() - n));
+                    if (it != Types.end() && it->second == "summary")
+                        return it->first;
+                }
+            }
+            return name;
+        }
+
+        static bool ValidName(const std::string& n)
+        {
+            if (n.empty() || std::isdigit((unsigned char)n[0]))
+                return false;
+            for (char c : n)
+                if (!std::isalnum((unsigned char)c) && c != '_' && c != ':')
+                    return false;
+            return true;
+        }
+
+        std::string Value(const std::string& series) const
+        {
+            const auto it = Series.find(series);
+            return it == Series.end() ? "<missing>" : it->second;
+        }
+    };
+
+    std::string Device(const char* metric, const GUID& id)
+    {
+        return std::string(metric) + "{container=\"" + WideToUtf8(GuidToString(id)) + "\"}";
+    }
+
+    void CheckWellFormed(const Scrape& s)
+    {
+        for (const auto& p : s.Problems)
+            ReportCheckFailure(__FILE__, __LINE__, p);
+    }
+
+    // Everything a client on the Unix socket gets back for `request`.
+    std::string Fetch(const std::string& path, const std::string& request)
+    {
+        const int s = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        std::string got;
+        if (connect(s, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0)
+        {
+            if (!request.empty())
+                (void)!send(s, request.data(), request.size(), 0);
+            char buf[4096];
+            for (ssize_t n; (n = recv(s, buf, sizeof(buf), 0)) > 0;)
+                got.append(buf, (size_t)n);
+        }
+        close(s);
+        return got;
+    }
+}
+
+KBLAY_TEST(MetricsRenderDriverCountersPerDevice)
+{
+    FakeStatusSource driver;
+    const GUID a = SequentialGuid(1);
+    const GUID b = SequentialGuid(2);
+    const GUID gone = SequentialGuid(3);
+    auto& sa = driver.Device(a);
+    sa.Role = KBLAY_ROLE_REMAP;
+    sa.State = KBLAY_STATE_ACTIVE;
+    sa.RemapHitCount = 1234;
+    sa.PassThroughCount = 56;
+    sa.UnmappedCount = 7;
+    sa.ShiftToggleCount = 89;
+    sa.DebounceDropCount = 3;
+    auto& sb = driver.Device(b);
+    sb.Role = KBLAY_ROLE_BASE;
+    sb.State = KBLAY_STATE_BYPASS_SOFT;
+    sb.LastErrorNtStatus = 0xC0000001u;
+    sb.PassThroughCount = 1ull << 40;
+    driver.Device(gone).RemapHitCount = 1;
+    driver.FailQuery(gone, true);
+
+    MetricsStore store;
+    MetricsSampler sampler(driver, store);
+    sampler.SampleOnce();
+    const Scrape s(*store.Text());
+    CheckWellFormed(s);
+
+    CHECK_EQ(s.Value(Device("kblay_remap_events_total", a)), std::string("1234"));
+    CHECK_EQ(s.Value(Device("kblay_pass_events_total", a)), std::string("56"));
+    CHECK_EQ(s.Value(Device("kblay_unmapped_events_total", a)), std::string("7"));
+    CHECK_EQ(s.Value(Device("kblay_shift_toggles_total", a)), std::string("89"));
+    CHECK_EQ(s.Value(Device("kblay_debounce_drops_total", a)), std::string("3"));
+    CHECK_EQ(s.Value(Device("kblay_device_role", a)), std::to_string(KBLAY_ROLE_REMAP));
+    CHECK_EQ(s.Value(Device("kblay_device_state", b)), std::to_string(KBLAY_STATE_BYPASS_SOFT));
+    CHECK_EQ(s.Value(Device("kblay_device_last_ntstatus", b)), std::string("3221225473"));
+    CHECK_EQ(s.Value(Device("kblay_pass_events_total", b)), std::string("1099511627776"));
+    CHECK_EQ(s.Types.at("kblay_remap_events_total"), std::string("counter"));
+    CHECK_EQ(s.Types.at("kblay_device_state"), std::string("gauge"));
+
+    // A device whose query failed is left out rather than shown as zeros.
+    CHECK_EQ(s.Value(Device("kblay_remap_events_total", gone)), std::string("<missing>"));
+    CHECK_EQ(s.Value("kblay_driver_sample_failures_total"), std::string("0"));
+    CHECK(std::strtod(s.Value("kblay_driver_sample_timestamp_seconds").c_str(), nullptr) > 1.7e9);
+}
+
+KBLAY_TEST(MetricsKeepTheLastDevicesWhenTheDriverCannotList)
+{
+    FakeStatusSource driver;
+    const GUID a = SequentialGuid(1);
+    driver.Device(a).RemapHitCount = 10;
+
+    MetricsStore store;
+    MetricsSampler sampler(driver, store);
+    sampler.SampleOnce();
+    const std::string stamp = Scrape(*store.Text()).Value("kblay_driver_sample_timestamp_seconds");
+
+    driver.Device(a).RemapHitCount = 20;
+    driver.FailList = true;
+    sampler.SampleOnce();
+    sampler.SampleOnce();
+    Scrape failed(*store.Text());
+    CheckWellFormed(failed);
+    CHECK_EQ(failed.Value(Device("kblay_remap_events_total", a)), std::string("10"));
+    CHECK_EQ(failed.Value("kblay_driver_sample_failures_total"), std::string("2"));
+    CHECK_EQ(failed.Value("kblay_driver_sample_timestamp_seconds"), stamp);
+
+    driver.FailList = false;
+    sampler.SampleOnce();
+    Scrape back(*store.Text());
+    CHECK_EQ(back.Value(Device("kblay_remap_events_total", a)), std::string("20"));
+    CHECK_EQ(back.Value("kblay_driver_sample_failures_total"), std::string("2"));
+
+    // No devices at all still renders every family, typed, with no samples.
+    driver.Remove(a);
+    sampler.SampleOnce();
+    Scrape empty(*store.Text());
+    CheckWellFormed(empty);
+    CHECK(empty.Types.count("kblay_remap_events_total"));
+    CHECK_EQ(empty.Value(Device("kblay_remap_events_total", a)), std::string("<missing>"));
+}
+
+KBLAY_TEST(MetricsRenderServicePassesAndIoctlTotals)
+{
+    ServiceMetrics m;
+    m.ConfigGeneration = 4;
+    m.Phases[(size_t)ApplyPhase::Config].Add(1500);
+    m.Phases[(size_t)ApplyPhase::Config].Add(500);
+    m.Phases[(size_t)ApplyPhase::Total].Add(2500000);
+    m.Converged = 9;
+    m.Failed = 1;
+    m.LastConvergenceMs = 250;
+    m.MaxConvergenceMs = 1750;
+    m.IoctlCompleted = 30;
+    m.IoctlTimedOut = 2;
+    m.IoctlSumUs = 4500;
+    m.IoctlMaxUs = 900;
+
+    MetricsStore store;
+    store.SetService(m);
+    const Scrape s(*store.Text());
+    CheckWellFormed(s);
+
+    CHECK_EQ(s.Value("kblay_config_generation"), std::string("4"));
+    CHECK_EQ(s.Types.at("kblay_apply_phase_seconds"), std::string("summary"));
+    CHECK_EQ(s.Value("kblay_apply_phase_seconds_sum{phase=\"config\"}"), std::string("0.002000"));
+    CHECK_EQ(s.Value("kblay_apply_phase_seconds_count{phase=\"config\"}"), std::string("2"));
+    CHECK_EQ(s.Value("kblay_apply_phase_max_seconds{phase=\"config\"}"), std::string("0.001500"));
+    CHECK_EQ(s.Value("kblay_apply_phase_seconds_sum{phase=\"total\"}"), std::string("2.500000"));
+    CHECK_EQ(s.Value("kblay_apply_phase_seconds_count{phase=\"reconcile\"}"), std::string("0"));
+    CHECK_EQ(s.Value("kblay_reconcile_converged_total"), std::string("9"));
+    CHECK_EQ(s.Value("kblay_reconcile_failed_total"), std::string("1"));
+    CHECK_EQ(s.Value("kblay_convergence_last_seconds"), std::string("0.250000"));
+    CHECK_EQ(s.Value("kblay_convergence_max_seconds"), std::string("1.750000"));
+    CHECK_EQ(s.Value("kblay_ioctl_latency_seconds_sum"), std::string("0.004500"));
+    CHECK_EQ(s.Value("kblay_ioctl_latency_seconds_count"), std::string("30"));
+    CHECK_EQ(s.Value("kblay_ioctl_latency_max_seconds"), std::string("0.000900"));
+    CHECK_EQ(s.Value("kblay_ioctl_timeouts_total"), std::string("2"));
+}
+
+KBLAY_TEST(MetricsFormatHoldsForManyDevices)
+{
+    FakeStatusSource driver;
+    const auto ids = RandomGuids(200, 50);
+    for (size_t i = 0; i < ids.size(); ++i)
+        driver.Device(ids[i]).RemapHitCount = i;
+
+    MetricsStore store;
+    MetricsSampler sampler(driver, store);
+    sampler.SampleOnce();
+    const Scrape s(*store.Text());
+    CheckWellFormed(s);
+    for (size_t i = 0; i < ids.size(); ++i)
+        CHECK_EQ(s.Value(Device("kblay_remap_events_total", ids[i])), std::to_string(i));
+}
+
+KBLAY_TEST(MetricsServerAnswersHttpAndBareClients)
+{
+    TestDir dir;
+    const std::string path = dir.Path("metrics.sock").string();
+    FakeStatusSource driver;
+    driver.Device(SequentialGuid(1)).RemapHitCount = 77;
+    MetricsStore store;
+    MetricsSampler sampler(driver, store);
+    sampler.SampleOnce();
+    const std::string body = *store.Text();
+
+    MetricsServer server(store);
+    CHECK(server.Start(Utf8ToWide(path)));
+
+    const std::string http = Fetch(path, "GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    const size_t split = http.find("\r\n\r\n");
+    CHECK(http.rfind("HTTP/1.0 200 OK\r\n", 0) == 0);
+    CHECK(http.find("Content-Type: text/plain; version=0.0.4") != std::string::npos);
+    CHECK(http.find("Content-Length: " + std::to_string(body.size()) + "\r\n") != std::string::npos);
+    CHECK(split != std::string::npos && http.substr(split + 4) == body);
+
+    // A client that sends nothing gets the text alone.
+    CHECK(Fetch(path, "") == body);
+
+    server.Stop();
+    CHECK(!std::filesystem::exists(path));
+}
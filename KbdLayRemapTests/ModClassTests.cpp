@@ -0,0 +1,272 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <algorithm>
+#include <random>
+
+// Modifier-conditioned rules lowered to per-class tables, checked against a
+// direct reading of the rule list, and tables swapped under a live engine.
+
+namespace
+{
+    // Groups each KBLAY_MODGROUP_* bit is held through (left-hand keys).
+    uint8_t ModBitsOfGroups(uint32_t groups)
+    {
+        return (uint8_t)(((groups & KBLAY_MODGROUP_SHIFT) ? KBLAY_MOD_LSHIFT : 0) |
+            ((groups & KBLAY_MODGROUP_CTRL) ? KBLAY_MOD_LCTRL : 0) |
+            ((groups & KBLAY_MODGROUP_ALT) ? KBLAY_MOD_LALT : 0) |
+            ((groups & KBLAY_MODGROUP_WIN) ? KBLAY_MOD_LWIN : 0));
+    }
+
+    uint16_t PrefixFlags(uint32_t prefix)
+    {
+        return prefix == 2 ? KBLAY_KEY_E1 : prefix == 1 ? KBLAY_KEY_E0 : 0;
+    }
+
+    uint8_t RulePrefixFlags(uint32_t prefix)
+    {
+        return prefix == 2 ? KBLAY_FLAG_E1 : prefix == 1 ? KBLAY_FLAG_E0 : 0;
+    }
+
+    // The rule list read the slow way: first rule for the key whose
+    // condition holds.
+    struct ReferenceRules
+    {
+        std::vector<KBLAY_RULE_ENTRY_V3> Rules;
+
+        KBLAY_RULE_CELL Lookup(uint32_t groups, uint32_t prefix, uint16_t code) const
+        {
+            for (const auto& r : Rules)
+            {
+                if (r.InMakeCode == code && (r.InFlags & (KBLAY_FLAG_E0 | KBLAY_FLAG_E1)) == RulePrefixFlags(prefix) &&
+                    (groups & r.ModMask) == r.ModValue)
+                    return KBLAY_RULE_CELL{ r.OutMakeCode, r.OutFlags, 1 };
+            }
+            return KBLAY_RULE_CELL{ 0, 0, 0 };
+        }
+
+        // Modifier states some rule condition tells apart.
+        size_t Classes() const
+        {
+            std::vector<std::vector<bool>> seen;
+            for (uint32_t g = 0; g < KBLAY_MODGROUP_STATES; ++g)
+            {
+                std::vector<bool> sig;
+                for (const auto& r : Rules)
+                {
+                    if (r.ModMask != 0)
+                        sig.push_back((g & r.ModMask) == r.ModValue);
+                }
+                if (std::find(seen.begin(), seen.end(), sig) == seen.end())
+                    seen.push_back(sig);
+            }
+            return seen.size();
+        }
+    };
+
+    const uint16_t kCodes[] = { 0x02, 0x03, 0x10, 0x1E, 0x1F, 0x28, 0x30, 0x47, 0x53, 0x0150, 0x01A0, 0x01FF };
+
+    ReferenceRules RandomRules(std::mt19937& rng)
+    {
+        static const uint8_t masks[][2] = {
+            { KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT },
+            { KBLAY_MODGROUP_SHIFT, 0 },
+            { KBLAY_MODGROUP_CTRL, KBLAY_MODGROUP_CTRL },
+            { KBLAY_MODGROUP_CTRL | KBLAY_MODGROUP_ALT, KBLAY_MODGROUP_CTRL },
+            { KBLAY_MODGROUP_ALL, KBLAY_MODGROUP_WIN },
+        };
+        static const uint8_t outFlags[] = { 0, KBLAY_FLAG_E0, KBLAY_FLAG_SHIFT, KBLAY_FLAG_E0 | KBLAY_FLAG_SHIFT, KBLAY_FLAG_E1 };
+
+        // Two conditions per blob fit KBLAY_RULE_MOD_CLASSES; some blobs
+        // get a third, which may not.
+        const size_t conditions = rng() % 8 == 0 ? 3 : 2;
+        uint8_t picked[3][2];
+        for (size_t i = 0; i < conditions; ++i)
+        {
+            const auto& m = masks[rng() % (sizeof(masks) / sizeof(masks[0]))];
+            picked[i][0] = m[0];
+            picked[i][1] = m[1];
+        }
+
+        ReferenceRules ref;
+        const size_t count = 1 + rng() % 40;
+        for (size_t i = 0; i < count; ++i)
+        {
+            KBLAY_RULE_ENTRY_V3 e{};
+            e.InMakeCode = kCodes[rng() % (sizeof(kCodes) / sizeof(kCodes[0]))];
+            // High codes stay in one page with two prefixes: at most 8 pages.
+            e.InFlags = RulePrefixFlags(e.InMakeCode > 0xFF ? rng() % 2 : rng() % 3);
+            if (rng() % 2)
+            {
+                const auto& m = picked[rng() % conditions];
+                e.ModMask = m[0];
+                e.ModValue = m[1];
+            }
+            e.OutMakeCode = rng() % 8 == 0 ? 0 : kCodes[rng() % (sizeof(kCodes) / sizeof(kCodes[0]))];
+            e.OutFlags = outFlags[rng() % (sizeof(outFlags) / sizeof(outFlags[0]))];
+            ref.Rules.push_back(e);
+        }
+        return ref;
+    }
+
+    std::vector<uint8_t> Blob(const ReferenceRules& ref)
+    {
+        TestBlob b;
+        for (const auto& r : ref.Rules)
+            b.Rule(r.InMakeCode, r.InFlags, r.OutMakeCode, r.OutFlags, r.ModMask, r.ModValue);
+        return b.Bytes();
+    }
+}
+
+KBLAY_TEST(ModClassLookupMatchesReferenceInterpreter)
+{
+    std::mt19937 rng(35);
+    size_t checked = 0;
+    size_t rejected = 0;
+
+    for (int round = 0; round < 400; ++round)
+    {
+        const ReferenceRules ref = RandomRules(rng);
+        TestEngine t;
+        const bool loaded = t.Load(Blob(ref));
+        CHECK_EQ(loaded, ref.Classes() <= KBLAY_RULE_MOD_CLASSES);
+        if (!loaded)
+        {
+            ++rejected;
+            continue;
+        }
+        CHECK_EQ((size_t)t.Engine->Table->ClassCount, ref.Classes());
+
+        for (uint32_t g = 0; g < KBLAY_MODGROUP_STATES; ++g)
+        {
+            KbdLayEngineModsFromBits(ModBitsOfGroups(g), &t.Engine->Mods);
+            for (uint32_t prefix = 0; prefix < KBLAY_RULE_PREFIXES; ++prefix)
+            {
+                for (uint16_t code : kCodes)
+                {
+                    const KBLAY_KEY_EVENT in = KeyDown(code, PrefixFlags(prefix));
+                    const KBLAY_RULE_CELL want = ref.Lookup(g, prefix, code);
+                    KBLAY_RULE_CELL got;
+                    const bool valid = KbdLayEngineLookupCell(t.Engine.get(), &in, &got) != FALSE;
+                    CHECK_EQ(valid, want.Valid != 0);
+                    if (valid && want.Valid)
+                    {
+                        CHECK_EQ(got.OutMakeCode, want.OutMakeCode);
+                        CHECK_EQ(got.OutFlags, want.OutFlags);
+                    }
+                    ++checked;
+                }
+            }
+        }
+    }
+
+    // The generator exercises both sides of the class cap.
+    CHECK(checked > 100000);
+    CHECK(rejected > 0);
+}
+
+KBLAY_TEST(ModClassTranslationMatchesReferenceInterpreter)
+{
+    std::mt19937 rng(3535);
+    for (int round = 0; round < 200; ++round)
+    {
+        const ReferenceRules ref = RandomRules(rng);
+        TestEngine t;
+        if (!t.Load(Blob(ref)))
+            continue;
+
+        for (int i = 0; i < 200; ++i)
+        {
+            const uint32_t g = rng() % KBLAY_MODGROUP_STATES;
+            const uint32_t prefix = rng() % 2;  // E1 never synthesizes Shift; keep to none/E0
+            const uint16_t code = kCodes[rng() % (sizeof(kCodes) / sizeof(kCodes[0]))];
+            const bool up = rng() % 2 != 0;
+            KbdLayEngineModsFromBits(ModBitsOfGroups(g), &t.Engine->Mods);
+
+            const KBLAY_KEY_EVENT in = up ? KeyUp(code, PrefixFlags(prefix)) : KeyDown(code, PrefixFlags(prefix));
+            KBLAY_ENGINE_RESULT r;
+            const auto out = t.Feed(in, &r);
+
+            const KBLAY_RULE_CELL want = ref.Lookup(g, prefix, code);
+            if (!want.Valid || want.OutMakeCode == 0)
+            {
+                CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+                CHECK(SameKeys(out, { in }));
+                continue;
+            }
+
+            KBLAY_KEY_EVENT mapped = KeyDown(want.OutMakeCode,
+                (uint16_t)(((want.OutFlags & KBLAY_FLAG_E0) ? KBLAY_KEY_E0 : 0) | ((want.OutFlags & KBLAY_FLAG_E1) ? KBLAY_KEY_E1 : 0) |
+                    (up ? KBLAY_KEY_BREAK : 0)));
+            const bool shiftHeld = (g & KBLAY_MODGROUP_SHIFT) != 0;
+            const bool shiftWanted = (want.OutFlags & KBLAY_FLAG_SHIFT) != 0;
+            if (shiftHeld == shiftWanted)
+            {
+                CHECK_EQ(r, KBLAY_ENGINE_REMAP);
+                CHECK(SameKeys(out, { mapped }));
+            }
+            else
+            {
+                CHECK_EQ(r, KBLAY_ENGINE_REMAP_TOGGLE);
+                CHECK_EQ(out.size(), (size_t)3);
+                CHECK(out.size() == 3 && SameKey(out[1], mapped));
+            }
+        }
+    }
+}
+
+KBLAY_TEST(ModClassCtrlCombinationsStayUnmapped)
+{
+    // The motivating case: remap a key, but not while Ctrl is held.
+    TestEngine t;
+    CHECK(t.Load(TestBlob()
+        .Rule(0x2C, 0, 0x15, 0, KBLAY_MODGROUP_CTRL, 0)  // Z -> Y unless Ctrl
+        .Bytes()));
+
+    CHECK(SameKeys(t.Feed(KeyDown(0x2C)), { KeyDown(0x15) }));
+    t.Feed(KeyDown(KBLAY_MAKE_CTRL, KBLAY_KEY_E0));
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(0x2C), &r), { KeyDown(0x2C) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    t.Feed(KeyUp(KBLAY_MAKE_CTRL, KBLAY_KEY_E0));
+    CHECK(SameKeys(t.Feed(KeyUp(0x2C)), { KeyUp(0x15) }));
+}
+
+KBLAY_TEST(RuleTableSwapTakesEffectOnTheNextEvent)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob().Rule(0x1E, 0, 0x30, 0).Bytes()));
+    CHECK(SameKeys(t.Feed(KeyDown(0x1E)), { KeyDown(0x30) }));
+
+    // Built elsewhere, swapped in; the engine hands the old table back.
+    TestBlob macroRules(KBLAY_RULE_BLOB_VERSION_4);
+    const uint16_t m = macroRules.Macro({ MacroDown(0x10), MacroUp(0x10) });
+    const auto bytes = macroRules.Rule(0x1E, 0, m, KBLAY_FLAG_MACRO).Bytes();
+    CHECK(KbdLayEngineValidateRuleBlob(bytes.data(), bytes.size(), 8192, 1u << 20));
+    std::unique_ptr<KBLAY_RULE_TABLE> next(new KBLAY_RULE_TABLE);
+    KbdLayEngineBuildRuleTable(bytes.data(), bytes.size(), next.get());
+
+    CHECK(KbdLayEngineSetRuleTable(t.Engine.get(), next.get()) == t.Table.get());
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(0x1E), &r), { KeyDown(0x10), KeyUp(0x10) }));
+    CHECK_EQ(r, KBLAY_ENGINE_MACRO);
+
+    // No table: everything passes unmapped, and there is nothing to hand back.
+    CHECK(KbdLayEngineSetRuleTable(t.Engine.get(), nullptr) == next.get());
+    CHECK(SameKeys(t.Feed(KeyDown(0x1E), &r), { KeyDown(0x1E) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    CHECK(KbdLayEngineSetRuleTable(t.Engine.get(), nullptr) == nullptr);
+}
+
+KBLAY_TEST(RuleTableSwapKeepsKeysInFlight)
+{
+    TestBlob holdRules(KBLAY_RULE_BLOB_VERSION_5);
+    const uint16_t h = holdRules.TapHold(0x39, KBLAY_MAKE_LSHIFT, 200);
+    TestEngine t;
+    CHECK(t.Load(holdRules.Rule(0x39, 0, h, KBLAY_FLAG_TAPHOLD).Bytes()));
+    CHECK(t.Feed(KeyDown(0x39)).empty());
+
+    // The old table is gone before the key resolves; its definition was copied.
+    CHECK(t.Load(TestBlob().Rule(0x1E, 0, 0x30, 0).Bytes()));
+    CHECK(SameKeys(t.Advance(t.NowMs + 250), { KeyDown(KBLAY_MAKE_LSHIFT) }));
+    CHECK(SameKeys(t.Feed(KeyUp(0x39)), { KeyUp(KBLAY_MAKE_LSHIFT) }));
+}
@@ -0,0 +1,211 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <atomic>
+#include <random>
+#include <thread>
+#include <vector>
+
+// The pooled modifier word: the SWAR read against a plain per-byte OR,
+// engines on one pool, and publishers on several threads against readers
+// that must never see a held modifier vanish.
+
+namespace
+{
+    // KBLAY_MOD_* bit i is set iff byte i of the counts is nonzero.
+    uint8_t ReferenceRead(uint64_t counts)
+    {
+        uint8_t bits = 0;
+        for (int i = 0; i < 8; ++i)
+            if ((counts >> (8 * i)) & 0xFF)
+                bits |= (uint8_t)(1u << i);
+        return bits;
+    }
+
+    struct ModKey
+    {
+        uint16_t Make;
+        uint16_t Flags;
+        uint8_t Bit;
+    };
+
+    const ModKey kMods[] = {
+        { KBLAY_MAKE_LSHIFT, 0, KBLAY_MOD_LSHIFT },
+        { KBLAY_MAKE_RSHIFT, 0, KBLAY_MOD_RSHIFT },
+        { KBLAY_MAKE_CTRL, 0, KBLAY_MOD_LCTRL },
+        { KBLAY_MAKE_CTRL, KBLAY_KEY_E0, KBLAY_MOD_RCTRL },
+        { KBLAY_MAKE_ALT, 0, KBLAY_MOD_LALT },
+        { KBLAY_MAKE_ALT, KBLAY_KEY_E0, KBLAY_MOD_RALT },
+        { KBLAY_MAKE_LWIN, KBLAY_KEY_E0, KBLAY_MOD_LWIN },
+        { KBLAY_MAKE_RWIN, KBLAY_KEY_E0, KBLAY_MOD_RWIN },
+    };
+}
+
+KBLAY_TEST(ModShareReadIsTheOrOfNonzeroCounts)
+{
+    // Every byte value in every position, including 0x80 and 0xFF where a
+    // carry out of the low seven bits would spill into the next byte.
+    for (int pos = 0; pos < 8; ++pos)
+    {
+        for (uint32_t v = 0; v < 256; ++v)
+        {
+            KBLAY_MOD_SHARE s{ (INT64)((uint64_t)v << (8 * pos)) };
+            CHECK_EQ(KbdLayModShareRead(&s), ReferenceRead((uint64_t)s.Counts));
+        }
+    }
+
+    std::mt19937_64 rng(46);
+    for (int i = 0; i < 100000; ++i)
+    {
+        // Bytes biased to 0, 1, 0x7F, 0x80 and 0xFF.
+        uint64_t w = 0;
+        for (int b = 0; b < 8; ++b)
+        {
+            static const uint8_t edges[] = { 0, 0, 1, 0x7F, 0x80, 0xFF };
+            const uint8_t byte = rng() % 2 ? edges[rng() % 6] : (uint8_t)rng();
+            w |= (uint64_t)byte << (8 * b);
+        }
+        KBLAY_MOD_SHARE s{ (INT64)w };
+        CHECK_EQ(KbdLayModShareRead(&s), ReferenceRead(w));
+    }
+}
+
+KBLAY_TEST(ModSharePublishMovesOneContribution)
+{
+    KBLAY_MOD_SHARE s{ 0 };
+    KbdLayModSharePublish(&s, 0, KBLAY_MOD_LSHIFT | KBLAY_MOD_RALT);
+    KbdLayModSharePublish(&s, 0, KBLAY_MOD_LSHIFT);
+    CHECK_EQ(KbdLayModShareRead(&s), KBLAY_MOD_LSHIFT | KBLAY_MOD_RALT);
+
+    // A change that adds one bit and drops another in the same publish.
+    KbdLayModSharePublish(&s, KBLAY_MOD_LSHIFT | KBLAY_MOD_RALT, KBLAY_MOD_RWIN);
+    CHECK_EQ(KbdLayModShareRead(&s), KBLAY_MOD_LSHIFT | KBLAY_MOD_RWIN);
+    KbdLayModSharePublish(&s, KBLAY_MOD_LSHIFT, 0);
+    CHECK_EQ(KbdLayModShareRead(&s), KBLAY_MOD_RWIN);
+    KbdLayModSharePublish(&s, KBLAY_MOD_RWIN, 0);
+    CHECK_EQ(s.Counts, (INT64)0);
+}
+
+KBLAY_TEST(ModShareLetsARemapKeyboardSeeShiftHeldElsewhere)
+{
+    // ' gives 2 unshifted and Shift+6 shifted; the shifted cell keeps the
+    // Shift held on the other keyboard rather than lifting it around the key.
+    const auto rules = TestBlob()
+        .Rule(0x28, 0, 0x03, 0, KBLAY_MODGROUP_SHIFT, 0)
+        .Rule(0x28, 0, 0x07, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, KBLAY_MODGROUP_SHIFT)
+        .Bytes();
+    KBLAY_MOD_SHARE share{ 0 };
+    TestEngine base;
+    TestEngine remap;
+    base.Role = KBLAY_ROLE_BASE;
+    CHECK(remap.Load(rules));
+    KbdLayEngineSetModShare(base.Engine.get(), &share);
+    KbdLayEngineSetModShare(remap.Engine.get(), &share);
+
+    base.Feed(KeyDown(KBLAY_MAKE_LSHIFT));
+    CHECK(SameKeys(remap.Feed(KeyDown(0x28)), { KeyDown(0x07) }));
+    base.Feed(KeyUp(KBLAY_MAKE_LSHIFT));
+    CHECK(SameKeys(remap.Feed(KeyDown(0x28)), { KeyDown(0x03) }));
+
+    // Leaving the pool takes what the engine published with it.
+    base.Feed(KeyDown(KBLAY_MAKE_RSHIFT));
+    CHECK_EQ(KbdLayModShareRead(&share), KBLAY_MOD_RSHIFT);
+    KbdLayEngineSetModShare(base.Engine.get(), nullptr);
+    CHECK_EQ(share.Counts, (INT64)0);
+}
+
+KBLAY_TEST(ModSharePublishLosesNoUpdateUnderContention)
+{
+    // Publishers with nothing between their read-modify-writes, each moving
+    // its own contribution through every modifier and back to nothing.
+    KBLAY_MOD_SHARE share{ 0 };
+    std::vector<std::thread> publishers;
+    for (int k = 0; k < 4; ++k)
+    {
+        publishers.emplace_back([&share, k]
+        {
+            std::mt19937 rng(k + 100);
+            UINT8 held = 0;
+            for (int i = 0; i < 500000; ++i)
+            {
+                const UINT8 next = (UINT8)rng();
+                KbdLayModSharePublish(&share, held, next);
+                held = next;
+            }
+            KbdLayModSharePublish(&share, held, 0);
+        });
+    }
+    for (auto& t : publishers)
+        t.join();
+    CHECK_EQ(share.Counts, (INT64)0);
+}
+
+KBLAY_TEST(ModShareStressPublishersAgainstReaders)
+{
+    KBLAY_MOD_SHARE share{ 0 };
+
+    // One keyboard holds Left Ctrl throughout; nobody may ever miss it.
+    TestEngine pinned;
+    pinned.Role = KBLAY_ROLE_BASE;
+    KbdLayEngineSetModShare(pinned.Engine.get(), &share);
+    pinned.Feed(KeyDown(KBLAY_MAKE_CTRL));
+
+    std::atomic<bool> stop{ false };
+    std::atomic<uint64_t> reads{ 0 };
+    std::atomic<uint64_t> missing{ 0 };
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 2; ++i)
+    {
+        readers.emplace_back([&]
+        {
+            while (!stop)
+            {
+                if (!(KbdLayModShareRead(&share) & KBLAY_MOD_LCTRL))
+                    ++missing;
+                ++reads;
+            }
+        });
+    }
+
+    // Keyboards pressing and releasing every modifier, Left Ctrl included.
+    // Failures are counted here and checked once the threads are joined.
+    std::atomic<uint32_t> misreported{ 0 };
+    std::vector<std::thread> keyboards;
+    for (int k = 0; k < 4; ++k)
+    {
+        keyboards.emplace_back([&share, &misreported, k]
+        {
+            TestEngine t;
+            t.Role = KBLAY_ROLE_BASE;
+            KbdLayEngineSetModShare(t.Engine.get(), &share);
+            std::mt19937 rng(k + 1);
+            bool down[8] = {};
+            UINT8 held = 0;
+            for (int i = 0; i < 200000; ++i)
+            {
+                const int m = rng() % 8;
+                t.Feed(down[m] ? KeyUp(kMods[m].Make, kMods[m].Flags) : KeyDown(kMods[m].Make, kMods[m].Flags));
+                down[m] = !down[m];
+                held ^= kMods[m].Bit;
+                misreported += t.Engine->Published != held;
+            }
+            for (int m = 0; m < 8; ++m)
+                if (down[m])
+                    t.Feed(KeyUp(kMods[m].Make, kMods[m].Flags));
+            misreported += t.Engine->Published != 0;
+        });
+    }
+    for (auto& t : keyboards)
+        t.join();
+    stop = true;
+    for (auto& t : readers)
+        t.join();
+
+    CHECK(reads != 0);
+    CHECK_EQ(missing.load(), (uint64_t)0);
+    CHECK_EQ(misreported.load(), 0u);
+
+    // Every publisher took back exactly what it added.
+    CHECK_EQ(share.Counts, (INT64)KbdLayModShareSpread(KBLAY_MOD_LCTRL));
+    pinned.Feed(KeyUp(KBLAY_MAKE_CTRL));
+    CHECK_EQ(share.Counts, (INT64)0);
+}
@@ -0,0 +1,152 @@
+#include "../Shared/KbdLayPersist.h"
+#include "EngineHarness.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+#include <cstddef>
+
+// Persisted device records: what KbdLayPersistSeal writes reads back, and
+// a record that was truncated, corrupted or written with a bad hash is
+// refused before its blob reaches the rule table builder.
+
+namespace
+{
+    const UINT32 kMaxEntries = 8192;
+    const size_t kMaxBlobBytes = 1u << 17;
+
+    std::vector<uint8_t> Rules()
+    {
+        TestBlob b;
+        for (uint16_t k = 0x10; k <= 0x19; ++k)
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0);
+        return b.Bytes();
+    }
+
+    std::vector<uint8_t> Record(const std::vector<uint8_t>& blob, const GUID& id,
+        UINT32 role = KBLAY_ROLE_REMAP, UINT32 state = KBLAY_STATE_ACTIVE)
+    {
+        std::vector<uint8_t> r(KbdLayPersistSize(blob.size()));
+        if (!blob.empty())
+            std::memcpy(KbdLayPersistBlob(r.data()), blob.data(), blob.size());
+        KbdLayPersistSeal(r.data(), role, state, &id, blob.size());
+        return r;
+    }
+
+    bool Decodes(const std::vector<uint8_t>& r, KBLAY_PERSIST_VIEW* view = nullptr)
+    {
+        KBLAY_PERSIST_VIEW v;
+        const bool ok = KbdLayPersistDecode(r.data(), r.size(), kMaxEntries, kMaxBlobBytes, &v) != FALSE;
+        if (view) *view = v;
+        return ok;
+    }
+
+    KBLAY_PERSIST_HEADER* Header(std::vector<uint8_t>& r)
+    {
+        return reinterpret_cast<KBLAY_PERSIST_HEADER*>(r.data());
+    }
+}
+
+KBLAY_TEST(PersistRoundTripsRoleStateAndRules)
+{
+    const auto blob = Rules();
+    const GUID id = SequentialGuid(4);
+    const auto r = Record(blob, id, KBLAY_ROLE_BASE, KBLAY_STATE_BYPASS_SOFT);
+
+    KBLAY_PERSIST_VIEW v;
+    CHECK(Decodes(r, &v));
+    CHECK_EQ(v.Role, (UINT32)KBLAY_ROLE_BASE);
+    CHECK_EQ(v.State, (UINT32)KBLAY_STATE_BYPASS_SOFT);
+    CHECK(std::memcmp(&v.ContainerId, &id, sizeof(id)) == 0);
+    CHECK_EQ(v.BlobSize, blob.size());
+    CHECK(v.Blob == r.data() + sizeof(KBLAY_PERSIST_HEADER));
+    CHECK(std::memcmp(v.Blob, blob.data(), blob.size()) == 0);
+
+    // No rules: no blob and no hash.
+    const auto bare = Record({}, id);
+    CHECK(Decodes(bare, &v));
+    CHECK(v.Blob == nullptr);
+    CHECK_EQ(v.BlobSize, (size_t)0);
+}
+
+KBLAY_TEST(PersistRefusesACorruptHash)
+{
+    auto r = Record(Rules(), SequentialGuid(1));
+    for (uint32_t bit = 0; bit < 32; ++bit)
+    {
+        auto bad = r;
+        Header(bad)->BlobHash ^= 1u << bit;
+        CHECK(!Decodes(bad));
+    }
+
+    // A record without rules must not claim a hash either.
+    auto bare = Record({}, SequentialGuid(1));
+    Header(bare)->BlobHash = 1;
+    CHECK(!Decodes(bare));
+}
+
+KBLAY_TEST(PersistRefusesAnyFlippedBlobOrFramingBit)
+{
+    const auto r = Record(Rules(), SequentialGuid(2));
+    const size_t header = sizeof(KBLAY_PERSIST_HEADER);
+
+    // Every bit of the blob is covered by the hash.
+    for (size_t bit = header * 8; bit < r.size() * 8; ++bit)
+    {
+        auto bad = r;
+        bad[bit / 8] ^= (uint8_t)(1u << (bit % 8));
+        CHECK(!Decodes(bad));
+    }
+
+    // So are the fields that frame it.
+    const size_t framing[] = {
+        offsetof(KBLAY_PERSIST_HEADER, Magic),
+        offsetof(KBLAY_PERSIST_HEADER, Version),
+        offsetof(KBLAY_PERSIST_HEADER, BlobSize),
+        offsetof(KBLAY_PERSIST_HEADER, Reserved),
+    };
+    for (size_t field : framing)
+    {
+        for (size_t bit = 0; bit < 32; ++bit)
+        {
+            auto bad = r;
+            bad[field + bit / 8] ^= (uint8_t)(1u << (bit % 8));
+            CHECK(!Decodes(bad));
+        }
+    }
+
+    // Unknown roles and states.
+    auto role = r;
+    Header(role)->Role = 7;
+    CHECK(!Decodes(role));
+    auto state = r;
+    Header(state)->State = 9;
+    CHECK(!Decodes(state));
+}
+
+KBLAY_TEST(PersistRefusesTruncatedAndOversizedRecords)
+{
+    const auto r = Record(Rules(), SequentialGuid(3));
+    for (size_t n = 0; n < r.size(); ++n)
+    {
+        const std::vector<uint8_t> cut(r.begin(), r.begin() + n);
+        CHECK(!Decodes(cut));
+    }
+    auto longer = r;
+    longer.push_back(0);
+    CHECK(!Decodes(longer));
+    KBLAY_PERSIST_VIEW v;
+    CHECK(!KbdLayPersistDecode(nullptr, r.size(), kMaxEntries, kMaxBlobBytes, &v));
+
+    // Limits lowered since the record was written.
+    CHECK(!KbdLayPersistDecode(r.data(), r.size(), kMaxEntries, r.size() - sizeof(KBLAY_PERSIST_HEADER) - 1, &v));
+    CHECK(!KbdLayPersistDecode(r.data(), r.size(), 9, kMaxBlobBytes, &v));
+}
+
+KBLAY_TEST(PersistRunsTheBlobThroughTheValidator)
+{
+    // A correctly sealed record around a blob the engine would reject.
+    auto blob = Rules();
+    auto* h = reinterpret_cast<KBLAY_RULE_BLOB_HEADER*>(blob.data());
+    h->EntryCount += 1;
+    CHECK(!KbdLayEngineValidateRuleBlob(blob.data(), blob.size(), kMaxEntries, kMaxBlobBytes));
+    CHECK(!Decodes(Record(blob, SequentialGuid(5))));
+}
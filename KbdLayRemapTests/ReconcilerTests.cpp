@@ -0,0 +1,160 @@
+#include "FakeDriverControl.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+
+namespace
+{
+    struct Fixture
+    {
+        FakeDriverControl Driver;
+        Reconciler R{ Driver, 1000, 60000, [this] { return Driver.Now(); } };
+        std::shared_ptr<const std::vector<BYTE>> Blob = std::make_shared<const std::vector<BYTE>>(std::vector<BYTE>{ 1, 2, 3, 4 });
+
+        DesiredDeviceState Want(uint32_t n, UINT32 role, UINT32 state)
+        {
+            DesiredDeviceState d;
+            d.ContainerId = SequentialGuid(n);
+            d.Role = role;
+            d.State = state;
+            if (role == KBLAY_ROLE_REMAP)
+                d.Blob = Blob;
+            return d;
+        }
+
+        ReconcileStats Pass(const std::vector<DesiredDeviceState>& desired)
+        {
+            return R.Reconcile(desired, Driver.Now());
+        }
+    };
+}
+
+KBLAY_TEST(ReconcilerMeasuresFirstTryConvergence)
+{
+    for (bool async : { false, true })
+    {
+        Fixture f;
+        f.Driver.Async = async;
+        f.Driver.Plug(SequentialGuid(1));
+
+        // Query, blob, role, state: four operations at 5 ms each.
+        const auto st = f.Pass({ f.Want(1, KBLAY_ROLE_REMAP, KBLAY_STATE_ACTIVE) });
+        CHECK_EQ(st.Converged, (size_t)1);
+        CHECK_EQ(st.Operations, (size_t)3);
+        CHECK_EQ(st.LastConvergenceMs, (uint64_t)20);
+        CHECK_EQ(st.MaxConvergenceMs, (uint64_t)20);
+
+        const auto s = f.Driver.StateOf(SequentialGuid(1));
+        CHECK_EQ(s.Role, (UINT32)KBLAY_ROLE_REMAP);
+        CHECK_EQ(s.State, (UINT32)KBLAY_STATE_ACTIVE);
+        CHECK_EQ(s.RuleBlobHash, KbdLayRuleBlobHash(f.Blob->data(), f.Blob->size()));
+    }
+}
+
+KBLAY_TEST(ReconcilerOrdersStateAroundRoleChanges)
+{
+    Fixture f;
+    f.Driver.Plug(SequentialGuid(1));
+    f.Pass({ f.Want(1, KBLAY_ROLE_REMAP, KBLAY_STATE_ACTIVE) });
+    CHECK(f.Driver.Calls() == std::vector<std::string>({ "blob", "role", "state" }));
+
+    // Leaving ACTIVE: state goes first.
+    f.Driver.ClearCalls();
+    f.Pass({ f.Want(1, KBLAY_ROLE_BASE, KBLAY_STATE_BYPASS_SOFT) });
+    CHECK(f.Driver.Calls() == std::vector<std::string>({ "state", "role" }));
+}
+
+KBLAY_TEST(ReconcilerLeavesInSyncDevicesAlone)
+{
+    Fixture f;
+    f.Driver.Plug(SequentialGuid(1));
+    const auto want = f.Want(1, KBLAY_ROLE_BASE, KBLAY_STATE_ACTIVE);
+    f.Pass({ want });
+
+    f.Driver.ClearCalls();
+    const auto st = f.Pass({ want });
+    CHECK_EQ(st.InSync, (size_t)1);
+    CHECK_EQ(st.Converged, (size_t)0);
+    CHECK_EQ(st.Operations, (size_t)0);
+    CHECK(f.Driver.Calls().empty());
+}
+
+KBLAY_TEST(ReconcilerTimesMultiPassConvergenceFromTheChange)
+{
+    Fixture f;
+    f.Driver.Plug(SequentialGuid(1));
+    f.Driver.FailSetRole = true;
+    const auto want = f.Want(1, KBLAY_ROLE_BASE, KBLAY_STATE_ACTIVE);
+    const uint64_t changedAt = f.Driver.Now();
+
+    auto st = f.Pass({ want });
+    CHECK_EQ(st.Failed, (size_t)1);
+    // Fallback to bypass: state and role.
+    CHECK_EQ(f.Driver.StateOf(SequentialGuid(1)).State, (UINT32)KBLAY_STATE_BYPASS_HARD);
+
+    // Inside the backoff window nothing is tried.
+    f.Driver.NowMs += 500;
+    st = f.Pass({ want });
+    CHECK_EQ(st.Deferred, (size_t)1);
+
+    f.Driver.NowMs += 600;
+    f.Driver.FailSetRole = false;
+    st = f.Pass({ want });
+    CHECK_EQ(st.Converged, (size_t)1);
+    CHECK_EQ(st.LastConvergenceMs, f.Driver.Now() - changedAt);
+}
+
+KBLAY_TEST(ReconcilerBacksOffExponentially)
+{
+    Fixture f;
+    f.Driver.Plug(SequentialGuid(1));
+    f.Driver.FailQuery = true;
+    const auto want = f.Want(1, KBLAY_ROLE_BASE, KBLAY_STATE_ACTIVE);
+
+    // Retries at +1 s, +2 s, +4 s after each failure.
+    uint64_t expected = 1000;
+    for (int i = 0; i < 3; ++i)
+    {
+        const uint64_t failedAt = f.Driver.Now();
+        CHECK_EQ(f.Pass({ want }).Failed, (size_t)1);
+
+        f.Driver.NowMs = failedAt + expected - 1;
+        CHECK_EQ(f.Pass({ want }).Deferred, (size_t)1);
+        f.Driver.NowMs = failedAt + expected;
+        expected *= 2;
+    }
+}
+
+KBLAY_TEST(ReconcilerReappliesAfterDriverDrift)
+{
+    Fixture f;
+    f.Driver.Plug(SequentialGuid(1));
+    const auto want = f.Want(1, KBLAY_ROLE_REMAP, KBLAY_STATE_ACTIVE);
+    f.Pass({ want });
+
+    // Device re-added: the driver forgot everything.
+    f.Driver.Plug(SequentialGuid(1));
+    f.Driver.NowMs += 10000;
+    const auto st = f.Pass({ want });
+    CHECK_EQ(st.Converged, (size_t)1);
+    CHECK_EQ(st.LastConvergenceMs, (uint64_t)20);
+    CHECK_EQ(f.Driver.StateOf(SequentialGuid(1)).State, (UINT32)KBLAY_STATE_ACTIVE);
+}
+
+KBLAY_TEST(ReconcilerDrivesDevicesIndependently)
+{
+    Fixture f;
+    f.Driver.Async = true;
+    std::vector<DesiredDeviceState> want;
+    for (uint32_t n = 0; n < 16; ++n)
+    {
+        f.Driver.Plug(SequentialGuid(n));
+        want.push_back(f.Want(n, n % 2 ? KBLAY_ROLE_BASE : KBLAY_ROLE_REMAP, KBLAY_STATE_ACTIVE));
+    }
+    // One missing device fails alone.
+    want.push_back(f.Want(99, KBLAY_ROLE_BASE, KBLAY_STATE_ACTIVE));
+
+    const auto st = f.Pass(want);
+    CHECK_EQ(st.Devices, (size_t)17);
+    CHECK_EQ(st.Converged, (size_t)16);
+    CHECK_EQ(st.Failed, (size_t)1);
+}
@@ -0,0 +1,39 @@
+#include "TraceFile.hpp"
+#include "Utf16.hpp"
+#include <cstdio>
+
+// kblay_replay FILE...
+// Host counterpart of `kblayctl trace replay`: exits 1 if any file cannot
+// be read, has no valid rules, or replays with a mismatch.
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        std::fprintf(stderr, "usage: kblay_replay FILE...\n");
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        TraceCapture capture;
+        if (!ReadTraceFile(Utf8ToWide(argv[i]), capture))
+        {
+            std::printf("%s: cannot read trace file\n", argv[i]);
+            ++failed;
+            continue;
+        }
+
+        TraceReplayReport report;
+        ReplayTrace(capture, report);
+        std::printf("%s: %zu events, %zu mismatches, %zu resyncs, %zu dropped, rules %s, %.1f ns/event recorded, %.1f ns/event here\n",
+            argv[i], report.Events, report.Mismatches, report.Resyncs, report.DroppedRecords,
+            report.RulesValid ? "valid" : "INVALID", report.RecordedNsPerEvent, report.HostNsPerEvent);
+        for (size_t idx : report.MismatchIndices)
+            std::printf("  mismatch at record %zu\n", idx);
+
+        if (!report.RulesValid || report.Mismatches)
+            ++failed;
+    }
+    return failed ? 1 : 0;
+}
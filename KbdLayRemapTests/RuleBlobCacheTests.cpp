@@ -0,0 +1,189 @@
+#include "KbdLayTest.hpp"
+#include "LayoutTables.hpp"
+#include "RuleBlob.hpp"
+#include "TestFiles.hpp"
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+// The compile-all blob cache: what WriteRuleBlobCache stores reads back
+// through ReadRuleBlobCache as the service loads it, and a cache that is
+// missing, from another compiler version or out of step with its manifest
+// reads back empty so the service compiles the pair itself.
+
+namespace
+{
+    const wchar_t* const kUs = L"00000409";
+    const wchar_t* const kJis = L"00000411";
+
+    std::string ReadAll(const std::filesystem::path& p)
+    {
+        std::ifstream f(p, std::ios::binary);
+        std::ostringstream s;
+        s << f.rdbuf();
+        return s.str();
+    }
+
+    void Replace(std::string& text, const std::string& from, const std::string& to)
+    {
+        const size_t at = text.find(from);
+        CHECK(at != std::string::npos);
+        if (at != std::string::npos)
+            text.replace(at, from.size(), to);
+    }
+
+    // A cache of both US/JIS pairs in `dir`.
+    void WriteUsJisCache(const TestDir& dir)
+    {
+        BuiltInLayoutSource builtIn;
+        const auto report = CompileAllLayoutPairs(builtIn, { kUs, kJis }, 2);
+        std::wstring error;
+        CHECK(WriteRuleBlobCache(dir.Path("").wstring(), report, error));
+        CHECK(error.empty());
+    }
+
+    // A made-up layout of `keys` keys whose characters depend on `seed`.
+    std::string SyntheticLayout(unsigned seed, unsigned keys)
+    {
+        std::string text = "// synthetic\n";
+        char line[64];
+        for (unsigned k = 0; k < keys; ++k)
+        {
+            const unsigned plain = 0x21 + (k * 7 + seed * 13) % 94;
+            const unsigned shifted = 0x21 + (k * 11 + seed * 5 + 47) % 94;
+            std::snprintf(line, sizeof(line), "KBLAY_LAYOUT_KEY(0x%02X, %u, %u)\n", k + 1, plain, shifted);
+            text += line;
+        }
+        return text;
+    }
+}
+
+KBLAY_TEST(RuleCacheReadsBackWhatCompileAllWrote)
+{
+    TestDir dir;
+    WriteUsJisCache(dir);
+    const std::wstring path = dir.Path("").wstring();
+
+    CHECK(ReadRuleBlobCache(path, kUs, kJis) == BuiltInRuleBlob(kUs, kJis));
+    CHECK(ReadRuleBlobCache(path, kJis, kUs) == BuiltInRuleBlob(kJis, kUs));
+
+    // Pairs that were not compiled, and no cache at all.
+    CHECK(ReadRuleBlobCache(path, kUs, L"00000407").empty());
+    CHECK(ReadRuleBlobCache(path, kUs, kUs).empty());
+    CHECK(ReadRuleBlobCache(dir.Path("missing").wstring(), kUs, kJis).empty());
+}
+
+KBLAY_TEST(RuleCacheCoversEveryPairOfDataFileLayouts)
+{
+    // Twelve layouts from data files, compiled on four threads.
+    TestDir layouts;
+    std::vector<std::wstring> klids;
+    std::vector<LayoutKeys> parsed;
+    for (unsigned i = 0; i < 12; ++i)
+    {
+        char klid[16];
+        std::snprintf(klid, sizeof(klid), "0000%04X", 0x0400 + i);
+        layouts.Write(std::string(klid) + ".inl", SyntheticLayout(i, 60));
+        klids.push_back(std::wstring(klid, klid + 8));
+    }
+    LayoutFileSource files(layouts.Path("").wstring());
+    for (const auto& k : klids)
+    {
+        parsed.emplace_back();
+        CHECK(files.Load(k, parsed.back()));
+    }
+
+    const auto report = CompileAllLayoutPairs(files, klids, 4);
+    CHECK(report.MissingLayouts.empty());
+    CHECK_EQ(report.Pairs.size(), (size_t)(12 * 11));
+
+    TestDir cache;
+    std::wstring error;
+    CHECK(WriteRuleBlobCache(cache.Path("").wstring(), report, error));
+    for (size_t b = 0; b < klids.size(); ++b)
+    {
+        for (size_t t = 0; t < klids.size(); ++t)
+        {
+            if (b == t)
+                continue;
+            const auto blob = ReadRuleBlobCache(cache.Path("").wstring(), klids[b], klids[t]);
+            CHECK(!blob.empty());
+            CHECK(blob == CompileLayoutPair(parsed[b], parsed[t]));
+        }
+    }
+}
+
+KBLAY_TEST(RuleCacheRefusesStaleOrDamagedEntries)
+{
+    // Each case damages a fresh copy of the cache one way.
+    struct Case
+    {
+        const char* Name;
+        void (*Damage)(const TestDir& dir);
+    };
+    static const Case cases[] = {
+        { "blob byte flipped", [](const TestDir& dir) {
+            auto blob = ReadAll(dir.Path("00000409-00000411.kbl"));
+            blob[blob.size() - 1] ^= 0x01;
+            dir.Write("00000409-00000411.kbl", blob);
+        } },
+        { "blob truncated", [](const TestDir& dir) {
+            auto blob = ReadAll(dir.Path("00000409-00000411.kbl"));
+            blob.resize(blob.size() - 4);
+            dir.Write("00000409-00000411.kbl", blob);
+        } },
+        { "blob deleted", [](const TestDir& dir) {
+            std::filesystem::remove(dir.Path("00000409-00000411.kbl"));
+        } },
+        { "older compiler", [](const TestDir& dir) {
+            auto m = ReadAll(dir.Path("manifest.ini"));
+            Replace(m, "Version=1", "Version=0");
+            dir.Write("manifest.ini", m);
+        } },
+        { "hash edited", [](const TestDir& dir) {
+            auto m = ReadAll(dir.Path("manifest.ini"));
+            Replace(m, "Hash=", "Hash=1");
+            dir.Write("manifest.ini", m);
+        } },
+        { "file outside the cache", [](const TestDir& dir) {
+            auto m = ReadAll(dir.Path("manifest.ini"));
+            Replace(m, "File=00000409-00000411.kbl", "File=../00000409-00000411.kbl");
+            dir.Write("manifest.ini", m);
+        } },
+        { "entries edited", [](const TestDir& dir) {
+            auto m = ReadAll(dir.Path("manifest.ini"));
+            Replace(m, "Entries=", "Entries=9");
+            dir.Write("manifest.ini", m);
+        } },
+        { "manifest deleted", [](const TestDir& dir) {
+            std::filesystem::remove(dir.Path("manifest.ini"));
+        } },
+    };
+
+    for (const Case& c : cases)
+    {
+        TestDir dir;
+        WriteUsJisCache(dir);
+        c.Damage(dir);
+        const bool empty = ReadRuleBlobCache(dir.Path("").wstring(), kUs, kJis).empty();
+        if (!empty)
+            ReportCheckFailure(__FILE__, __LINE__, std::string("damaged cache was used: ") + c.Name);
+    }
+}
+
+KBLAY_TEST(RuleCacheRunsBlobsThroughTheValidator)
+{
+    // A blob the driver would refuse, with a manifest that matches it.
+    BuiltInLayoutSource builtIn;
+    auto report = CompileAllLayoutPairs(builtIn, { kUs, kJis }, 1);
+    for (auto& r : report.Pairs)
+    {
+        auto* e = reinterpret_cast<KBLAY_RULE_ENTRY_V2*>(r.Blob.data() + sizeof(KBLAY_RULE_BLOB_HEADER));
+        e->Reserved0 = 1;
+    }
+
+    TestDir dir;
+    std::wstring error;
+    CHECK(WriteRuleBlobCache(dir.Path("").wstring(), report, error));
+    CHECK(ReadRuleBlobCache(dir.Path("").wstring(), kUs, kJis).empty());
+}
@@ -0,0 +1,110 @@
+#include "EngineHarness.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+#include "../Shared/Public.h"
+#include <cstddef>
+
+// Rule blob upload framing from KbdLayIoctl.h: what clients encode for the
+// direct and buffered IOCTLs, what the driver accepts, and that the largest
+// blob the limits allow still validates.
+
+namespace
+{
+    std::vector<uint8_t> Blob(uint32_t entries)
+    {
+        TestBlob b;
+        for (uint32_t i = 0; i < entries; ++i)
+            b.Rule((uint16_t)(0x10 + i % 0x40), 0, (uint16_t)(0x10 + (i + 1) % 0x40), 0);
+        return b.Bytes();
+    }
+
+    // The buffered IOCTL_KBLAY_SET_RULE_BLOB_EX input, as the clients build it.
+    std::vector<uint8_t> ExFrame(const GUID& id, const std::vector<uint8_t>& blob)
+    {
+        const size_t header = offsetof(KBLAY_SET_RULE_BLOB_EX_INPUT, Blob);
+        std::vector<uint8_t> buf(header + blob.size());
+        auto* ex = reinterpret_cast<KBLAY_SET_RULE_BLOB_EX_INPUT*>(buf.data());
+        ex->ContainerId = id;
+        ex->BlobSize = (UINT32)blob.size();
+        std::memcpy(buf.data() + header, blob.data(), blob.size());
+        return buf;
+    }
+}
+
+KBLAY_TEST(DirectUploadEncodesWhatTheDriverAccepts)
+{
+    const GUID id = SequentialGuid(7);
+    const auto blob = Blob(16);
+
+    KBLAY_SET_RULE_BLOB_DIRECT_INPUT in;
+    std::memset(&in, 0xCC, sizeof(in));
+    KbdLayEncodeRuleBlobDirect(&in, &id, blob.size());
+    CHECK(std::memcmp(&in.ContainerId, &id, sizeof(id)) == 0);
+    CHECK_EQ(in.BlobSize, (UINT32)blob.size());
+    CHECK_EQ(in.Reserved, 0u);
+    CHECK(KbdLayCheckRuleBlobDirect(&in, sizeof(in), blob.size(), KBLAY_MAX_RULE_BLOB_BYTES));
+}
+
+KBLAY_TEST(DirectUploadRejectsMismatchedFraming)
+{
+    const GUID id = SequentialGuid(1);
+    KBLAY_SET_RULE_BLOB_DIRECT_INPUT in;
+    KbdLayEncodeRuleBlobDirect(&in, &id, 256);
+
+    // Input buffer cut short, or the locked buffer not the size announced.
+    CHECK(!KbdLayCheckRuleBlobDirect(&in, sizeof(in) - 1, 256, KBLAY_MAX_RULE_BLOB_BYTES));
+    CHECK(!KbdLayCheckRuleBlobDirect(&in, sizeof(in), 255, KBLAY_MAX_RULE_BLOB_BYTES));
+    CHECK(!KbdLayCheckRuleBlobDirect(&in, sizeof(in), 257, KBLAY_MAX_RULE_BLOB_BYTES));
+
+    // Reserved is for later; a sender that sets it is not one we know.
+    KBLAY_SET_RULE_BLOB_DIRECT_INPUT reserved = in;
+    reserved.Reserved = 1;
+    CHECK(!KbdLayCheckRuleBlobDirect(&reserved, sizeof(reserved), 256, KBLAY_MAX_RULE_BLOB_BYTES));
+
+    // Smaller than a blob header, or over the ceiling.
+    KbdLayEncodeRuleBlobDirect(&in, &id, sizeof(KBLAY_RULE_BLOB_HEADER) - 1);
+    CHECK(!KbdLayCheckRuleBlobDirect(&in, sizeof(in), sizeof(KBLAY_RULE_BLOB_HEADER) - 1, KBLAY_MAX_RULE_BLOB_BYTES));
+    KbdLayEncodeRuleBlobDirect(&in, &id, KBLAY_MAX_RULE_BLOB_BYTES + 1);
+    CHECK(!KbdLayCheckRuleBlobDirect(&in, sizeof(in), KBLAY_MAX_RULE_BLOB_BYTES + 1, KBLAY_MAX_RULE_BLOB_BYTES));
+    KbdLayEncodeRuleBlobDirect(&in, &id, KBLAY_MAX_RULE_BLOB_BYTES);
+    CHECK(KbdLayCheckRuleBlobDirect(&in, sizeof(in), KBLAY_MAX_RULE_BLOB_BYTES, KBLAY_MAX_RULE_BLOB_BYTES));
+}
+
+KBLAY_TEST(BufferedUploadChecksTheBlobFitsTheInput)
+{
+    const auto blob = Blob(4);
+    auto frame = ExFrame(SequentialGuid(2), blob);
+    auto* ex = reinterpret_cast<KBLAY_SET_RULE_BLOB_EX_INPUT*>(frame.data());
+    const size_t header = offsetof(KBLAY_SET_RULE_BLOB_EX_INPUT, Blob);
+
+    CHECK(KbdLayCheckRuleBlobEx(ex, frame.size(), KBLAY_MAX_RULE_BLOB_BYTES));
+    CHECK(!KbdLayCheckRuleBlobEx(ex, frame.size() - 1, KBLAY_MAX_RULE_BLOB_BYTES));
+    CHECK(!KbdLayCheckRuleBlobEx(ex, header - 1, KBLAY_MAX_RULE_BLOB_BYTES));
+
+    // A size that would wrap past the buffer.
+    ex->BlobSize = 0xFFFFFFF0u;
+    CHECK(!KbdLayCheckRuleBlobEx(ex, frame.size(), KBLAY_MAX_RULE_BLOB_BYTES));
+}
+
+KBLAY_TEST(UploadLimitsAdmitTheLargestValidBlob)
+{
+    // The entry count is the real cap: a full blob is well under the byte limit.
+    const auto full = Blob(KBLAY_MAX_RULE_ENTRIES);
+    CHECK(full.size() <= KBLAY_MAX_RULE_BLOB_BYTES);
+    CHECK(KbdLayRuleBlobSizeOk(full.size(), KBLAY_MAX_RULE_BLOB_BYTES));
+    CHECK(KbdLayEngineValidateRuleBlob(full.data(), full.size(), KBLAY_MAX_RULE_ENTRIES, KBLAY_MAX_RULE_BLOB_BYTES));
+
+    const auto over = Blob(KBLAY_MAX_RULE_ENTRIES + 1);
+    CHECK(KbdLayRuleBlobSizeOk(over.size(), KBLAY_MAX_RULE_BLOB_BYTES));
+    CHECK(!KbdLayEngineValidateRuleBlob(over.data(), over.size(), KBLAY_MAX_RULE_ENTRIES, KBLAY_MAX_RULE_BLOB_BYTES));
+
+    // The same bytes through either framing reach the driver unchanged.
+    KBLAY_SET_RULE_BLOB_DIRECT_INPUT in;
+    const GUID id = SequentialGuid(3);
+    KbdLayEncodeRuleBlobDirect(&in, &id, full.size());
+    CHECK(KbdLayCheckRuleBlobDirect(&in, sizeof(in), full.size(), KBLAY_MAX_RULE_BLOB_BYTES));
+    const auto frame = ExFrame(id, full);
+    const auto* ex = reinterpret_cast<const KBLAY_SET_RULE_BLOB_EX_INPUT*>(frame.data());
+    CHECK(KbdLayCheckRuleBlobEx(ex, frame.size(), KBLAY_MAX_RULE_BLOB_BYTES));
+    CHECK(std::memcmp(ex->Blob, full.data(), full.size()) == 0);
+}
@@ -0,0 +1,142 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <cstdio>
+
+// Lookup cost by make-code range: low codes should cost the same whether or
+// not the table has high pages, and high codes one extra load on top.
+
+namespace
+{
+    std::vector<uint8_t> Rules(bool highPages)
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_3);
+        for (uint16_t k = 0x10; k <= 0x32; ++k)
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0);
+        if (highPages)
+        {
+            for (uint16_t page = 1; page <= KBLAY_RULE_HIGH_PAGES; ++page)
+            {
+                for (uint16_t lo = 0x10; lo <= 0x32; ++lo)
+                    b.Rule((uint16_t)((page << 8) | lo), 0, lo, 0);
+            }
+        }
+        return b.Bytes();
+    }
+
+    // Down/up over every mapped code, `page` selecting 0x00-0xFF or a high page.
+    std::vector<KBLAY_KEY_EVENT> Stream(uint16_t page, uint16_t prefix)
+    {
+        std::vector<KBLAY_KEY_EVENT> s;
+        for (uint16_t lo = 0x10; lo <= 0x32; ++lo)
+        {
+            const uint16_t code = (uint16_t)((page << 8) | lo);
+            s.push_back(KeyDown(code, prefix));
+            s.push_back(KeyUp(code, prefix));
+        }
+        return s;
+    }
+}
+
+KBLAY_BENCH(RuleTableLookup)
+{
+    struct Case
+    {
+        const char* Name;
+        std::vector<KBLAY_KEY_EVENT> Events;
+    };
+    const Case cases[] = {
+        { "low", Stream(0, 0) },
+        { "low-e1", Stream(0, KBLAY_KEY_E1) },
+        { "high", Stream(3, 0) },
+        { "high-no-page", Stream(0x7F, 0) },
+    };
+
+    for (bool highPages : { false, true })
+    {
+        TestEngine t;
+        if (!t.Load(Rules(highPages)))
+        {
+            std::printf("rule-table: bench rules do not validate\n");
+            return;
+        }
+
+        for (const auto& c : cases)
+        {
+            const uint64_t target = ctx.Iterations(8000000);
+            KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+            KBLAY_ENGINE_RESULT result;
+            uint64_t events = 0;
+            uint64_t remapped = 0;
+
+            BenchTimer timer;
+            while (events < target)
+            {
+                for (const auto& e : c.Events)
+                {
+                    KbdLayEngineProcess(t.Engine.get(), t.State, t.Role, t.NowMs, &e, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+                    remapped += result == KBLAY_ENGINE_REMAP;
+                }
+                events += c.Events.size();
+            }
+            const double seconds = timer.Seconds();
+            KeepValue(remapped);
+
+            char detail[64];
+            std::snprintf(detail, sizeof(detail), "remapped %.2f", (double)remapped / (double)events);
+            ctx.Report(std::string("rule-table/") + (highPages ? "with-high-pages/" : "low-only/") + c.Name, events, seconds, detail);
+        }
+    }
+}
+
+// Lookup cost as rule conditions split the modifier states into more
+// classes: one class index, one load, whatever the count.
+KBLAY_BENCH(RuleTableModClasses)
+{
+    static const uint8_t conditions[][2] = {
+        { KBLAY_MODGROUP_CTRL, 0 },
+        { KBLAY_MODGROUP_ALT, KBLAY_MODGROUP_ALT },
+    };
+    static const uint8_t heldBits[] = { 0, KBLAY_MOD_LCTRL, KBLAY_MOD_LALT, KBLAY_MOD_LCTRL | KBLAY_MOD_LALT };
+
+    for (size_t used = 0; used <= 2; ++used)
+    {
+        TestBlob b;
+        for (uint16_t k = 0x10; k <= 0x32; ++k)
+        {
+            for (size_t c = 0; c < used; ++c)
+                b.Rule(k, 0, (uint16_t)(k + 1 + c), 0, conditions[c][0], conditions[c][1]);
+            b.Rule(k, 0, (uint16_t)(k ^ 1), 0);
+        }
+
+        TestEngine t;
+        if (!t.Load(b.Bytes()))
+        {
+            std::printf("rule-table: mod-class rules do not validate\n");
+            return;
+        }
+
+        const std::vector<KBLAY_KEY_EVENT> events = Stream(0, 0);
+        const uint64_t target = ctx.Iterations(8000000);
+        KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+        KBLAY_ENGINE_RESULT result;
+        uint64_t count = 0;
+        uint64_t produced = 0;
+        size_t held = 0;
+
+        BenchTimer timer;
+        while (count < target)
+        {
+            // Change the held modifiers between passes, not per event.
+            KbdLayEngineModsFromBits(heldBits[held++ % 4], &t.Engine->Mods);
+            for (const auto& e : events)
+                produced += KbdLayEngineProcess(t.Engine.get(), t.State, t.Role, t.NowMs, &e, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+            count += events.size();
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(produced);
+
+        char detail[64];
+        std::snprintf(detail, sizeof(detail), "classes %u", t.Engine->Table->ClassCount);
+        ctx.Report("rule-table/mod-classes/" + std::to_string(used) + "-conditions", count, seconds, detail);
+    }
+}
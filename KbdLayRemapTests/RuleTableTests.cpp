@@ -0,0 +1,166 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <cstring>
+
+// The two-level rule table: 0x00-0xFF direct, higher codes through a page
+// directory, and the none/E0/E1 prefixes kept apart.
+
+static const uint16_t kA = 0x1E;
+static const uint16_t kB = 0x30;
+static const uint16_t kCtrl = KBLAY_MAKE_CTRL;
+static const uint16_t kNumLock = 0x45;
+static const uint16_t kScrollLock = 0x46;
+
+KBLAY_TEST(RuleTableRemapsCodesAboveTheLowRange)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob(KBLAY_RULE_BLOB_VERSION_2)
+        .Rule(0x0123, 0, kA, 0)
+        .Rule(0x01F0, 0, 0x0234, 0)
+        .Rule(kB, 0, 0x7E21, KBLAY_FLAG_E0)
+        .Bytes()));
+
+    // Both rules share page 0x01.
+    CHECK_EQ(t.Engine->Table->HighPageCount, 1u);
+
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(0x0123), &r), { KeyDown(kA) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP);
+    CHECK(SameKeys(t.Feed(KeyUp(0x01F0), &r), { KeyUp(0x0234) }));
+    CHECK(SameKeys(t.Feed(KeyDown(kB), &r), { KeyDown(0x7E21, KBLAY_KEY_E0) }));
+
+    // Same page, no rule; a page with no rules; the same low byte one page up.
+    CHECK(SameKeys(t.Feed(KeyDown(0x0124), &r), { KeyDown(0x0124) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    CHECK(SameKeys(t.Feed(KeyDown(0x0323), &r), { KeyDown(0x0323) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    CHECK(SameKeys(t.Feed(KeyDown(0x0023), &r), { KeyDown(0x0023) }));
+    CHECK(SameKeys(t.Feed(KeyDown(0xFF23), &r), { KeyDown(0xFF23) }));
+}
+
+KBLAY_TEST(RuleTableKeepsPrefixesApart)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob(KBLAY_RULE_BLOB_VERSION_2)
+        .Rule(kCtrl, KBLAY_FLAG_E1, kScrollLock, 0)
+        .Rule(0x0150, KBLAY_FLAG_E0, kA, 0)
+        .Rule(0x0150, KBLAY_FLAG_E1, kB, KBLAY_FLAG_E1)
+        .Bytes()));
+
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(kCtrl, KBLAY_KEY_E1), &r), { KeyDown(kScrollLock) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP);
+    CHECK(SameKeys(t.Feed(KeyDown(kCtrl), &r), { KeyDown(kCtrl) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    CHECK(SameKeys(t.Feed(KeyUp(kCtrl), &r), { KeyUp(kCtrl) }));
+    CHECK(SameKeys(t.Feed(KeyDown(kCtrl, KBLAY_KEY_E0), &r), { KeyDown(kCtrl, KBLAY_KEY_E0) }));
+    CHECK(SameKeys(t.Feed(KeyUp(kCtrl, KBLAY_KEY_E0), &r), { KeyUp(kCtrl, KBLAY_KEY_E0) }));
+
+    CHECK(SameKeys(t.Feed(KeyDown(0x0150), &r), { KeyDown(0x0150) }));
+    CHECK(SameKeys(t.Feed(KeyDown(0x0150, KBLAY_KEY_E0), &r), { KeyDown(kA) }));
+    CHECK(SameKeys(t.Feed(KeyUp(0x0150, KBLAY_KEY_E1), &r), { KeyUp(kB, KBLAY_KEY_E1) }));
+
+    // Each prefix has its own directory entry for page 0x01.
+    CHECK_EQ(t.Engine->Table->HighPageCount, 2u);
+}
+
+KBLAY_TEST(RuleTableE1SequenceLeavesModifiersAlone)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob(KBLAY_RULE_BLOB_VERSION_2).Rule(kA, 0, kB, 0).Bytes()));
+
+    // Pause: E1 1D 45, then the breaks. The E1 Ctrl is not a Ctrl press.
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed({ KeyDown(kCtrl, KBLAY_KEY_E1), KeyDown(kNumLock), KeyUp(kCtrl, KBLAY_KEY_E1), KeyUp(kNumLock) }),
+        { KeyDown(kCtrl, KBLAY_KEY_E1), KeyDown(kNumLock), KeyUp(kCtrl, KBLAY_KEY_E1), KeyUp(kNumLock) }));
+    CHECK(!t.Engine->Mods.PhysLCtrl);
+    CHECK(!t.Engine->Mods.PhysRCtrl);
+
+    t.Feed(KeyDown(kCtrl, KBLAY_KEY_E1));
+    CHECK_EQ(KbdLayEngineModsToBits(&t.Engine->Mods), (uint8_t)0);
+    CHECK(SameKeys(t.Feed(KeyDown(kA), &r), { KeyDown(kB) }));
+}
+
+KBLAY_TEST(RuleTableHighCodesHonourModifierConditions)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob()
+        .Rule(0x0201, 0, kA, 0, KBLAY_MODGROUP_CTRL, KBLAY_MODGROUP_CTRL)
+        .Rule(0x0201, 0, kB, KBLAY_FLAG_SHIFT)
+        .Bytes()));
+
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(t.Feed(KeyDown(0x0201), &r),
+        { KeyDown(KBLAY_MAKE_LSHIFT), KeyDown(kB), KeyUp(KBLAY_MAKE_LSHIFT) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP_TOGGLE);
+
+    t.Feed(KeyDown(kCtrl));
+    CHECK(SameKeys(t.Feed(KeyDown(0x0201), &r), { KeyDown(kA) }));
+    CHECK_EQ(r, KBLAY_ENGINE_REMAP);
+
+    // LookupCell (the trace path) sees the same cell through the page.
+    const KBLAY_KEY_EVENT high = KeyDown(0x0201);
+    KBLAY_RULE_CELL cell;
+    CHECK(KbdLayEngineLookupCell(t.Engine.get(), &high, &cell));
+    CHECK_EQ(cell.OutMakeCode, kA);
+    t.Feed(KeyUp(kCtrl));
+    CHECK(KbdLayEngineLookupCell(t.Engine.get(), &high, &cell));
+    CHECK_EQ(cell.OutMakeCode, kB);
+    CHECK_EQ(cell.OutFlags, (uint8_t)KBLAY_FLAG_SHIFT);
+}
+
+KBLAY_TEST(RuleTableCapsHighPages)
+{
+    // Pages are counted per (modifier class, prefix, code >> 8).
+    TestBlob fits(KBLAY_RULE_BLOB_VERSION_2);
+    for (uint16_t page = 1; page <= KBLAY_RULE_HIGH_PAGES; ++page)
+        fits.Rule((uint16_t)(page << 8), 0, kA, 0);
+    TestEngine t;
+    CHECK(t.Load(fits.Bytes()));
+    CHECK_EQ(t.Engine->Table->HighPageCount, (uint32_t)KBLAY_RULE_HIGH_PAGES);
+
+    // Many codes in one page are still one page.
+    TestBlob dense(KBLAY_RULE_BLOB_VERSION_2);
+    for (uint16_t code = 0x0100; code <= 0x01FF; ++code)
+        dense.Rule(code, 0, kA, 0);
+    CHECK(TestEngine().Load(dense.Bytes()));
+
+    TestBlob over(KBLAY_RULE_BLOB_VERSION_2);
+    for (uint16_t page = 1; page <= KBLAY_RULE_HIGH_PAGES + 1; ++page)
+        over.Rule((uint16_t)(page << 8), 0, kA, 0);
+    CHECK(!TestEngine().Load(over.Bytes()));
+
+    // A Ctrl condition splits the states into two classes; an unconditioned
+    // high rule then needs a page in each.
+    TestBlob split;
+    split.Rule(kA, 0, kB, 0, KBLAY_MODGROUP_CTRL, KBLAY_MODGROUP_CTRL);
+    for (uint16_t page = 1; page <= KBLAY_RULE_HIGH_PAGES / 2; ++page)
+        split.Rule((uint16_t)(page << 8), 0, kA, 0);
+    CHECK(TestEngine().Load(split.Bytes()));
+    split.Rule((uint16_t)((KBLAY_RULE_HIGH_PAGES / 2 + 1) << 8), 0, kA, 0);
+    CHECK(!TestEngine().Load(split.Bytes()));
+}
+
+KBLAY_TEST(RuleTableRejectsMalformedWideEntries)
+{
+    CHECK(!TestEngine().Load(TestBlob(KBLAY_RULE_BLOB_VERSION_2).Rule(0x0150, KBLAY_FLAG_E0 | KBLAY_FLAG_E1, kA, 0).Bytes()));
+    CHECK(!TestEngine().Load(TestBlob(KBLAY_RULE_BLOB_VERSION_2).Rule(0x0150, 0, kA, KBLAY_FLAG_E0 | KBLAY_FLAG_E1).Bytes()));
+
+    std::vector<uint8_t> blob = TestBlob(KBLAY_RULE_BLOB_VERSION_2).Rule(0x0150, 0, kA, 0).Bytes();
+    CHECK(TestEngine().Load(blob));
+    blob[sizeof(KBLAY_RULE_BLOB_HEADER) + offsetof(KBLAY_RULE_ENTRY_V2, Reserved0)] = 1;
+    CHECK(!TestEngine().Load(blob));
+    blob[sizeof(KBLAY_RULE_BLOB_HEADER) + offsetof(KBLAY_RULE_ENTRY_V2, Reserved0)] = 0;
+    blob[sizeof(KBLAY_RULE_BLOB_HEADER) + offsetof(KBLAY_RULE_ENTRY_V2, Reserved1)] = 1;
+    CHECK(!TestEngine().Load(blob));
+}
+
+KBLAY_TEST(RuleTableReadsVersion1BlobsIntoTheLowRange)
+{
+    TestEngine t;
+    CHECK(t.Load(TestBlob(KBLAY_RULE_BLOB_VERSION).Rule(kA, KBLAY_FLAG_E0, 0xF0, 0).Bytes()));
+    CHECK_EQ(t.Engine->Table->HighPageCount, 0u);
+
+    CHECK(SameKeys(t.Feed(KeyDown(kA, KBLAY_KEY_E0)), { KeyDown(0xF0) }));
+    CHECK(SameKeys(t.Feed(KeyDown(kA)), { KeyDown(kA) }));
+}
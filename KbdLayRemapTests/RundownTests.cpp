@@ -0,0 +1,133 @@
+#include "../Shared/KbdLayRundown.h"
+#include "KbdLayTest.hpp"
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// The upper-connection rundown: callbacks on several threads against a
+// disconnect that closes it, swaps the connection and reopens it.
+
+KBLAY_TEST(RundownRefusesHoldersWhileClosed)
+{
+    KBLAY_RUNDOWN r;
+    KbdLayRundownInit(&r);
+    CHECK(KbdLayRundownAcquire(&r));
+    CHECK(KbdLayRundownAcquire(&r));
+    KbdLayRundownRelease(&r);
+    KbdLayRundownRelease(&r);
+
+    KbdLayRundownClose(&r);
+    CHECK(!KbdLayRundownAcquire(&r));
+    KbdLayRundownReopen(&r);
+    CHECK(KbdLayRundownAcquire(&r));
+    KbdLayRundownRelease(&r);
+}
+
+KBLAY_TEST(RundownCloseWaitsForHolders)
+{
+    KBLAY_RUNDOWN r;
+    KbdLayRundownInit(&r);
+    CHECK(KbdLayRundownAcquire(&r));
+
+    std::atomic<bool> closed{ false };
+    std::thread closer([&] { KbdLayRundownClose(&r); closed = true; });
+
+    // Closing has begun: no new holders, and the old one still holds.
+    while (KbdLayRundownAcquire(&r))
+    {
+        KbdLayRundownRelease(&r);
+        std::this_thread::yield();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(!closed);
+
+    KbdLayRundownRelease(&r);
+    closer.join();
+    CHECK(closed);
+}
+
+KBLAY_TEST(RundownStressCallbacksAgainstDisconnect)
+{
+    struct Connection
+    {
+        std::atomic<bool> Alive{ true };
+        std::atomic<uint64_t> Calls{ 0 };
+    };
+
+    KBLAY_RUNDOWN r;
+    KbdLayRundownInit(&r);
+
+    // Connections are retired, not freed, so a late reader finds Alive false
+    // instead of freed memory.
+    std::vector<std::unique_ptr<Connection>> retired;
+    retired.emplace_back(new Connection);
+    std::atomic<Connection*> current{ retired.back().get() };
+
+    std::atomic<bool> stop{ false };
+    std::atomic<int> inside{ 0 };
+    std::atomic<uint64_t> stale{ 0 };
+    std::atomic<uint64_t> delivered{ 0 };
+    std::atomic<uint64_t> refused{ 0 };
+
+    std::vector<std::thread> callbacks;
+    for (int i = 0; i < 4; ++i)
+    {
+        callbacks.emplace_back([&]
+        {
+            while (!stop)
+            {
+                if (!KbdLayRundownAcquire(&r))
+                {
+                    ++refused;
+                    continue;
+                }
+                ++inside;
+                Connection* c = current.load();
+                for (int n = 0; n < 8; ++n)
+                {
+                    if (!c->Alive)
+                        ++stale;
+                    ++c->Calls;
+                }
+                --inside;
+                KbdLayRundownRelease(&r);
+                ++delivered;
+            }
+        });
+    }
+
+    // Disconnect: once Close returns nobody is inside, so the connection can
+    // be torn down and replaced before reopening.
+    uint64_t leftInside = 0;
+    for (int i = 0; i < 2000; ++i)
+    {
+        KbdLayRundownClose(&r);
+        if (inside != 0)
+            ++leftInside;
+        current.load()->Alive = false;
+        retired.emplace_back(new Connection);
+        current = retired.back().get();
+        KbdLayRundownReopen(&r);
+        if (i % 64 == 0)
+            std::this_thread::yield();
+    }
+
+    stop = true;
+    for (auto& t : callbacks)
+        t.join();
+
+    CHECK_EQ(leftInside, (uint64_t)0);
+    CHECK_EQ(stale.load(), (uint64_t)0);
+    CHECK(delivered != 0);
+
+    uint64_t calls = 0;
+    for (const auto& c : retired)
+        calls += c->Calls;
+    CHECK_EQ(calls, delivered * 8);
+
+    // Every holder has released.
+    KbdLayRundownClose(&r);
+    CHECK_EQ(r.Value, (INT64)KBLAY_RUNDOWN_CLOSED);
+}
@@ -0,0 +1,130 @@
+#pragma once
+#include "DeviceInventory.hpp"
+#include "Utf16.hpp"
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+// Stand-in for the PnP notification backend. The test owns the device list
+// and decides when notifications go out: synchronously, from another
+// thread, or not at all (a lost notification only a rescan repairs).
+class ScriptedPnpBackend final : public DeviceNotificationBackend
+{
+public:
+    struct Script
+    {
+        std::mutex Lock;
+        std::vector<FilterDeviceInfo> Present;
+        Sink Subscriber;
+        bool FailSubscribe = false;
+        size_t Enumerations = 0;
+        std::function<void()> DuringEnumerate;  // runs once, mid-enumeration
+    };
+
+    explicit ScriptedPnpBackend(std::shared_ptr<Script> script) : script_(std::move(script)) {}
+
+    std::vector<FilterDeviceInfo> Enumerate() override
+    {
+        std::vector<FilterDeviceInfo> list;
+        std::function<void()> hook;
+        {
+            std::lock_guard<std::mutex> g(script_->Lock);
+            ++script_->Enumerations;
+            list = script_->Present;
+            hook.swap(script_->DuringEnumerate);
+        }
+        if (hook)
+            hook();
+        return list;
+    }
+
+    bool Subscribe(Sink sink) override
+    {
+        std::lock_guard<std::mutex> g(script_->Lock);
+        if (script_->FailSubscribe)
+            return false;
+        script_->Subscriber = std::move(sink);
+        return true;
+    }
+
+    void Unsubscribe() override
+    {
+        std::lock_guard<std::mutex> g(script_->Lock);
+        script_->Subscriber = nullptr;
+    }
+
+private:
+    std::shared_ptr<Script> script_;
+};
+
+// Test-side controls for a ScriptedPnpBackend's script.
+class PnpScript
+{
+public:
+    PnpScript() : script_(std::make_shared<ScriptedPnpBackend::Script>()) {}
+
+    std::unique_ptr<DeviceNotificationBackend> Backend() const { return std::make_unique<ScriptedPnpBackend>(script_); }
+    ScriptedPnpBackend::Script& State() { return *script_; }
+
+    // Adds or refreshes the device; notifies unless `notify` is false.
+    void Arrive(const FilterDeviceInfo& d, bool notify = true)
+    {
+        {
+            std::lock_guard<std::mutex> g(script_->Lock);
+            auto it = Find(d.DevicePath);
+            if (it == script_->Present.end())
+                script_->Present.push_back(d);
+            else
+                *it = d;
+        }
+        if (notify)
+            Notify({ DeviceChange::Kind::Arrival, d });
+    }
+
+    void Remove(const std::wstring& path, bool notify = true)
+    {
+        FilterDeviceInfo gone{};
+        gone.DevicePath = path;
+        {
+            std::lock_guard<std::mutex> g(script_->Lock);
+            auto it = Find(path);
+            if (it != script_->Present.end())
+                script_->Present.erase(it);
+        }
+        if (notify)
+            Notify({ DeviceChange::Kind::Removal, gone });
+    }
+
+    void Notify(const DeviceChange& c)
+    {
+        DeviceNotificationBackend::Sink sink;
+        {
+            std::lock_guard<std::mutex> g(script_->Lock);
+            sink = script_->Subscriber;
+        }
+        if (sink)
+            sink(c);
+    }
+
+    // As Notify, from another thread, and waits for it.
+    void NotifyFromThread(const DeviceChange& c)
+    {
+        std::thread t([this, c] { Notify(c); });
+        t.join();
+    }
+
+    bool Subscribed()
+    {
+        std::lock_guard<std::mutex> g(script_->Lock);
+        return script_->Subscriber != nullptr;
+    }
+
+private:
+    std::vector<FilterDeviceInfo>::iterator Find(const std::wstring& path)
+    {
+        return std::find_if(script_->Present.begin(), script_->Present.end(),
+            [&](const FilterDeviceInfo& d) { return ToLowerAscii(d.DevicePath) == ToLowerAscii(path); });
+    }
+
+    std::shared_ptr<ScriptedPnpBackend::Script> script_;
+};
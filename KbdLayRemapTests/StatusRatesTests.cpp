@@ -0,0 +1,196 @@
+#include "FakeStatusSource.hpp"
+#include "GuidHelpers.hpp"
+#include "KbdLayTest.hpp"
+#include <cmath>
+
+static bool Near(double a, double b)
+{
+    return std::fabs(a - b) < 1e-9 * (1 + std::fabs(b));
+}
+
+KBLAY_TEST(ComputeRatesPerSecondAndAmplification)
+{
+    KBLAY_STATUS_OUTPUT prev{};
+    prev.RemapHitCount = 100;
+    prev.PassThroughCount = 50;
+    prev.UnmappedCount = 10;
+    prev.ShiftToggleCount = 5;
+    prev.DebounceDropCount = 1;
+    prev.EventsOutCount = 900;
+
+    KBLAY_STATUS_OUTPUT cur = prev;
+    cur.RemapHitCount += 40;      // 20/s over 2 s
+    cur.PassThroughCount += 10;
+    cur.UnmappedCount += 6;
+    cur.ShiftToggleCount += 8;
+    cur.DebounceDropCount += 4;
+    cur.EventsOutCount += 150;    // a few macros among the remaps
+
+    const DeviceRates r = ComputeRates(prev, cur, 2000000);
+    CHECK(Near(r.RemapPerSec, 20));
+    CHECK(Near(r.PassPerSec, 5));
+    CHECK(Near(r.UnmappedPerSec, 3));
+    CHECK(Near(r.ShiftTogglePerSec, 4));
+    CHECK(Near(r.DebouncePerSec, 2));
+
+    // In: 40 + 10 + 6 + 4 = 60. Out: what the driver says it sent up.
+    CHECK(Near(r.EventsInPerSec, 30));
+    CHECK(Near(r.EventsOutPerSec, 75));
+    CHECK(Near(r.Amplification, 150.0 / 60.0));
+    CHECK(!r.CountersReset);
+
+    // Dual-role keys still pending send nothing up yet.
+    KBLAY_STATUS_OUTPUT pending = cur;
+    pending.RemapHitCount += 2;
+    CHECK(Near(ComputeRates(cur, pending, 1000000).Amplification, 0.0));
+}
+
+KBLAY_TEST(ComputeRatesEstimatesOutputFromAnOlderDriver)
+{
+    // A reply too short to carry EventsOutCount.
+    KBLAY_STATUS_OUTPUT prev{};
+    prev.RemapHitCount = 100;
+    prev.ShiftToggleCount = 5;
+    prev.DebounceDropCount = 1;
+    KbdLayMarkStatusUnreported(&prev, KBLAY_STATUS_OUTPUT_V1_SIZE);
+    CHECK_EQ(prev.EventsOutCount, (UINT64)KBLAY_STATUS_NOT_REPORTED);
+
+    KBLAY_STATUS_OUTPUT cur = prev;
+    cur.RemapHitCount += 40;
+    cur.PassThroughCount += 10;
+    cur.UnmappedCount += 6;
+    cur.ShiftToggleCount += 8;
+    cur.DebounceDropCount += 4;
+
+    // In: 60. Out: 60 - 4 + 2 * 8 = 72.
+    const DeviceRates r = ComputeRates(prev, cur, 2000000);
+    CHECK(Near(r.EventsOutPerSec, 36));
+    CHECK(Near(r.Amplification, 72.0 / 60.0));
+    CHECK(!r.CountersReset);
+
+    // A full reply leaves the count alone.
+    KBLAY_STATUS_OUTPUT full{};
+    full.EventsOutCount = 7;
+    KbdLayMarkStatusUnreported(&full, sizeof(full));
+    CHECK_EQ(full.EventsOutCount, (UINT64)7);
+}
+
+KBLAY_TEST(ComputeRatesIdleAndZeroInterval)
+{
+    KBLAY_STATUS_OUTPUT s{};
+    s.RemapHitCount = 7;
+    DeviceRates r = ComputeRates(s, s, 1000000);
+    CHECK(Near(r.Amplification, 1.0));
+    CHECK(Near(r.EventsInPerSec, 0));
+
+    KBLAY_STATUS_OUTPUT cur = s;
+    cur.RemapHitCount = 9;
+    cur.EventsOutCount = 2;
+    r = ComputeRates(s, cur, 0);
+    CHECK(Near(r.RemapPerSec, 0));
+    CHECK(Near(r.Amplification, 1.0));
+}
+
+KBLAY_TEST(ComputeRatesDetectsResetAndNtStatusChange)
+{
+    KBLAY_STATUS_OUTPUT prev{};
+    prev.RemapHitCount = 1000;
+    prev.LastErrorNtStatus = 0;
+
+    KBLAY_STATUS_OUTPUT cur{};
+    cur.RemapHitCount = 30;       // device re-created: counts from zero
+    cur.LastErrorNtStatus = 0xC0000001u;
+
+    const DeviceRates r = ComputeRates(prev, cur, 1000000);
+    CHECK(r.CountersReset);
+    CHECK(Near(r.RemapPerSec, 30));
+    CHECK(r.NtStatusChanged);
+    CHECK_EQ(r.PreviousNtStatus, (UINT32)0);
+    CHECK_EQ(r.LastErrorNtStatus, (UINT32)0xC0000001u);
+}
+
+KBLAY_TEST(SamplerPrimesThenReportsEachDevice)
+{
+    FakeStatusSource src;
+    const GUID a = SequentialGuid(1);
+    const GUID b = SequentialGuid(2);
+    src.Device(a).Role = KBLAY_ROLE_REMAP;
+    src.Device(b).Role = KBLAY_ROLE_BASE;
+
+    StatusSampler sampler(src);
+    std::vector<DeviceRates> out;
+    CHECK(sampler.Sample(1000000, out));
+    CHECK(out.empty());
+
+    src.Device(a).RemapHitCount = 50;
+    src.Device(b).PassThroughCount = 25;
+    CHECK(sampler.Sample(1500000, out));
+    CHECK_EQ(out.size(), (size_t)2);
+    for (const auto& r : out)
+    {
+        CHECK_EQ(r.IntervalUs, (uint64_t)500000);
+        if (IsEqualGUID(r.ContainerId, a))
+            CHECK(Near(r.RemapPerSec, 100));
+        else
+            CHECK(Near(r.PassPerSec, 50));
+    }
+}
+
+KBLAY_TEST(SamplerDropsVanishedAndSkipsFailingDevices)
+{
+    FakeStatusSource src;
+    const GUID a = SequentialGuid(1);
+    const GUID b = SequentialGuid(2);
+    src.Device(a);
+    src.Device(b);
+
+    StatusSampler sampler(src);
+    std::vector<DeviceRates> out;
+    sampler.Sample(0, out);
+
+    // b fails this round: skipped, and forgotten, so it primes again.
+    src.FailQuery(b, true);
+    CHECK(sampler.Sample(1000000, out));
+    CHECK_EQ(out.size(), (size_t)1);
+    src.FailQuery(b, false);
+    CHECK(sampler.Sample(2000000, out));
+    CHECK_EQ(out.size(), (size_t)1);
+    CHECK(sampler.Sample(3000000, out));
+    CHECK_EQ(out.size(), (size_t)2);
+
+    // a is removed, then comes back: primes again, no stale interval.
+    src.Remove(a);
+    CHECK(sampler.Sample(4000000, out));
+    CHECK_EQ(out.size(), (size_t)1);
+    src.Device(a);
+    CHECK(sampler.Sample(5000000, out));
+    CHECK_EQ(out.size(), (size_t)1);
+    CHECK(sampler.Sample(6000000, out));
+    CHECK_EQ(out.size(), (size_t)2);
+    for (const auto& r : out)
+        CHECK_EQ(r.IntervalUs, (uint64_t)1000000);
+
+    src.FailList = true;
+    CHECK(!sampler.Sample(7000000, out));
+    CHECK(out.empty());
+}
+
+KBLAY_TEST(FormatRatesJsonHasEveryField)
+{
+    KBLAY_STATUS_OUTPUT prev{};
+    KBLAY_STATUS_OUTPUT cur{};
+    cur.ContainerId = SequentialGuid(3);
+    cur.Role = KBLAY_ROLE_REMAP;
+    cur.State = KBLAY_STATE_ACTIVE;
+    cur.RemapHitCount = 10;
+    cur.ShiftToggleCount = 5;
+    cur.EventsOutCount = 20;
+
+    const std::wstring json = FormatRatesJson(ComputeRates(prev, cur, 1000000), 42);
+    CHECK(json.front() == L'{' && json.back() == L'}');
+    for (const wchar_t* field : { L"\"ts_us\":42,", L"\"container\":\"{8a1b2c03-1234-5678-0000-000000000000}\"",
+             L"\"role\":2,", L"\"state\":2,", L"\"remap_ps\":10.00,", L"\"shift_toggle_ps\":5.00,",
+             L"\"in_ps\":10.00,", L"\"out_ps\":20.00,", L"\"amplification\":2.0000,",
+             L"\"last_nt\":\"0x00000000\"", L"\"last_nt_changed\":false", L"\"reset\":false" })
+        CHECK(json.find(field) != std::wstring::npos);
+}
@@ -0,0 +1,163 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+
+// Dual-role keys on a virtual clock: a release inside HoldAfterMs taps, the
+// deadline itself holds wherever it falls against the wheel's blocks,
+// another key decides a pending key early, and keys past the four in
+// flight go through untouched.
+
+namespace
+{
+    const uint16_t kSpace = 0x39;
+    const uint16_t kA = 0x1E;
+    const uint16_t kB = 0x30;
+    const uint16_t kHoldAfterMs = 200;
+
+    // Space taps Space and holds Left Shift; A types B. F1..F5 are dual-role
+    // too, tapping themselves and holding Left Ctrl.
+    std::vector<uint8_t> Rules()
+    {
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_5);
+        b.Rule(kSpace, 0, b.TapHold(kSpace, KBLAY_MAKE_LSHIFT, kHoldAfterMs), KBLAY_FLAG_TAPHOLD);
+        b.Rule(kA, 0, kB, 0);
+        for (uint16_t f = 0x3B; f <= 0x3F; ++f)
+            b.Rule(f, 0, b.TapHold(f, KBLAY_MAKE_CTRL, kHoldAfterMs), KBLAY_FLAG_TAPHOLD);
+        return b.Bytes();
+    }
+
+    struct Clocked
+    {
+        TestEngine T;
+        explicit Clocked(uint64_t startMs = 1000)
+        {
+            T.NowMs = startMs;
+            KbdLayEngineResetState(T.Engine.get(), startMs);
+            CHECK(T.Load(Rules()));
+        }
+
+        std::vector<KBLAY_KEY_EVENT> At(uint64_t atMs, const KBLAY_KEY_EVENT& in, KBLAY_ENGINE_RESULT* result = nullptr)
+        {
+            T.NowMs = atMs;
+            return T.Feed(in, result);
+        }
+
+        const KBLAY_TAPHOLD_STATE& State() const { return T.Engine->TapHold; }
+    };
+}
+
+KBLAY_TEST(TapHoldReleaseBeforeTheDeadlineTaps)
+{
+    Clocked c;
+    KBLAY_ENGINE_RESULT r;
+    CHECK(c.At(1000, KeyDown(kSpace), &r).empty());
+    CHECK_EQ(r, KBLAY_ENGINE_TAPHOLD);
+
+    // Repeats while pending are swallowed; nothing comes due before 1200.
+    CHECK(c.At(1100, KeyDown(kSpace)).empty());
+    CHECK(c.T.Advance(1199).empty());
+    CHECK(SameKeys(c.At(1199, KeyUp(kSpace), &r), { KeyDown(kSpace), KeyUp(kSpace) }));
+    CHECK_EQ(r, KBLAY_ENGINE_TAPHOLD);
+    CHECK_EQ(c.State().Taps, (UINT64)1);
+    CHECK_EQ(c.State().Holds, (UINT64)0);
+    CHECK_EQ(c.State().Active, 0u);
+    CHECK(!KbdLayEngineTimersArmed(c.T.Engine.get()));
+
+    // The timer went with the tap: later time brings nothing.
+    CHECK(c.T.Advance(5000).empty());
+}
+
+KBLAY_TEST(TapHoldDeadlineHoldsOnItsTick)
+{
+    // Released exactly at HoldAfterMs is a hold, and a release 1 ms
+    // earlier a tap, for every press time across two 64 ms blocks.
+    for (uint64_t down = 1000; down < 1000 + 128; ++down)
+    {
+        Clocked early(down - 50);
+        early.At(down, KeyDown(kSpace));
+        CHECK(SameKeys(early.At(down + kHoldAfterMs - 1, KeyUp(kSpace)), { KeyDown(kSpace), KeyUp(kSpace) }));
+
+        Clocked onTime(down - 50);
+        onTime.At(down, KeyDown(kSpace));
+        const auto out = onTime.At(down + kHoldAfterMs, KeyUp(kSpace));
+        if (!SameKeys(out, { KeyDown(KBLAY_MAKE_LSHIFT), KeyUp(KBLAY_MAKE_LSHIFT) }))
+            ReportCheckFailure(__FILE__, __LINE__, "release at the deadline tapped, pressed at " + std::to_string(down));
+        CHECK_EQ(onTime.State().MaxLateMs, 0u);
+    }
+}
+
+KBLAY_TEST(TapHoldTimeoutHoldsUntilRelease)
+{
+    Clocked c;
+    c.At(1000, KeyDown(kSpace));
+
+    // The clock alone decides it; MaxLateMs is how far past the deadline
+    // the engine first heard of the time.
+    CHECK(SameKeys(c.T.Advance(1250), { KeyDown(KBLAY_MAKE_LSHIFT) }));
+    CHECK_EQ(c.State().MaxLateMs, 50u);
+    CHECK_EQ(c.State().Holds, (UINT64)1);
+    CHECK(!KbdLayEngineTimersArmed(c.T.Engine.get()));
+    CHECK(c.T.Advance(2000).empty());
+
+    // Repeats now repeat the hold key, and A comes out shifted.
+    CHECK(SameKeys(c.At(2000, KeyDown(kSpace)), { KeyDown(KBLAY_MAKE_LSHIFT) }));
+    CHECK(SameKeys(c.At(2010, KeyDown(kA)), { KeyDown(kB) }));
+    CHECK(SameKeys(c.At(2020, KeyUp(kA)), { KeyUp(kB) }));
+    CHECK(SameKeys(c.At(2030, KeyUp(kSpace)), { KeyUp(KBLAY_MAKE_LSHIFT) }));
+    CHECK_EQ(c.State().Active, 0u);
+    CHECK_EQ(c.State().Taps, (UINT64)0);
+}
+
+KBLAY_TEST(TapHoldAnotherKeyDecidesAHold)
+{
+    Clocked c;
+    c.At(1000, KeyDown(kSpace));
+
+    // A release of a key that was already down decides nothing.
+    CHECK(SameKeys(c.At(1010, KeyUp(kA)), { KeyUp(kB) }));
+    CHECK_EQ(c.State().Holds, (UINT64)0);
+
+    // A press does: the hold goes out ahead of the key, well before 1200.
+    CHECK(SameKeys(c.At(1050, KeyDown(kA)), { KeyDown(KBLAY_MAKE_LSHIFT), KeyDown(kB) }));
+    CHECK_EQ(c.State().Holds, (UINT64)1);
+    CHECK_EQ(c.State().MaxLateMs, 0u);
+    CHECK(!KbdLayEngineTimersArmed(c.T.Engine.get()));
+    CHECK(c.T.Advance(1300).empty());
+
+    CHECK(SameKeys(c.At(1300, KeyUp(kA)), { KeyUp(kB) }));
+    CHECK(SameKeys(c.At(1310, KeyUp(kSpace)), { KeyUp(KBLAY_MAKE_LSHIFT) }));
+
+    // A second dual-role key decides the first and is itself pending
+    // until the next press.
+    Clocked two;
+    two.At(1000, KeyDown(0x3C));
+    CHECK(SameKeys(two.At(1005, KeyDown(kSpace)), { KeyDown(KBLAY_MAKE_CTRL) }));
+    CHECK(SameKeys(two.At(1010, KeyDown(kA)), { KeyDown(KBLAY_MAKE_LSHIFT), KeyDown(kB) }));
+}
+
+KBLAY_TEST(TapHoldFifthKeyInFlightPassesThrough)
+{
+    Clocked c;
+    // Four dual-role keys down: each new press holds the ones before it.
+    for (uint16_t f = 0x3B; f <= 0x3E; ++f)
+        c.At(1000 + f, KeyDown(f));
+    CHECK_EQ(c.State().Active, (UINT32)KBLAY_TAPHOLD_MAX_ACTIVE);
+    CHECK_EQ(c.State().Holds, (UINT64)3);
+
+    // The fifth finds no slot and goes through as it is, after holding the fourth.
+    KBLAY_ENGINE_RESULT r;
+    CHECK(SameKeys(c.At(1100, KeyDown(0x3F), &r), { KeyDown(KBLAY_MAKE_CTRL), KeyDown(0x3F) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    CHECK(SameKeys(c.At(1110, KeyUp(0x3F), &r), { KeyUp(0x3F) }));
+    CHECK_EQ(r, KBLAY_ENGINE_UNMAPPED);
+    CHECK_EQ(c.State().Active, (UINT32)KBLAY_TAPHOLD_MAX_ACTIVE);
+
+    // Releasing one frees its slot for the next press.
+    CHECK(SameKeys(c.At(1120, KeyUp(0x3B)), { KeyUp(KBLAY_MAKE_CTRL) }));
+    CHECK(c.At(1130, KeyDown(0x3F), &r).empty());
+    CHECK_EQ(r, KBLAY_ENGINE_TAPHOLD);
+    CHECK(SameKeys(c.At(1140, KeyUp(0x3F)), { KeyDown(0x3F), KeyUp(0x3F) }));
+    for (uint16_t f = 0x3C; f <= 0x3E; ++f)
+        c.At(1200 + f, KeyUp(f));
+    CHECK_EQ(c.State().Active, 0u);
+    CHECK_EQ(c.State().Taps, (UINT64)1);
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+// Scratch files for tests, under a per-process directory in the system temp dir.
+class TestDir
+{
+public:
+    TestDir()
+    {
+        dir_ = std::filesystem::temp_directory_path() / ("kblay-test-" + std::to_string((unsigned long long)(uintptr_t)this));
+        std::filesystem::create_directories(dir_);
+    }
+
+    ~TestDir()
+    {
+        std::error_code ec;
+        std::filesystem::remove_all(dir_, ec);
+    }
+
+    TestDir(const TestDir&) = delete;
+    TestDir& operator=(const TestDir&) = delete;
+
+    std::filesystem::path Path(const std::string& name) const { return dir_ / name; }
+
+    std::filesystem::path Write(const std::string& name, const std::string& bytes) const
+    {
+        const auto p = Path(name);
+        std::ofstream(p, std::ios::binary | std::ios::trunc).write(bytes.data(), (std::streamsize)bytes.size());
+        return p;
+    }
+
+private:
+    std::filesystem::path dir_;
+};
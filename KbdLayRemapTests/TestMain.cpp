@@ -0,0 +1,6 @@
+int RunRegisteredTests(int argc, char** argv);
+
+int main(int argc, char** argv)
+{
+    return RunRegisteredTests(argc, argv);
+}
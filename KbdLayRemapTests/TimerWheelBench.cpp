@@ -0,0 +1,126 @@
+#include "EngineHarness.hpp"
+#include "KbdLayTest.hpp"
+#include <cstdio>
+#include <random>
+
+// The timer wheel on a virtual clock: Advance one tick at a time and in
+// 17 ms jumps, with timers that re-arm as they fire; then the cost of
+// resolving dual-role keys through the engine, as taps, as holds on
+// timeout and as holds forced by another key.
+
+namespace
+{
+    struct Rearming
+    {
+        KBLAY_TIMER_WHEEL Wheel;
+        std::mt19937 Rng{ 37 };
+        uint64_t Fired = 0;
+
+        static VOID OnFire(VOID* context, KBLAY_TIMER* timer, UINT64 now)
+        {
+            auto* r = static_cast<Rearming*>(context);
+            ++r->Fired;
+            // Hold deadlines are mostly 150..300 ms out; some go past the horizon.
+            const uint64_t out = r->Rng() % 64 == 0 ? 4096 + r->Rng() % 4096 : 150 + r->Rng() % 150;
+            KbdLayWheelArm(&r->Wheel, timer, now + out);
+        }
+    };
+
+    void RunAdvance(BenchContext& ctx, uint32_t timers, uint64_t step)
+    {
+        Rearming r;
+        KbdLayWheelInit(&r.Wheel, 0);
+        std::vector<KBLAY_TIMER> t(timers);
+        for (auto& timer : t)
+        {
+            timer = KBLAY_TIMER{};
+            KbdLayWheelArm(&r.Wheel, &timer, 1 + r.Rng() % 300);
+        }
+
+        const uint64_t ticks = ctx.Iterations(20000000);
+        uint64_t now = 0;
+        BenchTimer timer;
+        while (now < ticks)
+        {
+            now += step;
+            KbdLayWheelAdvance(&r.Wheel, now, Rearming::OnFire, &r);
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(r.Fired);
+
+        char detail[32];
+        std::snprintf(detail, sizeof(detail), "%llu fired", (unsigned long long)r.Fired);
+        char name[64];
+        std::snprintf(name, sizeof(name), "wheel/advance/%u-timers/step-%llums", timers, (unsigned long long)step);
+        ctx.Report(name, now, seconds, detail);
+    }
+
+    // One dual-role key resolved `how`, over and over: events per second
+    // counts every press, release and Advance the engine saw.
+    enum class Resolve { Tap, Timeout, Interrupt };
+
+    void RunResolve(BenchContext& ctx, const char* name, Resolve how)
+    {
+        const uint16_t space = 0x39;
+        TestBlob b(KBLAY_RULE_BLOB_VERSION_5);
+        b.Rule(space, 0, b.TapHold(space, KBLAY_MAKE_LSHIFT, 200), KBLAY_FLAG_TAPHOLD);
+        b.Rule(0x1E, 0, 0x30, 0);
+        TestEngine t;
+        t.Load(b.Bytes());
+
+        KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+        KBLAY_ENGINE_RESULT result;
+        const KBLAY_KEY_EVENT down = KeyDown(space), up = KeyUp(space);
+        const KBLAY_KEY_EVENT aDown = KeyDown(0x1E), aUp = KeyUp(0x1E);
+        auto feed = [&](const KBLAY_KEY_EVENT& e) {
+            return KbdLayEngineProcess(t.Engine.get(), t.State, t.Role, t.NowMs, &e, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+        };
+
+        const uint64_t target = ctx.Iterations(4000000);
+        uint64_t events = 0;
+        uint64_t produced = 0;
+        BenchTimer timer;
+        for (uint64_t i = 0; i < target; ++i)
+        {
+            produced += feed(down);
+            switch (how)
+            {
+            case Resolve::Tap:
+                t.NowMs += 90;
+                break;
+            case Resolve::Timeout:
+                t.NowMs += 210;
+                produced += KbdLayEngineAdvance(t.Engine.get(), t.NowMs, out, KBLAY_ENGINE_MAX_OUTPUT);
+                ++events;
+                break;
+            case Resolve::Interrupt:
+                t.NowMs += 40;
+                produced += feed(aDown);
+                produced += feed(aUp);
+                events += 2;
+                break;
+            }
+            produced += feed(up);
+            t.NowMs += 30;
+            events += 2;
+        }
+        const double seconds = timer.Seconds();
+        KeepValue(produced);
+
+        char detail[64];
+        std::snprintf(detail, sizeof(detail), "%.1f ns/resolution", seconds * 1e9 / (double)target);
+        ctx.Report(std::string("taphold/") + name, events, seconds, detail);
+    }
+}
+
+KBLAY_BENCH(TimerWheel)
+{
+    for (uint32_t timers : { 1u, 4u, 64u })
+    {
+        RunAdvance(ctx, timers, 1);
+        RunAdvance(ctx, timers, 17);
+    }
+    RunResolve(ctx, "tap", Resolve::Tap);
+    RunResolve(ctx, "timeout", Resolve::Timeout);
+    RunResolve(ctx, "interrupt", Resolve::Interrupt);
+}
@@ -0,0 +1,228 @@
+#include "KbdLayTest.hpp"
+#include "../Shared/KbdLayTimerWheel.h"
+#include <map>
+#include <random>
+#include <vector>
+
+// The timer wheel on a virtual clock: every deadline fires on its own tick
+// across 64 ms block boundaries and past the level-1 horizon, re-arming and
+// cancelling, Armed, and random use against a plain ordered map.
+
+namespace
+{
+    // Timers with their index, and what fired when.
+    struct Harness
+    {
+        KBLAY_TIMER_WHEEL Wheel;
+        std::vector<KBLAY_TIMER> Timers;
+        std::vector<std::pair<size_t, uint64_t>> Fired;   // timer, tick
+        uint64_t RearmEvery = 0;                          // fire re-arms this far out
+
+        Harness(size_t count, uint64_t now) : Timers(count)
+        {
+            KbdLayWheelInit(&Wheel, now);
+            for (auto& t : Timers)
+                t = KBLAY_TIMER{};
+        }
+
+        void Arm(size_t i, uint64_t expires) { KbdLayWheelArm(&Wheel, &Timers[i], expires); }
+        void Cancel(size_t i) { KbdLayWheelCancel(&Wheel, &Timers[i]); }
+        void Advance(uint64_t now) { KbdLayWheelAdvance(&Wheel, now, OnFire, this); }
+
+        static VOID OnFire(VOID* context, KBLAY_TIMER* timer, UINT64 now)
+        {
+            auto* h = static_cast<Harness*>(context);
+            CHECK_EQ(h->Wheel.Now, (UINT64)now);
+            CHECK(!KbdLayTimerArmed(timer));
+            h->Fired.emplace_back((size_t)(timer - h->Timers.data()), now);
+            if (h->RearmEvery)
+                KbdLayWheelArm(&h->Wheel, timer, now + h->RearmEvery);
+        }
+
+        // Every timer fired, each on the tick it was armed for.
+        bool AllOnTime() const
+        {
+            if (Fired.size() != Timers.size())
+                return false;
+            for (const auto& f : Fired)
+                if (f.second != Timers[f.first].Expires)
+                    return false;
+            return true;
+        }
+    };
+}
+
+KBLAY_TEST(TimerWheelFiresOnTheDeadlineAtBlockBoundaries)
+{
+    // A probe armed at 10 for 128 fired at 129 while 130 and 210 were on time.
+    Harness probe(3, 10);
+    probe.Arm(0, 128);
+    probe.Arm(1, 130);
+    probe.Arm(2, 210);
+    probe.Advance(300);
+    CHECK(probe.AllOnTime());
+
+    // Every deadline up to 300 ms out, from starts on and around a block
+    // edge, advanced one tick at a time and in one jump.
+    for (const uint64_t start : { 0ull, 10ull, 63ull, 64ull, 65ull, 127ull, 1000ull })
+    {
+        for (const bool stepwise : { true, false })
+        {
+            Harness h(300, start);
+            for (size_t i = 0; i < 300; ++i)
+                h.Arm(i, start + 1 + i);
+            CHECK_EQ(h.Wheel.Armed, 300u);
+            if (stepwise)
+            {
+                for (uint64_t now = start + 1; now <= start + 300; ++now)
+                {
+                    const size_t before = h.Fired.size();
+                    h.Advance(now);
+                    CHECK_EQ(h.Fired.size(), before + 1);
+                }
+            }
+            else
+            {
+                h.Advance(start + 300);
+            }
+            CHECK(h.AllOnTime());
+            CHECK_EQ(h.Wheel.Armed, 0u);
+        }
+    }
+}
+
+KBLAY_TEST(TimerWheelParksTimersPastTheHorizon)
+{
+    // 4096 ms is where level 1 runs out; these go round the wheel again,
+    // some more than once, and still fire on their tick.
+    const uint64_t start = 77;
+    const uint64_t outs[] = { 4032, 4095, 4096, 4097, 4160, 8191, 8192, 12345, 40000 };
+    Harness h(sizeof(outs) / sizeof(outs[0]), start);
+    for (size_t i = 0; i < h.Timers.size(); ++i)
+        h.Arm(i, start + outs[i]);
+
+    // Uneven steps, some landing inside a block and some on its edge.
+    std::mt19937 rng(37);
+    uint64_t now = start;
+    while (now < start + 40000)
+    {
+        now += 1 + rng() % 700;
+        h.Advance(now);
+        for (size_t i = 0; i < h.Timers.size(); ++i)
+            CHECK_EQ((bool)KbdLayTimerArmed(&h.Timers[i]), h.Timers[i].Expires > now);
+    }
+    CHECK(h.AllOnTime());
+}
+
+KBLAY_TEST(TimerWheelRearmAndCancel)
+{
+    Harness h(4, 100);
+
+    // Re-arming moves the one timer; it fires once, at the last time given.
+    h.Arm(0, 300);
+    h.Arm(0, 150);
+    h.Arm(0, 5000);
+    h.Arm(0, 200);
+    CHECK_EQ(h.Wheel.Armed, 1u);
+
+    // Cancelled timers never fire, and cancelling twice is harmless.
+    h.Arm(1, 180);
+    h.Cancel(1);
+    h.Cancel(1);
+    h.Cancel(2);
+    CHECK_EQ(h.Wheel.Armed, 1u);
+
+    // A time already past fires on the next tick.
+    h.Arm(3, 40);
+    CHECK_EQ(h.Wheel.Armed, 2u);
+    h.Advance(101);
+    CHECK(h.Fired.size() == 1 && h.Fired[0] == std::make_pair((size_t)3, (uint64_t)101));
+    h.Advance(300);
+    CHECK(h.Fired.size() == 2 && h.Fired[1] == std::make_pair((size_t)0, (uint64_t)200));
+    CHECK_EQ(h.Wheel.Armed, 0u);
+
+    // A clock going backwards is ignored.
+    h.Advance(250);
+    CHECK_EQ(h.Wheel.Now, (UINT64)300);
+
+    // Re-armed from its own callback, a timer fires every period.
+    h.Fired.clear();
+    h.RearmEvery = 64;
+    h.Arm(2, 364);
+    h.Advance(364 + 64 * 9);
+    CHECK_EQ(h.Fired.size(), (size_t)10);
+    for (size_t i = 0; i < h.Fired.size(); ++i)
+        CHECK_EQ(h.Fired[i].second, (uint64_t)(364 + 64 * i));
+    CHECK_EQ(h.Wheel.Armed, 1u);
+}
+
+KBLAY_TEST(TimerWheelMatchesAnOrderedMap)
+{
+    // Random arms, re-arms, cancels and advances; the map says what must
+    // fire on each tick, and Armed must always equal its size.
+    std::mt19937_64 rng(37);
+    const uint64_t start = 5;
+    Harness h(64, start);
+    std::map<size_t, uint64_t> armed;   // timer -> expiry
+    uint64_t now = start;
+
+    for (int op = 0; op < 200000; ++op)
+    {
+        const size_t i = rng() % h.Timers.size();
+        switch (rng() % 4)
+        {
+        case 0:
+        case 1:
+        {
+            // Mostly near, sometimes at the edge of a block, sometimes far.
+            const uint64_t r = rng() % 16;
+            const uint64_t at = r < 10 ? now + rng() % 300
+                : r < 14 ? ((now >> 6) + 1 + rng() % 4) << 6
+                : now + rng() % 10000;
+            h.Arm(i, at);
+            armed[i] = at > now ? at : now + 1;
+            break;
+        }
+        case 2:
+            h.Cancel(i);
+            armed.erase(i);
+            break;
+        default:
+        {
+            const uint64_t to = now + rng() % 200;
+            h.Fired.clear();
+            h.Advance(to);
+            std::multimap<uint64_t, size_t> due;
+            std::map<size_t, uint64_t> dueAt;
+            for (auto it = armed.begin(); it != armed.end();)
+            {
+                if (it->second <= to)
+                {
+                    due.emplace(it->second, it->first);
+                    dueAt[it->first] = it->second;
+                    it = armed.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+            CHECK_EQ(h.Fired.size(), due.size());
+            auto expect = due.begin();
+            for (size_t f = 0; f < h.Fired.size() && expect != due.end(); ++f, ++expect)
+            {
+                // Same ticks in the same order; within a tick any order will do.
+                CHECK_EQ(h.Fired[f].second, expect->first);
+                CHECK_EQ(dueAt.count(h.Fired[f].first) ? dueAt[h.Fired[f].first] : 0, h.Fired[f].second);
+            }
+            now = to;
+            break;
+        }
+        }
+        if (h.Wheel.Armed != armed.size())
+        {
+            ReportCheckFailure(__FILE__, __LINE__, "Armed differs from the map at op " + std::to_string(op));
+            return;
+        }
+    }
+}
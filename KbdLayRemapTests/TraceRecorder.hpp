@@ -0,0 +1,81 @@
+#pragma once
+#include "EngineHarness.hpp"
+#include "TraceFile.hpp"
+
+// Produces trace records the way the driver's traced path does
+// (RemapEngine.c): modifiers and pool before the event, result, first
+// outputs, the consulted cell, and timer records for clock-driven holds.
+class TraceRecorder
+{
+public:
+    static const uint64_t kFrequency = 10000000;  // 100 ns ticks
+
+    explicit TraceRecorder(const std::vector<uint8_t>& rules)
+    {
+        capture_.Frequency = kFrequency;
+        capture_.RuleBlob = rules;
+        engine_.Load(rules);
+    }
+
+    TestEngine& Engine() { return engine_; }
+
+    void Key(const KBLAY_KEY_EVENT& in, uint64_t atMs)
+    {
+        KBLAY_TRACE_RECORD rec{};
+        rec.In = in;
+        rec.State = (UINT8)engine_.State;
+        rec.Role = (UINT8)engine_.Role;
+        Before(rec, atMs);
+
+        KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+        KBLAY_ENGINE_RESULT result = KBLAY_ENGINE_PASS;
+        const size_t n = KbdLayEngineProcess(engine_.Engine.get(), engine_.State, engine_.Role, atMs, &in, out, KBLAY_ENGINE_MAX_OUTPUT, &result);
+        if (result != KBLAY_ENGINE_PASS)
+            rec.HasCell = KbdLayEngineLookupCell(engine_.Engine.get(), &rec.In, &rec.Cell);
+        After(rec, result, out, n);
+    }
+
+    // The tap-hold timer firing at atMs; records only if it produced output.
+    void Timer(uint64_t atMs)
+    {
+        KBLAY_TRACE_RECORD rec{};
+        rec.State = (UINT8)engine_.State;
+        rec.Role = (UINT8)engine_.Role;
+        Before(rec, atMs);
+
+        KBLAY_KEY_EVENT out[KBLAY_ENGINE_MAX_OUTPUT];
+        const size_t n = KbdLayEngineAdvance(engine_.Engine.get(), atMs, out, KBLAY_ENGINE_MAX_OUTPUT);
+        if (n)
+            After(rec, KBLAY_ENGINE_TIMER, out, n);
+    }
+
+    // Drops the next `count` records, as a full trace ring would.
+    void Drop(uint32_t count) { sequence_ += count; }
+
+    TraceCapture& Capture() { return capture_; }
+
+private:
+    void Before(KBLAY_TRACE_RECORD& rec, uint64_t atMs)
+    {
+        const KBLAY_ENGINE* e = engine_.Engine.get();
+        rec.Timestamp = atMs * (kFrequency / 1000);
+        rec.Mods = KbdLayEngineModsToBits(&e->Mods);
+        rec.DebounceMs = (UINT16)e->Debounce.WindowMs;
+        rec.SharedMods = e->Share ? KbdLayModShareRead(e->Share) : 0;
+        rec.EngineTicks = 2;
+    }
+
+    void After(KBLAY_TRACE_RECORD& rec, KBLAY_ENGINE_RESULT result, const KBLAY_KEY_EVENT* out, size_t n)
+    {
+        rec.Result = (UINT8)result;
+        rec.OutCount = (UINT8)n;
+        for (size_t i = 0; i < n && i < KBLAY_TRACE_RECORD_OUT; ++i)
+            rec.Out[i] = out[i];
+        rec.Sequence = sequence_++;
+        capture_.Records.push_back(rec);
+    }
+
+    TestEngine engine_;
+    TraceCapture capture_;
+    uint32_t sequence_ = 0;
+};
@@ -0,0 +1,196 @@
+#include "KbdLayTest.hpp"
+#include "TestFiles.hpp"
+#include "TraceRecorder.hpp"
+
+// Host replay of recorded traces: what kblayctl trace replay and
+// kblay_replay run against captures taken on a device.
+
+static const uint16_t kA = 0x1E;
+static const uint16_t kB = 0x30;
+static const uint16_t kF = 0x21;
+static const uint16_t kJ = 0x24;
+static const uint16_t kQuote = 0x28;
+static const uint16_t k2 = 0x03;
+static const uint16_t kSpace = 0x39;
+static const uint16_t kLCtrl = 0x1D;
+
+static std::vector<uint8_t> MixedRules()
+{
+    TestBlob blob(KBLAY_RULE_BLOB_VERSION_5);
+    const uint16_t macro = blob.Macro({ MacroDown(kLCtrl), MacroDown(kA), MacroUp(kA), MacroUp(kLCtrl) });
+    const uint16_t hold = blob.TapHold(kSpace, KBLAY_MAKE_LSHIFT, 200);
+    return blob
+        .Rule(kA, 0, kB, 0)
+        .Rule(kQuote, 0, k2, KBLAY_FLAG_SHIFT, KBLAY_MODGROUP_SHIFT, 0)
+        .Rule(kF, 0, macro, KBLAY_FLAG_MACRO)
+        .Rule(kSpace, 0, hold, KBLAY_FLAG_TAPHOLD)
+        .Bytes();
+}
+
+// Typing with remaps, shift synthesis, a macro, one tap and one hold that
+// only resolves from the timer.
+static void RecordSession(TraceRecorder& rec)
+{
+    uint64_t ms = 1000;
+    const uint16_t keys[] = { kA, kQuote, kJ, kF, kA };
+    for (uint16_t k : keys)
+    {
+        rec.Key(KeyDown(k), ms += 40);
+        rec.Key(KeyUp(k), ms += 30);
+    }
+
+    rec.Key(KeyDown(kSpace), ms += 50);
+    rec.Key(KeyUp(kSpace), ms += 60);
+
+    rec.Key(KeyDown(kSpace), ms += 50);
+    rec.Timer(ms += 250);
+    rec.Key(KeyDown(kJ), ms += 20);
+    rec.Key(KeyUp(kJ), ms += 20);
+    rec.Key(KeyUp(kSpace), ms += 20);
+    rec.Timer(ms += 300);  // nothing pending: no record
+}
+
+static TraceCapture WriteAndRead(TestDir& dir, const TraceCapture& capture, size_t extraBytes = 0)
+{
+    const std::wstring path = dir.Path("session.kbltrace").wstring();
+    {
+        TraceWriter w;
+        CHECK(w.Open(path, capture.ContainerId, capture.Frequency, capture.RuleBlob));
+        CHECK(w.Append(capture.Records.data(), capture.Records.size()));
+        CHECK_EQ(w.RecordCount(), (uint64_t)capture.Records.size());
+    }
+    if (extraBytes)
+    {
+        std::ofstream f(dir.Path("session.kbltrace"), std::ios::binary | std::ios::app);
+        const std::string partial(extraBytes, '\x5A');
+        f.write(partial.data(), (std::streamsize)partial.size());
+    }
+
+    TraceCapture read;
+    CHECK(ReadTraceFile(path, read));
+    return read;
+}
+
+KBLAY_TEST(TraceReplayMatchesRecordedSession)
+{
+    TraceRecorder rec(MixedRules());
+    RecordSession(rec);
+
+    // The timer record exists and the idle Advance left none.
+    size_t timers = 0;
+    for (const auto& r : rec.Capture().Records)
+        timers += r.Result == KBLAY_ENGINE_TIMER;
+    CHECK_EQ(timers, (size_t)1);
+
+    TestDir dir;
+    const TraceCapture read = WriteAndRead(dir, rec.Capture());
+    CHECK_EQ(read.Records.size(), rec.Capture().Records.size());
+    CHECK_EQ(read.Frequency, TraceRecorder::kFrequency);
+    CHECK(read.RuleBlob == rec.Capture().RuleBlob);
+
+    TraceReplayReport report;
+    CHECK(ReplayTrace(read, report));
+    CHECK(report.RulesValid);
+    CHECK_EQ(report.Events, read.Records.size());
+    CHECK_EQ(report.Mismatches, (size_t)0);
+    CHECK_EQ(report.Resyncs, (size_t)1);
+    CHECK_EQ(report.DroppedRecords, (size_t)0);
+}
+
+KBLAY_TEST(TraceReplayFlagsTheRecordThatDiffers)
+{
+    TraceRecorder rec(MixedRules());
+    RecordSession(rec);
+
+    // Pretend the driver produced something else for the first remap.
+    auto& records = rec.Capture().Records;
+    CHECK_EQ(records[0].Out[0].MakeCode, kB);
+    records[0].Out[0].MakeCode = kJ;
+
+    // And for the macro's third output, which is still within the record.
+    size_t macro = 0;
+    while (macro < records.size() && records[macro].Result != KBLAY_ENGINE_MACRO)
+        ++macro;
+    CHECK(macro < records.size());
+    records[macro].Out[2].Flags ^= KBLAY_KEY_BREAK;
+
+    TraceReplayReport report;
+    CHECK(ReplayTrace(rec.Capture(), report));
+    CHECK_EQ(report.Mismatches, (size_t)2);
+    CHECK(report.MismatchIndices == (std::vector<size_t>{ 0, macro }));
+}
+
+KBLAY_TEST(TraceReplayResyncsAcrossDroppedRecords)
+{
+    TraceRecorder rec(MixedRules());
+    rec.Key(KeyDown(kA), 1000);
+    rec.Key(KeyUp(kA), 1040);
+    // A shift press and three more records were lost from the ring; the
+    // engine still ran them.
+    rec.Drop(4);
+    rec.Key(KeyDown(KBLAY_MAKE_LSHIFT), 1100);
+    rec.Capture().Records.pop_back();
+    rec.Key(KeyDown(kQuote), 1200);  // Shift held: no synthesis
+    rec.Key(KeyUp(kQuote), 1240);
+
+    TraceReplayReport report;
+    CHECK(ReplayTrace(rec.Capture(), report));
+    CHECK_EQ(report.DroppedRecords, (size_t)5);
+    CHECK_EQ(report.Resyncs, (size_t)2);
+    CHECK_EQ(report.Mismatches, (size_t)0);
+}
+
+KBLAY_TEST(TraceFileIgnoresTrailingPartialRecord)
+{
+    TraceRecorder rec(MixedRules());
+    RecordSession(rec);
+
+    TestDir dir;
+    const TraceCapture read = WriteAndRead(dir, rec.Capture(), sizeof(KBLAY_TRACE_RECORD) / 2);
+    CHECK_EQ(read.Records.size(), rec.Capture().Records.size());
+
+    TraceReplayReport report;
+    CHECK(ReplayTrace(read, report));
+    CHECK_EQ(report.Mismatches, (size_t)0);
+}
+
+KBLAY_TEST(TraceFileRejectsForeignHeaders)
+{
+    TraceRecorder rec(MixedRules());
+    RecordSession(rec);
+
+    TestDir dir;
+    WriteAndRead(dir, rec.Capture());
+    std::string bytes;
+    {
+        std::ifstream f(dir.Path("session.kbltrace"), std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+
+    TraceCapture read;
+    std::string bad = bytes;
+    bad[0] = 'X';
+    CHECK(!ReadTraceFile(dir.Write("magic.kbltrace", bad).wstring(), read));
+
+    bad = bytes;
+    bad[offsetof(KBLAY_TRACE_FILE_HEADER, RecordSize)] = 72;
+    CHECK(!ReadTraceFile(dir.Write("size.kbltrace", bad).wstring(), read));
+
+    // Rule blob running past the end of the file.
+    bad = bytes.substr(0, sizeof(KBLAY_TRACE_FILE_HEADER) + 4);
+    CHECK(!ReadTraceFile(dir.Write("blob.kbltrace", bad).wstring(), read));
+
+    CHECK(!ReadTraceFile(dir.Path("missing.kbltrace").wstring(), read));
+}
+
+KBLAY_TEST(TraceReplayReportsInvalidRules)
+{
+    TraceRecorder rec(MixedRules());
+    RecordSession(rec);
+    rec.Capture().RuleBlob.resize(6);
+
+    TraceReplayReport report;
+    CHECK(ReplayTrace(rec.Capture(), report));
+    CHECK(!report.RulesValid);
+    CHECK(report.Mismatches != 0);
+}
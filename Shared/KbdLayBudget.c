@@ -0,0 +1,49 @@
+#include "KbdLayBudget.h"
+
+VOID KbdLayBudgetStart(
+    _Out_ KBLAY_BUDGET* Budget,
+    _In_ const KBLAY_BUDGET_CONFIG* Config,
+    _In_ UINT64 Now,
+    _In_ UINT64 TicksPerSecond)
+{
+    Budget->MaxEvents = Config->MaxEvents ? Config->MaxEvents : 0xFFFFFFFFu;
+    Budget->Taken = 0;
+    Budget->Deadline = ~(UINT64)0;
+
+    if (Config->MaxMicros && TicksPerSecond)
+    {
+        const UINT64 ticks = (TicksPerSecond / 1000000) * Config->MaxMicros +
+            (TicksPerSecond % 1000000) * Config->MaxMicros / 1000000;
+        if (Now + ticks >= Now)
+            Budget->Deadline = Now + ticks;
+    }
+}
+
+UINT32 KbdLayBacklogPush(
+    _Inout_ KBLAY_BACKLOG* Backlog,
+    _In_reads_(Count) const KBLAY_KEY_EVENT* Events,
+    _In_ UINT32 Count)
+{
+    const UINT32 room = KBLAY_BACKLOG_EVENTS - Backlog->Count;
+    const UINT32 n = Count < room ? Count : room;
+
+    for (UINT32 i = 0; i < n; ++i)
+        Backlog->Events[(Backlog->Head + Backlog->Count + i) % KBLAY_BACKLOG_EVENTS] = Events[i];
+    Backlog->Count += n;
+    return n;
+}
+
+UINT32 KbdLayBacklogPeek(_In_ const KBLAY_BACKLOG* Backlog, _Out_ const KBLAY_KEY_EVENT** Span)
+{
+    *Span = &Backlog->Events[Backlog->Head];
+    const UINT32 toEnd = KBLAY_BACKLOG_EVENTS - Backlog->Head;
+    return Backlog->Count < toEnd ? Backlog->Count : toEnd;
+}
+
+VOID KbdLayBacklogPop(_Inout_ KBLAY_BACKLOG* Backlog, _In_ UINT32 Count)
+{
+    if (Count > Backlog->Count)
+        Count = Backlog->Count;
+    Backlog->Head = (Backlog->Head + Count) % KBLAY_BACKLOG_EVENTS;
+    Backlog->Count -= Count;
+}
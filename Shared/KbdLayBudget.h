@@ -0,0 +1,75 @@
+#pragma once
+
+// Work budget for one slice of input processing, and the backlog that holds
+// the input a slice did not get to. Plain data on a caller-supplied clock;
+// the caller serializes access.
+
+#include "KbdLayPlatform.h"
+#include "KbdLayEngine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KBLAY_BUDGET_DEFAULT_EVENTS 64
+#define KBLAY_BUDGET_DEFAULT_US     200
+
+    // Input events a device can hold back; more stays with the port driver.
+#define KBLAY_BACKLOG_EVENTS 256
+
+    typedef struct KBLAY_BUDGET_CONFIG
+    {
+        UINT32 MaxEvents;    // per slice; 0 = no limit
+        UINT32 MaxMicros;    // per slice; 0 = no limit
+    } KBLAY_BUDGET_CONFIG;
+
+    typedef struct KBLAY_BUDGET
+    {
+        UINT64 Deadline;     // clock ticks; ~0 = none
+        UINT32 MaxEvents;
+        UINT32 Taken;
+    } KBLAY_BUDGET;
+
+    VOID KbdLayBudgetStart(
+        _Out_ KBLAY_BUDGET* Budget,
+        _In_ const KBLAY_BUDGET_CONFIG* Config,
+        _In_ UINT64 Now,
+        _In_ UINT64 TicksPerSecond);
+
+    // Events the slice has room for at Now; charge the ones used with
+    // KbdLayBudgetCharge. A fresh slice always has room, so every slice
+    // makes progress.
+    static KBLAY_FORCEINLINE UINT32 KbdLayBudgetRoom(_In_ const KBLAY_BUDGET* Budget, _In_ UINT64 Now)
+    {
+        if (Budget->Taken != 0 && (Budget->Taken >= Budget->MaxEvents || Now >= Budget->Deadline))
+            return 0;
+        return Budget->MaxEvents - Budget->Taken;
+    }
+
+    static KBLAY_FORCEINLINE VOID KbdLayBudgetCharge(_Inout_ KBLAY_BUDGET* Budget, _In_ UINT32 Count)
+    {
+        Budget->Taken += Count;
+    }
+
+    typedef struct KBLAY_BACKLOG
+    {
+        UINT32 Head;
+        UINT32 Count;
+        KBLAY_KEY_EVENT Events[KBLAY_BACKLOG_EVENTS];
+    } KBLAY_BACKLOG;
+
+    // Appends as many of Events as fit, in order; returns how many.
+    UINT32 KbdLayBacklogPush(
+        _Inout_ KBLAY_BACKLOG* Backlog,
+        _In_reads_(Count) const KBLAY_KEY_EVENT* Events,
+        _In_ UINT32 Count);
+
+    // Oldest events that are contiguous in memory; returns how many (0 if
+    // empty). Push does not move them, so they may be read while it runs.
+    UINT32 KbdLayBacklogPeek(_In_ const KBLAY_BACKLOG* Backlog, _Out_ const KBLAY_KEY_EVENT** Span);
+
+    VOID KbdLayBacklogPop(_Inout_ KBLAY_BACKLOG* Backlog, _In_ UINT32 Count);
+
+#ifdef __cplusplus
+}
+#endif
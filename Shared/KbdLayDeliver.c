@@ -0,0 +1,102 @@
+#include "KbdLayDeliver.h"
+#include <string.h>
+
+BOOLEAN KbdLayOutboxFlush(
+    _Inout_ KBLAY_OUTBOX* Box,
+    _In_ const KBLAY_DELIVER_OPS* Ops,
+    _Inout_ VOID* Context)
+{
+    if (Box->Count == 0)
+        return TRUE;
+
+    UINT32 accepted = Ops->Send(Context, Box->Events, Box->Count);
+    if (accepted >= Box->Count)
+    {
+        Box->Count = 0;
+        return TRUE;
+    }
+
+    // Whatever is left goes first next time, in order.
+    Box->Count -= accepted;
+    if (accepted)
+        memmove(Box->Events, Box->Events + accepted, Box->Count * sizeof(Box->Events[0]));
+    return FALSE;
+}
+
+KBLAY_DELIVER_STATUS KbdLayDeliver(
+    _Inout_ KBLAY_OUTBOX* Box,
+    _In_ const KBLAY_DELIVER_OPS* Ops,
+    _Inout_ VOID* Context,
+    _In_reads_(Count) const KBLAY_KEY_EVENT* In,
+    _In_ UINT32 Count,
+    _Inout_ KBLAY_BUDGET* Budget,
+    _Out_ UINT32* Taken)
+{
+    KBLAY_DELIVER_STATUS status = KBLAY_DELIVER_DONE;
+    UINT32 taken = 0;
+
+    *Taken = 0;
+    if (!KbdLayOutboxFlush(Box, Ops, Context))
+        return KBLAY_DELIVER_FULL;
+
+    while (taken < Count)
+    {
+        const UINT32 room = KbdLayBudgetRoom(Budget, Ops->Now(Context));
+        if (room == 0)
+        {
+            status = KBLAY_DELIVER_BUDGET;
+            break;
+        }
+
+        // Always leave room for one input's full output.
+        if (KBLAY_OUTBOX_EVENTS - Box->Count < KBLAY_ENGINE_MAX_OUTPUT &&
+            !KbdLayOutboxFlush(Box, Ops, Context))
+        {
+            *Taken = taken;
+            return KBLAY_DELIVER_FULL;
+        }
+
+        const UINT32 want = Count - taken < room ? Count - taken : room;
+        UINT32 produced = 0;
+        const UINT32 n = Ops->Translate(Context, In + taken, want,
+            Box->Events + Box->Count, KBLAY_OUTBOX_EVENTS - Box->Count, &produced);
+        Box->Count += produced;
+        taken += n;
+        KbdLayBudgetCharge(Budget, n);
+    }
+
+    *Taken = taken;
+    if (!KbdLayOutboxFlush(Box, Ops, Context))
+        return KBLAY_DELIVER_FULL;
+    return status;
+}
+
+KBLAY_DELIVER_STATUS KbdLayDeliverBacklog(
+    _Inout_ KBLAY_OUTBOX* Box,
+    _Inout_ KBLAY_BACKLOG* Backlog,
+    _In_ const KBLAY_DELIVER_OPS* Ops,
+    _Inout_ VOID* Context,
+    _Inout_ KBLAY_BUDGET* Budget)
+{
+    for (;;)
+    {
+        // Push only appends past the span, so it can be read unlocked.
+        const KBLAY_KEY_EVENT* span = NULL;
+        Ops->Lock(Context);
+        const UINT32 n = KbdLayBacklogPeek(Backlog, &span);
+        Ops->Unlock(Context);
+
+        UINT32 taken = 0;
+        const KBLAY_DELIVER_STATUS status = KbdLayDeliver(Box, Ops, Context, span, n, Budget, &taken);
+
+        if (taken != 0)
+        {
+            Ops->Lock(Context);
+            KbdLayBacklogPop(Backlog, taken);
+            Ops->Unlock(Context);
+        }
+
+        if (status != KBLAY_DELIVER_DONE || n == 0)
+            return status;
+    }
+}
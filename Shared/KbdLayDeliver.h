@@ -0,0 +1,104 @@
+#pragma once
+
+// Handing translated input to the class driver. The class driver may take
+// only part of what it is given; whatever it leaves stays in the outbox and
+// goes out before anything translated later. An input counts as consumed
+// once it has been translated, so it is never translated twice: tap-hold,
+// debounce, macro and shared-modifier state see every event exactly once.
+//
+// The caller owns the outbox exclusively while it delivers and supplies the
+// translation, the class callback and the clock; there is no locking here.
+
+#include "KbdLayPlatform.h"
+#include "KbdLayEngine.h"
+#include "KbdLayBudget.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Events per class callback; room for several full macros.
+#define KBLAY_OUTBOX_EVENTS (4 * KBLAY_ENGINE_MAX_OUTPUT)
+
+    // Translates a run of In into Out and returns the inputs taken; stops
+    // before an input once fewer than KBLAY_ENGINE_MAX_OUTPUT slots are left.
+    typedef UINT32 KBLAY_DELIVER_TRANSLATE(
+        _Inout_ VOID* Context,
+        _In_reads_(Count) const KBLAY_KEY_EVENT* In,
+        _In_ UINT32 Count,
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+        _In_ UINT32 OutCap,
+        _Out_ UINT32* Produced);
+
+    // The class driver's service callback; returns the events it accepted,
+    // always a prefix of Events.
+    typedef UINT32 KBLAY_DELIVER_SEND(
+        _Inout_ VOID* Context,
+        _In_reads_(Count) const KBLAY_KEY_EVENT* Events,
+        _In_ UINT32 Count);
+
+    // The budget's clock.
+    typedef UINT64 KBLAY_DELIVER_NOW(_Inout_ VOID* Context);
+
+    // Guards the backlog against concurrent pushes (KbdLayDeliverBacklog only).
+    typedef VOID KBLAY_DELIVER_LOCK(_Inout_ VOID* Context);
+
+    typedef struct KBLAY_DELIVER_OPS
+    {
+        KBLAY_DELIVER_TRANSLATE* Translate;
+        KBLAY_DELIVER_SEND*      Send;
+        KBLAY_DELIVER_NOW*       Now;
+        KBLAY_DELIVER_LOCK*      Lock;
+        KBLAY_DELIVER_LOCK*      Unlock;
+    } KBLAY_DELIVER_OPS;
+
+    typedef struct KBLAY_OUTBOX
+    {
+        UINT32 Count;        // events translated but not yet accepted, oldest first
+        KBLAY_KEY_EVENT Events[KBLAY_OUTBOX_EVENTS];
+    } KBLAY_OUTBOX;
+
+    // Why a delivery stopped, and so when to try again: BUDGET right away
+    // (after other devices have had a turn), FULL only once the class driver
+    // has had time to drain.
+    typedef enum KBLAY_DELIVER_STATUS
+    {
+        KBLAY_DELIVER_DONE = 0,      // all input taken, all output accepted
+        KBLAY_DELIVER_BUDGET = 1,    // the budget ran out; more can go now
+        KBLAY_DELIVER_FULL = 2       // the class driver took less than it was given
+    } KBLAY_DELIVER_STATUS;
+
+    // Offers the outbox to the class driver; TRUE once it is empty.
+    BOOLEAN KbdLayOutboxFlush(
+        _Inout_ KBLAY_OUTBOX* Box,
+        _In_ const KBLAY_DELIVER_OPS* Ops,
+        _Inout_ VOID* Context);
+
+    // Sends what the outbox owes, then translates In through the outbox as
+    // far as Budget and the class driver allow. *Taken is the inputs
+    // translated; their output is either accepted or owed in Box. Nothing is
+    // translated while output is owed, so on KBLAY_DELIVER_FULL the rest of
+    // In is untouched.
+    KBLAY_DELIVER_STATUS KbdLayDeliver(
+        _Inout_ KBLAY_OUTBOX* Box,
+        _In_ const KBLAY_DELIVER_OPS* Ops,
+        _Inout_ VOID* Context,
+        _In_reads_(Count) const KBLAY_KEY_EVENT* In,
+        _In_ UINT32 Count,
+        _Inout_ KBLAY_BUDGET* Budget,
+        _Out_ UINT32* Taken);
+
+    // KbdLayDeliver over Backlog, oldest first, across its wrap. Translated
+    // entries are popped, so none is translated twice; with an empty backlog
+    // this only sends what the outbox owes. Only the outbox's owner calls
+    // this; pushes may run concurrently under Ops->Lock.
+    KBLAY_DELIVER_STATUS KbdLayDeliverBacklog(
+        _Inout_ KBLAY_OUTBOX* Box,
+        _Inout_ KBLAY_BACKLOG* Backlog,
+        _In_ const KBLAY_DELIVER_OPS* Ops,
+        _Inout_ VOID* Context,
+        _Inout_ KBLAY_BUDGET* Budget);
+
+#ifdef __cplusplus
+}
+#endif
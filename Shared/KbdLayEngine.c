@@ -0,0 +1,1294 @@
+#include "KbdLayEngine.h"
+#include "KbdLayIoctl.h"
+#include <string.h>
+
+static KBLAY_FORCEINLINE BOOLEAN IsKeyBreak(_In_ const KBLAY_KEY_EVENT* In)
+{
+    return (In->Flags & KBLAY_KEY_BREAK) ? TRUE : FALSE;
+}
+
+static KBLAY_FORCEINLINE BOOLEAN IsE0(_In_ const KBLAY_KEY_EVENT* In)
+{
+    return (In->Flags & KBLAY_KEY_E0) ? TRUE : FALSE;
+}
+
+static KBLAY_FORCEINLINE BOOLEAN IsE1(_In_ const KBLAY_KEY_EVENT* In)
+{
+    return (In->Flags & KBLAY_KEY_E1) ? TRUE : FALSE;
+}
+
+static KBLAY_FORCEINLINE BOOLEAN IsShiftMakeCode(_In_ USHORT MakeCode)
+{
+    return (MakeCode == KBLAY_MAKE_LSHIFT || MakeCode == KBLAY_MAKE_RSHIFT) ? TRUE : FALSE;
+}
+
+static KBLAY_FORCEINLINE UINT32 PrefixIndex(_In_ const KBLAY_KEY_EVENT* In)
+{
+    return IsE1(In) ? 2u : (IsE0(In) ? 1u : 0u);
+}
+
+// 0x00-0xFF: one load from Low. Higher codes: directory byte, then the page.
+static KBLAY_FORCEINLINE KBLAY_RULE_CELL FindCell(
+    _In_ const KBLAY_RULE_TABLE* Table,
+    _In_ UINT32 Class,
+    _In_ UINT32 Prefix,
+    _In_ USHORT MakeCode)
+{
+    if (MakeCode <= 0xFF)
+        return Table->Low[Class][Prefix][MakeCode];
+
+    const UINT8 page = Table->HighDir[Class][Prefix][MakeCode >> 8];
+    if (page == 0)
+    {
+        const KBLAY_RULE_CELL none = { 0 };
+        return none;
+    }
+    return Table->High[page - 1][MakeCode & 0xFF];
+}
+
+static KBLAY_FORCEINLINE size_t RuleEntrySize(_In_ UINT32 Version)
+{
+    if (Version >= KBLAY_RULE_BLOB_VERSION_3) return sizeof(KBLAY_RULE_ENTRY_V3);
+    if (Version == KBLAY_RULE_BLOB_VERSION_2) return sizeof(KBLAY_RULE_ENTRY_V2);
+    return sizeof(KBLAY_RULE_ENTRY);
+}
+
+// Reads entry `Index` of a v1-v4 blob in the v3 shape. Before v3 rules only
+// condition on Shift: their KBLAY_FLAG_SHIFT becomes a Shift-only condition.
+// Flags for features newer than the blob (macros v4, tap-hold v5) are dropped.
+static VOID ReadRuleEntry(
+    _In_ const KBLAY_RULE_BLOB_HEADER* Header,
+    _In_ UINT32 Index,
+    _Out_ KBLAY_RULE_ENTRY_V3* Entry)
+{
+    const UINT8* body = (const UINT8*)Header + sizeof(KBLAY_RULE_BLOB_HEADER);
+
+    if (Header->Version >= KBLAY_RULE_BLOB_VERSION_3)
+    {
+        memcpy(Entry, body + (size_t)Index * sizeof(KBLAY_RULE_ENTRY_V3), sizeof(*Entry));
+        if (Header->Version < KBLAY_RULE_BLOB_VERSION_4)
+            Entry->OutFlags &= (UINT8)~KBLAY_FLAG_MACRO;
+        if (Header->Version < KBLAY_RULE_BLOB_VERSION_5)
+            Entry->OutFlags &= (UINT8)~KBLAY_FLAG_TAPHOLD;
+        return;
+    }
+
+    UINT8 inFlags;
+    memset(Entry, 0, sizeof(*Entry));
+    if (Header->Version == KBLAY_RULE_BLOB_VERSION_2)
+    {
+        KBLAY_RULE_ENTRY_V2 e;
+        memcpy(&e, body + (size_t)Index * sizeof(KBLAY_RULE_ENTRY_V2), sizeof(e));
+        Entry->InMakeCode = e.InMakeCode;
+        Entry->OutMakeCode = e.OutMakeCode;
+        Entry->OutFlags = e.OutFlags;
+        inFlags = e.InFlags;
+    }
+    else
+    {
+        const KBLAY_RULE_ENTRY* e = (const KBLAY_RULE_ENTRY*)body + Index;
+        Entry->InMakeCode = e->InMakeCode;
+        Entry->OutMakeCode = e->OutMakeCode;
+        Entry->OutFlags = e->OutFlags;
+        inFlags = e->InFlags;
+    }
+
+    Entry->OutFlags &= (UINT8)~(KBLAY_FLAG_MACRO | KBLAY_FLAG_TAPHOLD);
+    Entry->InFlags = (UINT8)(inFlags & ~KBLAY_FLAG_SHIFT);
+    Entry->ModMask = KBLAY_MODGROUP_SHIFT;
+    Entry->ModValue = (inFlags & KBLAY_FLAG_SHIFT) ? KBLAY_MODGROUP_SHIFT : 0;
+}
+
+// v4+ macro section, right after the entries.
+static KBLAY_FORCEINLINE const UINT8* MacroSection(_In_ const KBLAY_RULE_BLOB_HEADER* Header)
+{
+    return (const UINT8*)Header + sizeof(KBLAY_RULE_BLOB_HEADER) + (size_t)Header->EntryCount * sizeof(KBLAY_RULE_ENTRY_V3);
+}
+
+// Checks the macro section and returns the offset just past it in *End.
+static BOOLEAN ValidateMacroSection(
+    _In_ const KBLAY_RULE_BLOB_HEADER* Header,
+    _In_ size_t BlobSize,
+    _Out_ UINT32* MacroCount,
+    _Out_ size_t* End)
+{
+    *MacroCount = 0;
+    *End = 0;
+
+    const UINT8* p = MacroSection(Header);
+    const size_t offset = (size_t)(p - (const UINT8*)Header);
+    if (BlobSize - offset < sizeof(KBLAY_MACRO_SECTION))
+        return FALSE;
+
+    KBLAY_MACRO_SECTION sec;
+    memcpy(&sec, p, sizeof(sec));
+    if (sec.MacroCount > KBLAY_MACRO_MAX || sec.StepCount > KBLAY_MACRO_MAX_STEPS)
+        return FALSE;
+
+    const size_t need = offset + sizeof(sec)
+        + (size_t)sec.MacroCount * sizeof(KBLAY_MACRO_DEF)
+        + (size_t)sec.StepCount * sizeof(KBLAY_MACRO_STEP);
+    if (need > BlobSize)
+        return FALSE;
+
+    const UINT8* defs = p + sizeof(sec);
+    for (UINT32 i = 0; i < sec.MacroCount; ++i)
+    {
+        KBLAY_MACRO_DEF d;
+        memcpy(&d, defs + (size_t)i * sizeof(d), sizeof(d));
+        if (d.Reserved != 0 || d.StepCount == 0 || d.StepCount > KBLAY_MACRO_MAX_EVENTS)
+            return FALSE;
+        if ((UINT32)d.FirstStep + d.StepCount > sec.StepCount)
+            return FALSE;
+    }
+
+    const UINT8* steps = defs + (size_t)sec.MacroCount * sizeof(KBLAY_MACRO_DEF);
+    for (UINT32 i = 0; i < sec.StepCount; ++i)
+    {
+        KBLAY_MACRO_STEP st;
+        memcpy(&st, steps + (size_t)i * sizeof(st), sizeof(st));
+        if (st.Reserved != 0 || (st.Flags & ~(KBLAY_FLAG_E0 | KBLAY_FLAG_E1 | KBLAY_FLAG_BREAK)) != 0)
+            return FALSE;
+        if ((st.Flags & (KBLAY_FLAG_E0 | KBLAY_FLAG_E1)) == (KBLAY_FLAG_E0 | KBLAY_FLAG_E1))
+            return FALSE;
+    }
+
+    *MacroCount = sec.MacroCount;
+    *End = need;
+    return TRUE;
+}
+
+// v5 tap-hold section at Offset; must run to the end of the blob.
+static BOOLEAN ValidateTapHoldSection(
+    _In_ const KBLAY_RULE_BLOB_HEADER* Header,
+    _In_ size_t BlobSize,
+    _In_ size_t Offset,
+    _Out_ UINT32* TapHoldCount)
+{
+    *TapHoldCount = 0;
+
+    if (BlobSize - Offset < sizeof(KBLAY_TAPHOLD_SECTION))
+        return FALSE;
+
+    const UINT8* p = (const UINT8*)Header + Offset;
+    KBLAY_TAPHOLD_SECTION sec;
+    memcpy(&sec, p, sizeof(sec));
+    if (sec.Reserved != 0 || sec.Count > KBLAY_TAPHOLD_MAX)
+        return FALSE;
+    if (Offset + sizeof(sec) + (size_t)sec.Count * sizeof(KBLAY_TAPHOLD_DEF) != BlobSize)
+        return FALSE;
+
+    for (UINT32 i = 0; i < sec.Count; ++i)
+    {
+        KBLAY_TAPHOLD_DEF d;
+        memcpy(&d, p + sizeof(sec) + (size_t)i * sizeof(d), sizeof(d));
+        if (d.HoldAfterMs == 0 || d.HoldAfterMs > KBLAY_TAPHOLD_MAX_MS)
+            return FALSE;
+        if (((d.TapFlags | d.HoldFlags) & ~(KBLAY_FLAG_E0 | KBLAY_FLAG_E1)) != 0)
+            return FALSE;
+        if ((d.TapFlags & (KBLAY_FLAG_E0 | KBLAY_FLAG_E1)) == (KBLAY_FLAG_E0 | KBLAY_FLAG_E1) ||
+            (d.HoldFlags & (KBLAY_FLAG_E0 | KBLAY_FLAG_E1)) == (KBLAY_FLAG_E0 | KBLAY_FLAG_E1))
+            return FALSE;
+    }
+
+    *TapHoldCount = sec.Count;
+    return TRUE;
+}
+
+static KBLAY_FORCEINLINE UINT32 PrefixFromRuleFlags(_In_ UINT8 Flags)
+{
+    return (Flags & KBLAY_FLAG_E1) ? 2u : ((Flags & KBLAY_FLAG_E0) ? 1u : 0u);
+}
+
+static KBLAY_FORCEINLINE BOOLEAN RuleMatches(_In_ const KBLAY_RULE_ENTRY_V3* Entry, _In_ UINT32 Groups)
+{
+    return ((Groups & Entry->ModMask) == Entry->ModValue) ? TRUE : FALSE;
+}
+
+// Partitions the modifier-group states into classes no rule can tell apart,
+// refining by each rule's condition in turn. Numbered by first state, so
+// state 0 (nothing held) is always class 0. Returns the class count.
+static UINT32 ComputeModClasses(
+    _In_ const KBLAY_RULE_BLOB_HEADER* Header,
+    _Out_writes_(KBLAY_MODGROUP_STATES) UINT8* ClassOf)
+{
+    UINT32 count = 1;
+    memset(ClassOf, 0, KBLAY_MODGROUP_STATES);
+
+    for (UINT32 i = 0; i < Header->EntryCount && count < KBLAY_MODGROUP_STATES; ++i)
+    {
+        KBLAY_RULE_ENTRY_V3 e;
+        ReadRuleEntry(Header, i, &e);
+        if ((e.ModMask & KBLAY_MODGROUP_ALL) == 0)
+            continue;
+
+        // New class per (old class, matches) pair, in state order.
+        UINT8 split[KBLAY_MODGROUP_STATES][2];
+        UINT8 next[KBLAY_MODGROUP_STATES];
+        UINT32 newCount = 0;
+        memset(split, 0xFF, sizeof(split));
+
+        for (UINT32 g = 0; g < KBLAY_MODGROUP_STATES; ++g)
+        {
+            UINT8* slot = &split[ClassOf[g]][RuleMatches(&e, g) ? 1 : 0];
+            if (*slot == 0xFF)
+                *slot = (UINT8)newCount++;
+            next[g] = *slot;
+        }
+
+        memcpy(ClassOf, next, KBLAY_MODGROUP_STATES);
+        count = newCount;
+    }
+    return count;
+}
+
+// Lowest state in each class, to evaluate conditions against.
+static VOID ClassRepresentatives(
+    _In_reads_(KBLAY_MODGROUP_STATES) const UINT8* ClassOf,
+    _In_ UINT32 ClassCount,
+    _Out_writes_(KBLAY_RULE_MOD_CLASSES) UINT8* Rep)
+{
+    memset(Rep, 0, KBLAY_RULE_MOD_CLASSES);
+    for (UINT32 g = KBLAY_MODGROUP_STATES; g-- > 0;)
+    {
+        if (ClassOf[g] < ClassCount && ClassOf[g] < KBLAY_RULE_MOD_CLASSES)
+            Rep[ClassOf[g]] = (UINT8)g;
+    }
+}
+
+// TRUE if `In` was a modifier key (and Mods may have changed).
+static BOOLEAN ApplyModifierKey(_Inout_ KBLAY_ENGINE_MODS* Mods, _In_ const KBLAY_KEY_EVENT* In)
+{
+    const BOOLEAN brk = IsKeyBreak(In);
+    const BOOLEAN e0 = IsE0(In);
+    const BOOLEAN e1 = IsE1(In);
+    const USHORT mc = In->MakeCode;
+
+    // Ignore E1-prefixed sequences (e.g., Pause/Break) to avoid corrupting Ctrl state.
+    if (e1)
+        return FALSE;
+
+    // Shift (set-1; no E0)
+    if (!e0 && mc == KBLAY_MAKE_LSHIFT)
+    {
+        Mods->PhysLShift = brk ? FALSE : TRUE;
+        return TRUE;
+    }
+    if (!e0 && mc == KBLAY_MAKE_RSHIFT)
+    {
+        Mods->PhysRShift = brk ? FALSE : TRUE;
+        return TRUE;
+    }
+
+    // Ctrl (E0 distinguishes right)
+    if (mc == KBLAY_MAKE_CTRL)
+    {
+        if (e0) Mods->PhysRCtrl = brk ? FALSE : TRUE;
+        else    Mods->PhysLCtrl = brk ? FALSE : TRUE;
+        return TRUE;
+    }
+
+    // Alt (E0 distinguishes right alt / AltGr)
+    if (mc == KBLAY_MAKE_ALT)
+    {
+        if (e0) Mods->PhysRAlt = brk ? FALSE : TRUE;
+        else    Mods->PhysLAlt = brk ? FALSE : TRUE;
+        return TRUE;
+    }
+
+    // Win (typically E0, but be permissive)
+    if (mc == KBLAY_MAKE_LWIN)
+    {
+        Mods->PhysLWin = brk ? FALSE : TRUE;
+        return TRUE;
+    }
+    if (mc == KBLAY_MAKE_RWIN)
+    {
+        Mods->PhysRWin = brk ? FALSE : TRUE;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static KBLAY_FORCEINLINE UINT8 ModGroupsOf(_In_ const KBLAY_ENGINE_MODS* Mods)
+{
+    return (UINT8)(
+        ((Mods->PhysLShift || Mods->PhysRShift) ? KBLAY_MODGROUP_SHIFT : 0) |
+        ((Mods->PhysLCtrl || Mods->PhysRCtrl) ? KBLAY_MODGROUP_CTRL : 0) |
+        ((Mods->PhysLAlt || Mods->PhysRAlt) ? KBLAY_MODGROUP_ALT : 0) |
+        ((Mods->PhysLWin || Mods->PhysRWin) ? KBLAY_MODGROUP_WIN : 0));
+}
+
+// KBLAY_MOD_* bits to KBLAY_MODGROUP_*: either side of a pair holds its group.
+static KBLAY_FORCEINLINE UINT8 ModGroupsOfBits(_In_ UINT8 Bits)
+{
+    const UINT32 pairs = (Bits | (Bits >> 1)) & 0x55u;
+    return (UINT8)((pairs & 1u) | ((pairs >> 1) & 2u) | ((pairs >> 2) & 4u) | ((pairs >> 3) & 8u));
+}
+
+static VOID PublishMods(_Inout_ KBLAY_ENGINE* Engine)
+{
+    const UINT8 bits = KbdLayEngineModsToBits(&Engine->Mods);
+    KbdLayModSharePublish(Engine->Share, Engine->Published, bits);
+    Engine->Published = bits;
+}
+
+static KBLAY_FORCEINLINE VOID UpdatePhysicalMods(_Inout_ KBLAY_ENGINE* Engine, _In_ const KBLAY_KEY_EVENT* In)
+{
+    // Groups only change on modifier keys; keep them cached for the lookup.
+    if (ApplyModifierKey(&Engine->Mods, In))
+    {
+        Engine->Mods.Groups = ModGroupsOf(&Engine->Mods);
+        if (Engine->Share != NULL)
+            PublishMods(Engine);
+    }
+}
+
+// Groups the rule lookup goes by: this engine's own, or the pool's, which
+// other devices change without telling us.
+static KBLAY_FORCEINLINE UINT8 LookupGroups(_In_ const KBLAY_ENGINE* Engine)
+{
+    if (Engine->Share == NULL)
+        return Engine->Mods.Groups;
+    return ModGroupsOfBits(KbdLayModShareRead(Engine->Share));
+}
+
+static VOID MakeSyntheticShift(
+    _Out_ KBLAY_KEY_EVENT* Out,
+    _In_ const KBLAY_KEY_EVENT* Ref,
+    _In_ BOOLEAN Down)
+{
+    *Out = *Ref;
+    Out->MakeCode = KBLAY_MAKE_LSHIFT; // choose left shift for synthesis
+    Out->Flags = Ref->Flags;
+
+    // Ensure no extended flags on synthetic shift.
+    Out->Flags &= (USHORT)~(KBLAY_KEY_E0 | KBLAY_KEY_E1);
+
+    if (Down) Out->Flags &= (USHORT)~KBLAY_KEY_BREAK;
+    else      Out->Flags |= KBLAY_KEY_BREAK;
+}
+
+// Make: the macro's steps, each based on `In` (UnitId, ExtraInformation).
+// Break: nothing. Either way the key itself is swallowed.
+static size_t EmitMacro(
+    _In_ const KBLAY_RULE_TABLE* Table,
+    _In_ UINT16 Index,
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap,
+    _Out_ KBLAY_ENGINE_RESULT* Result)
+{
+    if (Index >= Table->MacroCount || Table->Macros[Index].StepCount > OutCap)
+    {
+        Out[0] = *In;
+        *Result = KBLAY_ENGINE_UNMAPPED;
+        return 1;
+    }
+
+    *Result = KBLAY_ENGINE_MACRO;
+    if (IsKeyBreak(In))
+        return 0;
+
+    const KBLAY_MACRO_DEF m = Table->Macros[Index];
+    const KBLAY_MACRO_STEP* step = &Table->MacroSteps[m.FirstStep];
+    const USHORT keep = (USHORT)(In->Flags & ~(KBLAY_KEY_BREAK | KBLAY_KEY_E0 | KBLAY_KEY_E1));
+
+    for (UINT32 i = 0; i < m.StepCount; ++i)
+    {
+        Out[i] = *In;
+        Out[i].MakeCode = step[i].MakeCode;
+        Out[i].Flags = (USHORT)(keep |
+            ((step[i].Flags & KBLAY_FLAG_E0) ? KBLAY_KEY_E0 : 0) |
+            ((step[i].Flags & KBLAY_FLAG_E1) ? KBLAY_KEY_E1 : 0) |
+            ((step[i].Flags & KBLAY_FLAG_BREAK) ? KBLAY_KEY_BREAK : 0));
+    }
+    return m.StepCount;
+}
+
+// Bounded output cursor; events past Cap are lost (callers size for the worst case).
+typedef struct KBLAY_EMIT
+{
+    KBLAY_KEY_EVENT* Out;
+    size_t Cap;
+    size_t Count;
+} KBLAY_EMIT;
+
+static VOID EmitKey(
+    _Inout_ KBLAY_EMIT* Emit,
+    _In_ const KBLAY_KEY_EVENT* Ref,
+    _In_ USHORT MakeCode,
+    _In_ UINT8 RuleFlags,
+    _In_ BOOLEAN Break)
+{
+    if (Emit->Count >= Emit->Cap)
+        return;
+
+    KBLAY_KEY_EVENT* e = &Emit->Out[Emit->Count++];
+    *e = *Ref;
+    e->MakeCode = MakeCode;
+    e->Flags = (USHORT)((Ref->Flags & ~(KBLAY_KEY_BREAK | KBLAY_KEY_E0 | KBLAY_KEY_E1)) |
+        ((RuleFlags & KBLAY_FLAG_E0) ? KBLAY_KEY_E0 : 0) |
+        ((RuleFlags & KBLAY_FLAG_E1) ? KBLAY_KEY_E1 : 0) |
+        (Break ? KBLAY_KEY_BREAK : 0));
+}
+
+static VOID Hold(_Inout_ KBLAY_TAPHOLD_STATE* TapHold, _Inout_ KBLAY_TAPHOLD_SLOT* Slot, _Inout_ KBLAY_EMIT* Emit)
+{
+    KbdLayWheelCancel(&TapHold->Wheel, &Slot->Timer);
+    Slot->Phase = KBLAY_TAPHOLD_HELD;
+    TapHold->Holds++;
+    EmitKey(Emit, &Slot->Key, Slot->Def.HoldMakeCode, Slot->Def.HoldFlags, FALSE);
+}
+
+typedef struct KBLAY_FIRE_CONTEXT
+{
+    KBLAY_TAPHOLD_STATE* TapHold;
+    KBLAY_EMIT* Emit;
+    UINT64 Target;    // the time being advanced to
+} KBLAY_FIRE_CONTEXT;
+
+static VOID OnHoldTimer(_Inout_ VOID* Context, _Inout_ KBLAY_TIMER* Timer, _In_ UINT64 Now)
+{
+    (void)Now;
+
+    KBLAY_FIRE_CONTEXT* fc = (KBLAY_FIRE_CONTEXT*)Context;
+    KBLAY_TAPHOLD_SLOT* slot = (KBLAY_TAPHOLD_SLOT*)Timer;
+    if (slot->Phase != KBLAY_TAPHOLD_PENDING)
+        return;
+
+    const UINT64 late = fc->Target - Timer->Expires;
+    if (late > fc->TapHold->MaxLateMs)
+        fc->TapHold->MaxLateMs = late > 0xFFFFFFFFull ? 0xFFFFFFFFu : (UINT32)late;
+
+    Hold(fc->TapHold, slot, fc->Emit);
+}
+
+static KBLAY_FORCEINLINE VOID AdvanceClock(_Inout_ KBLAY_TAPHOLD_STATE* TapHold, _In_ UINT64 NowMs, _Inout_ KBLAY_EMIT* Emit)
+{
+    if (TapHold->Wheel.Armed == 0)
+    {
+        // Keep the clock current so arming is relative to now.
+        if (NowMs > TapHold->Wheel.Now)
+            TapHold->Wheel.Now = NowMs;
+        return;
+    }
+
+    KBLAY_FIRE_CONTEXT fc = { TapHold, Emit, NowMs };
+    KbdLayWheelAdvance(&TapHold->Wheel, NowMs, OnHoldTimer, &fc);
+}
+
+static KBLAY_TAPHOLD_SLOT* FindTapHoldSlot(_Inout_ KBLAY_TAPHOLD_STATE* TapHold, _In_ const KBLAY_KEY_EVENT* In)
+{
+    const USHORT prefix = (USHORT)(In->Flags & (KBLAY_KEY_E0 | KBLAY_KEY_E1));
+    for (UINT32 i = 0; i < KBLAY_TAPHOLD_MAX_ACTIVE; ++i)
+    {
+        KBLAY_TAPHOLD_SLOT* slot = &TapHold->Slots[i];
+        if (slot->Phase != KBLAY_TAPHOLD_IDLE &&
+            slot->Key.MakeCode == In->MakeCode &&
+            (slot->Key.Flags & (KBLAY_KEY_E0 | KBLAY_KEY_E1)) == prefix)
+            return slot;
+    }
+    return NULL;
+}
+
+// The dual-role key itself, while in flight: repeats and its release.
+static VOID ContinueTapHold(
+    _Inout_ KBLAY_TAPHOLD_STATE* TapHold,
+    _Inout_ KBLAY_TAPHOLD_SLOT* Slot,
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Inout_ KBLAY_EMIT* Emit)
+{
+    const BOOLEAN brk = IsKeyBreak(In);
+
+    if (Slot->Phase == KBLAY_TAPHOLD_HELD)
+    {
+        // Repeats keep the hold key repeating.
+        EmitKey(Emit, In, Slot->Def.HoldMakeCode, Slot->Def.HoldFlags, brk);
+    }
+    else if (brk)
+    {
+        // Released before HoldAfterMs: a tap.
+        KbdLayWheelCancel(&TapHold->Wheel, &Slot->Timer);
+        TapHold->Taps++;
+        EmitKey(Emit, &Slot->Key, Slot->Def.TapMakeCode, Slot->Def.TapFlags, FALSE);
+        EmitKey(Emit, In, Slot->Def.TapMakeCode, Slot->Def.TapFlags, TRUE);
+    }
+    // else: a repeat while pending is swallowed.
+
+    if (brk)
+    {
+        Slot->Phase = KBLAY_TAPHOLD_IDLE;
+        TapHold->Active--;
+    }
+}
+
+static VOID HoldAllPending(_Inout_ KBLAY_TAPHOLD_STATE* TapHold, _Inout_ KBLAY_EMIT* Emit)
+{
+    for (;;)
+    {
+        KBLAY_TAPHOLD_SLOT* first = NULL;
+        for (UINT32 i = 0; i < KBLAY_TAPHOLD_MAX_ACTIVE; ++i)
+        {
+            KBLAY_TAPHOLD_SLOT* slot = &TapHold->Slots[i];
+            if (slot->Phase == KBLAY_TAPHOLD_PENDING && (!first || (INT32)(slot->PressSeq - first->PressSeq) < 0))
+                first = slot;
+        }
+        if (!first)
+            return;
+        Hold(TapHold, first, Emit);
+    }
+}
+
+// What an engine without rules looks up: every modifier state in class 0,
+// every cell invalid.
+static const KBLAY_RULE_TABLE g_EmptyRuleTable = { 0 };
+
+VOID KbdLayEngineInit(_Out_ KBLAY_ENGINE* Engine)
+{
+    memset(Engine, 0, sizeof(*Engine));
+    Engine->Table = &g_EmptyRuleTable;
+}
+
+static VOID ResetDebounce(_Inout_ KBLAY_DEBOUNCE_STATE* Debounce, _In_ UINT64 NowMs)
+{
+    // Every key starts released long ago, as far as the window can tell.
+    const UINT32 longAgo = (UINT32)NowMs - 0x80000000u;
+
+    memset(Debounce->Swallowed, 0, sizeof(Debounce->Swallowed));
+    for (UINT32 i = 0; i < KBLAY_DEBOUNCE_KEYS; ++i)
+    {
+        Debounce->LastBreakMs[i][0] = longAgo;
+        Debounce->LastBreakMs[i][1] = longAgo;
+    }
+}
+
+VOID KbdLayEngineResetState(_Inout_ KBLAY_ENGINE* Engine, _In_ UINT64 NowMs)
+{
+    memset(&Engine->Mods, 0, sizeof(Engine->Mods));
+    if (Engine->Share != NULL)
+        PublishMods(Engine);
+    memset(&Engine->TapHold, 0, sizeof(Engine->TapHold));
+    KbdLayWheelInit(&Engine->TapHold.Wheel, NowMs);
+    ResetDebounce(&Engine->Debounce, NowMs);
+}
+
+VOID KbdLayEngineSetDebounce(_Inout_ KBLAY_ENGINE* Engine, _In_ UINT32 WindowMs, _In_ UINT64 NowMs)
+{
+    Engine->Debounce.WindowMs = WindowMs < KBLAY_DEBOUNCE_MAX_MS ? WindowMs : KBLAY_DEBOUNCE_MAX_MS;
+    ResetDebounce(&Engine->Debounce, NowMs);
+    Engine->ChainKey = 0;
+}
+
+VOID KbdLayEngineSetModShare(_Inout_ KBLAY_ENGINE* Engine, _In_opt_ KBLAY_MOD_SHARE* Share)
+{
+    if (Engine->Share != NULL)
+        KbdLayModSharePublish(Engine->Share, Engine->Published, 0);
+    Engine->Published = 0;
+    Engine->Share = Share;
+    if (Share != NULL)
+        PublishMods(Engine);
+}
+
+BOOLEAN KbdLayEngineValidateRuleBlob(
+    _In_reads_bytes_(BlobSize) const VOID* Blob,
+    _In_ size_t BlobSize,
+    _In_ UINT32 MaxEntries,
+    _In_ size_t MaxBlobBytes)
+{
+    if (Blob == NULL)
+        return FALSE;
+
+    if (BlobSize < sizeof(KBLAY_RULE_BLOB_HEADER) || BlobSize > MaxBlobBytes)
+        return FALSE;
+
+    const KBLAY_RULE_BLOB_HEADER* h = (const KBLAY_RULE_BLOB_HEADER*)Blob;
+
+    // Expect: Version / Reserved / TotalSizeBytes / EntryCount
+    if ((h->Version != KBLAY_RULE_BLOB_VERSION &&
+         h->Version != KBLAY_RULE_BLOB_VERSION_2 &&
+         h->Version != KBLAY_RULE_BLOB_VERSION_3 &&
+         h->Version != KBLAY_RULE_BLOB_VERSION_4 &&
+         h->Version != KBLAY_RULE_BLOB_VERSION_5) || h->Reserved != 0)
+        return FALSE;
+
+    if (h->TotalSizeBytes != (UINT32)BlobSize)
+        return FALSE;
+
+    if (h->EntryCount > MaxEntries)
+        return FALSE;
+
+    const size_t headerBytes = sizeof(KBLAY_RULE_BLOB_HEADER);
+    const size_t entryBytes = RuleEntrySize(h->Version);
+
+    const size_t maxEntriesBySize = (BlobSize - headerBytes) / entryBytes;
+    if ((size_t)h->EntryCount > maxEntriesBySize)
+        return FALSE;
+
+    UINT32 macroCount = 0;
+    UINT32 tapHoldCount = 0;
+    if (h->Version >= KBLAY_RULE_BLOB_VERSION_4)
+    {
+        size_t end = 0;
+        if (!ValidateMacroSection(h, BlobSize, &macroCount, &end))
+            return FALSE;
+        if (h->Version == KBLAY_RULE_BLOB_VERSION_4 && end != BlobSize)
+            return FALSE;
+        if (h->Version == KBLAY_RULE_BLOB_VERSION_5 && !ValidateTapHoldSection(h, BlobSize, end, &tapHoldCount))
+            return FALSE;
+    }
+    else
+    {
+        const size_t need = headerBytes + (size_t)h->EntryCount * entryBytes;
+        if (need != BlobSize)
+            return FALSE;
+    }
+
+    if (h->Version == KBLAY_RULE_BLOB_VERSION)
+        return TRUE;
+
+    const UINT8* body = (const UINT8*)Blob + headerBytes;
+    for (UINT32 i = 0; i < h->EntryCount; ++i)
+    {
+        KBLAY_RULE_ENTRY_V3 e;
+        ReadRuleEntry(h, i, &e);
+
+        if (h->Version == KBLAY_RULE_BLOB_VERSION_2)
+        {
+            KBLAY_RULE_ENTRY_V2 raw;
+            memcpy(&raw, body + (size_t)i * sizeof(raw), sizeof(raw));
+            if (raw.Reserved0 != 0 || raw.Reserved1 != 0)
+                return FALSE;
+        }
+        else
+        {
+            if ((e.InFlags & KBLAY_FLAG_SHIFT) != 0)
+                return FALSE;
+            if ((e.ModMask & ~KBLAY_MODGROUP_ALL) != 0 || (e.ModValue & ~e.ModMask) != 0)
+                return FALSE;
+        }
+
+        if ((e.InFlags & (KBLAY_FLAG_E0 | KBLAY_FLAG_E1)) == (KBLAY_FLAG_E0 | KBLAY_FLAG_E1))
+            return FALSE;
+        if ((e.OutFlags & (KBLAY_FLAG_E0 | KBLAY_FLAG_E1)) == (KBLAY_FLAG_E0 | KBLAY_FLAG_E1))
+            return FALSE;
+        if ((e.OutFlags & KBLAY_FLAG_MACRO) && e.OutMakeCode >= macroCount)
+            return FALSE;
+        if ((e.OutFlags & KBLAY_FLAG_TAPHOLD) && e.OutMakeCode >= tapHoldCount)
+            return FALSE;
+        if ((e.OutFlags & (KBLAY_FLAG_MACRO | KBLAY_FLAG_TAPHOLD)) == (KBLAY_FLAG_MACRO | KBLAY_FLAG_TAPHOLD))
+            return FALSE;
+    }
+
+    UINT8 classOf[KBLAY_MODGROUP_STATES];
+    const UINT32 classes = ComputeModClasses(h, classOf);
+    if (classes > KBLAY_RULE_MOD_CLASSES)
+        return FALSE;
+
+    UINT8 rep[KBLAY_RULE_MOD_CLASSES];
+    ClassRepresentatives(classOf, classes, rep);
+
+    // Number of high pages the build would need, one bit per (class, prefix, page).
+    UINT8 pageSeen[(KBLAY_RULE_MOD_CLASSES * KBLAY_RULE_PREFIXES * 256) / 8];
+    UINT32 pages = 0;
+    memset(pageSeen, 0, sizeof(pageSeen));
+
+    for (UINT32 i = 0; i < h->EntryCount; ++i)
+    {
+        KBLAY_RULE_ENTRY_V3 e;
+        ReadRuleEntry(h, i, &e);
+        if (e.InMakeCode <= 0xFF)
+            continue;
+
+        for (UINT32 c = 0; c < classes; ++c)
+        {
+            if (!RuleMatches(&e, rep[c]))
+                continue;
+
+            const UINT32 bit = (c * KBLAY_RULE_PREFIXES + PrefixFromRuleFlags(e.InFlags)) * 256u
+                + (UINT32)(e.InMakeCode >> 8);
+            if (pageSeen[bit / 8] & (1u << (bit % 8)))
+                continue;
+            pageSeen[bit / 8] |= (UINT8)(1u << (bit % 8));
+            if (++pages > KBLAY_RULE_HIGH_PAGES)
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+VOID KbdLayEngineBuildRuleTable(
+    _In_reads_bytes_(BlobSize) const VOID* Blob,
+    _In_ size_t BlobSize,
+    _Out_ KBLAY_RULE_TABLE* Table)
+{
+    (void)BlobSize;
+
+    const KBLAY_RULE_BLOB_HEADER* h = (const KBLAY_RULE_BLOB_HEADER*)Blob;
+
+    memset(Table, 0, sizeof(*Table));
+
+    // Validation caps the class count; stay in bounds regardless.
+    UINT32 classes = ComputeModClasses(h, Table->ModClass);
+    if (classes > KBLAY_RULE_MOD_CLASSES)
+    {
+        classes = 1;
+        memset(Table->ModClass, 0, sizeof(Table->ModClass));
+    }
+    Table->ClassCount = classes;
+
+    UINT8 rep[KBLAY_RULE_MOD_CLASSES];
+    ClassRepresentatives(Table->ModClass, classes, rep);
+
+    const UINT8 allowedIn = (UINT8)(KBLAY_FLAG_E0 | KBLAY_FLAG_E1);
+    const UINT8 allowedOut = (UINT8)(KBLAY_FLAG_E0 | KBLAY_FLAG_E1 | KBLAY_FLAG_SHIFT | KBLAY_FLAG_MACRO | KBLAY_FLAG_TAPHOLD);
+
+    // Per class: some remap cell wants Shift down / up in its output.
+    BOOLEAN shiftOut[KBLAY_RULE_MOD_CLASSES] = { 0 };
+    BOOLEAN plainOut[KBLAY_RULE_MOD_CLASSES] = { 0 };
+
+    if (h->Version >= KBLAY_RULE_BLOB_VERSION_4)
+    {
+        const UINT8* p = MacroSection(h);
+        KBLAY_MACRO_SECTION sec;
+        memcpy(&sec, p, sizeof(sec));
+
+        // Validation caps both counts; stay in bounds regardless.
+        if (sec.MacroCount <= KBLAY_MACRO_MAX && sec.StepCount <= KBLAY_MACRO_MAX_STEPS)
+        {
+            p += sizeof(sec);
+            memcpy(Table->Macros, p, (size_t)sec.MacroCount * sizeof(KBLAY_MACRO_DEF));
+            p += (size_t)sec.MacroCount * sizeof(KBLAY_MACRO_DEF);
+            memcpy(Table->MacroSteps, p, (size_t)sec.StepCount * sizeof(KBLAY_MACRO_STEP));
+            p += (size_t)sec.StepCount * sizeof(KBLAY_MACRO_STEP);
+            Table->MacroCount = sec.MacroCount;
+
+            if (h->Version == KBLAY_RULE_BLOB_VERSION_5)
+            {
+                KBLAY_TAPHOLD_SECTION th;
+                memcpy(&th, p, sizeof(th));
+                if (th.Count <= KBLAY_TAPHOLD_MAX)
+                {
+                    memcpy(Table->TapHolds, p + sizeof(th), (size_t)th.Count * sizeof(KBLAY_TAPHOLD_DEF));
+                    Table->TapHoldCount = th.Count;
+                }
+            }
+        }
+    }
+
+    for (UINT32 i = 0; i < h->EntryCount; ++i)
+    {
+        KBLAY_RULE_ENTRY_V3 e;
+        ReadRuleEntry(h, i, &e);
+
+        const UINT32 prefix = PrefixFromRuleFlags((UINT8)(e.InFlags & allowedIn));
+
+        for (UINT32 c = 0; c < classes; ++c)
+        {
+            if (!RuleMatches(&e, rep[c]))
+                continue;
+
+            KBLAY_RULE_CELL* cell;
+            if (e.InMakeCode <= 0xFF)
+            {
+                cell = &Table->Low[c][prefix][e.InMakeCode];
+            }
+            else
+            {
+                UINT8* dir = &Table->HighDir[c][prefix][e.InMakeCode >> 8];
+                if (*dir == 0)
+                {
+                    // Validation caps the page count; stay in bounds regardless.
+                    if (Table->HighPageCount >= KBLAY_RULE_HIGH_PAGES)
+                        continue;
+                    *dir = (UINT8)++Table->HighPageCount;
+                }
+                cell = &Table->High[*dir - 1][e.InMakeCode & 0xFF];
+            }
+
+            // First matching rule wins.
+            if (cell->Valid)
+                continue;
+
+            cell->OutMakeCode = e.OutMakeCode;
+            cell->OutFlags = (UINT8)(e.OutFlags & allowedOut);
+            cell->Valid = 1;
+
+            if (cell->OutFlags & KBLAY_FLAG_MACRO)
+                Table->Stages |= KBLAY_STAGE_MACRO;
+            else if (cell->OutFlags & KBLAY_FLAG_TAPHOLD)
+                Table->Stages |= KBLAY_STAGE_TAPHOLD;
+            else if (cell->OutMakeCode != 0 && (cell->OutFlags & KBLAY_FLAG_SHIFT))
+                shiftOut[c] = TRUE;
+            else if (cell->OutMakeCode != 0)
+                plainOut[c] = TRUE;
+        }
+    }
+
+    // Shift synthesis is needed if some modifier state reaches a cell whose
+    // Shift differs from the physical one.
+    for (UINT32 g = 0; g < KBLAY_MODGROUP_STATES; ++g)
+    {
+        const UINT8 c = Table->ModClass[g];
+        if ((g & KBLAY_MODGROUP_SHIFT) ? plainOut[c] : shiftOut[c])
+            Table->Stages |= KBLAY_STAGE_SHIFT;
+    }
+}
+
+// Starts a dual-role key on its make. The key is swallowed until it resolves.
+static size_t BeginTapHold(
+    _Inout_ KBLAY_ENGINE* Engine,
+    _In_ UINT16 Index,
+    _In_ UINT64 NowMs,
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Out_writes_(1) KBLAY_KEY_EVENT* Out,
+    _Out_ KBLAY_ENGINE_RESULT* Result)
+{
+    KBLAY_TAPHOLD_STATE* th = &Engine->TapHold;
+    KBLAY_TAPHOLD_SLOT* slot = NULL;
+    for (UINT32 i = 0; i < KBLAY_TAPHOLD_MAX_ACTIVE && !slot; ++i)
+    {
+        if (th->Slots[i].Phase == KBLAY_TAPHOLD_IDLE)
+            slot = &th->Slots[i];
+    }
+
+    // A break we never saw go down (rules changed), an unknown definition, or
+    // too many keys in flight: let the key through untouched.
+    if (IsKeyBreak(In) || Index >= Engine->Table->TapHoldCount || slot == NULL)
+    {
+        Out[0] = *In;
+        *Result = KBLAY_ENGINE_UNMAPPED;
+        return 1;
+    }
+
+    slot->Key = *In;
+    slot->Def = Engine->Table->TapHolds[Index];
+    slot->Phase = KBLAY_TAPHOLD_PENDING;
+    slot->PressSeq = th->PressSeq++;
+    th->Active++;
+    KbdLayWheelArm(&th->Wheel, &slot->Timer, NowMs + slot->Def.HoldAfterMs);
+
+    *Result = KBLAY_ENGINE_TAPHOLD;
+    return 0;
+}
+
+// The event pipeline. Every chain runs the modifier tracker; the stage mask
+// adds, in order:
+//   TAPHOLD  the clock, dual-role keys in flight, holds forced by another key
+//   KEYMAP   rule lookup (ACTIVE with the REMAP role)
+//   MACRO    macro cells, inside KEYMAP
+//   SHIFT    shift synthesis, inside KEYMAP
+// RunChain is instantiated once per mask with the mask as a constant, so a
+// stage that is off compiles away, once for a single event and once inside
+// the batch loop. KbdLayEngineProcess(Batch) calls the variant picked by
+// ConfigureChain, which runs only when the inputs to the mask change.
+// Statistics are the caller's stage, driven by the results.
+
+// TRUE if In is chatter to drop. Keys above the tracked range and E1
+// sequences always pass.
+static KBLAY_FORCEINLINE BOOLEAN DebounceStage(
+    _Inout_ KBLAY_DEBOUNCE_STATE* Debounce,
+    _In_ UINT64 NowMs,
+    _In_ const KBLAY_KEY_EVENT* In)
+{
+    if (In->MakeCode >= KBLAY_DEBOUNCE_KEYS || IsE1(In))
+        return FALSE;
+
+    const UINT32 e0 = IsE0(In) ? 1u : 0u;
+    const UINT32 key = ((UINT32)In->MakeCode << 1) | e0;
+    const UINT32 bit = 1u << (key & 31);
+    UINT32* swallowed = &Debounce->Swallowed[key >> 5];
+    UINT32* lastBreak = &Debounce->LastBreakMs[In->MakeCode][e0];
+    const UINT32 now = (UINT32)NowMs;
+
+    if (IsKeyBreak(In))
+    {
+        // A bouncing release keeps pushing the window out.
+        *lastBreak = now;
+        if (*swallowed & bit)
+        {
+            *swallowed &= ~bit;
+            return TRUE;
+        }
+        return FALSE;
+    }
+
+    if (now - *lastBreak < Debounce->WindowMs)
+    {
+        *swallowed |= bit;
+        return TRUE;
+    }
+    // Typematic repeats land here too, so a dropped make's key recovers
+    // with its first repeat.
+    *swallowed &= ~bit;
+    return FALSE;
+}
+
+static KBLAY_FORCEINLINE size_t PassStage(
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap)
+{
+    if (OutCap < 1)
+        return 0;
+    Out[0] = *In;
+    return 1;
+}
+
+static KBLAY_FORCEINLINE size_t KeymapStage(
+    _Inout_ KBLAY_ENGINE* Engine,
+    _In_ const UINT32 Stages,
+    _In_ UINT64 NowMs,
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap,
+    _Out_ KBLAY_ENGINE_RESULT* Result)
+{
+    if (OutCap < 1)
+        return 0;
+
+    const UINT8 groups = LookupGroups(Engine);
+    const BOOLEAN physShift = (groups & KBLAY_MODGROUP_SHIFT) ? TRUE : FALSE;
+    const KBLAY_RULE_CELL cell = FindCell(Engine->Table, Engine->Table->ModClass[groups], PrefixIndex(In), In->MakeCode);
+
+    if ((Stages & KBLAY_STAGE_MACRO) && cell.Valid && (cell.OutFlags & KBLAY_FLAG_MACRO))
+        return EmitMacro(Engine->Table, cell.OutMakeCode, In, Out, OutCap, Result);
+
+    if ((Stages & KBLAY_STAGE_TAPHOLD) && cell.Valid && (cell.OutFlags & KBLAY_FLAG_TAPHOLD))
+        return BeginTapHold(Engine, cell.OutMakeCode, NowMs, In, Out, Result);
+
+    // With its stage off, a macro or tap-hold cell passes unmapped.
+    if (!cell.Valid || cell.OutMakeCode == 0 || (cell.OutFlags & (KBLAY_FLAG_MACRO | KBLAY_FLAG_TAPHOLD)))
+    {
+        Out[0] = *In;
+        *Result = KBLAY_ENGINE_UNMAPPED;
+        return 1;
+    }
+
+    // Build the remapped event
+    KBLAY_KEY_EVENT mapped = *In;
+    mapped.MakeCode = cell.OutMakeCode;
+
+    // The rule decides the prefix; preserve BREAK and any other bits.
+    mapped.Flags &= (USHORT)~(KBLAY_KEY_E0 | KBLAY_KEY_E1);
+    if (cell.OutFlags & KBLAY_FLAG_E0) mapped.Flags |= KBLAY_KEY_E0;
+    if (cell.OutFlags & KBLAY_FLAG_E1) mapped.Flags |= KBLAY_KEY_E1;
+
+    // Shift-handling policy:
+    // We interpret KBLAY_FLAG_SHIFT in OutFlags as "emit the output as if Shift is held".
+    const BOOLEAN outShiftWanted = (cell.OutFlags & KBLAY_FLAG_SHIFT) ? TRUE : FALSE;
+
+    *Result = KBLAY_ENGINE_REMAP;
+
+    // Never synthesize shift around actual Shift key events (avoid weirdness),
+    // and skip the toggle when the shift state already matches or there is
+    // no room for it (best-effort: just emit mapped). Without the SHIFT
+    // stage the table has no cell where they differ.
+    if (!(Stages & KBLAY_STAGE_SHIFT) ||
+        IsShiftMakeCode(In->MakeCode) || IsE1(In) || physShift == outShiftWanted || OutCap < 3)
+    {
+        Out[0] = mapped;
+        return 1;
+    }
+
+    if (outShiftWanted && !physShift)
+    {
+        // Shift DOWN -> key -> Shift UP
+        MakeSyntheticShift(&Out[0], In, TRUE);
+        Out[1] = mapped;
+        MakeSyntheticShift(&Out[2], In, FALSE);
+    }
+    else
+    {
+        // physShift == TRUE && outShiftWanted == FALSE
+        // Shift UP -> key -> Shift DOWN
+        MakeSyntheticShift(&Out[0], In, FALSE);
+        Out[1] = mapped;
+        MakeSyntheticShift(&Out[2], In, TRUE);
+    }
+
+    *Result = KBLAY_ENGINE_REMAP_TOGGLE;
+    return 3;
+}
+
+static KBLAY_FORCEINLINE size_t RunChain(
+    _Inout_ KBLAY_ENGINE* Engine,
+    _In_ const UINT32 Stages,
+    _In_ UINT64 NowMs,
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap,
+    _Out_ KBLAY_ENGINE_RESULT* Result)
+{
+    *Result = KBLAY_ENGINE_PASS;
+
+    if (OutCap < 1)
+        return 0;
+
+    size_t emitted = 0;
+
+    if (Stages & KBLAY_STAGE_TAPHOLD)
+    {
+        KBLAY_EMIT emit = { Out, OutCap, 0 };
+        KBLAY_TAPHOLD_STATE* th = &Engine->TapHold;
+
+        // Holds that came due since the last event go out ahead of it.
+        AdvanceClock(th, NowMs, &emit);
+
+        if ((Stages & KBLAY_STAGE_DEBOUNCE) && DebounceStage(&Engine->Debounce, NowMs, In))
+        {
+            *Result = KBLAY_ENGINE_DEBOUNCED;
+            return emit.Count;
+        }
+
+        UpdatePhysicalMods(Engine, In);
+
+        if (th->Active != 0)
+        {
+            // Dual-role keys in flight finish in any state, so none is left down.
+            KBLAY_TAPHOLD_SLOT* slot = FindTapHoldSlot(th, In);
+            if (slot)
+            {
+                ContinueTapHold(th, slot, In, &emit);
+                *Result = KBLAY_ENGINE_TAPHOLD;
+                return emit.Count;
+            }
+
+            // Another key going down decides pending keys as holds.
+            if (!IsKeyBreak(In))
+                HoldAllPending(th, &emit);
+        }
+
+        emitted = emit.Count;
+    }
+    else
+    {
+        if ((Stages & KBLAY_STAGE_DEBOUNCE) && DebounceStage(&Engine->Debounce, NowMs, In))
+        {
+            *Result = KBLAY_ENGINE_DEBOUNCED;
+            return 0;
+        }
+
+        // Every state keeps modifier tracking current so a later transition to ACTIVE is correct.
+        UpdatePhysicalMods(Engine, In);
+    }
+
+    if (Stages & KBLAY_STAGE_KEYMAP)
+        return emitted + KeymapStage(Engine, Stages, NowMs, In, Out + emitted, OutCap - emitted, Result);
+
+    // Hard/soft bypass, and ACTIVE with a non-remap role (treated as soft bypass for safety).
+    return emitted + PassStage(In, Out + emitted, OutCap - emitted);
+}
+
+static KBLAY_FORCEINLINE size_t RunBatch(
+    _Inout_ KBLAY_ENGINE* Engine,
+    _In_ const UINT32 Stages,
+    _In_ UINT64 NowMs,
+    _In_reads_(InCount) const KBLAY_KEY_EVENT* In,
+    _In_ size_t InCount,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap,
+    _Out_writes_opt_(InCount) UINT16* InputEnd,
+    _Out_ KBLAY_ENGINE_BATCH* Batch)
+{
+    size_t used = 0;
+    size_t i = 0;
+
+    memset(Batch, 0, sizeof(*Batch));
+
+    for (; i < InCount && OutCap - used >= KBLAY_ENGINE_MAX_OUTPUT; ++i)
+    {
+        KBLAY_ENGINE_RESULT result;
+        used += RunChain(Engine, Stages, NowMs, &In[i], Out + used, OutCap - used, &result);
+        Batch->Results[result]++;
+        if (InputEnd)
+            InputEnd[i] = (UINT16)used;
+    }
+
+    Batch->Produced = (UINT32)used;
+    return i;
+}
+
+#define KBLAY_DEFINE_CHAIN(Stages) \
+    static size_t Chain##Stages( \
+        _Inout_ KBLAY_ENGINE* Engine, \
+        _In_ UINT64 NowMs, \
+        _In_ const KBLAY_KEY_EVENT* In, \
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out, \
+        _In_ size_t OutCap, \
+        _Out_ KBLAY_ENGINE_RESULT* Result) \
+    { \
+        return RunChain(Engine, Stages, NowMs, In, Out, OutCap, Result); \
+    } \
+    static size_t BatchChain##Stages( \
+        _Inout_ KBLAY_ENGINE* Engine, \
+        _In_ UINT64 NowMs, \
+        _In_reads_(InCount) const KBLAY_KEY_EVENT* In, \
+        _In_ size_t InCount, \
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out, \
+        _In_ size_t OutCap, \
+        _Out_writes_opt_(InCount) UINT16* InputEnd, \
+        _Out_ KBLAY_ENGINE_BATCH* Batch) \
+    { \
+        return RunBatch(Engine, Stages, NowMs, In, InCount, Out, OutCap, InputEnd, Batch); \
+    }
+
+KBLAY_DEFINE_CHAIN(0)
+KBLAY_DEFINE_CHAIN(1)
+KBLAY_DEFINE_CHAIN(2)
+KBLAY_DEFINE_CHAIN(3)
+KBLAY_DEFINE_CHAIN(6)
+KBLAY_DEFINE_CHAIN(7)
+KBLAY_DEFINE_CHAIN(10)
+KBLAY_DEFINE_CHAIN(11)
+KBLAY_DEFINE_CHAIN(14)
+KBLAY_DEFINE_CHAIN(15)
+KBLAY_DEFINE_CHAIN(16)
+KBLAY_DEFINE_CHAIN(17)
+KBLAY_DEFINE_CHAIN(18)
+KBLAY_DEFINE_CHAIN(19)
+KBLAY_DEFINE_CHAIN(22)
+KBLAY_DEFINE_CHAIN(23)
+KBLAY_DEFINE_CHAIN(26)
+KBLAY_DEFINE_CHAIN(27)
+KBLAY_DEFINE_CHAIN(30)
+KBLAY_DEFINE_CHAIN(31)
+
+#undef KBLAY_DEFINE_CHAIN
+
+// MACRO and SHIFT live inside KEYMAP; ConfigureChain never sets them
+// without it, so those masks have no variant.
+static KBLAY_ENGINE_CHAIN* const g_Chains[KBLAY_STAGE_ALL + 1] =
+{
+    Chain0, Chain1, Chain2, Chain3, NULL, NULL, Chain6, Chain7,
+    NULL, NULL, Chain10, Chain11, NULL, NULL, Chain14, Chain15,
+    Chain16, Chain17, Chain18, Chain19, NULL, NULL, Chain22, Chain23,
+    NULL, NULL, Chain26, Chain27, NULL, NULL, Chain30, Chain31,
+};
+
+static KBLAY_ENGINE_BATCH_CHAIN* const g_BatchChains[KBLAY_STAGE_ALL + 1] =
+{
+    BatchChain0, BatchChain1, BatchChain2, BatchChain3, NULL, NULL, BatchChain6, BatchChain7,
+    NULL, NULL, BatchChain10, BatchChain11, NULL, NULL, BatchChain14, BatchChain15,
+    BatchChain16, BatchChain17, BatchChain18, BatchChain19, NULL, NULL, BatchChain22, BatchChain23,
+    NULL, NULL, BatchChain26, BatchChain27, NULL, NULL, BatchChain30, BatchChain31,
+};
+
+KBLAY_STATIC_ASSERT(KBLAY_STAGE_ALL == 31);
+
+static KBLAY_FORCEINLINE UINT32 ChainKey(_In_ UINT32 State, _In_ UINT32 Role)
+{
+    return KBLAY_CHAIN_KEY_VALID | ((Role & 0xFF) << 8) | (State & 0xFF);
+}
+
+static VOID ConfigureChain(_Inout_ KBLAY_ENGINE* Engine, _In_ UINT32 State, _In_ UINT32 Role)
+{
+    UINT32 stages = Engine->Table->Stages & KBLAY_STAGE_TAPHOLD;
+
+    // Keys still in flight from an earlier table need the stage to finish.
+    if (Engine->TapHold.Active != 0)
+        stages |= KBLAY_STAGE_TAPHOLD;
+
+    if (State == (UINT32)KBLAY_STATE_ACTIVE && Role == (UINT32)KBLAY_ROLE_REMAP)
+        stages |= KBLAY_STAGE_KEYMAP | (Engine->Table->Stages & (KBLAY_STAGE_MACRO | KBLAY_STAGE_SHIFT));
+
+    // Hard bypass hands input through untouched.
+    if (Engine->Debounce.WindowMs != 0 && State != (UINT32)KBLAY_STATE_BYPASS_HARD)
+        stages |= KBLAY_STAGE_DEBOUNCE;
+
+    Engine->Stages = (UINT16)stages;
+    Engine->Chain = g_Chains[stages];
+    Engine->BatchChain = g_BatchChains[stages];
+    Engine->ChainKey = ChainKey(State, Role);
+}
+
+size_t KbdLayEngineProcess(
+    _Inout_ KBLAY_ENGINE* Engine,
+    _In_ UINT32 State,
+    _In_ UINT32 Role,
+    _In_ UINT64 NowMs,
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap,
+    _Out_ KBLAY_ENGINE_RESULT* Result)
+{
+    if (Engine->ChainKey != ChainKey(State, Role))
+        ConfigureChain(Engine, State, Role);
+
+    return Engine->Chain(Engine, NowMs, In, Out, OutCap, Result);
+}
+
+size_t KbdLayEngineProcessBatch(
+    _Inout_ KBLAY_ENGINE* Engine,
+    _In_ UINT32 State,
+    _In_ UINT32 Role,
+    _In_ UINT64 NowMs,
+    _In_reads_(InCount) const KBLAY_KEY_EVENT* In,
+    _In_ size_t InCount,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap,
+    _Out_writes_opt_(InCount) UINT16* InputEnd,
+    _Out_ KBLAY_ENGINE_BATCH* Batch)
+{
+    if (Engine->ChainKey != ChainKey(State, Role))
+        ConfigureChain(Engine, State, Role);
+
+    return Engine->BatchChain(Engine, NowMs, In, InCount, Out, OutCap, InputEnd, Batch);
+}
+
+const KBLAY_RULE_TABLE* KbdLayEngineSetRuleTable(_Inout_ KBLAY_ENGINE* Engine, _In_opt_ const KBLAY_RULE_TABLE* Table)
+{
+    const KBLAY_RULE_TABLE* old = Engine->Table;
+    Engine->Table = Table != NULL ? Table : &g_EmptyRuleTable;
+    // The new table may need other stages: pick the chain again.
+    Engine->ChainKey = 0;
+    return old != &g_EmptyRuleTable ? old : NULL;
+}
+
+size_t KbdLayEngineAdvance(
+    _Inout_ KBLAY_ENGINE* Engine,
+    _In_ UINT64 NowMs,
+    _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+    _In_ size_t OutCap)
+{
+    KBLAY_EMIT emit = { Out, OutCap, 0 };
+    AdvanceClock(&Engine->TapHold, NowMs, &emit);
+    return emit.Count;
+}
+
+BOOLEAN KbdLayEngineLookupCell(
+    _In_ const KBLAY_ENGINE* Engine,
+    _In_ const KBLAY_KEY_EVENT* In,
+    _Out_ KBLAY_RULE_CELL* Cell)
+{
+    *Cell = FindCell(Engine->Table, Engine->Table->ModClass[LookupGroups(Engine)], PrefixIndex(In), In->MakeCode);
+    return Cell->Valid ? TRUE : FALSE;
+}
+
+UINT8 KbdLayEngineModsToBits(_In_ const KBLAY_ENGINE_MODS* Mods)
+{
+    return (UINT8)(
+        (Mods->PhysLShift ? KBLAY_MOD_LSHIFT : 0) |
+        (Mods->PhysRShift ? KBLAY_MOD_RSHIFT : 0) |
+        (Mods->PhysLCtrl ? KBLAY_MOD_LCTRL : 0) |
+        (Mods->PhysRCtrl ? KBLAY_MOD_RCTRL : 0) |
+        (Mods->PhysLAlt ? KBLAY_MOD_LALT : 0) |
+        (Mods->PhysRAlt ? KBLAY_MOD_RALT : 0) |
+        (Mods->PhysLWin ? KBLAY_MOD_LWIN : 0) |
+        (Mods->PhysRWin ? KBLAY_MOD_RWIN : 0));
+}
+
+VOID KbdLayEngineModsFromBits(_In_ UINT8 Bits, _Out_ KBLAY_ENGINE_MODS* Mods)
+{
+    Mods->PhysLShift = (Bits & KBLAY_MOD_LSHIFT) ? TRUE : FALSE;
+    Mods->PhysRShift = (Bits & KBLAY_MOD_RSHIFT) ? TRUE : FALSE;
+    Mods->PhysLCtrl = (Bits & KBLAY_MOD_LCTRL) ? TRUE : FALSE;
+    Mods->PhysRCtrl = (Bits & KBLAY_MOD_RCTRL) ? TRUE : FALSE;
+    Mods->PhysLAlt = (Bits & KBLAY_MOD_LALT) ? TRUE : FALSE;
+    Mods->PhysRAlt = (Bits & KBLAY_MOD_RALT) ? TRUE : FALSE;
+    Mods->PhysLWin = (Bits & KBLAY_MOD_LWIN) ? TRUE : FALSE;
+    Mods->PhysRWin = (Bits & KBLAY_MOD_RWIN) ? TRUE : FALSE;
+    Mods->Groups = ModGroupsOf(Mods);
+}
@@ -0,0 +1,336 @@
+#pragma once
+
+// Portable remap core shared by the driver and user-mode tools.
+// No locking, allocation or counters here: the caller serializes access to a
+// KBLAY_ENGINE and accounts for the returned KBLAY_ENGINE_RESULT.
+
+#include "KbdLayPlatform.h"
+#include "KbdLayRules.h"
+#include "KbdLayTimerWheel.h"
+#include "KbdLayModShare.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Same layout and flag values as KEYBOARD_INPUT_DATA (ntddkbd.h), so the
+    // driver can hand its buffers to the engine without copying.
+    typedef struct KBLAY_KEY_EVENT
+    {
+        USHORT UnitId;
+        USHORT MakeCode;
+        USHORT Flags;
+        USHORT Reserved;
+        ULONG  ExtraInformation;
+    } KBLAY_KEY_EVENT;
+
+#define KBLAY_KEY_BREAK 0x01
+#define KBLAY_KEY_E0    0x02
+#define KBLAY_KEY_E1    0x04
+
+    KBLAY_STATIC_ASSERT(sizeof(KBLAY_KEY_EVENT) == 12);
+
+    // Common set-1 make codes for modifiers (no E0 for shifts).
+#define KBLAY_MAKE_LSHIFT 0x2A
+#define KBLAY_MAKE_RSHIFT 0x36
+#define KBLAY_MAKE_CTRL   0x1D
+#define KBLAY_MAKE_ALT    0x38
+#define KBLAY_MAKE_LWIN   0x5B
+#define KBLAY_MAKE_RWIN   0x5C
+
+    // Dual-role keys that can be pending or held at once.
+#define KBLAY_TAPHOLD_MAX_ACTIVE 4
+
+    // Output events for one input event, at most: holds resolved by it
+    // (or by the clock) ahead of its own output, which may be a full macro.
+#define KBLAY_ENGINE_MAX_OUTPUT (KBLAY_MACRO_MAX_EVENTS + KBLAY_TAPHOLD_MAX_ACTIVE)
+
+    // One rule cell. Valid and output share a 32-bit word so a lookup is one load.
+    typedef struct KBLAY_RULE_CELL
+    {
+        UINT16 OutMakeCode;
+        UINT8  OutFlags;    // KBLAY_FLAG_E0 | KBLAY_FLAG_E1 | KBLAY_FLAG_SHIFT
+        UINT8  Valid;
+    } KBLAY_RULE_CELL;
+
+    KBLAY_STATIC_ASSERT(sizeof(KBLAY_RULE_CELL) == 4);
+
+    // Prefix index: none, E0, E1.
+#define KBLAY_RULE_PREFIXES   3
+    // Distinct (class, prefix, makeCode >> 8) pages above 0xFF a table can hold.
+#define KBLAY_RULE_HIGH_PAGES 8
+    // Modifier-group states (KBLAY_MODGROUP_* combinations) and the number of
+    // distinct classes the rule conditions may split them into.
+#define KBLAY_MODGROUP_STATES   16
+#define KBLAY_RULE_MOD_CLASSES  4
+
+    // Rule conditions are lowered at build time: states that every rule treats
+    // alike share a class, and each class has its own precomputed cells. The
+    // lookup is ModClass[held groups], then a direct index.
+    //
+    // Make codes 0x00-0xFF are a direct index into Low; higher codes go through
+    // HighDir (1-based page number, 0 = no rules) into High. The table has no
+    // pointers, so it can be copied as a whole.
+    typedef struct KBLAY_RULE_TABLE
+    {
+        UINT8           ModClass[KBLAY_MODGROUP_STATES];
+        UINT32          ClassCount;
+        UINT32          Stages;         // KBLAY_STAGE_MACRO/TAPHOLD/SHIFT if any cell needs them
+        KBLAY_RULE_CELL Low[KBLAY_RULE_MOD_CLASSES][KBLAY_RULE_PREFIXES][256];      // [class][prefix][makeCode]
+        UINT8           HighDir[KBLAY_RULE_MOD_CLASSES][KBLAY_RULE_PREFIXES][256];  // [class][prefix][makeCode >> 8]
+        UINT32          HighPageCount;
+        KBLAY_RULE_CELL High[KBLAY_RULE_HIGH_PAGES][256];                         // [page - 1][makeCode & 0xFF]
+        UINT32           MacroCount;
+        KBLAY_MACRO_DEF  Macros[KBLAY_MACRO_MAX];       // cells with KBLAY_FLAG_MACRO index this
+        KBLAY_MACRO_STEP MacroSteps[KBLAY_MACRO_MAX_STEPS];
+        UINT32            TapHoldCount;
+        KBLAY_TAPHOLD_DEF TapHolds[KBLAY_TAPHOLD_MAX];  // cells with KBLAY_FLAG_TAPHOLD index this
+    } KBLAY_RULE_TABLE;
+
+    // Physical modifier state as seen from hardware events.
+    // (Split L/R so we can reason about shift accurately.)
+    typedef struct KBLAY_ENGINE_MODS
+    {
+        BOOLEAN PhysLShift;
+        BOOLEAN PhysRShift;
+        BOOLEAN PhysLCtrl;
+        BOOLEAN PhysRCtrl;
+        BOOLEAN PhysLAlt;
+        BOOLEAN PhysRAlt;
+        BOOLEAN PhysLWin;
+        BOOLEAN PhysRWin;
+        UINT8   Groups;     // KBLAY_MODGROUP_* held, derived from the above
+    } KBLAY_ENGINE_MODS;
+
+    // Packed form of KBLAY_ENGINE_MODS (trace records).
+#define KBLAY_MOD_LSHIFT 0x01
+#define KBLAY_MOD_RSHIFT 0x02
+#define KBLAY_MOD_LCTRL  0x04
+#define KBLAY_MOD_RCTRL  0x08
+#define KBLAY_MOD_LALT   0x10
+#define KBLAY_MOD_RALT   0x20
+#define KBLAY_MOD_LWIN   0x40
+#define KBLAY_MOD_RWIN   0x80
+
+    typedef enum KBLAY_TAPHOLD_PHASE
+    {
+        KBLAY_TAPHOLD_IDLE = 0,
+        KBLAY_TAPHOLD_PENDING = 1,   // down, not yet decided
+        KBLAY_TAPHOLD_HELD = 2       // decided as hold; HoldMakeCode is down
+    } KBLAY_TAPHOLD_PHASE;
+
+    // One dual-role key in flight. The definition is copied in so a rule
+    // reload cannot strand a held key.
+    typedef struct KBLAY_TAPHOLD_SLOT
+    {
+        KBLAY_TIMER       Timer;     // first member: the wheel hands it back
+        KBLAY_KEY_EVENT   Key;       // the make that started it
+        KBLAY_TAPHOLD_DEF Def;
+        UINT32            Phase;     // KBLAY_TAPHOLD_PHASE
+        UINT32            PressSeq;  // resolve pending keys in press order
+    } KBLAY_TAPHOLD_SLOT;
+
+    // Active and the wheel's Now/Armed come first: every event reads them.
+    typedef struct KBLAY_TAPHOLD_STATE
+    {
+        UINT32 Active;               // slots not IDLE
+        UINT32 PressSeq;
+        KBLAY_TIMER_WHEEL  Wheel;    // clock in ms; runs only while a key is pending
+        KBLAY_TAPHOLD_SLOT Slots[KBLAY_TAPHOLD_MAX_ACTIVE];
+        UINT32 MaxLateMs;            // worst delay between HoldAfterMs and the hold going out
+        UINT32 Reserved;
+        UINT64 Taps;
+        UINT64 Holds;
+    } KBLAY_TAPHOLD_STATE;
+
+    // Make codes the debounce stage tracks, each with and without E0.
+#define KBLAY_DEBOUNCE_KEYS   256
+#define KBLAY_DEBOUNCE_MAX_MS 250
+
+    // Chatter filter: a make within WindowMs of the same key's last break is
+    // bounce and is dropped, together with the break that ends it. Other
+    // breaks always pass, so the filter cannot leave a key down.
+    typedef struct KBLAY_DEBOUNCE_STATE
+    {
+        UINT32 WindowMs;                                   // 0 = stage off
+        UINT32 Swallowed[KBLAY_DEBOUNCE_KEYS * 2 / 32];    // make dropped, its break goes too
+        UINT32 LastBreakMs[KBLAY_DEBOUNCE_KEYS][2];        // [makeCode][E0], low 32 bits of the clock
+    } KBLAY_DEBOUNCE_STATE;
+
+    typedef enum KBLAY_ENGINE_RESULT
+    {
+        KBLAY_ENGINE_PASS = 0,         // bypass state or non-remap role
+        KBLAY_ENGINE_UNMAPPED = 1,     // active, but no rule for this key
+        KBLAY_ENGINE_REMAP = 2,        // rule applied
+        KBLAY_ENGINE_REMAP_TOGGLE = 3, // rule applied with a synthetic shift toggle
+        KBLAY_ENGINE_MACRO = 4,        // macro emitted (make) or its key swallowed (break)
+        KBLAY_ENGINE_TAPHOLD = 5,      // dual-role key started, repeated or resolved
+        KBLAY_ENGINE_TIMER = 6,        // no input: KbdLayEngineAdvance output (trace records)
+        KBLAY_ENGINE_DEBOUNCED = 7     // dropped as switch chatter; no output
+    } KBLAY_ENGINE_RESULT;
+
+    // Pipeline stages besides the modifier tracker, which always runs.
+#define KBLAY_STAGE_TAPHOLD 0x1     // clock and dual-role keys
+#define KBLAY_STAGE_KEYMAP  0x2     // rule lookup (ACTIVE, REMAP role)
+#define KBLAY_STAGE_MACRO   0x4     // macro cells
+#define KBLAY_STAGE_SHIFT   0x8     // shift synthesis around remapped keys
+#define KBLAY_STAGE_DEBOUNCE 0x10   // chatter filter, ahead of everything but the clock
+#define KBLAY_STAGE_ALL     0x1F
+
+    // Set in a chain key so that no State/Role pair matches a zeroed one.
+#define KBLAY_CHAIN_KEY_VALID 0x80000000u
+
+    struct KBLAY_ENGINE;
+
+    // One specialization of the pipeline for a fixed stage mask.
+    typedef size_t KBLAY_ENGINE_CHAIN(
+        _Inout_ struct KBLAY_ENGINE* Engine,
+        _In_ UINT64 NowMs,
+        _In_ const KBLAY_KEY_EVENT* In,
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+        _In_ size_t OutCap,
+        _Out_ KBLAY_ENGINE_RESULT* Result);
+
+#define KBLAY_ENGINE_RESULT_KINDS (KBLAY_ENGINE_DEBOUNCED + 1)
+
+    // What a batch did: output written and inputs per KBLAY_ENGINE_RESULT.
+    typedef struct KBLAY_ENGINE_BATCH
+    {
+        UINT32 Produced;
+        UINT32 Results[KBLAY_ENGINE_RESULT_KINDS];
+    } KBLAY_ENGINE_BATCH;
+
+    // The same chain looped over a batch, so the batch costs one indirect call.
+    typedef size_t KBLAY_ENGINE_BATCH_CHAIN(
+        _Inout_ struct KBLAY_ENGINE* Engine,
+        _In_ UINT64 NowMs,
+        _In_reads_(InCount) const KBLAY_KEY_EVENT* In,
+        _In_ size_t InCount,
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+        _In_ size_t OutCap,
+        _Out_writes_opt_(InCount) UINT16* InputEnd,
+        _Out_ KBLAY_ENGINE_BATCH* Batch);
+
+    typedef struct KBLAY_ENGINE
+    {
+        KBLAY_ENGINE_CHAIN*       Chain;      // picked for ChainKey; see KbdLayEngineProcess
+        const KBLAY_RULE_TABLE*   Table;      // never NULL; see KbdLayEngineSetRuleTable
+        UINT32                    ChainKey;
+        UINT16                    Stages;     // KBLAY_STAGE_* the chains run
+        KBLAY_ENGINE_MODS   Mods;
+        KBLAY_MOD_SHARE*    Share;            // see KbdLayEngineSetModShare; NULL = not shared
+        KBLAY_TAPHOLD_STATE TapHold;
+        KBLAY_DEBOUNCE_STATE Debounce;
+        UINT8               Published;        // KBLAY_MOD_* this engine has added to Share
+        KBLAY_ENGINE_BATCH_CHAIN* BatchChain; // once per batch: outside the hot line
+    } KBLAY_ENGINE;
+
+    // Engine state every event touches besides its rule cell and class
+    // index: it must stay within one 64-byte line from the engine's start.
+#define KBLAY_ENGINE_HOT_BYTES (FIELD_OFFSET(KBLAY_ENGINE, TapHold.Wheel.Armed) + sizeof(UINT32))
+    KBLAY_STATIC_ASSERT(KBLAY_ENGINE_HOT_BYTES <= 64);
+
+    VOID KbdLayEngineInit(_Out_ KBLAY_ENGINE* Engine);
+
+    // Forgets modifier, tap-hold and debounce state (not the rules or the
+    // debounce window) and restarts the clock at NowMs. Keys in flight are
+    // dropped without output.
+    VOID KbdLayEngineResetState(_Inout_ KBLAY_ENGINE* Engine, _In_ UINT64 NowMs);
+
+    // Sets the debounce window (clamped to KBLAY_DEBOUNCE_MAX_MS; 0 turns the
+    // stage off) and forgets the key history. The stage runs in every state
+    // but KBLAY_STATE_BYPASS_HARD. Keep the window below the fastest
+    // intentional re-press of one key.
+    VOID KbdLayEngineSetDebounce(_Inout_ KBLAY_ENGINE* Engine, _In_ UINT32 WindowMs, _In_ UINT64 NowMs);
+
+    // Pools this engine's modifiers with every other engine on Share (NULL
+    // leaves the pool). Rule lookups and shift synthesis then go by the
+    // modifiers held on any of them; modifier tracking and trace bits stay
+    // per engine. Engines on one Share may run concurrently; each one's
+    // own calls are serialized as usual.
+    VOID KbdLayEngineSetModShare(_Inout_ KBLAY_ENGINE* Engine, _In_opt_ KBLAY_MOD_SHARE* Share);
+
+    // Checks a KBLAY_RULE_BLOB_HEADER-prefixed blob (v1-v5) against the
+    // format and the given limits, including the KBLAY_RULE_MOD_CLASSES and
+    // KBLAY_RULE_HIGH_PAGES caps.
+    BOOLEAN KbdLayEngineValidateRuleBlob(
+        _In_reads_bytes_(BlobSize) const VOID* Blob,
+        _In_ size_t BlobSize,
+        _In_ UINT32 MaxEntries,
+        _In_ size_t MaxBlobBytes);
+
+    // Builds a table from a blob that passed KbdLayEngineValidateRuleBlob.
+    VOID KbdLayEngineBuildRuleTable(
+        _In_reads_bytes_(BlobSize) const VOID* Blob,
+        _In_ size_t BlobSize,
+        _Out_ KBLAY_RULE_TABLE* Table);
+
+    // Translates one event with the stage chain that fits State, Role and
+    // the table; the chain is chosen again only when one of them changes.
+    // Returns the number of events written to Out; 0 if OutCap is 0 or the
+    // event was swallowed (macro or tap-hold key, or chatter).
+    // Holds that are due by NowMs, or forced by this key going down, come
+    // first. Pass OutCap >= KBLAY_ENGINE_MAX_OUTPUT; with less, a macro
+    // that does not fit passes the key unmapped and extra holds are lost.
+    // `State`/`Role` are KBLAY_STATE/KBLAY_ROLE; NowMs must not go backwards.
+    size_t KbdLayEngineProcess(
+        _Inout_ KBLAY_ENGINE* Engine,
+        _In_ UINT32 State,
+        _In_ UINT32 Role,
+        _In_ UINT64 NowMs,
+        _In_ const KBLAY_KEY_EVENT* In,
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+        _In_ size_t OutCap,
+        _Out_ KBLAY_ENGINE_RESULT* Result);
+
+    // KbdLayEngineProcess over In[0..InCount) with one clock reading. Stops
+    // before an input once fewer than KBLAY_ENGINE_MAX_OUTPUT slots are left
+    // in Out and returns the inputs taken. InputEnd, if given, receives the
+    // Out count after each of them.
+    size_t KbdLayEngineProcessBatch(
+        _Inout_ KBLAY_ENGINE* Engine,
+        _In_ UINT32 State,
+        _In_ UINT32 Role,
+        _In_ UINT64 NowMs,
+        _In_reads_(InCount) const KBLAY_KEY_EVENT* In,
+        _In_ size_t InCount,
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+        _In_ size_t OutCap,
+        _Out_writes_opt_(InCount) UINT16* InputEnd,
+        _Out_ KBLAY_ENGINE_BATCH* Batch);
+
+    // Points the engine at Table (NULL: no rules) and returns the table it
+    // used before, NULL if it had none. The engine only reads the table, and
+    // only inside its own calls: once those are serialized past this one,
+    // the returned table may be freed. Built tables are not copied, so a
+    // caller can build outside its lock and swap under it.
+    const KBLAY_RULE_TABLE* KbdLayEngineSetRuleTable(_Inout_ KBLAY_ENGINE* Engine, _In_opt_ const KBLAY_RULE_TABLE* Table);
+
+    // Moves the clock to NowMs without an input event, emitting the holds
+    // that became due (at most KBLAY_TAPHOLD_MAX_ACTIVE).
+    size_t KbdLayEngineAdvance(
+        _Inout_ KBLAY_ENGINE* Engine,
+        _In_ UINT64 NowMs,
+        _Out_writes_(OutCap) KBLAY_KEY_EVENT* Out,
+        _In_ size_t OutCap);
+
+    // TRUE while a dual-role key is waiting on the clock.
+    static KBLAY_FORCEINLINE BOOLEAN KbdLayEngineTimersArmed(_In_ const KBLAY_ENGINE* Engine)
+    {
+        return Engine->TapHold.Wheel.Armed != 0 ? TRUE : FALSE;
+    }
+
+    // Rule cell the engine would consult for `In` given the current modifier
+    // state, pooled if shared (call after KbdLayEngineProcess to see what it
+    // used). FALSE if none.
+    BOOLEAN KbdLayEngineLookupCell(
+        _In_ const KBLAY_ENGINE* Engine,
+        _In_ const KBLAY_KEY_EVENT* In,
+        _Out_ KBLAY_RULE_CELL* Cell);
+
+    UINT8 KbdLayEngineModsToBits(_In_ const KBLAY_ENGINE_MODS* Mods);
+    VOID KbdLayEngineModsFromBits(_In_ UINT8 Bits, _Out_ KBLAY_ENGINE_MODS* Mods);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,14 +1,6 @@
 #pragma once
 
-#ifdef _KERNEL_MODE
-#include <ntddk.h>
-#else
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif
-#include <Windows.h>
-#include <guiddef.h>
-#endif
+#include "KbdLayPlatform.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -1,17 +1,10 @@
 #pragma once
 
-#ifdef _KERNEL_MODE
-#include <ntddk.h>
-#else
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif
-#include <Windows.h>
-#include <winioctl.h>
-#endif
+#include "KbdLayPlatform.h"
 
 #include "KbdLayGuids.h"
 #include "KbdLayRules.h"
+#include "KbdLayTrace.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -67,6 +60,16 @@ extern "C" {
         UINT8  Blob[1];
     } KBLAY_SET_RULE_BLOB_EX_INPUT;
 
+    // IOCTL_KBLAY_SET_RULE_BLOB_EX_DIRECT: this is the input buffer; the blob
+    // is the output buffer, locked in place (METHOD_IN_DIRECT) rather than
+    // copied through the system buffer.
+    typedef struct KBLAY_SET_RULE_BLOB_DIRECT_INPUT
+    {
+        GUID   ContainerId;
+        UINT32 BlobSize;     // must equal the output buffer length
+        UINT32 Reserved;     // must be 0
+    } KBLAY_SET_RULE_BLOB_DIRECT_INPUT;
+
     typedef struct KBLAY_ENUM_CONTAINERS_OUTPUT
     {
         UINT32 Count;
@@ -99,10 +102,97 @@ extern "C" {
         UINT32 LastErrorNtStatus;
 
         GUID ContainerId;
+
+        // Fields below were appended later. The driver accepts output
+        // buffers of KBLAY_STATUS_OUTPUT_V1_SIZE and fills what fits.
+        UINT32 RuleBlobHash; // KbdLayRuleBlobHash of the active blob, 0 if none
+        UINT32 TapHoldMaxLateMs; // worst delay of a tap-hold timer past its deadline
+        UINT64 DebounceDropCount; // input events dropped as switch chatter
+        UINT64 EventsOutCount; // events sent up: mapped, passed, synthesized and timer output
     } KBLAY_STATUS_OUTPUT;
 
+    typedef struct KBLAY_SET_TRACE_EX_INPUT
+    {
+        GUID   ContainerId;
+        UINT32 Enable;
+        UINT32 Capacity;     // records; 0 = default. Fixed once the ring exists.
+    } KBLAY_SET_TRACE_EX_INPUT;
+
+    typedef struct KBLAY_DRAIN_TRACE_EX_INPUT
+    {
+        GUID ContainerId;
+    } KBLAY_DRAIN_TRACE_EX_INPUT;
+
+    typedef struct KBLAY_DRAIN_TRACE_OUTPUT
+    {
+        UINT32 Count;        // records returned
+        UINT32 Dropped;      // records lost to a full ring since the last drain
+        UINT64 Frequency;    // performance counter ticks per second
+        KBLAY_TRACE_RECORD Records[1];
+    } KBLAY_DRAIN_TRACE_OUTPUT;
+
+    typedef struct KBLAY_GET_RULE_BLOB_EX_INPUT
+    {
+        GUID ContainerId;
+    } KBLAY_GET_RULE_BLOB_EX_INPUT;
+
 #pragma pack(pop)
 
+#define KBLAY_STATUS_OUTPUT_V1_SIZE FIELD_OFFSET(KBLAY_STATUS_OUTPUT, RuleBlobHash)
+
+    // An appended counter an older driver's reply did not reach, so readers
+    // can tell it from a count of zero.
+#define KBLAY_STATUS_NOT_REPORTED ((UINT64)-1)
+
+    static __inline VOID KbdLayMarkStatusUnreported(_Inout_ KBLAY_STATUS_OUTPUT* Out, _In_ size_t Returned)
+    {
+        if (Returned < FIELD_OFFSET(KBLAY_STATUS_OUTPUT, EventsOutCount) + sizeof(Out->EventsOutCount))
+            Out->EventsOutCount = KBLAY_STATUS_NOT_REPORTED;
+    }
+
+    // Rule blob upload framing, shared by the clients that build it and the
+    // driver that checks it. The blob's own format is KbdLayEngineValidateRuleBlob's job.
+
+    static __inline VOID KbdLayEncodeRuleBlobDirect(
+        _Out_ KBLAY_SET_RULE_BLOB_DIRECT_INPUT* In,
+        _In_ const GUID* ContainerId,
+        _In_ size_t BlobSize)
+    {
+        memset(In, 0, sizeof(*In));
+        In->ContainerId = *ContainerId;
+        In->BlobSize = (UINT32)BlobSize;
+    }
+
+    // TRUE if a blob of BlobSize bytes may be uploaded at all.
+    static __inline BOOLEAN KbdLayRuleBlobSizeOk(_In_ size_t BlobSize, _In_ size_t MaxBlobBytes)
+    {
+        return (BlobSize >= sizeof(KBLAY_RULE_BLOB_HEADER) && BlobSize <= MaxBlobBytes) ? TRUE : FALSE;
+    }
+
+    // IOCTL_KBLAY_SET_RULE_BLOB_EX: InBytes is the whole input buffer.
+    static __inline BOOLEAN KbdLayCheckRuleBlobEx(
+        _In_reads_bytes_(InBytes) const KBLAY_SET_RULE_BLOB_EX_INPUT* In,
+        _In_ size_t InBytes,
+        _In_ size_t MaxBlobBytes)
+    {
+        const size_t header = FIELD_OFFSET(KBLAY_SET_RULE_BLOB_EX_INPUT, Blob);
+        if (InBytes < header || !KbdLayRuleBlobSizeOk(In->BlobSize, MaxBlobBytes))
+            return FALSE;
+        return In->BlobSize <= InBytes - header ? TRUE : FALSE;
+    }
+
+    // IOCTL_KBLAY_SET_RULE_BLOB_EX_DIRECT: DataBytes is the locked blob buffer.
+    static __inline BOOLEAN KbdLayCheckRuleBlobDirect(
+        _In_reads_bytes_(InBytes) const KBLAY_SET_RULE_BLOB_DIRECT_INPUT* In,
+        _In_ size_t InBytes,
+        _In_ size_t DataBytes,
+        _In_ size_t MaxBlobBytes)
+    {
+        if (InBytes < sizeof(*In) || In->Reserved != 0)
+            return FALSE;
+        return (In->BlobSize == DataBytes && KbdLayRuleBlobSizeOk(DataBytes, MaxBlobBytes)) ? TRUE : FALSE;
+    }
+
     // IOCTL function codes
 #define KBLAY_IOCTL_BASE  0x800
 
@@ -118,6 +208,16 @@ extern "C" {
 #define IOCTL_KBLAY_GET_STATUS_EX    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x907, METHOD_BUFFERED, FILE_READ_ACCESS)
 #define IOCTL_KBLAY_ENUM_CONTAINERS  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x908, METHOD_BUFFERED, FILE_READ_ACCESS)
 #define IOCTL_KBLAY_ENUM_DEVICES     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x909, METHOD_BUFFERED, FILE_READ_ACCESS)
+#define IOCTL_KBLAY_SET_TRACE_EX     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x90A, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#define IOCTL_KBLAY_DRAIN_TRACE_EX   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x90B, METHOD_BUFFERED, FILE_READ_ACCESS)
+// Rule blob last accepted by the first device with the ContainerId (empty v1 blob if none).
+#define IOCTL_KBLAY_GET_RULE_BLOB_EX CTL_CODE(FILE_DEVICE_UNKNOWN, 0x90C, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+// Direct-I/O forms of SET_RULE_BLOB(_EX): the blob is passed as the output
+// buffer and read from the caller's locked pages. The per-device one takes
+// no input buffer.
+#define IOCTL_KBLAY_SET_RULE_BLOB_DIRECT    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x90D, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
+#define IOCTL_KBLAY_SET_RULE_BLOB_EX_DIRECT CTL_CODE(FILE_DEVICE_UNKNOWN, 0x90E, METHOD_IN_DIRECT, FILE_WRITE_ACCESS)
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,51 @@
+#pragma once
+
+// Modifier state pooled across devices, so a remap keyboard sees Shift held
+// on another keyboard. One 64-bit word holds a count per KBLAY_MOD_* bit
+// (bit i in byte i): a device publishes its changes with one interlocked
+// add and a reader gets the OR of every device's modifiers from one load.
+// Counts are 8 bits, far more than the keyboards one system has.
+
+#include "KbdLayPlatform.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    typedef struct KBLAY_MOD_SHARE
+    {
+        volatile INT64 Counts;
+    } KBLAY_MOD_SHARE;
+
+    // One count per set bit of Bits, in that bit's byte.
+    static __inline UINT64 KbdLayModShareSpread(UINT8 Bits)
+    {
+        UINT64 w = 0;
+        for (UINT32 i = 0; i < 8; ++i)
+            w |= (UINT64)((Bits >> i) & 1u) << (8 * i);
+        return w;
+    }
+
+    // KBLAY_MOD_* held on any publishing device.
+    static KBLAY_FORCEINLINE UINT8 KbdLayModShareRead(const KBLAY_MOD_SHARE* Share)
+    {
+        const UINT64 w = (UINT64)KBLAY_ATOMIC_LOAD64(&Share->Counts);
+        // High bit of each byte set iff the byte is nonzero (no carry
+        // crosses bytes), then gather those 8 bits into the top byte.
+        const UINT64 nz = (((w & 0x7F7F7F7F7F7F7F7Full) + 0x7F7F7F7F7F7F7F7Full) | w) & 0x8080808080808080ull;
+        return (UINT8)(((nz >> 7) * 0x0102040810204080ull) >> 56);
+    }
+
+    // Moves this device's contribution from Old to New.
+    static __inline VOID KbdLayModSharePublish(KBLAY_MOD_SHARE* Share, UINT8 Old, UINT8 New)
+    {
+        if (Old == New)
+            return;
+        const UINT64 add = KbdLayModShareSpread((UINT8)(New & ~Old));
+        const UINT64 sub = KbdLayModShareSpread((UINT8)(Old & ~New));
+        KBLAY_ATOMIC_ADD64(&Share->Counts, (INT64)(add - sub));
+    }
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,75 @@
+#include "KbdLayPersist.h"
+#include "KbdLayEngine.h"
+#include <string.h>
+
+VOID KbdLayPersistSeal(
+    _Inout_ VOID* Record,
+    _In_ UINT32 Role,
+    _In_ UINT32 State,
+    _In_ const GUID* ContainerId,
+    _In_ size_t BlobSize)
+{
+    KBLAY_PERSIST_HEADER h;
+    memset(&h, 0, sizeof(h));
+    h.Magic = KBLAY_PERSIST_MAGIC;
+    h.Version = KBLAY_PERSIST_VERSION;
+    h.Role = Role;
+    h.State = State;
+    h.ContainerId = *ContainerId;
+    h.BlobSize = (UINT32)BlobSize;
+    h.BlobHash = BlobSize ? KbdLayRuleBlobHash(KbdLayPersistBlob(Record), BlobSize) : 0;
+    memcpy(Record, &h, sizeof(h));
+}
+
+static BOOLEAN IsKnownRole(_In_ UINT32 Role)
+{
+    return Role == KBLAY_ROLE_NONE || Role == KBLAY_ROLE_BASE || Role == KBLAY_ROLE_REMAP;
+}
+
+static BOOLEAN IsKnownState(_In_ UINT32 State)
+{
+    return State == KBLAY_STATE_BYPASS_HARD || State == KBLAY_STATE_BYPASS_SOFT || State == KBLAY_STATE_ACTIVE;
+}
+
+BOOLEAN KbdLayPersistDecode(
+    _In_reads_bytes_(Size) const VOID* Data,
+    _In_ size_t Size,
+    _In_ UINT32 MaxEntries,
+    _In_ size_t MaxBlobBytes,
+    _Out_ KBLAY_PERSIST_VIEW* View)
+{
+    memset(View, 0, sizeof(*View));
+
+    if (!Data || Size < sizeof(KBLAY_PERSIST_HEADER))
+        return FALSE;
+
+    KBLAY_PERSIST_HEADER h;
+    memcpy(&h, Data, sizeof(h));
+
+    if (h.Magic != KBLAY_PERSIST_MAGIC || h.Version != KBLAY_PERSIST_VERSION || h.Reserved != 0)
+        return FALSE;
+    if (!IsKnownRole(h.Role) || !IsKnownState(h.State))
+        return FALSE;
+    if (h.BlobSize != Size - sizeof(h) || h.BlobSize > MaxBlobBytes)
+        return FALSE;
+
+    const UINT8* blob = (const UINT8*)Data + sizeof(h);
+    if (h.BlobSize)
+    {
+        if (KbdLayRuleBlobHash(blob, h.BlobSize) != h.BlobHash)
+            return FALSE;
+        if (!KbdLayEngineValidateRuleBlob(blob, h.BlobSize, MaxEntries, MaxBlobBytes))
+            return FALSE;
+    }
+    else if (h.BlobHash != 0)
+    {
+        return FALSE;
+    }
+
+    View->Role = h.Role;
+    View->State = h.State;
+    View->ContainerId = h.ContainerId;
+    View->Blob = h.BlobSize ? blob : NULL;
+    View->BlobSize = h.BlobSize;
+    return TRUE;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+// Record a device keeps in its hardware registry key so it comes back with
+// the role, state and rules it last had, before user mode is running.
+// The record is the header below followed by the rule blob; the table is
+// rebuilt from the blob on load, so a record from an older driver is only
+// trusted as far as the current validator allows.
+
+#include "KbdLayPlatform.h"
+#include "KbdLayIoctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KBLAY_PERSIST_VALUE_NAME L"KbdLayPersistedState"
+
+#define KBLAY_PERSIST_MAGIC   0x5350594Cu   // 'LYPS'
+#define KBLAY_PERSIST_VERSION 1u
+
+#pragma pack(push, 1)
+    typedef struct KBLAY_PERSIST_HEADER
+    {
+        UINT32 Magic;
+        UINT32 Version;
+        UINT32 Role;         // KBLAY_ROLE
+        UINT32 State;        // KBLAY_STATE
+        GUID   ContainerId;  // of the device that wrote it; GUID_NULL if unknown
+        UINT32 BlobSize;     // bytes following the header; 0 = no rules
+        UINT32 BlobHash;     // KbdLayRuleBlobHash of those bytes
+        UINT32 Reserved;     // must be 0
+    } KBLAY_PERSIST_HEADER;
+#pragma pack(pop)
+
+    typedef struct KBLAY_PERSIST_VIEW
+    {
+        UINT32      Role;
+        UINT32      State;
+        GUID        ContainerId;
+        const VOID* Blob;    // into the decoded record; NULL if BlobSize is 0
+        size_t      BlobSize;
+    } KBLAY_PERSIST_VIEW;
+
+    static __inline size_t KbdLayPersistSize(size_t BlobSize)
+    {
+        return sizeof(KBLAY_PERSIST_HEADER) + BlobSize;
+    }
+
+    // Where a record's blob goes; copy it there before KbdLayPersistSeal.
+    static __inline UINT8* KbdLayPersistBlob(VOID* Record)
+    {
+        return (UINT8*)Record + sizeof(KBLAY_PERSIST_HEADER);
+    }
+
+    // Fills in the header of a KbdLayPersistSize(BlobSize)-byte record whose
+    // blob is already in place. Lets the caller copy the blob under its own
+    // lock and hash it outside.
+    VOID KbdLayPersistSeal(
+        _Inout_ VOID* Record,
+        _In_ UINT32 Role,
+        _In_ UINT32 State,
+        _In_ const GUID* ContainerId,
+        _In_ size_t BlobSize);
+
+    // Checks a record read back from storage: header fields, the hash, and
+    // the blob against KbdLayEngineValidateRuleBlob with the given limits.
+    // On success View points into Data.
+    BOOLEAN KbdLayPersistDecode(
+        _In_reads_bytes_(Size) const VOID* Data,
+        _In_ size_t Size,
+        _In_ UINT32 MaxEntries,
+        _In_ size_t MaxBlobBytes,
+        _Out_ KBLAY_PERSIST_VIEW* View);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,110 @@
+#pragma once
+
+// Platform selection for code shared between the driver, the Windows user-mode
+// components and host (non-Windows) builds of the portable pieces.
+
+#if defined(_KERNEL_MODE)
+#include <ntddk.h>
+#elif defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#include <winioctl.h>
+#include <guiddef.h>
+#else
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define KBLAY_HOST_BUILD 1
+
+typedef void     VOID;
+typedef uint8_t  UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef int32_t  INT32;
+typedef int64_t  INT64;
+typedef uint8_t  BYTE;
+typedef uint8_t  BOOLEAN;
+typedef uint16_t USHORT;
+typedef uint32_t ULONG;
+typedef int32_t  LONG;
+typedef int64_t  LONG64;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#ifndef GUID_DEFINED
+#define GUID_DEFINED
+typedef struct _GUID
+{
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t  Data4[8];
+} GUID;
+#endif
+
+#ifdef __cplusplus
+static inline bool IsEqualGUID(const GUID& a, const GUID& b) { return memcmp(&a, &b, sizeof(GUID)) == 0; }
+#else
+#define IsEqualGUID(a, b) (memcmp((a), (b), sizeof(GUID)) == 0)
+#endif
+
+#ifndef FIELD_OFFSET
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#endif
+
+#define FILE_DEVICE_UNKNOWN 0x00000022
+#define METHOD_BUFFERED     0
+#define METHOD_IN_DIRECT    1
+#define METHOD_OUT_DIRECT   2
+#define FILE_ANY_ACCESS     0
+#define FILE_READ_ACCESS    0x0001
+#define FILE_WRITE_ACCESS   0x0002
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+    (((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+// SAL annotations used by the shared C sources.
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Inout_
+#define _In_reads_bytes_(n)
+#define _In_reads_(n)
+#define _Out_writes_(n)
+#define _Out_writes_opt_(n)
+#endif
+
+// Use as `static KBLAY_FORCEINLINE`.
+#if defined(_MSC_VER)
+#define KBLAY_FORCEINLINE __forceinline
+#elif defined(__GNUC__)
+#define KBLAY_FORCEINLINE inline __attribute__((always_inline))
+#else
+#define KBLAY_FORCEINLINE inline
+#endif
+
+#if defined(__cplusplus)
+#define KBLAY_STATIC_ASSERT(e) static_assert((e), #e)
+#elif defined(_MSC_VER)
+#define KBLAY_STATIC_ASSERT(e) typedef char __KBLAY_STATIC_ASSERT__[(e) ? 1 : -1]
+#else
+#define KBLAY_STATIC_ASSERT(e) _Static_assert((e), #e)
+#endif
+
+// 64-bit atomics for state several devices share: a relaxed load, and a
+// full-barrier add and compare-exchange (which returns the old value).
+#if defined(_KERNEL_MODE) || defined(_WIN32)
+#define KBLAY_ATOMIC_LOAD64(p)   ((INT64)ReadNoFence64((const volatile LONG64*)(p)))
+#define KBLAY_ATOMIC_ADD64(p, v) ((void)InterlockedExchangeAdd64((volatile LONG64*)(p), (LONG64)(v)))
+#define KBLAY_ATOMIC_CAS64(p, cmp, v) ((INT64)InterlockedCompareExchange64((volatile LONG64*)(p), (LONG64)(v), (LONG64)(cmp)))
+#else
+#define KBLAY_ATOMIC_LOAD64(p)   __atomic_load_n((volatile INT64*)(p), __ATOMIC_RELAXED)
+#define KBLAY_ATOMIC_ADD64(p, v) ((void)__atomic_fetch_add((volatile INT64*)(p), (INT64)(v), __ATOMIC_SEQ_CST))
+#define KBLAY_ATOMIC_CAS64(p, cmp, v) __sync_val_compare_and_swap((volatile INT64*)(p), (INT64)(cmp), (INT64)(v))
+#endif
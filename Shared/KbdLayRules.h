@@ -1,30 +1,47 @@
 #pragma once
 
-#ifdef _KERNEL_MODE
-#include <ntddk.h>
-#else
-#ifndef WIN32_LEAN_AND_MEAN
-#define WIN32_LEAN_AND_MEAN
-#endif
-#include <Windows.h>
-#endif
+#include "KbdLayPlatform.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-#define KBLAY_RULE_BLOB_VERSION 0x00010000u
+#define KBLAY_RULE_BLOB_VERSION    0x00010000u  // KBLAY_RULE_ENTRY records
+#define KBLAY_RULE_BLOB_VERSION_2  0x00020000u  // KBLAY_RULE_ENTRY_V2 records
+#define KBLAY_RULE_BLOB_VERSION_3  0x00030000u  // KBLAY_RULE_ENTRY_V3 records
+#define KBLAY_RULE_BLOB_VERSION_4  0x00040000u  // V3 records, then KBLAY_MACRO_SECTION
+#define KBLAY_RULE_BLOB_VERSION_5  0x00050000u  // as v4, then KBLAY_TAPHOLD_SECTION
 
     // InFlags / OutFlags bit layout
 #define KBLAY_FLAG_E0        0x01u
 #define KBLAY_FLAG_SHIFT     0x02u
+#define KBLAY_FLAG_E1        0x04u  // v2+; exclusive with KBLAY_FLAG_E0
+#define KBLAY_FLAG_MACRO     0x08u  // v4 OutFlags: OutMakeCode is a macro index
+#define KBLAY_FLAG_BREAK     0x10u  // macro steps only: emit a key up
+#define KBLAY_FLAG_TAPHOLD   0x20u  // v5 OutFlags: OutMakeCode is a tap-hold index
+
+    // Macro limits (v4).
+#define KBLAY_MACRO_MAX_EVENTS 32u   // steps in one macro
+#define KBLAY_MACRO_MAX        64u   // macros per blob
+#define KBLAY_MACRO_MAX_STEPS  512u  // steps per blob, all macros together
+
+    // Tap-hold limits (v5).
+#define KBLAY_TAPHOLD_MAX       32u     // definitions per blob
+#define KBLAY_TAPHOLD_MAX_MS    5000u   // longest HoldAfterMs
+
+    // Modifier groups a v3 rule can be conditioned on (either side held).
+#define KBLAY_MODGROUP_SHIFT  0x01u
+#define KBLAY_MODGROUP_CTRL   0x02u
+#define KBLAY_MODGROUP_ALT    0x04u
+#define KBLAY_MODGROUP_WIN    0x08u
+#define KBLAY_MODGROUP_ALL    0x0Fu
 
 #pragma pack(push, 1)
 
     typedef struct KBLAY_RULE_BLOB_HEADER
     {
-        UINT32 Version;         // KBLAY_RULE_BLOB_VERSION
-        UINT32 EntryCount;      // number of KBLAY_RULE_ENTRY records following
+        UINT32 Version;         // KBLAY_RULE_BLOB_VERSION[_2|_3]
+        UINT32 EntryCount;      // number of entry records following
         UINT32 TotalSizeBytes;  // sizeof(header) + EntryCount*sizeof(entry)
         UINT32 Reserved;        // must be 0
     } KBLAY_RULE_BLOB_HEADER;
@@ -37,8 +54,90 @@ extern "C" {
         UINT8  OutFlags;     // KBLAY_FLAG_E0 | KBLAY_FLAG_SHIFT (SHIFT=desired shift state during MAKE)
     } KBLAY_RULE_ENTRY;
 
+    // v2: 16-bit make codes and E1-prefixed keys.
+    typedef struct KBLAY_RULE_ENTRY_V2
+    {
+        UINT16 InMakeCode;
+        UINT8  InFlags;      // KBLAY_FLAG_E0 | KBLAY_FLAG_E1 | KBLAY_FLAG_SHIFT
+        UINT8  Reserved0;    // must be 0
+        UINT16 OutMakeCode;
+        UINT8  OutFlags;     // KBLAY_FLAG_E0 | KBLAY_FLAG_E1 | KBLAY_FLAG_SHIFT
+        UINT8  Reserved1;    // must be 0
+    } KBLAY_RULE_ENTRY_V2;
+
+    // v3: the rule applies while (held modifier groups & ModMask) == ModValue.
+    // Shift is part of the condition, so KBLAY_FLAG_SHIFT is not allowed in
+    // InFlags. When several rules match an event the first one in the blob
+    // wins; an OutMakeCode of 0 leaves the key unmapped.
+    typedef struct KBLAY_RULE_ENTRY_V3
+    {
+        UINT16 InMakeCode;
+        UINT8  InFlags;      // KBLAY_FLAG_E0 | KBLAY_FLAG_E1
+        UINT8  ModMask;      // KBLAY_MODGROUP_*
+        UINT16 OutMakeCode;
+        UINT8  OutFlags;     // KBLAY_FLAG_E0 | KBLAY_FLAG_E1 | KBLAY_FLAG_SHIFT
+        UINT8  ModValue;     // subset of ModMask
+    } KBLAY_RULE_ENTRY_V3;
+
+    // v4: follows the KBLAY_RULE_ENTRY_V3 records, and is itself followed by
+    // MacroCount KBLAY_MACRO_DEFs and StepCount KBLAY_MACRO_STEPs.
+    typedef struct KBLAY_MACRO_SECTION
+    {
+        UINT32 MacroCount;
+        UINT32 StepCount;
+    } KBLAY_MACRO_SECTION;
+
+    typedef struct KBLAY_MACRO_DEF
+    {
+        UINT16 FirstStep;
+        UINT8  StepCount;    // 1..KBLAY_MACRO_MAX_EVENTS
+        UINT8  Reserved;     // must be 0
+    } KBLAY_MACRO_DEF;
+
+    // A macro is emitted verbatim on the key's make (and on each repeat);
+    // the key's break is swallowed. Steps carry their own shift keys.
+    typedef struct KBLAY_MACRO_STEP
+    {
+        UINT16 MakeCode;
+        UINT8  Flags;        // KBLAY_FLAG_E0 | KBLAY_FLAG_E1 | KBLAY_FLAG_BREAK
+        UINT8  Reserved;     // must be 0
+    } KBLAY_MACRO_STEP;
+
+    // v5: follows the macro section; Count KBLAY_TAPHOLD_DEFs come after it.
+    typedef struct KBLAY_TAPHOLD_SECTION
+    {
+        UINT32 Count;
+        UINT32 Reserved;     // must be 0
+    } KBLAY_TAPHOLD_SECTION;
+
+    // Dual-role key: released within HoldAfterMs it taps TapMakeCode;
+    // held past it, or when another key goes down first, it holds
+    // HoldMakeCode until released.
+    typedef struct KBLAY_TAPHOLD_DEF
+    {
+        UINT16 TapMakeCode;
+        UINT16 HoldMakeCode;
+        UINT8  TapFlags;     // KBLAY_FLAG_E0 | KBLAY_FLAG_E1
+        UINT8  HoldFlags;    // KBLAY_FLAG_E0 | KBLAY_FLAG_E1
+        UINT16 HoldAfterMs;  // 1..KBLAY_TAPHOLD_MAX_MS
+    } KBLAY_TAPHOLD_DEF;
+
 #pragma pack(pop)
 
+    // FNV-1a over a rule blob. The driver reports the hash of the blob it
+    // last accepted so user mode can tell whether a re-upload is needed.
+    static __inline UINT32 KbdLayRuleBlobHash(const VOID* Blob, size_t BlobSize)
+    {
+        const UINT8* p = (const UINT8*)Blob;
+        UINT32 h = 2166136261u;
+        for (size_t i = 0; i < BlobSize; ++i)
+        {
+            h ^= p[i];
+            h *= 16777619u;
+        }
+        return h;
+    }
+
 #ifdef __cplusplus
 }
 #endif
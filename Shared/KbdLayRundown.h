@@ -0,0 +1,120 @@
+#pragma once
+
+// Rundown protection for an object that callbacks use without a lock (the
+// keyboard class connection). A callback acquires once per batch; closing
+// refuses new holders and waits for the current ones to leave, after which
+// the object may change and be reopened.
+//
+// The kernel backend is EX_RUNDOWN_REF. Elsewhere one word holds the
+// holder count in units of 2 and a closed flag in bit 0, and closing spins.
+
+#include "KbdLayPlatform.h"
+
+#if !defined(_KERNEL_MODE)
+#if defined(_WIN32)
+#define KBLAY_RUNDOWN_YIELD() ((void)SwitchToThread())
+#else
+#include <sched.h>
+#define KBLAY_RUNDOWN_YIELD() ((void)sched_yield())
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_KERNEL_MODE)
+
+    typedef struct KBLAY_RUNDOWN
+    {
+        EX_RUNDOWN_REF Ref;
+    } KBLAY_RUNDOWN;
+
+    // Open, with no holders.
+    static KBLAY_FORCEINLINE VOID KbdLayRundownInit(_Out_ KBLAY_RUNDOWN* Rundown)
+    {
+        ExInitializeRundownProtection(&Rundown->Ref);
+    }
+
+    // FALSE once closing has begun.
+    static KBLAY_FORCEINLINE BOOLEAN KbdLayRundownAcquire(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        return ExAcquireRundownProtection(&Rundown->Ref);
+    }
+
+    static KBLAY_FORCEINLINE VOID KbdLayRundownRelease(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        ExReleaseRundownProtection(&Rundown->Ref);
+    }
+
+    // Closes, then waits until every holder has released. PASSIVE_LEVEL.
+    static KBLAY_FORCEINLINE VOID KbdLayRundownClose(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        ExWaitForRundownProtectionRelease(&Rundown->Ref);
+    }
+
+    // Opens a closed rundown again.
+    static KBLAY_FORCEINLINE VOID KbdLayRundownReopen(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        ExReInitializeRundownProtection(&Rundown->Ref);
+    }
+
+#else
+
+#define KBLAY_RUNDOWN_CLOSED 1
+#define KBLAY_RUNDOWN_HOLDER 2
+
+    typedef struct KBLAY_RUNDOWN
+    {
+        volatile INT64 Value;
+    } KBLAY_RUNDOWN;
+
+    static KBLAY_FORCEINLINE VOID KbdLayRundownInit(_Out_ KBLAY_RUNDOWN* Rundown)
+    {
+        Rundown->Value = 0;
+    }
+
+    static KBLAY_FORCEINLINE BOOLEAN KbdLayRundownAcquire(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        INT64 v = KBLAY_ATOMIC_LOAD64(&Rundown->Value);
+        for (;;)
+        {
+            if (v & KBLAY_RUNDOWN_CLOSED)
+                return FALSE;
+            const INT64 seen = KBLAY_ATOMIC_CAS64(&Rundown->Value, v, v + KBLAY_RUNDOWN_HOLDER);
+            if (seen == v)
+                return TRUE;
+            v = seen;
+        }
+    }
+
+    static KBLAY_FORCEINLINE VOID KbdLayRundownRelease(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        KBLAY_ATOMIC_ADD64(&Rundown->Value, -KBLAY_RUNDOWN_HOLDER);
+    }
+
+    static KBLAY_FORCEINLINE VOID KbdLayRundownClose(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        INT64 v = KBLAY_ATOMIC_LOAD64(&Rundown->Value);
+        for (;;)
+        {
+            const INT64 seen = KBLAY_ATOMIC_CAS64(&Rundown->Value, v, v | KBLAY_RUNDOWN_CLOSED);
+            if (seen == v)
+                break;
+            v = seen;
+        }
+
+        while (KBLAY_ATOMIC_CAS64(&Rundown->Value, KBLAY_RUNDOWN_CLOSED, KBLAY_RUNDOWN_CLOSED) != KBLAY_RUNDOWN_CLOSED)
+            KBLAY_RUNDOWN_YIELD();
+    }
+
+    static KBLAY_FORCEINLINE VOID KbdLayRundownReopen(_Inout_ KBLAY_RUNDOWN* Rundown)
+    {
+        (VOID)KBLAY_ATOMIC_CAS64(&Rundown->Value, KBLAY_RUNDOWN_CLOSED, 0);
+    }
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,108 @@
+#include "KbdLayTimerWheel.h"
+#include <string.h>
+
+#define KBLAY_WHEEL_MASK    (KBLAY_WHEEL_SLOTS - 1u)
+#define KBLAY_WHEEL_HORIZON ((UINT64)KBLAY_WHEEL_SLOTS << KBLAY_WHEEL_BITS)
+
+static VOID Link(_Inout_ KBLAY_TIMER** Head, _Inout_ KBLAY_TIMER* Timer)
+{
+    Timer->Next = *Head;
+    if (Timer->Next)
+        Timer->Next->PrevNext = &Timer->Next;
+    Timer->PrevNext = Head;
+    *Head = Timer;
+}
+
+static VOID Unlink(_Inout_ KBLAY_TIMER* Timer)
+{
+    *Timer->PrevNext = Timer->Next;
+    if (Timer->Next)
+        Timer->Next->PrevNext = Timer->PrevNext;
+    Timer->Next = NULL;
+    Timer->PrevNext = NULL;
+}
+
+// Files Timer to fire at `at`, which is not before Wheel->Now. Level-1 slots
+// are visited at the start of their 64 ms block, which is never after the
+// expiry of anything in them; one due on that very tick goes to its level-0
+// slot, which Advance empties next.
+static VOID File(_Inout_ KBLAY_TIMER_WHEEL* Wheel, _Inout_ KBLAY_TIMER* Timer, _In_ UINT64 at)
+{
+    const UINT64 now = Wheel->Now;
+    const UINT64 delta = at - now;
+
+    if (delta < KBLAY_WHEEL_SLOTS)
+        Link(&Wheel->Slots[0][at & KBLAY_WHEEL_MASK], Timer);
+    else if (delta < KBLAY_WHEEL_HORIZON)
+        Link(&Wheel->Slots[1][(at >> KBLAY_WHEEL_BITS) & KBLAY_WHEEL_MASK], Timer);
+    else
+        Link(&Wheel->Slots[1][((now >> KBLAY_WHEEL_BITS) + KBLAY_WHEEL_MASK) & KBLAY_WHEEL_MASK], Timer);
+}
+
+VOID KbdLayWheelInit(_Out_ KBLAY_TIMER_WHEEL* Wheel, _In_ UINT64 Now)
+{
+    memset(Wheel, 0, sizeof(*Wheel));
+    Wheel->Now = Now;
+}
+
+VOID KbdLayWheelArm(_Inout_ KBLAY_TIMER_WHEEL* Wheel, _Inout_ KBLAY_TIMER* Timer, _In_ UINT64 Expires)
+{
+    if (KbdLayTimerArmed(Timer))
+        Unlink(Timer);
+    else
+        ++Wheel->Armed;
+
+    Timer->Expires = Expires;
+    File(Wheel, Timer, Expires > Wheel->Now ? Expires : Wheel->Now + 1);
+}
+
+VOID KbdLayWheelCancel(_Inout_ KBLAY_TIMER_WHEEL* Wheel, _Inout_ KBLAY_TIMER* Timer)
+{
+    if (!KbdLayTimerArmed(Timer))
+        return;
+    Unlink(Timer);
+    --Wheel->Armed;
+}
+
+VOID KbdLayWheelAdvance(
+    _Inout_ KBLAY_TIMER_WHEEL* Wheel,
+    _In_ UINT64 Now,
+    _In_ KBLAY_TIMER_FIRE* Fire,
+    _Inout_ VOID* Context)
+{
+    while (Wheel->Now < Now)
+    {
+        if (Wheel->Armed == 0)
+        {
+            Wheel->Now = Now;
+            return;
+        }
+
+        const UINT64 t = ++Wheel->Now;
+
+        // Start of a 64 ms block: re-file that block's level-1 timers.
+        if ((t & KBLAY_WHEEL_MASK) == 0)
+        {
+            KBLAY_TIMER* list = Wheel->Slots[1][(t >> KBLAY_WHEEL_BITS) & KBLAY_WHEEL_MASK];
+            Wheel->Slots[1][(t >> KBLAY_WHEEL_BITS) & KBLAY_WHEEL_MASK] = NULL;
+            while (list)
+            {
+                KBLAY_TIMER* next = list->Next;
+                list->Next = NULL;
+                list->PrevNext = NULL;
+                File(Wheel, list, list->Expires > t ? list->Expires : t);
+                list = next;
+            }
+        }
+
+        // Everything in the level-0 slot is due now. Detach first: Fire may re-arm.
+        KBLAY_TIMER** slot = &Wheel->Slots[0][t & KBLAY_WHEEL_MASK];
+        while (*slot)
+        {
+            KBLAY_TIMER* timer = *slot;
+            Unlink(timer);
+            --Wheel->Armed;
+            Fire(Context, timer, t);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+// Hierarchical timer wheel on a caller-supplied clock (milliseconds).
+// Timers are intrusive and never allocated here, so the wheel can live in a
+// device context and be advanced at DISPATCH_LEVEL. The caller serializes
+// access; there is no locking.
+//
+// Level 0 has one slot per millisecond, level 1 one per 64 ms; timers past
+// the 4.096 s horizon park in the last level-1 slot and are re-filed when it
+// comes round.
+
+#include "KbdLayPlatform.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KBLAY_WHEEL_BITS   6
+#define KBLAY_WHEEL_SLOTS  (1u << KBLAY_WHEEL_BITS)
+#define KBLAY_WHEEL_LEVELS 2
+
+    typedef struct KBLAY_TIMER
+    {
+        struct KBLAY_TIMER*  Next;
+        struct KBLAY_TIMER** PrevNext;   // NULL when not armed
+        UINT64 Expires;
+    } KBLAY_TIMER;
+
+    typedef struct KBLAY_TIMER_WHEEL
+    {
+        UINT64       Now;
+        UINT32       Armed;
+        KBLAY_TIMER* Slots[KBLAY_WHEEL_LEVELS][KBLAY_WHEEL_SLOTS];
+    } KBLAY_TIMER_WHEEL;
+
+    // Called once per expired timer, with the wheel's Now set to the tick it
+    // expired on. The timer is already disarmed and may be re-armed.
+    typedef VOID KBLAY_TIMER_FIRE(_Inout_ VOID* Context, _Inout_ KBLAY_TIMER* Timer, _In_ UINT64 Now);
+
+    VOID KbdLayWheelInit(_Out_ KBLAY_TIMER_WHEEL* Wheel, _In_ UINT64 Now);
+
+    // Arms (or re-arms) Timer for `Expires`; a time not after Now fires on the next tick.
+    VOID KbdLayWheelArm(_Inout_ KBLAY_TIMER_WHEEL* Wheel, _Inout_ KBLAY_TIMER* Timer, _In_ UINT64 Expires);
+
+    VOID KbdLayWheelCancel(_Inout_ KBLAY_TIMER_WHEEL* Wheel, _Inout_ KBLAY_TIMER* Timer);
+
+    // Moves the clock forward to Now, firing timers in expiry order. A Now in
+    // the past is ignored. Cheap when nothing is armed.
+    VOID KbdLayWheelAdvance(
+        _Inout_ KBLAY_TIMER_WHEEL* Wheel,
+        _In_ UINT64 Now,
+        _In_ KBLAY_TIMER_FIRE* Fire,
+        _Inout_ VOID* Context);
+
+    static KBLAY_FORCEINLINE BOOLEAN KbdLayTimerArmed(_In_ const KBLAY_TIMER* Timer)
+    {
+        return Timer->PrevNext != NULL ? TRUE : FALSE;
+    }
+
+#ifdef __cplusplus
+}
+#endif
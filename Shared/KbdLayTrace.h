@@ -0,0 +1,56 @@
+#pragma once
+
+#include "KbdLayPlatform.h"
+#include "KbdLayEngine.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    // Output events kept per record; macros are truncated.
+#define KBLAY_TRACE_RECORD_OUT 3
+
+    // One processed input event as captured by the driver's trace ring.
+    typedef struct KBLAY_TRACE_RECORD
+    {
+        UINT64 Timestamp;    // performance counter ticks
+        UINT32 Sequence;     // per device; gaps mean records were dropped
+        UINT32 EngineTicks;  // performance counter ticks spent in the engine
+        KBLAY_KEY_EVENT In;
+        KBLAY_KEY_EVENT Out[KBLAY_TRACE_RECORD_OUT];  // first outputs only
+        UINT8  OutCount;     // all outputs, may exceed KBLAY_TRACE_RECORD_OUT
+        UINT8  Result;       // KBLAY_ENGINE_RESULT
+        UINT8  Mods;         // KBLAY_MOD_* before the event
+        UINT8  State;        // KBLAY_STATE
+        UINT8  Role;         // KBLAY_ROLE
+        UINT8  HasCell;      // Cell is the rule the engine consulted
+        UINT16 DebounceMs;   // debounce window in effect, 0 = off
+        KBLAY_RULE_CELL Cell;
+        UINT8  SharedMods;   // KBLAY_MOD_* pooled across keyboards before the event, 0 if not shared
+        UINT8  Reserved2[3];
+    } KBLAY_TRACE_RECORD;
+
+    KBLAY_STATIC_ASSERT(sizeof(KBLAY_TRACE_RECORD) == 80);
+
+#define KBLAY_TRACE_DEFAULT_CAPACITY 4096u
+#define KBLAY_TRACE_MAX_CAPACITY     65536u
+
+    // kblayctl trace file: header, RuleBlobSize bytes of rule blob, then
+    // KBLAY_TRACE_RECORDs to end of file.
+#define KBLAY_TRACE_FILE_MAGIC   "KBLTRACE"
+#define KBLAY_TRACE_FILE_VERSION 1u
+
+    typedef struct KBLAY_TRACE_FILE_HEADER
+    {
+        char   Magic[8];
+        UINT32 Version;
+        UINT32 RecordSize;   // sizeof(KBLAY_TRACE_RECORD)
+        UINT64 Frequency;    // performance counter ticks per second
+        GUID   ContainerId;
+        UINT32 RuleBlobSize;
+        UINT32 Reserved;
+    } KBLAY_TRACE_FILE_HEADER;
+
+#ifdef __cplusplus
+}
+#endif
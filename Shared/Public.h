@@ -16,9 +16,9 @@
 #endif
 
 #ifndef KBLAY_MAX_RULE_ENTRIES
-#define KBLAY_MAX_RULE_ENTRIES      1024u
+#define KBLAY_MAX_RULE_ENTRIES      8192u
 #endif
 
 #ifndef KBLAY_MAX_RULE_BLOB_BYTES
-#define KBLAY_MAX_RULE_BLOB_BYTES   (64u * 1024u)
+#define KBLAY_MAX_RULE_BLOB_BYTES   (128u * 1024u)
 #endif